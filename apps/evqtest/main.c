@@ -0,0 +1,340 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/syscalls.h>
+#include <newos/errors.h>
+#include <socket/socket.h>
+#include <unistd.h>
+
+// runs event queues through their paces on pipes and a loopback tcp
+// connection: level, edge and oneshot delivery, closing a file that's still
+// registered, and deleting a queue out from under a waiter
+
+#define TEST_PORT 1911
+#define SHORT_WAIT 100000
+
+#define CHECK(cond, msg) \
+	do { \
+		if(!(cond)) { \
+			printf("  line %d: %s\n", __LINE__, msg); \
+			goto out; \
+		} \
+	} while(0)
+
+// waits for a single event, returns 1 if it got one
+static int wait_one(evq_id q, bigtime_t timeout, struct evq_event *ev)
+{
+	memset(ev, 0, sizeof(*ev));
+	return _kern_evq_wait(q, ev, 1, EVQ_FLAG_TIMEOUT, timeout);
+}
+
+static int test_level(void)
+{
+	struct evq_event ev;
+	int fds[2] = { -1, -1 };
+	evq_id q;
+	char c = 'x';
+	int rc = -1;
+
+	q = _kern_evq_create("evqtest level");
+	if(q < 0)
+		return q;
+	CHECK(pipe(fds) >= 0, "error creating pipe");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fds[0], EVQ_IN, &fds[0]) >= 0, "error adding pipe");
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "empty pipe reported ready");
+
+	write(fds[1], &c, 1);
+	CHECK(wait_one(q, SHORT_WAIT, &ev) == 1, "write wasn't reported");
+	CHECK(ev.fd == fds[0] && (ev.events & EVQ_IN) && ev.data == &fds[0], "wrong event");
+
+	// nothing was read, so it has to keep coming back
+	CHECK(wait_one(q, 0, &ev) == 1, "level triggered event wasn't reported again");
+	CHECK(wait_one(q, 0, &ev) == 1, "level triggered event wasn't reported a third time");
+
+	read(fds[0], &c, 1);
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "drained pipe still reported ready");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fds[0], EVQ_IN, NULL) == ERR_VFS_ALREADY_EXISTS, "added twice");
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_REMOVE, fds[0], 0, NULL) >= 0, "error removing pipe");
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_REMOVE, fds[0], 0, NULL) == ERR_NOT_FOUND, "removed twice");
+
+	rc = 0;
+out:
+	if(fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	_kern_evq_delete(q);
+	return rc;
+}
+
+static int test_edge(void)
+{
+	struct evq_event ev;
+	int fds[2] = { -1, -1 };
+	evq_id q;
+	char c = 'x';
+	int rc = -1;
+
+	q = _kern_evq_create("evqtest edge");
+	if(q < 0)
+		return q;
+	CHECK(pipe(fds) >= 0, "error creating pipe");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fds[0], EVQ_IN | EVQ_EDGE, NULL) >= 0, "error adding pipe");
+
+	write(fds[1], &c, 1);
+	CHECK(wait_one(q, SHORT_WAIT, &ev) == 1, "write wasn't reported");
+	CHECK(ev.fd == fds[0] && (ev.events & EVQ_IN), "wrong event");
+
+	// still data in the pipe, but nothing new happened
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "edge triggered event reported twice");
+
+	write(fds[1], &c, 1);
+	CHECK(wait_one(q, SHORT_WAIT, &ev) == 1, "second write wasn't reported");
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "second edge reported twice");
+
+	rc = 0;
+out:
+	if(fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	_kern_evq_delete(q);
+	return rc;
+}
+
+static int test_oneshot(void)
+{
+	struct evq_event ev;
+	int fds[2] = { -1, -1 };
+	evq_id q;
+	char c = 'x';
+	int rc = -1;
+
+	q = _kern_evq_create("evqtest oneshot");
+	if(q < 0)
+		return q;
+	CHECK(pipe(fds) >= 0, "error creating pipe");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fds[0], EVQ_IN | EVQ_ONESHOT, NULL) >= 0, "error adding pipe");
+
+	write(fds[1], &c, 1);
+	CHECK(wait_one(q, SHORT_WAIT, &ev) == 1, "write wasn't reported");
+
+	// it's disabled until it's modified, no matter what happens to the pipe
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "oneshot event reported twice");
+	write(fds[1], &c, 1);
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "disabled oneshot reported a new write");
+
+	// rearming it sees the data that's still there
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_MODIFY, fds[0], EVQ_IN | EVQ_ONESHOT, NULL) >= 0, "error rearming");
+	CHECK(wait_one(q, 0, &ev) == 1, "rearmed oneshot wasn't reported");
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "rearmed oneshot reported twice");
+
+	rc = 0;
+out:
+	if(fds[0] >= 0) {
+		close(fds[0]);
+		close(fds[1]);
+	}
+	_kern_evq_delete(q);
+	return rc;
+}
+
+static int test_close(void)
+{
+	struct evq_event ev;
+	int fds[2] = { -1, -1 };
+	evq_id q;
+	char c;
+	int rc = -1;
+
+	q = _kern_evq_create("evqtest close");
+	if(q < 0)
+		return q;
+	CHECK(pipe(fds) >= 0, "error creating pipe");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fds[0], EVQ_IN, NULL) >= 0, "error adding read end");
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fds[1], EVQ_OUT | EVQ_EDGE, NULL) >= 0, "error adding write end");
+	CHECK(wait_one(q, 0, &ev) == 1 && ev.fd == fds[1], "write end wasn't writable");
+
+	// the registration mustn't keep the write end open, the read end has to see the hangup
+	close(fds[1]);
+	CHECK(wait_one(q, SHORT_WAIT, &ev) == 1, "close wasn't reported");
+	CHECK(ev.fd == fds[0] && (ev.events & EVQ_HUP), "read end didn't see the hangup");
+	CHECK(read(fds[0], &c, 1) == 0, "read end didn't see the end of the pipe");
+
+	// and the registration went with it
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_REMOVE, fds[1], 0, NULL) == ERR_NOT_FOUND, "closed write end still registered");
+	fds[1] = -1;
+
+	close(fds[0]);
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_REMOVE, fds[0], 0, NULL) == ERR_NOT_FOUND, "closed read end still registered");
+	fds[0] = -1;
+
+	rc = 0;
+out:
+	if(fds[0] >= 0)
+		close(fds[0]);
+	if(fds[1] >= 0)
+		close(fds[1]);
+	_kern_evq_delete(q);
+	return rc;
+}
+
+static int delete_waiter_thread(void *args)
+{
+	evq_id q = (evq_id)(addr_t)args;
+	struct evq_event ev;
+
+	// no timeout, only deleting the queue gets us out
+	return _kern_evq_wait(q, &ev, 1, 0, 0);
+}
+
+static int test_delete(void)
+{
+	thread_id tid;
+	evq_id q;
+	bool deleted = false;
+	int retcode;
+	int rc = -1;
+
+	q = _kern_evq_create("evqtest delete");
+	if(q < 0)
+		return q;
+
+	tid = _kern_thread_create_thread("evqtest waiter", &delete_waiter_thread, (void *)(addr_t)q);
+	CHECK(tid >= 0, "error creating waiter thread");
+	_kern_thread_resume_thread(tid);
+
+	// give it time to go to sleep on the empty queue
+	_kern_snooze(SHORT_WAIT);
+
+	CHECK(_kern_evq_delete(q) >= 0, "error deleting queue");
+	deleted = true;
+	CHECK(_kern_thread_wait_on_thread(tid, &retcode) >= 0, "error waiting on the waiter");
+	CHECK(retcode == ERR_INVALID_HANDLE, "waiter didn't get kicked out of the deleted queue");
+
+	rc = 0;
+out:
+	if(!deleted)
+		_kern_evq_delete(q);
+	return rc;
+}
+
+static int connect_thread(void *args)
+{
+	sockaddr *addr = args;
+	char c = 'x';
+	int fd;
+	int err;
+
+	fd = socket_create(SOCK_PROTO_TCP, 0);
+	if(fd < 0)
+		return fd;
+
+	// hang up first, so the listening port isn't left behind in TIME_WAIT
+	err = socket_connect(fd, addr);
+	if(err >= 0)
+		err = socket_write(fd, &c, 1);
+
+	socket_close(fd);
+	return err < 0 ? err : 0;
+}
+
+static int test_socket(void)
+{
+	struct evq_event ev;
+	sockaddr addr;
+	sockaddr peer;
+	thread_id tid = -1;
+	int listen_fd = -1;
+	int fd = -1;
+	evq_id q;
+	int retcode;
+	char c;
+	int rc = -1;
+
+	q = _kern_evq_create("evqtest socket");
+	if(q < 0)
+		return q;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = TEST_PORT;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(127,0,0,1);
+
+	listen_fd = socket_create(SOCK_PROTO_TCP, 0);
+	CHECK(listen_fd >= 0, "error creating listening socket");
+	CHECK(socket_bind(listen_fd, &addr) >= 0, "error binding");
+	CHECK(socket_listen(listen_fd) >= 0, "error listening");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, listen_fd, EVQ_IN, NULL) >= 0, "error adding listening socket");
+	CHECK(wait_one(q, 0, &ev) == ERR_TIMED_OUT, "listener ready with nobody connecting");
+
+	tid = _kern_thread_create_thread("evqtest connect", &connect_thread, &addr);
+	CHECK(tid >= 0, "error creating connect thread");
+	_kern_thread_resume_thread(tid);
+
+	CHECK(wait_one(q, 1000000, &ev) == 1, "connection wasn't reported");
+	CHECK(ev.fd == listen_fd && (ev.events & EVQ_IN), "wrong event for the listener");
+
+	fd = socket_accept(listen_fd, &peer);
+	CHECK(fd >= 0, "error accepting");
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_REMOVE, listen_fd, 0, NULL) >= 0, "error removing listening socket");
+
+	CHECK(_kern_evq_ctl(q, EVQ_CTL_ADD, fd, EVQ_IN, &fd) >= 0, "error adding connection");
+	CHECK(wait_one(q, 1000000, &ev) == 1, "data wasn't reported");
+	CHECK(ev.fd == fd && (ev.events & EVQ_IN) && ev.data == &fd, "wrong event for the connection");
+	CHECK(socket_read(fd, &c, 1) == 1, "error reading");
+
+	rc = 0;
+out:
+	if(tid >= 0)
+		_kern_thread_wait_on_thread(tid, &retcode);
+	// the connection is closed while it's still registered
+	if(fd >= 0)
+		socket_close(fd);
+	if(listen_fd >= 0)
+		socket_close(listen_fd);
+	_kern_evq_delete(q);
+	return rc;
+}
+
+static const struct {
+	const char *name;
+	int (*func)(void);
+} tests[] = {
+	{ "level", &test_level },
+	{ "edge", &test_edge },
+	{ "oneshot", &test_oneshot },
+	{ "close", &test_close },
+	{ "delete", &test_delete },
+	{ "socket", &test_socket },
+};
+
+int main(int argc, char **argv)
+{
+	int failed = 0;
+	int err;
+	int i;
+
+	for(i = 0; i < (int)(sizeof(tests) / sizeof(tests[0])); i++) {
+		err = tests[i].func();
+		printf("%-10s %s\n", tests[i].name, err < 0 ? "FAILED" : "ok");
+		if(err < 0)
+			failed++;
+	}
+
+	printf("%d of %d tests failed\n", failed, i);
+
+	return failed > 0 ? 1 : 0;
+}
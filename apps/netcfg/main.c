@@ -22,8 +22,11 @@ static int usage(const char *argv[])
 	printf("\n");
 	printf("\troute add default ipv4 addr <ip address> if <interface> ipv4 addr <ip address>\n");
 	printf("\troute add net ipv4 addr <ip address> mask <netmask> if <interface> ipv4 addr <ip address>\n");
-	printf("\troute delete ipv4 addr <ip address>\n");
+	printf("\troute delete ipv4 addr <ip address> [mask <netmask>]\n");
 	printf("\troute list\n");
+	printf("\troute stats\n");
+	printf("\n");
+	printf("\ttcp cc [<algorithm>]\n");
 
 	return -1;
 }
@@ -78,6 +81,75 @@ static int parse_ipv4_addr_string(ipv4_addr *ip_addr, const char *_ip_addr_strin
 	return NO_ERROR;
 }
 
+static void print_ipv4_addr(ipv4_addr addr)
+{
+	printf("%d.%d.%d.%d", (addr >> 24) & 0xff, (addr >> 16) & 0xff, (addr >> 8) & 0xff, addr & 0xff);
+}
+
+static int route_list(void)
+{
+	struct _ioctl_net_route_entry entries[64];
+	int fd;
+	int count;
+	int i;
+
+	fd = open(NET_CONTROL_DEV, 0);
+	if(fd < 0) {
+		printf("error opening network control device\n");
+		return fd;
+	}
+	count = ioctl(fd, IOCTL_NET_CONTROL_ROUTE_LIST, entries, sizeof(entries));
+	close(fd);
+
+	if(count < 0) {
+		printf("error calling ioctl %d (%s)\n", count, strerror(count));
+		return count;
+	}
+
+	for(i = 0; i < count && i < (int)(sizeof(entries) / sizeof(entries[0])); i++) {
+		print_ipv4_addr(NETADDR_TO_IPV4(entries[i].net_addr));
+		printf(" mask ");
+		print_ipv4_addr(NETADDR_TO_IPV4(entries[i].mask_addr));
+		if(entries[i].flags & ROUTE_FLAGS_GW) {
+			printf(" gw ");
+			print_ipv4_addr(NETADDR_TO_IPV4(entries[i].gw_addr));
+		}
+		printf(" if %s addr ", entries[i].if_name);
+		print_ipv4_addr(NETADDR_TO_IPV4(entries[i].if_addr));
+		printf("\n");
+	}
+	if(count > i)
+		printf("(%d more routes not shown)\n", count - i);
+
+	return 0;
+}
+
+static int route_stats(void)
+{
+	struct _ioctl_net_route_stats stats;
+	int fd;
+	int err;
+
+	fd = open(NET_CONTROL_DEV, 0);
+	if(fd < 0) {
+		printf("error opening network control device\n");
+		return fd;
+	}
+	err = ioctl(fd, IOCTL_NET_CONTROL_ROUTE_STATS, &stats, sizeof(stats));
+	close(fd);
+
+	if(err < 0) {
+		printf("error calling ioctl %d (%s)\n", err, strerror(err));
+		return err;
+	}
+
+	printf("%d routes in %d trie nodes, generation %d\n", stats.routes, stats.nodes, stats.generation);
+	printf("%Ld lookups, %Ld cache hits, %Ld cache misses, %Ld with no route\n",
+		stats.lookups, stats.cache_hits, stats.cache_misses, stats.no_route);
+
+	return 0;
+}
+
 static int do_if(int argc, const char *argv[], int curr_arg)
 {
 	int op;
@@ -225,8 +297,15 @@ static int do_route(int argc, const char *argv[], int curr_arg)
 			return usage(argv);
 		op = IOCTL_NET_CONTROL_ROUTE_DELETE;
 		parse_ipv4_addr_string(&net_addr, argv[curr_arg + 3]);
+		if(curr_arg + 5 < argc) {
+			if(strncasecmp(argv[curr_arg + 4], "mask", sizeof("mask")))
+				return usage(argv);
+			parse_ipv4_addr_string(&mask_addr, argv[curr_arg + 5]);
+		}
 	} else if(!strncasecmp(argv[curr_arg], "list", sizeof("list"))) {
-		op = IOCTL_NET_CONTROL_ROUTE_LIST;
+		return route_list();
+	} else if(!strncasecmp(argv[curr_arg], "stats", sizeof("stats"))) {
+		return route_stats();
 	} else {
 		return usage(argv);
 	}
@@ -273,6 +352,44 @@ static int do_route(int argc, const char *argv[], int curr_arg)
 	return 0;
 }
 
+static int do_tcp(int argc, const char *argv[], int curr_arg)
+{
+	struct _ioctl_net_tcp_cc cc;
+	int fd;
+	int op;
+	int err;
+
+	if(curr_arg >= argc || strncasecmp(argv[curr_arg], "cc", sizeof("cc")))
+		return usage(argv);
+
+	// with no name it just says which one is in use
+	memset(&cc, 0, sizeof(cc));
+	if(curr_arg + 1 < argc) {
+		op = IOCTL_NET_CONTROL_TCP_SET_CC;
+		strlcpy(cc.name, argv[curr_arg + 1], sizeof(cc.name));
+	} else {
+		op = IOCTL_NET_CONTROL_TCP_GET_CC;
+	}
+
+	fd = open(NET_CONTROL_DEV, 0);
+	if(fd < 0) {
+		printf("error opening network control device\n");
+		return fd;
+	}
+	err = ioctl(fd, op, &cc, sizeof(cc));
+	close(fd);
+
+	if(err < 0) {
+		printf("error calling ioctl %d (%s)\n", err, strerror(err));
+		return err;
+	}
+
+	if(op == IOCTL_NET_CONTROL_TCP_GET_CC)
+		printf("%s\n", cc.name);
+
+	return 0;
+}
+
 int main(int argc, const char *argv[])
 {
 	int curr_arg;
@@ -286,6 +403,8 @@ int main(int argc, const char *argv[])
 		return do_if(argc, argv, curr_arg + 1);
 	} else if(!strncasecmp(argv[curr_arg], "route", sizeof("route"))) {
 		return do_route(argc, argv, curr_arg + 1);
+	} else if(!strncasecmp(argv[curr_arg], "tcp", sizeof("tcp"))) {
+		return do_tcp(argc, argv, curr_arg + 1);
 	} else {
 		return usage(argv);
 	}
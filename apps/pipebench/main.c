@@ -0,0 +1,143 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/syscalls.h>
+#include <newos/errors.h>
+#include <newos/pipefs_priv.h>
+#include <unistd.h>
+
+// pushes data through a pipe between two threads at a range of write sizes
+// and reports the throughput of each
+
+#define DEFAULT_TOTAL (32*1024*1024)
+#define MAX_CHUNK (256*1024)
+
+static int fds[2];
+static int chunk_size;
+static int total_len;
+static char *write_buf;
+static char *read_buf;
+
+static int writer_thread(void *args)
+{
+	int left = total_len;
+	ssize_t len;
+
+	while(left > 0) {
+		len = write(fds[1], write_buf, min(left, chunk_size));
+		if(len < 0) {
+			printf("write returned %d\n", (int)len);
+			return -1;
+		}
+		left -= len;
+	}
+	return 0;
+}
+
+static int run(int chunk, int buffer_size, int low_water)
+{
+	thread_id tid;
+	bigtime_t start, t;
+	int left;
+	ssize_t len;
+	int retcode;
+	int err;
+
+	err = pipe(fds);
+	if(err < 0) {
+		printf("error %d creating pipe\n", err);
+		return err;
+	}
+	if(buffer_size > 0) {
+		err = _kern_ioctl(fds[0], _PIPEFS_IOCTL_SET_BUFFER_SIZE, &buffer_size, sizeof(buffer_size));
+		if(err < 0)
+			printf("error %d setting the buffer size to %d\n", err, buffer_size);
+	}
+	if(low_water > 0) {
+		err = _kern_ioctl(fds[0], _PIPEFS_IOCTL_SET_LOW_WATER, &low_water, sizeof(low_water));
+		if(err < 0)
+			printf("error %d setting the low water mark to %d\n", err, low_water);
+	}
+
+	chunk_size = chunk;
+	start = _kern_system_time();
+
+	tid = _kern_thread_create_thread("pipebench writer", &writer_thread, NULL);
+	if(tid < 0) {
+		printf("error %d creating writer thread\n", tid);
+		close(fds[0]);
+		close(fds[1]);
+		return tid;
+	}
+	_kern_thread_resume_thread(tid);
+
+	for(left = total_len; left > 0; left -= len) {
+		len = read(fds[0], read_buf, min(left, chunk_size));
+		if(len <= 0) {
+			printf("read returned %d\n", (int)len);
+			break;
+		}
+	}
+
+	_kern_thread_wait_on_thread(tid, &retcode);
+	t = _kern_system_time() - start;
+
+	printf("%7d byte writes: %d bytes in %Ld usecs, %d KB/s\n", chunk, total_len - left, t,
+		t > 0 ? (int)(((long long)(total_len - left) * 1000000 / 1024) / t) : 0);
+
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-t total bytes] [-b pipe buffer size] [-l low water mark] [write size ...]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	static const int default_chunks[] = { 64, 512, 4096, 16384, 65536, 262144 };
+	int buffer_size = 0;
+	int low_water = 0;
+	int i;
+
+	total_len = DEFAULT_TOTAL;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if(i + 1 >= argc)
+			usage(argv[0]);
+		if(!strcmp(argv[i], "-t"))
+			total_len = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-b"))
+			buffer_size = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-l"))
+			low_water = atoi(argv[++i]);
+		else
+			usage(argv[0]);
+	}
+
+	write_buf = malloc(MAX_CHUNK);
+	read_buf = malloc(MAX_CHUNK);
+	if(write_buf == NULL || read_buf == NULL) {
+		printf("out of memory\n");
+		return 1;
+	}
+	memset(write_buf, 0xaa, MAX_CHUNK);
+
+	if(i < argc) {
+		for(; i < argc; i++)
+			run(min(atoi(argv[i]), MAX_CHUNK), buffer_size, low_water);
+	} else {
+		for(i = 0; i < (int)(sizeof(default_chunks) / sizeof(default_chunks[0])); i++)
+			run(default_chunks[i], buffer_size, low_water);
+	}
+
+	return 0;
+}
@@ -0,0 +1,320 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <string.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/syscalls.h>
+#include <newos/errors.h>
+#include <newos/net.h>
+#include <socket/socket.h>
+#include <unistd.h>
+
+// pushes data over tcp connections to ourselves through the loopback
+// interface and reports the throughput, once per congestion control algorithm
+// named on the command line. Build the kernel with LOSE_TX_PACKETS turned on
+// in include/kernel/net/if.h to see how each one holds up under loss. With -s it runs
+// that many connections at once, which spreads them over the receive threads
+// on a multiprocessor machine.
+
+#define DEFAULT_TOTAL (16*1024*1024)
+#define DEFAULT_PORT 1910
+#define MAX_CHUNK (256*1024)
+#define MAX_STREAMS 64
+
+typedef struct stream {
+	int fd;
+	unsigned int received;
+	int bad;
+	thread_id sender;
+	thread_id reader;
+} stream;
+
+static int port;
+static int chunk_size;
+static int total_len;
+static int num_streams;
+static stream streams[MAX_STREAMS];
+
+// what's at a given offset in the stream, so the reader can tell if anything got mangled
+static char pattern_byte(unsigned int offset)
+{
+	return (offset % 251) ^ (offset >> 16);
+}
+
+static void fill_pattern(char *buf, unsigned int offset, int len)
+{
+	int i;
+
+	for(i = 0; i < len; i++)
+		buf[i] = pattern_byte(offset + i);
+}
+
+// gets or sets the congestion control new sockets get, which is system wide
+static int cc_ioctl(int op, struct _ioctl_net_tcp_cc *cc)
+{
+	int fd;
+	int err;
+
+	fd = open(NET_CONTROL_DEV, 0);
+	if(fd < 0)
+		return fd;
+
+	err = ioctl(fd, op, cc, sizeof(*cc));
+	close(fd);
+
+	return err;
+}
+
+static int sender_thread(void *args)
+{
+	sockaddr addr;
+	unsigned int offset = 0;
+	ssize_t len;
+	char *write_buf;
+	char c;
+	int fd;
+	int err;
+
+	write_buf = malloc(chunk_size);
+	if(write_buf == NULL) {
+		printf("out of memory\n");
+		return ERR_NO_MEMORY;
+	}
+
+	fd = socket_create(SOCK_PROTO_TCP, 0);
+	if(fd < 0) {
+		printf("error %d creating sending socket\n", fd);
+		free(write_buf);
+		return fd;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = port;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(127,0,0,1);
+
+	err = socket_connect(fd, &addr);
+	if(err < 0) {
+		printf("error %d connecting\n", err);
+		socket_close(fd);
+		free(write_buf);
+		return err;
+	}
+
+	while(offset < (unsigned int)total_len) {
+		len = min(total_len - offset, (unsigned int)chunk_size);
+		fill_pattern(write_buf, offset, len);
+		len = socket_write(fd, write_buf, len);
+		if(len < 0) {
+			printf("socket_write returned %d\n", (int)len);
+			break;
+		}
+		offset += len;
+	}
+
+	// the reader hangs up once it has everything, which is when our data is all acked
+	while(socket_read(fd, &c, sizeof(c)) > 0)
+		;
+
+	socket_close(fd);
+	free(write_buf);
+	return 0;
+}
+
+static int reader_thread(void *args)
+{
+	stream *st = args;
+	ssize_t len;
+	char *read_buf;
+	int i;
+
+	read_buf = malloc(chunk_size);
+	if(read_buf == NULL) {
+		printf("out of memory\n");
+		socket_close(st->fd);
+		return ERR_NO_MEMORY;
+	}
+
+	for(st->received = 0; st->received < (unsigned int)total_len; st->received += len) {
+		len = socket_read(st->fd, read_buf, min(total_len - st->received, (unsigned int)chunk_size));
+		if(len <= 0) {
+			printf("socket_read returned %d\n", (int)len);
+			break;
+		}
+		for(i = 0; i < len; i++) {
+			if(read_buf[i] != pattern_byte(st->received + i))
+				st->bad++;
+		}
+	}
+
+	socket_close(st->fd);
+	free(read_buf);
+	return 0;
+}
+
+static int run_streams(const char *cc_name)
+{
+	sockaddr addr;
+	bigtime_t start, t;
+	long long received = 0;
+	int listen_fd;
+	int retcode;
+	int bad = 0;
+	int started;
+	int i;
+	int err;
+
+	listen_fd = socket_create(SOCK_PROTO_TCP, 0);
+	if(listen_fd < 0) {
+		printf("error %d creating listening socket\n", listen_fd);
+		return listen_fd;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.addr.len = 4;
+	addr.addr.type = ADDR_TYPE_IP;
+	addr.port = port;
+	NETADDR_TO_IPV4(addr.addr) = IPV4_DOTADDR_TO_ADDR(127,0,0,1);
+
+	err = socket_bind(listen_fd, &addr);
+	if(err >= 0)
+		err = socket_listen(listen_fd);
+	if(err < 0) {
+		printf("error %d setting up the listening socket\n", err);
+		socket_close(listen_fd);
+		return err;
+	}
+
+	start = _kern_system_time();
+
+	// a sender and a reader for each connection, so they all move at once
+	for(started = 0; started < num_streams; started++) {
+		stream *st = &streams[started];
+
+		memset(st, 0, sizeof(*st));
+		st->sender = _kern_thread_create_thread("tcpbench sender", &sender_thread, NULL);
+		if(st->sender < 0) {
+			printf("error %d creating sender thread\n", st->sender);
+			break;
+		}
+		_kern_thread_resume_thread(st->sender);
+
+		st->fd = socket_accept(listen_fd, &addr);
+		if(st->fd < 0) {
+			printf("error %d accepting\n", st->fd);
+			_kern_thread_wait_on_thread(st->sender, &retcode);
+			break;
+		}
+
+		st->reader = _kern_thread_create_thread("tcpbench reader", &reader_thread, st);
+		if(st->reader < 0) {
+			printf("error %d creating reader thread\n", st->reader);
+			socket_close(st->fd);
+			_kern_thread_wait_on_thread(st->sender, &retcode);
+			break;
+		}
+		_kern_thread_resume_thread(st->reader);
+	}
+
+	for(i = 0; i < started; i++) {
+		_kern_thread_wait_on_thread(streams[i].reader, &retcode);
+		received += streams[i].received;
+		bad += streams[i].bad;
+	}
+	t = _kern_system_time() - start;
+
+	for(i = 0; i < started; i++)
+		_kern_thread_wait_on_thread(streams[i].sender, &retcode);
+	socket_close(listen_fd);
+
+	printf("%-10s %d streams, %Ld bytes in %Ld usecs, %d KB/s", cc_name ? cc_name : "(default)", started, received, t,
+		t > 0 ? (int)((received * 1000000 / 1024) / t) : 0);
+	if(bad > 0)
+		printf(", %d bad bytes", bad);
+	printf("\n");
+
+	// a new port each time, the last connection may still be hanging around in TIME_WAIT
+	port++;
+
+	return (bad > 0 || started < num_streams) ? ERR_GENERAL : 0;
+}
+
+static int run(const char *cc_name)
+{
+	struct _ioctl_net_tcp_cc old_cc;
+	struct _ioctl_net_tcp_cc cc;
+	int err;
+
+	if(cc_name == NULL)
+		return run_streams(NULL);
+
+	// switch the default over for the run, and put back what was there after
+	memset(&old_cc, 0, sizeof(old_cc));
+	err = cc_ioctl(IOCTL_NET_CONTROL_TCP_GET_CC, &old_cc);
+	if(err < 0) {
+		printf("error %d (%s) getting the current congestion control\n", err, strerror(err));
+		return err;
+	}
+
+	memset(&cc, 0, sizeof(cc));
+	strlcpy(cc.name, cc_name, sizeof(cc.name));
+	err = cc_ioctl(IOCTL_NET_CONTROL_TCP_SET_CC, &cc);
+	if(err < 0) {
+		printf("error %d (%s) selecting congestion control '%s'\n", err, strerror(err), cc_name);
+		return err;
+	}
+
+	err = run_streams(cc_name);
+
+	if(cc_ioctl(IOCTL_NET_CONTROL_TCP_SET_CC, &old_cc) < 0)
+		printf("error putting congestion control '%s' back\n", old_cc.name);
+
+	return err;
+}
+
+static void usage(const char *name)
+{
+	printf("usage: %s [-t total bytes per stream] [-w write size] [-s streams] [-p port] [congestion control ...]\n", name);
+	printf("to test under packet loss, rebuild the kernel with LOSE_TX_PACKETS set in include/kernel/net/if.h\n");
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	int i;
+
+	total_len = DEFAULT_TOTAL;
+	chunk_size = 65536;
+	port = DEFAULT_PORT;
+	num_streams = 1;
+
+	for(i = 1; i < argc && argv[i][0] == '-'; i++) {
+		if(i + 1 >= argc)
+			usage(argv[0]);
+		if(!strcmp(argv[i], "-t"))
+			total_len = atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-w"))
+			chunk_size = min(atoi(argv[++i]), MAX_CHUNK);
+		else if(!strcmp(argv[i], "-s"))
+			num_streams = min(atoi(argv[++i]), MAX_STREAMS);
+		else if(!strcmp(argv[i], "-p"))
+			port = atoi(argv[++i]);
+		else
+			usage(argv[0]);
+	}
+	if(total_len <= 0 || chunk_size <= 0 || num_streams <= 0)
+		usage(argv[0]);
+
+	if(i < argc) {
+		for(; i < argc; i++)
+			run(argv[i]);
+	} else {
+		run(NULL);
+	}
+
+	return 0;
+}
@@ -20,6 +20,12 @@ typedef struct thread_time {
 	bigtime_t delta_user_time;
 	bigtime_t delta_kernel_time;
 
+	uint32 last_context_switches;
+	uint32 last_preemptions;
+
+	uint32 delta_context_switches;
+	uint32 delta_preemptions;
+
 	bool touched;
 } thread_time;
 
@@ -137,6 +143,8 @@ static int gather_info(void)
 			// save the last user and kernel time
 			tt->last_user_time = tt->info.user_time;
 			tt->last_kernel_time = tt->info.kernel_time;
+			tt->last_context_switches = tt->info.context_switches;
+			tt->last_preemptions = tt->info.preemptions;
 
 			// save the new data
 			memcpy(&tt->info, &ti, sizeof(ti));
@@ -144,6 +152,8 @@ static int gather_info(void)
 			// calculate the delta time
 			tt->delta_user_time = tt->info.user_time - tt->last_user_time;
 			tt->delta_kernel_time = tt->info.kernel_time - tt->last_kernel_time;
+			tt->delta_context_switches = tt->info.context_switches - tt->last_context_switches;
+			tt->delta_preemptions = tt->info.preemptions - tt->last_preemptions;
 
 			tt->touched = true;
 		}
@@ -163,19 +173,24 @@ static int display_info(void)
 	thread_time *tt;
 	bigtime_t total_user = 0;
 	bigtime_t total_kernel = 0;
+	uint32 total_csw = 0;
+	uint32 total_preempt = 0;
 
 	// clear and home the screen
 	printf("%c[2J%c[H", 0x1b, 0x1b);
 
 	// print the thread dump
-	printf("   tid   pid   pri    usertime  kerneltime                            name\n");
+	printf("   tid   pid   pri    usertime  kerneltime     csw preempt                            name\n");
 	for(tt = times; tt; tt = tt->next) {
-		printf("%6d%6d%6d%12Ld%12Ld%32s\n",
-			tt->info.id, tt->info.owner_proc_id, tt->info.priority, tt->delta_user_time, tt->delta_kernel_time, tt->info.name);
+		printf("%6d%6d%6d%12Ld%12Ld%8d%8d%32s\n",
+			tt->info.id, tt->info.owner_proc_id, tt->info.priority, tt->delta_user_time, tt->delta_kernel_time,
+			tt->delta_context_switches, tt->delta_preemptions, tt->info.name);
 		total_user += tt->delta_user_time;
 		total_kernel += tt->delta_kernel_time;
+		total_csw += tt->delta_context_switches;
+		total_preempt += tt->delta_preemptions;
 	}
-	printf("%18s%12Ld%12Ld\n", "total:", total_user, total_kernel);
+	printf("%18s%12Ld%12Ld%8d%8d\n", "total:", total_user, total_kernel, total_csw, total_preempt);
 
 	return 0;
 }
@@ -38,5 +38,15 @@ void arch_cpu_idle(void);
 
 #include INC_ARCH(kernel/arch,cpu.h)
 
+// full memory barrier for the lock free readers, an arch can supply a cheaper one
+#ifndef arch_cpu_memory_barrier
+#define arch_cpu_memory_barrier() __sync_synchronize()
+#endif
+
+// hint to the cpu that it's in a spin loop waiting on another cpu
+#ifndef arch_cpu_pause
+#define arch_cpu_pause() __asm__ __volatile__ ("" ::: "memory")
+#endif
+
 #endif
 
@@ -149,6 +149,9 @@ struct iframe {
 #define X86_AMD_EXT_3DNOWEXT (1<<30)   // 3DNow! extensions
 #define X86_AMD_EXT_3DNOW   (1<<31)   // 3DNow!
 
+// x86 power management features from cpuid eax 0x80000007, edx register
+#define X86_APM_INVARIANT_TSC (1<<8)   // tsc runs at a constant rate in all C/P states
+
 // features
 enum i386_feature_type {
 	FEATURE_COMMON = 0,     // cpuid eax=1, ecx register
@@ -185,6 +188,8 @@ struct arch_cpu_info {
 };
 
 #define nop() __asm__ ("nop"::)
+// spin loop hint, encodes as rep nop so older cpus just see a nop
+#define arch_cpu_pause() __asm__ __volatile__ ("pause" ::: "memory")
 
 void setup_system_time(unsigned int cv_factor);
 bigtime_t i386_cycles_to_time(uint64 cycles);
@@ -209,6 +214,10 @@ void i386_cpuid(unsigned int selector, unsigned int *data);
 bool i386_check_feature(uint32 feature, enum i386_feature_type type);
 void i386_set_task_switched(void);
 void i386_clear_task_switched(void);
+uint32 i386_ones_sum(uint32 sum, const void *buf, size_t len);
+
+// ones complement sum used by the network checksum code, see kernel/net/misc.c
+#define _ARCH_ONES_SUM(sum, buf, len) i386_ones_sum(sum, buf, len)
 
 #define read_cr0(value) \
 	__asm__("movl	%%cr0,%0" : "=r" (value))
@@ -0,0 +1,42 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _NEWOS_KERNEL_ARCH_I386_ONES_SUM_H
+#define _NEWOS_KERNEL_ARCH_I386_ONES_SUM_H
+
+// below this, setting up the sse2 loop costs more than it saves
+#define SSE2_CKSUM_MIN 256
+
+uint32 i386_ones_sum_adc(uint32 sum, const void *buf, size_t len);
+uint64 i386_ones_sum_sse2(const void *buf, size_t len);
+
+// Sums the 16 byte multiple at the front of a long buffer with sse2 and the
+// rest with adcl. The sse2 part runs between I386_ONES_SUM_GET_FPU() and
+// I386_ONES_SUM_PUT_FPU(state), which the includer defines to borrow the fpu.
+// Also built into tools/cksumbench, so it can't depend on anything but the
+// basic integer types and bool.
+static inline uint32 i386_ones_sum_split(uint32 sum, const void *buf, size_t len, bool use_sse2)
+{
+	if(use_sse2 && len >= SSE2_CKSUM_MIN) {
+		size_t sse_len = len & ~15;
+		unsigned int fpu_state;
+		uint64 sum64;
+
+		fpu_state = I386_ONES_SUM_GET_FPU();
+		sum64 = i386_ones_sum_sse2(buf, sse_len);
+		I386_ONES_SUM_PUT_FPU(fpu_state);
+
+		sum64 += sum;
+		while(sum64 >> 32)
+			sum64 = (sum64 & 0xffffffff) + (sum64 >> 32);
+		sum = sum64;
+
+		buf = (const uint8 *)buf + sse_len;
+		len -= sse_len;
+	}
+
+	return i386_ones_sum_adc(sum, buf, len);
+}
+
+#endif
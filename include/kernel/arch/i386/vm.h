@@ -5,6 +5,10 @@
 #ifndef _NEWOS_KERNEL_ARCH_I386_VM_H
 #define _NEWOS_KERNEL_ARCH_I386_VM_H
 
+struct vm_translation_map_struct;
+
+// load the map's pgdir on this cpu, keeping track of which cpus have it loaded
+void i386_vm_translation_map_switch(struct vm_translation_map_struct *map);
 
 #endif
 
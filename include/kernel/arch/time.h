@@ -7,10 +7,15 @@
 
 #include <boot/stage2.h>
 
+int arch_time_preboot_init(kernel_args *ka, int cpu_num);
 int arch_time_init(kernel_args *ka);
 void arch_time_tick(void);
 bigtime_t arch_get_time_delta(void);
 bigtime_t arch_get_rtc_delta(void);
 
+// a free running counter that can keep system time without a periodic tick
+bool arch_time_has_clocksource(void);
+bigtime_t arch_get_clocksource_time(void);
+
 #endif
 
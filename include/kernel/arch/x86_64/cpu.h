@@ -120,6 +120,8 @@ struct arch_cpu_info {
 };
 
 #define nop() __asm__ ("nop"::)
+// spin loop hint, encodes as rep nop so older cpus just see a nop
+#define arch_cpu_pause() __asm__ __volatile__ ("pause" ::: "memory")
 
 void setup_system_time(unsigned int cv_factor);
 bigtime_t x86_64_cycles_to_time(uint64 cycles);
@@ -135,6 +137,10 @@ void x86_64_fxrstor(void *fpu_state);
 void x86_64_fsave_swap(void *old_fpu_state, void *new_fpu_state);
 void x86_64_fxsave_swap(void *old_fpu_state, void *new_fpu_state);
 uint64 x86_64_rdtsc(void);
+uint32 x86_64_ones_sum(uint32 sum, const void *buf, size_t len);
+
+// ones complement sum used by the network checksum code, see kernel/net/misc.c
+#define _ARCH_ONES_SUM(sum, buf, len) x86_64_ones_sum(sum, buf, len)
 
 addr_t read_cr3(void);
 extern inline addr_t read_cr3(void) {
@@ -11,6 +11,10 @@
 
 #define CBUF_FLAG_CHAIN_HEAD 1
 #define CBUF_FLAG_CHAIN_TAIL 2
+#define CBUF_FLAG_CKSUM_VALID 4 /* cksum on the chain head holds the sum of the data */
+
+/* the fields ahead of dat, rounded up to keep dat aligned */
+#define CBUF_HEADER_LEN ((2*sizeof(void *) + 2*sizeof(size_t) + sizeof(void *) + sizeof(int) + sizeof(uint32) + 7) & ~7)
 
 typedef struct cbuf {
 	struct cbuf *next;
@@ -18,11 +22,13 @@ typedef struct cbuf {
 	size_t total_len;
 	void *data;
 	int flags;
+	uint32 cksum;
 
 	/* used by the network stack to chain a list of these together */
 	struct cbuf *packet_next;
 
-	char dat[CBUF_LEN - 2*sizeof(struct cbuf *) - 2*sizeof(size_t) - sizeof(void *) - sizeof(int)];
+	/* drivers hand dat straight to dma engines, some of which want it 8 byte aligned */
+	char dat[CBUF_LEN - CBUF_HEADER_LEN] _ALIGNED(8);
 } cbuf;
 
 int cbuf_init(void);
@@ -39,6 +45,7 @@ int cbuf_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size_t le
 int cbuf_memcpy_from_chain(void *dest, cbuf *chain, size_t offset, size_t len);
 
 int cbuf_user_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size_t len);
+int cbuf_user_memcpy_to_chain_cksum(cbuf *chain, size_t offset, const void *_src, size_t len, uint16 *sum);
 int cbuf_user_memcpy_from_chain(void *dest, cbuf *chain, size_t offset, size_t len);
 
 uint16 cbuf_ones_cksum16(cbuf *chain, size_t offset, size_t len);
@@ -46,6 +53,7 @@ uint16 cbuf_ones_cksum16_2(cbuf *chain, size_t offset, size_t len, void *buf, si
 
 cbuf *cbuf_merge_chains(cbuf *chain1, cbuf *chain2);
 cbuf *cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leading_space);
+cbuf *cbuf_duplicate_chain_cksum(cbuf *chain, size_t offset, size_t len, size_t leading_space);
 
 cbuf *cbuf_truncate_head(cbuf *chain, size_t trunc_bytes, bool free_unused);
 int cbuf_truncate_tail(cbuf *chain, size_t trunc_bytes, bool free_unused);
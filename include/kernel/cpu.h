@@ -21,17 +21,30 @@ typedef struct cpu_ent {
 	int preempted;
 	struct timer_event quantum_timer;
 
+	// thread.c: per-cpu priority run queues
+	struct run_queue run_q;
+
+	// thread.c: whether the thread lock was carried across the last context switch
+	bool switch_thread_locked;
+
+	// thread.c: id of the thread running on this cpu, checked by spinning lockers
+	volatile thread_id running_thread;
+
 	// remember which thread's fpu state we hold
 	// NULL means we dont hold any state
 	struct thread *fpu_state_thread;
 
-	// timer.c: per-cpu timer queues
-	struct timer_event * volatile timer_events;
+	// timer.c: per-cpu timer wheel
+	struct timer_wheel timer_wheel;
 	spinlock_t timer_spinlock;
 
+	// smp.c: tlb invalidation icis sent from and handled on this cpu
+	int tlb_shootdowns_sent;
+	int tlb_shootdowns_received;
+
 	// arch-specific stuff
 	struct arch_cpu_info arch;
-} cpu_ent _ALIGNED(64);
+} _ALIGNED(64) cpu_ent;
 
 extern cpu_ent cpu[_MAX_CPUS];
 
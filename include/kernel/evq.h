@@ -0,0 +1,81 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_EVQ_H
+#define _KERNEL_EVQ_H
+
+#include <kernel/kernel.h>
+#include <kernel/smp.h>
+#include <kernel/list.h>
+#include <boot/stage2.h>
+
+/* readiness bits, returned by fs_poll and reported by evq_wait */
+#define EVQ_IN		0x1		// a read (or an accept) won't block
+#define EVQ_OUT		0x2		// a write won't block
+#define EVQ_ERR		0x4		// always reported, doesn't need to be asked for
+#define EVQ_HUP		0x8		// the other end went away, always reported
+
+/* flags that go along with the events asked for in evq_ctl */
+#define EVQ_EDGE	0x100	// report when the object becomes ready, not for as long as it is
+#define EVQ_ONESHOT	0x200	// report once, then nothing until the next EVQ_CTL_MODIFY
+
+/* evq_ctl ops */
+#define EVQ_CTL_ADD		0
+#define EVQ_CTL_MODIFY	1
+#define EVQ_CTL_REMOVE	2
+
+/* same values as the SEM_FLAG_ ones, they're passed straight through */
+#define EVQ_FLAG_TIMEOUT 2
+#define EVQ_FLAG_INTERRUPTABLE 4
+
+struct evq_event {
+	int fd;
+	int events;
+	void *data;
+};
+
+/*
+** Anything that can be waited on keeps a poll_list. fs_poll hangs the
+** poll_waiter it's handed on the list and looks at the readiness under the
+** object's own lock, and the object calls poll_notify() whenever one of the
+** bits may have come on. The notify callbacks run with the list's spinlock
+** held and interrupts off, so they can't block.
+*/
+struct poll_waiter;
+
+typedef void (*poll_notify_func)(struct poll_waiter *waiter, int events);
+
+typedef struct poll_list {
+	spinlock_t lock;
+	struct list_node waiters;
+} poll_list;
+
+typedef struct poll_waiter {
+	struct list_node node;
+	poll_list *list;	// NULL when it isn't on one
+	poll_notify_func notify;
+} poll_waiter;
+
+void poll_list_init(poll_list *list);
+void poll_list_add(poll_list *list, poll_waiter *waiter);
+void poll_list_remove(poll_waiter *waiter);
+void poll_notify(poll_list *list, int events);
+
+int evq_init(kernel_args *ka);
+
+evq_id evq_create(const char *name);
+int evq_delete(evq_id id);
+int evq_ctl(evq_id id, int op, int fd, int events, void *data);
+int evq_wait(evq_id id, struct evq_event *events, int max_events, int flags, bigtime_t timeout);
+int evq_delete_owned_evqs(proc_id owner);
+// drops every registration on a file that's been closed everywhere else
+void evq_file_closed(void *file);
+
+evq_id user_evq_create(const char *uname);
+int user_evq_delete(evq_id id);
+int user_evq_ctl(evq_id id, int op, int fd, int events, void *data);
+int user_evq_wait(evq_id id, struct evq_event *uevents, int max_events, int flags, bigtime_t timeout);
+
+#endif
+
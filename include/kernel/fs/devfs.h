@@ -26,6 +26,9 @@ struct dev_calls {
 	int (*dev_canpage)(dev_ident ident);
 	ssize_t (*dev_readpage)(dev_ident ident, iovecs *vecs, off_t pos);
 	ssize_t (*dev_writepage)(dev_ident ident, iovecs *vecs, off_t pos);
+
+	/* see fs_poll, NULL if the device never blocks */
+	int (*dev_poll)(dev_cookie cookie, struct poll_waiter *waiter);
 };
 
 /* api drivers will use these to publish devices */
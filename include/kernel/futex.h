@@ -0,0 +1,23 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_FUTEX_H
+#define _KERNEL_FUTEX_H
+
+#include <kernel/kernel.h>
+#include <boot/stage2.h>
+
+// same values as the SEM_FLAG_ ones, they're passed straight through
+#define FUTEX_FLAG_TIMEOUT 2
+#define FUTEX_FLAG_INTERRUPTABLE 4
+
+int futex_init(kernel_args *ka);
+
+// sleeps as long as *uaddr == val, until a futex_wake on the same word
+int user_futex_wait(int *uaddr, int val, int flags, bigtime_t timeout);
+// wakes up to count threads sleeping on uaddr, returns how many it woke
+int user_futex_wake(int *uaddr, int count);
+
+#endif
+
@@ -0,0 +1,58 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_ID_TABLE_H
+#define _KERNEL_ID_TABLE_H
+
+#include <kernel/kernel.h>
+
+/*
+** A table of fixed size entries handed out by id, for things like sems and
+** ports. The table starts out small and grows a chunk at a time, up to
+** max_slots. Chunks never move or go away, so a pointer to an entry stays
+** good forever and id % max_slots is always the slot an id lives in.
+** Free slots are kept on a list, so allocating and freeing are O(1).
+**
+** The table has no lock of its own. Allocating and freeing go under the
+** spinlock the owner hands to id_table_init(), while lookups don't need it.
+*/
+#define ID_TABLE_CHUNK_SLOTS 256
+
+// grow once fewer than this many slots are left, so there's always a few
+// around for anybody who can't wait on the heap
+#define ID_TABLE_LOW_WATER 64
+
+struct id_table_chunk;
+
+typedef struct id_table {
+	size_t entry_size;
+	int max_slots;
+	int num_slots;
+	int free_head;
+	int free_count;
+	int growing;
+	int *spinlock;
+	void (*init_entry)(void *entry);
+	struct id_table_chunk **chunks;
+} id_table;
+
+int id_table_init(id_table *table, size_t entry_size, int max_slots, int initial_slots,
+	int *spinlock, void (*init_entry)(void *entry));
+int id_table_grow(id_table *table);
+
+// call with the table's spinlock held
+void *id_table_alloc(id_table *table, int *_id);
+void id_table_free(id_table *table, int id);
+
+// the entry id would be in, if there is one. The caller has to check that it's
+// still the one it wanted
+void *id_table_lookup(id_table *table, int id);
+void *id_table_slot(id_table *table, int slot);
+
+static inline bool id_table_needs_grow(id_table *table)
+{
+	return table->free_count < ID_TABLE_LOW_WATER && table->num_slots < table->max_slots;
+}
+
+#endif
@@ -7,9 +7,15 @@
 
 #include <kernel/kernel.h>
 #include <kernel/debug.h>
+#include <kernel/smp.h>
 
+// recursive locks and mutexes are adaptive: an uncontended lock is a single atomic op,
+// a contended one spins for a bit while the holder is running on another cpu and then
+// blocks on a semaphore that is only created the first time anyone has to wait.
+// count is the number of threads holding or waiting for the lock.
 typedef struct recursive_lock {
-	thread_id holder;
+	volatile int count;
+	volatile thread_id holder;
 	sem_id sem;
 	int recursion;
 } recursive_lock;
@@ -23,16 +29,55 @@ int recursive_lock_get_recursion(recursive_lock *lock);
 #define ASSERT_LOCKED_RECURSIVE(r) { ASSERT(thread_get_current_thread_id() == (r)->holder); }
 
 typedef struct mutex {
-	thread_id holder;
+	volatile int count;
+	volatile thread_id holder;
 	sem_id sem;
+	const char *name; // for the sem when it's created, not copied so it has to stay around
 } mutex;
 
+// create the semaphore up front, for locks that are taken on the sem_create path
+#define MUTEX_FLAG_CREATE_SEM 0x1
+
 int mutex_init(mutex *m, const char *name);
+int mutex_init_etc(mutex *m, const char *name, int flags);
 void mutex_destroy(mutex *m);
 void mutex_lock(mutex *m);
 void mutex_unlock(mutex *m);
 
 #define ASSERT_LOCKED_MUTEX(m) { ASSERT(thread_get_current_thread_id() == (m)->holder); }
 
+// reader/writer lock. Readers get in with a single compare and swap as long as no
+// writer holds the lock or is waiting for it, so writers can't be starved. Waiters
+// block on semaphores that are created on first use, and the lock is handed
+// directly to them on release.
+typedef struct rw_lock {
+	volatile int state; // reader count plus the flags below
+	spinlock_t lock; // protects the waiter counts
+	int read_waiters;
+	int write_waiters;
+	sem_id read_sem;
+	sem_id write_sem;
+	volatile thread_id writer;
+	volatile int *cpu_readers; // per-cpu reader counts, if RW_LOCK_FLAG_PERCPU_READERS
+} rw_lock;
+
+#define RW_LOCK_READER_MASK 0x0000ffff
+#define RW_LOCK_WRITER      0x00010000
+#define RW_LOCK_WAITERS     0x00020000
+
+// readers only touch a counter on their own cpu, which makes write locking
+// expensive. Meant for locks that are almost never written.
+#define RW_LOCK_FLAG_PERCPU_READERS 0x1
+
+int rw_lock_init(rw_lock *lock, const char *name);
+int rw_lock_init_etc(rw_lock *lock, const char *name, int flags);
+void rw_lock_destroy(rw_lock *lock);
+void rw_lock_read_lock(rw_lock *lock);
+void rw_lock_read_unlock(rw_lock *lock);
+void rw_lock_write_lock(rw_lock *lock);
+void rw_lock_write_unlock(rw_lock *lock);
+
+#define ASSERT_WRITE_LOCKED_RW_LOCK(l) { ASSERT(thread_get_current_thread_id() == (l)->writer); }
+
 #endif
 
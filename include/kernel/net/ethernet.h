@@ -21,6 +21,9 @@ typedef uint8 ethernet_addr[6];
 int ethernet_input(cbuf *buf, ifnet *i);
 int ethernet_output(cbuf *buf, ifnet *i, netaddr *target, int protocol_type);
 
+// where the ip header starts in a received frame, or -1 if it isn't ip
+int ethernet_ip_offset(cbuf *buf);
+
 int ethernet_init(void);
 
 void dump_ethernet_addr(ethernet_addr addr);
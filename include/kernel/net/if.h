@@ -28,6 +28,28 @@ enum {
 
 typedef int if_id;
 
+// drop a percentage of outgoing frames, loopback included, to see how the
+// protocols above cope with loss
+#define LOSE_TX_PACKETS 0
+#define LOSE_TX_PERCENTAGE 5
+
+// a driver that can hand received frames to the stack as cbufs exports this
+// through IOCTL_NET_IF_GET_RX_HOOK. rx_frames blocks until there is at least
+// one frame and then returns up to max_frames of them without blocking again.
+// The stack owns the returned chains.
+typedef struct if_rx_hook {
+	void *cookie;
+	int (*rx_frames)(void *cookie, cbuf **frames, int max_frames);
+} if_rx_hook;
+
+// the transmit side, exported through IOCTL_NET_IF_GET_TX_HOOK. tx_frames queues
+// the chains without flattening them first and takes ownership of all of them,
+// freeing whatever it couldn't send. Returns the number of frames queued.
+typedef struct if_tx_hook {
+	void *cookie;
+	int (*tx_frames)(void *cookie, cbuf **frames, int count);
+} if_tx_hook;
+
 typedef struct ifnet {
 	struct ifnet *next;
 	if_id id;
@@ -41,6 +63,8 @@ typedef struct ifnet {
 	size_t mtu;
 	int (*link_input)(cbuf *buf, struct ifnet *i);
 	int (*link_output)(cbuf *buf, struct ifnet *i, netaddr *target, int protocol_type);
+	if_rx_hook rx_hook;
+	if_tx_hook tx_hook;
 	sem_id tx_queue_sem;
 	mutex tx_queue_lock;
 	fixed_queue tx_queue;
@@ -9,14 +9,31 @@
 #include <kernel/cbuf.h>
 #include <newos/net.h>
 
+// the result of a route lookup. Sockets keep one around as a route cache,
+// it's good until the routing table changes or they talk to someone else.
+typedef struct ipv4_route_cache {
+	ipv4_addr dest_addr;
+	int generation;
+	if_id interface_id;
+	ipv4_addr target_addr; // next hop, either dest_addr or the gateway
+	ipv4_addr if_addr;
+} ipv4_route_cache;
+
 int ipv4_route_add(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num);
 int ipv4_route_add_gateway(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num, ipv4_addr gw_addr);
+int ipv4_route_delete(ipv4_addr network_addr, ipv4_addr netmask);
+void ipv4_route_cache_init(ipv4_route_cache *cache);
+int ipv4_route_lookup(ipv4_addr dest_addr, ipv4_route_cache *cache);
+int ipv4_route_list(struct _ioctl_net_route_entry *user_entries, int max_entries);
+void ipv4_route_get_stats(struct _ioctl_net_route_stats *stats);
+int ipv4_route_init(void);
 
 int ipv4_lookup_srcaddr_for_dest(ipv4_addr dest_addr, ipv4_addr *src_addr);
 int ipv4_get_mss_for_dest(ipv4_addr dest_addr, uint32 *mss);
 
 int ipv4_input(cbuf *buf, ifnet *i);
 int ipv4_output(cbuf *buf, ipv4_addr target_addr, int protocol);
+int ipv4_output_route(cbuf *buf, ipv4_addr target_addr, int protocol, ipv4_route_cache *route);
 int ipv4_init(void);
 
 void dump_ipv4_addr(ipv4_addr addr);
@@ -43,6 +43,9 @@
 #endif
 
 uint16 ones_sum16(uint32 sum, const void *_buf, int len);
+// combine two partial sums. A sum of bytes that sit at an odd offset in the
+// packet has to be byte swapped before it's added in.
+uint16 ones_sum16_add(uint16 sum1, uint16 sum2);
 uint16 cksum16(void *_buf, int len);
 uint16 cksum16_2(void *buf1, int len1, void *buf2, int len2);
 int cmp_netaddr(netaddr *addr1, netaddr *addr2);
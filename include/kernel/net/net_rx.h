@@ -0,0 +1,22 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _NEWOS_KERNEL_NET_NET_RX_H
+#define _NEWOS_KERNEL_NET_NET_RX_H
+
+#include <kernel/net/if.h>
+#include <kernel/cbuf.h>
+
+typedef int (*net_rx_input_func)(cbuf *buf, ifnet *i);
+
+// hands a received packet to one of the per cpu receive threads, which calls
+// input on it. Packets of the same flow always go to the same thread, and in
+// order. ip_offset is where the ipv4 header starts in buf, or -1 if it isn't
+// ip, and is only looked at to pick the thread. Takes ownership of buf.
+int net_rx_queue_packet(cbuf *buf, ifnet *i, net_rx_input_func input, int ip_offset);
+
+int net_rx_init(void);
+
+#endif
+
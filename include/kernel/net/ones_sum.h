@@ -0,0 +1,77 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _NEWOS_KERNEL_NET_ONES_SUM_H
+#define _NEWOS_KERNEL_NET_ONES_SUM_H
+
+// portable version for the architectures without their own. Adds 32 bit words
+// into a 64 bit accumulator so no carry is lost and folds once at the end.
+// Also built into tools/cksumbench, so it can't depend on anything but the
+// basic integer types, bool and addr_t.
+static inline uint32 ones_sum_generic(uint32 sum, const void *_buf, size_t len)
+{
+	const uint8 *buf = _buf;
+	uint64 acc = 0;
+	bool swapped = false;
+	union {
+		uint8 b[2];
+		uint16 w;
+	} tail;
+
+	if(len == 0)
+		return sum;
+
+	// the 16 bit words are counted from the start of the buffer. If that's on an
+	// odd address, pretend there's a zero byte in front of it to line the loads
+	// up; that sums the swapped words so the result gets swapped back.
+	if((addr_t)buf & 1) {
+		tail.b[0] = 0;
+		tail.b[1] = *buf++;
+		acc += tail.w;
+		len--;
+		swapped = true;
+	}
+	if(((addr_t)buf & 2) && len >= 2) {
+		acc += *(const uint16 *)buf;
+		buf += 2;
+		len -= 2;
+	}
+
+	while(len >= 16) {
+		const uint32 *buf32 = (const uint32 *)buf;
+		acc += buf32[0];
+		acc += buf32[1];
+		acc += buf32[2];
+		acc += buf32[3];
+		buf += 16;
+		len -= 16;
+	}
+	while(len >= 4) {
+		acc += *(const uint32 *)buf;
+		buf += 4;
+		len -= 4;
+	}
+	if(len >= 2) {
+		acc += *(const uint16 *)buf;
+		buf += 2;
+		len -= 2;
+	}
+	if(len) {
+		tail.b[0] = *buf;
+		tail.b[1] = 0;
+		acc += tail.w;
+	}
+
+	while(acc >> 16)
+		acc = (acc & 0xffff) + (acc >> 16);
+	if(swapped)
+		acc = ((acc & 0xff) << 8) | (acc >> 8);
+
+	acc += sum;
+	while(acc >> 32)
+		acc = (acc & 0xffffffff) + (acc >> 32);
+	return acc;
+}
+
+#endif
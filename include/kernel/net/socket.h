@@ -10,6 +10,8 @@
 
 typedef int32 sock_id;
 
+struct poll_waiter;
+
 int socket_init(void);
 sock_id socket_create(int type, int flags);
 int socket_bind(sock_id id, sockaddr *addr);
@@ -22,6 +24,7 @@ ssize_t socket_recvfrom(sock_id id, void *buf, ssize_t len, sockaddr *addr);
 ssize_t socket_recvfrom_etc(sock_id id, void *buf, ssize_t len, sockaddr *addr, int flags, bigtime_t timeout);
 ssize_t socket_sendto(sock_id id, const void *buf, ssize_t len, sockaddr *addr);
 int socket_close(sock_id id);
+int socket_poll(sock_id id, struct poll_waiter *waiter);
 
 int socket_dev_init(void);
 
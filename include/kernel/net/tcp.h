@@ -19,6 +19,7 @@ int tcp_accept(void *prot_data, sockaddr *addr, void **new_socket);
 int tcp_close(void *prot_data);
 ssize_t tcp_recvfrom(void *prot_data, void *buf, ssize_t len, sockaddr *saddr, int flags, bigtime_t timeout);
 ssize_t tcp_sendto(void *prot_data, const void *buf, ssize_t len, sockaddr *addr);
+int tcp_poll(void *prot_data, struct poll_waiter *waiter);
 int tcp_init(void);
 
 #endif
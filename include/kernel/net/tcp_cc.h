@@ -0,0 +1,52 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _NEWOS_KERNEL_NET_TCP_CC_H
+#define _NEWOS_KERNEL_NET_TCP_CC_H
+
+#include <kernel/kernel.h>
+
+/*
+** Congestion control algorithms for tcp. tcp itself runs slow start, loss
+** detection and recovery, an algorithm only decides how the window grows
+** while things are going well and how far it's cut when a loss shows up.
+** Everything is called with the socket's lock held.
+*/
+#define TCP_CC_PRIV_SIZE 32
+
+typedef struct tcp_cc_state {
+	uint32 cwnd;		// congestion window, in bytes
+	uint32 ssthresh;	// slow start threshold, in bytes
+	uint32 mss;
+	bigtime_t srtt;		// smoothed round trip time, 0 until there's been a sample
+	uint64 priv[TCP_CC_PRIV_SIZE / sizeof(uint64)]; // the algorithm's own state
+} tcp_cc_state;
+
+typedef struct tcp_cc_ops {
+	struct tcp_cc_ops *next;
+	const char *name;
+
+	// sets up priv, cwnd and ssthresh are taken care of by tcp
+	void (*init)(tcp_cc_state *cc);
+	// new data was acked while not recovering from a loss
+	void (*ack)(tcp_cc_state *cc, uint32 bytes_acked);
+	// a loss was detected with flight_size bytes outstanding, returns the new ssthresh
+	uint32 (*ssthresh)(tcp_cc_state *cc, uint32 flight_size);
+} tcp_cc_ops;
+
+#define TCP_CC_DEFAULT "newreno"
+
+int tcp_cc_init(void);
+int tcp_cc_register(tcp_cc_ops *ops);
+tcp_cc_ops *tcp_cc_find(const char *name);
+tcp_cc_ops *tcp_cc_get_default(void);
+int tcp_cc_set_default(const char *name);
+
+// slow start step shared by the algorithms, returns true if cwnd was below ssthresh
+bool tcp_cc_slow_start(tcp_cc_state *cc, uint32 bytes_acked);
+
+int tcp_cubic_init(void);
+
+#endif
+
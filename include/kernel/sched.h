@@ -0,0 +1,26 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_SCHED_H
+#define _KERNEL_SCHED_H
+
+#include <kernel/thread.h>
+
+// quantum bounds, in usecs. cpu bound threads are pushed towards the minimum
+#define SCHED_MAX_QUANTUM 20000
+#define SCHED_MIN_QUANTUM 5000
+
+// how many levels above its base priority a thread that mostly sleeps may be boosted
+#define SCHED_MAX_BOOST 8
+
+/* scheduler policy hooks, called by thread.c with the thread lock held */
+void sched_init_thread(struct thread *t, int priority);
+void sched_set_base_priority(struct thread *t, int priority);
+void sched_thread_start_running(struct thread *t, bigtime_t now);
+void sched_thread_stop_running(struct thread *t, bigtime_t now, bool quantum_expired);
+void sched_thread_woken(struct thread *t, bigtime_t now);
+bigtime_t sched_quantum(struct thread *t);
+
+#endif
+
@@ -0,0 +1,32 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _KERNEL_SLAB_H
+#define _KERNEL_SLAB_H
+
+#include <kernel/kernel.h>
+#include <boot/stage2.h>
+
+typedef struct object_cache object_cache;
+
+// constructors are run once when a slab is populated, destructors when the
+// slab is handed back to the page allocator. Objects are expected to be
+// freed in their constructed state.
+typedef int (*object_cache_ctor)(void *cookie, void *object);
+typedef void (*object_cache_dtor)(void *cookie, void *object);
+
+object_cache *object_cache_create(const char *name, size_t object_size, size_t alignment,
+	object_cache_ctor ctor, object_cache_dtor dtor, void *cookie);
+void object_cache_destroy(object_cache *cache);
+void *object_cache_alloc(object_cache *cache);
+void object_cache_free(object_cache *cache, void *object);
+
+// push cached objects back into their slabs and release empty slabs
+void object_cache_reclaim(object_cache *cache);
+void slab_reclaim(void);
+
+int slab_init(kernel_args *ka);
+int slab_init2(kernel_args *ka);
+
+#endif
@@ -14,6 +14,7 @@ enum {
 	SMP_MSG_GLOBAL_INVL_PAGE,
 	SMP_MSG_RESCHEDULE,
 	SMP_MSG_CPU_HALT,
+	SMP_MSG_TIMER_REPROGRAM,
 	SMP_MSG_1,
 };
 
@@ -33,6 +34,7 @@ void smp_wait_for_ap_cpus(kernel_args *ka);
 
 void smp_send_ici(int target_cpu, int message, unsigned long data, unsigned long data2, unsigned long data3, void *data_ptr, int flags);
 void smp_send_broadcast_ici(int message, unsigned long data, unsigned long data2, unsigned long data3, void *data_ptr, int flags);
+void smp_send_multicast_ici(unsigned int cpu_mask, int message, unsigned long data, unsigned long data2, unsigned long data3, void *data_ptr, int flags);
 int smp_enable_ici(void);
 int smp_disable_ici(void);
 
@@ -54,6 +56,8 @@ extern inline void smp_send_ici(int target_cpu, int message, unsigned long data,
 	unsigned long data2, unsigned long data3, void *data_ptr, int flags) {}
 extern inline void smp_send_broadcast_ici(int message, unsigned long data, 
 	unsigned long data2, unsigned long data3, void *data_ptr, int flags) {}
+extern inline void smp_send_multicast_ici(unsigned int cpu_mask, int message, unsigned long data,
+	unsigned long data2, unsigned long data3, void *data_ptr, int flags) {}
 extern inline int smp_enable_ici(void) { return 0; }
 extern inline int smp_disable_ici(void) { return 0; }
 
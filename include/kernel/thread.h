@@ -30,6 +30,8 @@
 #define THREAD_RT_LOW_PRIORITY    THREAD_MIN_RT_PRIORITY
 #define THREAD_RT_HIGH_PRIORITY   THREAD_MAX_RT_PRIORITY
 
+#define THREAD_RUN_Q_BITMAP_WORDS ((THREAD_NUM_PRIORITY_LEVELS + 31) / 32)
+
 extern spinlock_t thread_spinlock;
 #define GRAB_THREAD_LOCK() acquire_spinlock(&thread_spinlock)
 #define RELEASE_THREAD_LOCK() release_spinlock(&thread_spinlock)
@@ -95,10 +97,13 @@ struct thread {
 	struct list_node q_node;
 	struct proc *proc;
 	char name[SYS_MAX_OS_NAME_LEN];
-	int priority;
+	int priority; // effective priority, may be boosted above base_priority
+	int base_priority;
 	int state;
 	int next_state;
 	struct cpu_ent *cpu;
+	int last_cpu; // cpu we last ran on, used for cache affinity on wakeup
+	int run_q_cpu; // cpu whose run queue we are sitting in, -1 if none
 	bool in_kernel;
 
 	struct cpu_ent *fpu_cpu; // this cpu holds our fpu state
@@ -113,6 +118,8 @@ struct thread {
 	int sem_errcode;
 	int sem_flags;
 
+	sem_id futex_sem; // sleeps in futex waits on this, created on first use
+
 	addr_t fault_handler;
 	addr_t entry;
 	void *args;
@@ -127,6 +134,15 @@ struct thread {
 	bigtime_t last_time;
 	int last_time_type; // KERNEL_TIME or USER_TIME
 
+	// scheduler policy state, see sched.c
+	bigtime_t sched_run_avg; // decaying average of how long we run when scheduled
+	bigtime_t sched_sleep_avg; // decaying average of how long we block for
+	bigtime_t sched_start; // when we were last switched in
+	bigtime_t sleep_start; // when we last blocked, 0 if not blocked
+	bigtime_t quantum; // length of the quantum we were last given
+	uint32 context_switches;
+	uint32 preemptions;
+
 	sigset_t		sig_pending;
 	sigset_t		sig_block_mask;
 	struct sigaction sig_action[32];
@@ -136,6 +152,19 @@ struct thread {
 	struct arch_thread arch_info;
 };
 
+// per-cpu run queue, one hangs off of each cpu_ent
+// NOTE: the lock nests inside the thread lock, and covers the queue as well
+// as the priority and state of the threads in it and the one running on the
+// cpu. It's held across a context switch.
+struct run_queue {
+	spinlock_t lock;
+	uint32 bitmap[THREAD_RUN_Q_BITMAP_WORDS]; // bit set for each non-empty priority level
+	int count; // number of non-idle threads queued
+	volatile int curr_priority; // priority of the thread currently running on this cpu
+	int steal_count; // number of threads this cpu has stolen from others
+	struct list_node q[THREAD_NUM_PRIORITY_LEVELS];
+};
+
 struct proc_info {
 	proc_id pid;
 	proc_id ppid;
@@ -158,6 +187,9 @@ struct thread_info {
 
 	bigtime_t user_time;
 	bigtime_t kernel_time;
+
+	uint32 context_switches;
+	uint32 preemptions;
 };
 
 #include <kernel/arch/thread.h>
@@ -176,6 +208,7 @@ int thread_suspend_thread(thread_id id);
 int thread_resume_thread(thread_id id);
 int thread_set_priority(thread_id id, int priority);
 void thread_resched(void);
+void thread_preempt(void);
 void thread_start_threading(void);
 int thread_snooze(bigtime_t time);
 void thread_yield(void);
@@ -195,6 +228,7 @@ extern inline thread_id thread_get_current_thread_id(void) {
 	struct thread *t = thread_get_current_thread(); return t ? t->id : 0;
 }
 int thread_wait_on_thread(thread_id id, int *retcode);
+bool thread_is_running(thread_id id);
 
 thread_id thread_create_user_thread(char *name, proc_id pid, addr_t entry, void *args);
 thread_id thread_create_kernel_thread(const char *name, int (*func)(void *args), void *args);
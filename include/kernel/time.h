@@ -7,6 +7,7 @@
 
 #include <boot/stage2.h>
 
+int time_preboot_init(kernel_args *ka, int cpu_num); // run by every cpu as it enters the kernel
 int time_init(kernel_args *ka);
 int time_init2(kernel_args *ka); // should be called just before enabling interrupts
 void time_tick(int tick_rate);
@@ -20,5 +21,8 @@ bigtime_t system_time_lores(void);
 // usecs since Jan 1, 1AD
 bigtime_t local_time(void);
 
+// if set, system time doesn't depend on time_tick() being called
+bool time_has_clocksource(void);
+
 #endif
 
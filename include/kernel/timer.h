@@ -6,6 +6,7 @@
 #define _KERNEL_TIMER_H
 
 #include <boot/stage2.h>
+#include <kernel/list.h>
 
 typedef int (*timer_callback)(void *);
 
@@ -15,7 +16,7 @@ typedef enum {
 } timer_mode;
 
 struct timer_event {
-	struct timer_event *next;
+	struct list_node node;
 	timer_mode mode;
 	int scheduled_cpu;
 	bigtime_t sched_time;
@@ -24,11 +25,28 @@ struct timer_event {
 	void *data;
 };
 
+// per-cpu hierarchical timing wheel. Each level has TIMER_WHEEL_SLOTS slots,
+// and each slot of a level covers as much time as all of the level below it.
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+struct timer_wheel {
+	bigtime_t clk; // next wheel tick to be run
+	bigtime_t next_hw_tick; // wheel tick the hardware timer is set to go off at
+	int count; // number of events in the wheel
+	struct list_node slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+};
+
+// pass to timer_set_event_etc() to arm the event on the current cpu
+#define TIMER_CURRENT_CPU -1
+
 int timer_init(kernel_args *ka);
 int timer_init_percpu(kernel_args *ka, int cpu_num);
 int timer_interrupt(void);
 void timer_setup_timer(timer_callback func, void *data, struct timer_event *event);
 int timer_set_event(bigtime_t relative_time, timer_mode mode, struct timer_event *event);
+int timer_set_event_etc(bigtime_t relative_time, timer_mode mode, struct timer_event *event, int cpu_num);
 int timer_cancel_event(struct timer_event *event);
 
 /*
@@ -37,5 +55,8 @@ int timer_cancel_event(struct timer_event *event);
 int local_timer_cancel_event(struct timer_event *event);
 int _local_timer_cancel_event(int curr_cpu, struct timer_event *event);
 
+// only to be used by the ici handler
+void timer_reprogram(void);
+
 #endif
 
@@ -52,6 +52,8 @@ struct file_stat {
 	off_t		size;
 };
 
+struct poll_waiter;
+
 struct fs_calls {
 	int (*fs_mount)(fs_cookie *fs, fs_id id, const char *device, void *args, vnode_id *root_vnid);
 	int (*fs_unmount)(fs_cookie fs);
@@ -91,6 +93,10 @@ struct fs_calls {
 
 	int (*fs_rstat)(fs_cookie fs, fs_vnode v, struct file_stat *stat);
 	int (*fs_wstat)(fs_cookie fs, fs_vnode v, struct file_stat *stat, int stat_mask);
+
+	/* returns the EVQ_ bits that are ready now, and if waiter isn't NULL hangs it on the
+	   object so it hears about changes. May be NULL if the stream never blocks. */
+	int (*fs_poll)(fs_cookie fs, fs_vnode v, file_cookie cookie, struct poll_waiter *waiter);
 };
 
 int vfs_init(kernel_args *ka);
@@ -123,6 +129,16 @@ ssize_t vfs_writepage(void *vnode, iovecs *vecs, off_t pos);
 void *vfs_get_cache_ptr(void *vnode);
 int vfs_set_cache_ptr(void *vnode, void *cache);
 
+/* calls needed by event queues to hold on to and poll open files */
+int vfs_get_file_from_fd(int fd, bool kernel, void **file);
+int vfs_put_file_ptr(void *file);
+int vfs_poll_file(void *file, struct poll_waiter *waiter);
+/* takes another reference on a file the caller already holds, one that doesn't keep
+   the file open. Once only those are left evq_file_closed() is called to give them
+   back, which may happen when the caller puts its own reference. */
+void vfs_watch_file(void *file);
+int vfs_put_watched_file_ptr(void *file);
+
 /* calls kernel code should make if it's trying strange stuff */
 int vfs_mount(char *path, const char *device, const char *fs_name, void *args, bool kernel);
 int vfs_unmount(char *path, bool kernel);
@@ -10,6 +10,7 @@
 #include <kernel/vfs.h>
 #include <kernel/arch/vm_translation_map.h>
 #include <kernel/list.h>
+#include <kernel/lock.h>
 
 // vm page
 typedef struct vm_page {
@@ -26,10 +27,11 @@ typedef struct vm_page {
 
 	struct list_node cache_node;
 
-	unsigned int ref_count;
+	int ref_count;
 
 	unsigned int type : 2;
 	unsigned int state : 4;
+	unsigned int cached : 1; // sitting in a per-cpu free page cache
 } vm_page;
 
 #define VM_PAGE_MAGIC 'vmpg'
@@ -107,6 +109,14 @@ typedef struct vm_region {
 	struct vm_address_space *aspace;
 	struct vm_region *aspace_next;
 	struct vm_virtual_map *map;
+	// node in the virtual map's region tree
+	struct vm_region *tree_left;
+	struct vm_region *tree_right;
+	struct vm_region *tree_parent;
+	int tree_height;
+	addr_t tree_min_base; // lowest base in this subtree
+	addr_t tree_max_last; // highest address covered by this subtree
+	addr_t tree_max_gap;  // largest hole between regions in this subtree
 	struct list_node cache_node;
 	struct vm_region *hash_next;
 } vm_region;
@@ -115,10 +125,11 @@ typedef struct vm_region {
 
 // virtual map (1 per address space)
 typedef struct vm_virtual_map {
-	vm_region *region_list;
+	vm_region *region_list; // sorted by base, linked through aspace_next
+	vm_region *region_tree;
 	vm_region *region_hint;
 	int change_count;
-	sem_id sem;
+	rw_lock lock;
 	struct vm_address_space *aspace;
 	addr_t base;
 	addr_t alloc_base;
@@ -235,6 +246,23 @@ int vm_get_page_mapping(aspace_id aid, addr_t vaddr, addr_t *paddr);
 int vm_get_physical_page(addr_t paddr, addr_t *vaddr, int flags);
 int vm_put_physical_page(addr_t vaddr);
 
+// the pages behind a piece of a user buffer, held in place so another
+// thread can copy out of them while the owner waits
+#define VM_LOAN_MAX_PAGES 16
+
+typedef struct vm_page_loan {
+	addr_t offset; // where the data starts in the first page
+	addr_t len;
+	int num_pages;
+	vm_page *pages[VM_LOAN_MAX_PAGES];
+	vm_cache_ref *cache_refs[VM_LOAN_MAX_PAGES];
+} vm_page_loan;
+
+ssize_t vm_loan_user_pages(const void *buf, addr_t len, vm_page_loan *loan);
+void vm_unloan_pages(vm_page_loan *loan);
+int vm_loan_copy_to_user(vm_page_loan *loan, addr_t pos, void *buf, addr_t len);
+int vm_move_pages_to_user(void *buf, vm_page **pages, int count);
+
 int user_memcpy(void *to, const void *from, size_t size);
 int user_strcpy(char *to, const char *from);
 int user_strncpy(char *to, const char *from, size_t size);
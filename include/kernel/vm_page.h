@@ -19,6 +19,7 @@ int vm_mark_page_range_inuse(addr_t start_page, addr_t len);
 int vm_page_set_state(vm_page *page, int state);
 
 vm_page *vm_page_allocate_page(int state);
+int vm_page_allocate_pages(addr_t count, int state, vm_page **pages);
 vm_page *vm_page_allocate_page_run(int state, addr_t len);
 vm_page *vm_page_allocate_specific_page(addr_t page_num, int state);
 vm_page *vm_lookup_page(addr_t page_num);
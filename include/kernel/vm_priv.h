@@ -23,9 +23,6 @@
 #define MAX_FAULTS_PER_SECOND 100
 #define MIN_FAULTS_PER_SECOND 10
 
-#define WRITE_COUNT 1024
-#define READ_COUNT 1
-
 // page attributes
 #define PAGE_MODIFIED 0x04
 #define PAGE_ACCESSED 0x08
@@ -40,6 +37,15 @@ int vm_daemon_init(void);
 int vm_aspace_walk_start(struct hash_iterator *i);
 vm_address_space *vm_aspace_walk_next(struct hash_iterator *i);
 
+// balanced tree of regions in a virtual map. The map's rw lock must be held,
+// read locked for lookups and write locked for insert and remove
+void vm_region_tree_init(vm_virtual_map *map);
+vm_region *vm_region_tree_lookup(vm_virtual_map *map, addr_t address);
+int vm_region_tree_find_slot(vm_virtual_map *map, addr_t start, addr_t size, addr_t *_base);
+bool vm_region_tree_range_free(vm_virtual_map *map, addr_t start, addr_t size);
+void vm_region_tree_insert(vm_virtual_map *map, vm_region *region);
+void vm_region_tree_remove(vm_virtual_map *map, vm_region *region);
+
 // get some data about the number of pages in the system
 addr_t vm_page_num_pages(void);
 addr_t vm_page_num_free_pages(void);
@@ -60,6 +60,11 @@ enum {
 	IOCTL_NET_CONTROL_ROUTE_LIST,
 	IOCTL_NET_IF_GET_ADDR,
 	IOCTL_NET_IF_GET_TYPE,
+	IOCTL_NET_IF_GET_RX_HOOK, // kernel only, fills in an if_rx_hook
+	IOCTL_NET_IF_GET_TX_HOOK, // kernel only, fills in an if_tx_hook
+	IOCTL_NET_CONTROL_ROUTE_STATS,
+	IOCTL_NET_CONTROL_TCP_SET_CC,
+	IOCTL_NET_CONTROL_TCP_GET_CC,
 };
 
 /* used in all of the IF control messages */
@@ -78,6 +83,34 @@ struct _ioctl_net_route_struct {
 	char if_name[SYS_MAX_PATH_LEN];
 };
 
+/* IOCTL_NET_CONTROL_ROUTE_LIST fills in an array of these and returns the number of routes */
+#define ROUTE_FLAGS_GW 1
+
+struct _ioctl_net_route_entry {
+	netaddr net_addr;
+	netaddr mask_addr;
+	netaddr if_addr;
+	netaddr gw_addr;
+	int flags;
+	char if_name[SYS_MAX_NAME_LEN];
+};
+
+/* IOCTL_NET_CONTROL_ROUTE_STATS */
+struct _ioctl_net_route_stats {
+	int routes;
+	int nodes;
+	int generation;
+	uint64 lookups;
+	uint64 cache_hits;
+	uint64 cache_misses;
+	uint64 no_route;
+};
+
+/* IOCTL_NET_CONTROL_TCP_SET_CC and _GET_CC, the congestion control new tcp sockets get */
+struct _ioctl_net_tcp_cc {
+	char name[SYS_MAX_NAME_LEN];
+};
+
 #define NET_CONTROL_DEV "/dev/net/ctrl"
 
 #endif
@@ -7,6 +7,9 @@
 
 enum {
 	_PIPEFS_IOCTL_CREATE_ANONYMOUS = 10000,
+	_PIPEFS_IOCTL_SET_BUFFER_SIZE, // int, how much the pipe can hold
+	_PIPEFS_IOCTL_GET_BUFFER_SIZE,
+	_PIPEFS_IOCTL_SET_LOW_WATER,   // int, bytes buffered before a blocked reader wakes up
 };
 
 #endif
@@ -119,6 +119,7 @@ typedef int pgrp_id;        // process group id
 typedef int sess_id;        // session id
 typedef int sem_id;         // semaphore id
 typedef int port_id;        // ipc port id
+typedef int evq_id;         // event queue id
 typedef int image_id;       // binary image id
 
 # include <stddef.h>
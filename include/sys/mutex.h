@@ -0,0 +1,47 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#ifndef _NEWOS_INCLUDE_SYS_MUTEX_H
+#define _NEWOS_INCLUDE_SYS_MUTEX_H
+
+#include <newos/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// User space locks built on futexes. Taking and dropping a lock nobody else
+// wants is a single atomic op, only sleeping and waking go into the kernel.
+// Both are just ints, so zeroed memory is an unlocked mutex and an idle cond.
+typedef struct mutex {
+	int state; // 0 unlocked, 1 locked, 2 locked with (maybe) sleepers
+} mutex_t;
+
+typedef struct cond {
+	int seq; // bumped on every signal, waiters sleep on it
+	int waiters; // signals skip the kernel when there are none
+} cond_t;
+
+#define MUTEX_INITIALIZER { 0 }
+#define COND_INITIALIZER { 0, 0 }
+
+int mutex_init(mutex_t *m);
+int mutex_destroy(mutex_t *m);
+int mutex_lock(mutex_t *m);
+int mutex_trylock(mutex_t *m);
+int mutex_unlock(mutex_t *m);
+
+int cond_init(cond_t *c);
+int cond_destroy(cond_t *c);
+int cond_wait(cond_t *c, mutex_t *m);
+int cond_timedwait(cond_t *c, mutex_t *m, bigtime_t timeout);
+int cond_signal(cond_t *c);
+int cond_broadcast(cond_t *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
+
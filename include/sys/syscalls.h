@@ -37,6 +37,30 @@ struct file_stat {
 
 #define PORT_FLAG_TIMEOUT 2
 
+#define FUTEX_FLAG_TIMEOUT 2
+#define FUTEX_FLAG_INTERRUPTABLE 4
+
+/* event queue readiness bits, and flags for _kern_evq_ctl */
+#define EVQ_IN 0x1
+#define EVQ_OUT 0x2
+#define EVQ_ERR 0x4
+#define EVQ_HUP 0x8
+#define EVQ_EDGE 0x100
+#define EVQ_ONESHOT 0x200
+
+#define EVQ_CTL_ADD 0
+#define EVQ_CTL_MODIFY 1
+#define EVQ_CTL_REMOVE 2
+
+#define EVQ_FLAG_TIMEOUT 2
+#define EVQ_FLAG_INTERRUPTABLE 4
+
+struct evq_event {
+	int fd;
+	int events;
+	void *data;
+};
+
 // info about a region that external entities may want to know
 typedef struct vm_region_info {
 	region_id id;
@@ -86,6 +110,9 @@ struct thread_info {
 
 	bigtime_t user_time;
 	bigtime_t kernel_time;
+
+	uint32 context_switches;
+	uint32 preemptions;
 };
 
 // args to proc_create_proc()
@@ -251,6 +278,16 @@ int _kern_atomic_or(int *val, int incr);
 int _kern_atomic_set(int *val, int set_to);
 int _kern_test_and_set(int *val, int set_to, int test_val);
 
+/* futexes, see sys/mutex.h for the locks built on them */
+int _kern_futex_wait(int *addr, int val, int flags, bigtime_t timeout);
+int _kern_futex_wake(int *addr, int count);
+
+/* event queues, wait for any of a bunch of fds to be ready */
+evq_id _kern_evq_create(const char *name);
+int _kern_evq_delete(evq_id id);
+int _kern_evq_ctl(evq_id id, int op, int fd, int events, void *data);
+int _kern_evq_wait(evq_id id, struct evq_event *events, int max_events, int flags, bigtime_t timeout);
+
 /* signals */
 int _kern_sigaction(int sig, const struct sigaction *action, struct sigaction *old_action);
 int _kern_send_signal(thread_id tid, uint signal);
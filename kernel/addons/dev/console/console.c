@@ -733,6 +733,8 @@ static struct dev_calls console_hooks = {
 	/* cannot page from /dev/console */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -365,6 +365,8 @@ static struct dev_calls floppy_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
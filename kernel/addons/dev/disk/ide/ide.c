@@ -279,7 +279,8 @@ static struct dev_calls ide_hooks = {
 
 	ide_canpage,
 	ide_readpage,
-	ide_writepage
+	ide_writepage,
+	NULL
 };
 
 //--------------------------------------------------------------------------------
@@ -251,6 +251,8 @@ struct dev_calls ide_hooks = {
 	/* cannot page from pci devices */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 void	init_ide_struct(int bus,int device,int partition_id)
@@ -351,6 +351,8 @@ static struct dev_calls ide_hooks = {
 	// can't page from ide devices
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -511,7 +511,8 @@ static struct dev_calls netblock_hooks = {
 	&netblock_write,
 	&netblock_canpage,
 	&netblock_readpage,
-	&netblock_writepage
+	&netblock_writepage,
+	NULL
 };
 
 int dev_bootstrap(void);
@@ -253,6 +253,8 @@ struct dev_calls ps2_mouse_hooks = {
 	/* cannot page from mouse */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 }; // ps2_mouse_hooks
 
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <newos/errors.h>
 #include <kernel/net/ethernet.h>
+#include <kernel/net/if.h>
 
 #include "pcnet32_dev.h"
 #include "pcnet32_priv.h"
@@ -58,6 +59,16 @@ static ssize_t pcnet32_read(dev_cookie cookie, void *buf, off_t pos, ssize_t len
 	return pcnet32_rx(nic, buf, len);
 }
 
+static int pcnet32_rx_hook(void *cookie, cbuf **frames, int max_frames)
+{
+	return pcnet32_rx_frames((pcnet32 *)cookie, frames, max_frames);
+}
+
+static int pcnet32_tx_hook(void *cookie, cbuf **frames, int count)
+{
+	return pcnet32_xmit_frames((pcnet32 *)cookie, frames, count);
+}
+
 static ssize_t pcnet32_write(dev_cookie cookie, const void *buf, off_t pos, ssize_t len)
 {
 	pcnet32 *nic = (pcnet32 *)cookie;
@@ -93,6 +104,22 @@ static int pcnet32_ioctl(dev_cookie cookie, int op, void *buf, size_t len)
 				err = ERR_VFS_INSUFFICIENT_BUF;
 			}
 			break;
+		case IOCTL_NET_IF_GET_RX_HOOK:
+			if (len >= sizeof(if_rx_hook)) {
+				((if_rx_hook *)buf)->cookie = nic;
+				((if_rx_hook *)buf)->rx_frames = &pcnet32_rx_hook;
+			} else {
+				err = ERR_VFS_INSUFFICIENT_BUF;
+			}
+			break;
+		case IOCTL_NET_IF_GET_TX_HOOK:
+			if (len >= sizeof(if_tx_hook)) {
+				((if_tx_hook *)buf)->cookie = nic;
+				((if_tx_hook *)buf)->tx_frames = &pcnet32_tx_hook;
+			} else {
+				err = ERR_VFS_INSUFFICIENT_BUF;
+			}
+			break;
 		default:
 			err = ERR_INVALID_ARGS;
 	}
@@ -111,6 +138,8 @@ static struct dev_calls pcnet32_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -60,6 +60,12 @@ static uint16 gringlens[] = { 1, 2, 4, 8, 16, 32, 64, 128, 256, 512 };
 #define TXRING_BUFFER(_nic, _index) ((_nic)->tx_buffers + ((_index) * (_nic)->tx_buffersize))
 #define BUFFER_PHYS(_nic, _buffer) (addr_t)((_nic)->buffers_phys + ((_buffer) - (_nic)->buffers))
 
+// size of the cbufs loaned to the rx descriptors, enough for a full frame plus the crc
+#define RX_CBUF_LEN 1536
+
+// chains with more pieces than this get copied into a tx buffer instead
+#define TX_MAX_SEGMENTS 8
+
 static int pcnet32_int(void*);
 
 // call this to enable a receive buffer so the controller can fill it.
@@ -156,18 +162,31 @@ pcnet32 *pcnet32_new(pci_module_hooks *bus, uint32 initmode, uint16 rxbuffer_siz
 	if (mutex_init(&nic->rxring_mutex, "pcnet32_rxring") < 0)
 		goto err_after_rxring_sem;
 
+	nic->rx_cbufs = (cbuf**)kmalloc(nic->rxring_count * sizeof(cbuf *));
+	if (nic->rx_cbufs == NULL)
+		goto err_after_rxring_mutex;
+	memset(nic->rx_cbufs, 0, nic->rxring_count * sizeof(cbuf *));
+
 	// setup_transmit_descriptor_ring;
 	nic->txring_count = txring_count;
 	nic->tx_buffersize = txbuffer_size;
 	nic->txring_head = 0;
 
+	if (mutex_init(&nic->txring_mutex, "pcnet32_txring") < 0)
+		goto err_after_rx_cbufs;
+
+	nic->tx_cbufs = (cbuf**)kmalloc(nic->txring_count * sizeof(cbuf *));
+	if (nic->tx_cbufs == NULL)
+		goto err_after_txring_mutex;
+	memset(nic->tx_cbufs, 0, nic->txring_count * sizeof(cbuf *));
+
 	nic->txring_region = vm_create_anonymous_region(
 		vm_get_kernel_aspace_id(), "pcnet32_txring", (void**)&nic->txring,
 		REGION_ADDR_ANY_ADDRESS, nic->txring_count * sizeof(struct pcnet32_txdesc),
 		REGION_WIRING_WIRED_CONTIG, LOCK_KERNEL | LOCK_RW);
 
 	if (nic->txring_region < 0)
-		goto err_after_rxring_mutex;
+		goto err_after_tx_cbufs;
 
 	memset(nic->txring, 0, nic->txring_count * sizeof(struct pcnet32_txdesc));
 	vm_get_page_mapping(vm_get_kernel_aspace_id(),
@@ -216,6 +235,15 @@ err_after_buffers_region:
 err_after_txring_region:
 	vm_delete_region(vm_get_kernel_aspace_id(), nic->txring_region);
 
+err_after_tx_cbufs:
+	kfree(nic->tx_cbufs);
+
+err_after_txring_mutex:
+	mutex_destroy(&nic->txring_mutex);
+
+err_after_rx_cbufs:
+	kfree(nic->rx_cbufs);
+
 err_after_rxring_mutex:
 	mutex_destroy(&nic->rxring_mutex);
 
@@ -367,8 +395,16 @@ void pcnet32_start(pcnet32 *nic)
 	for (i = 0; i < nic->rxring_count; i++)
 		rxdesc_init(nic, i);
 
-	// Initialize the txring
+	// Initialize the txring, dropping anything that was still queued
+	mutex_lock(&nic->txring_mutex);
+	for (i = 0; i < nic->txring_count; i++) {
+		if (nic->tx_cbufs[i] != NULL) {
+			cbuf_free_chain(nic->tx_cbufs[i]);
+			nic->tx_cbufs[i] = NULL;
+		}
+	}
 	memset(nic->txring, 0, nic->txring_count * sizeof(struct pcnet32_txdesc));
+	mutex_unlock(&nic->txring_mutex);
 
 	// write the start and interrupt enable bits.
 	write_csr(nic, PCNET_CSR_STATUS, PCNET_STATUS_STRT | PCNET_STATUS_IENA);
@@ -393,6 +429,21 @@ void pcnet32_stop(pcnet32 *nic)
 
 void pcnet32_delete(pcnet32 *nic)
 {
+	int i;
+
+	for (i = 0; i < nic->rxring_count; i++) {
+		if (nic->rx_cbufs[i] != NULL)
+			cbuf_free_chain(nic->rx_cbufs[i]);
+	}
+	kfree(nic->rx_cbufs);
+
+	for (i = 0; i < nic->txring_count; i++) {
+		if (nic->tx_cbufs[i] != NULL)
+			cbuf_free_chain(nic->tx_cbufs[i]);
+	}
+	kfree(nic->tx_cbufs);
+	mutex_destroy(&nic->txring_mutex);
+
         sem_delete(nic->interrupt_sem);
         vm_delete_region(vm_get_kernel_aspace_id(), nic->buffers_region);
 
@@ -410,10 +461,27 @@ static void rxdesc_init(pcnet32 *nic, uint16 index)
 	uint16 masked_index = RXRING_INDEX(nic, index);
 
 	struct pcnet32_rxdesc *desc = nic->rxring + masked_index;
-	uint32 buffer = BUFFER_PHYS(nic, RXRING_BUFFER(nic, masked_index));
+	addr_t buffer = 0;
+
+	// loan a cbuf to the descriptor so the frame can go up the stack without a copy
+	if (nic->rx_cbufs[masked_index] == NULL)
+		nic->rx_cbufs[masked_index] = cbuf_get_chain(RX_CBUF_LEN);
+	if (nic->rx_cbufs[masked_index] != NULL) {
+		vm_get_page_mapping(vm_get_kernel_aspace_id(), (addr_t)nic->rx_cbufs[masked_index]->data, &buffer);
+		if (buffer == 0) {
+			cbuf_free_chain(nic->rx_cbufs[masked_index]);
+			nic->rx_cbufs[masked_index] = NULL;
+		}
+	}
 
-	desc->buffer_addr = buffer;
-	desc->buffer_length = -nic->rx_buffersize;
+	if (buffer != 0) {
+		desc->buffer_addr = buffer;
+		desc->buffer_length = -RX_CBUF_LEN;
+	} else {
+		// out of cbufs, use the static buffer for this slot
+		desc->buffer_addr = BUFFER_PHYS(nic, RXRING_BUFFER(nic, masked_index));
+		desc->buffer_length = -nic->rx_buffersize;
+	}
 	desc->message_length = 0;
 	desc->user = 0;
 
@@ -421,13 +489,24 @@ static void rxdesc_init(pcnet32 *nic, uint16 index)
 	desc->status = PCNET_RXSTATUS_OWN;
 }
 
-ssize_t pcnet32_xmit(pcnet32 *nic, const char *ptr, ssize_t len)
+// the controller is done with a descriptor we want to reuse, let go of
+// the chain that was sent out of it.
+// NOTE: the txring_mutex should be held
+static void txdesc_reclaim(pcnet32 *nic, uint16 index)
+{
+	if (nic->tx_cbufs[index] != NULL) {
+		cbuf_free_chain(nic->tx_cbufs[index]);
+		nic->tx_cbufs[index] = NULL;
+	}
+}
+
+// copy a frame into the tx buffer of the next descriptor and queue it up.
+// NOTE: the txring_mutex should be held
+static ssize_t xmit_copy(pcnet32 *nic, const char *ptr, cbuf *chain, ssize_t len)
 {
 	uint16 index = 0;
 	uint8 *buffer = NULL;
 
-	SHOW_FLOW(3, "nic %p data %p len %d", nic, ptr, len);
-
 	index = TXRING_INDEX(nic, nic->txring_head);
 
 	SHOW_FLOW(3, "using txring index %d", index);
@@ -441,13 +520,17 @@ ssize_t pcnet32_xmit(pcnet32 *nic, const char *ptr, ssize_t len)
 		SHOW_FLOW0(3, "packet was too large or no more txbuffers.");
 		return ERR_VFS_INSUFFICIENT_BUF;
 	}
+	txdesc_reclaim(nic, index);
 
 	// Get buffer address from descriptor at end_tx_queue;
 	buffer = TXRING_BUFFER(nic, index);
 	nic->txring[index].buffer_addr = BUFFER_PHYS(nic, buffer);
 
 	// Copy packet to tx buffer;
-	memcpy(buffer, ptr, len);
+	if (chain != NULL)
+		cbuf_memcpy_from_chain(buffer, chain, 0, len);
+	else
+		memcpy(buffer, ptr, len);
 
 	// Set up BCNT field of descriptor;
 	nic->txring[index].buffer_length = -len;
@@ -460,77 +543,215 @@ ssize_t pcnet32_xmit(pcnet32 *nic, const char *ptr, ssize_t len)
 	// if (tx_queue_tail > last_tx_descriptor) tx_queue_tail = first_tx_descriptor;
 	nic->txring_head++;
 
-	// set the transmit demand bit in CSR0
-	modify_csr(nic, PCNET_CSR_STATUS, PCNET_STATUS_TDMD, PCNET_STATUS_TDMD);
-
 	// return "OK";
 	return len;
 }
 
-ssize_t pcnet32_rx(pcnet32 *nic, char *buf, ssize_t buf_len)
+// queue a frame straight out of its cbufs, one descriptor per piece of the chain.
+// Returns ERR_NOT_ALLOWED if the chain has to go through the copying path instead.
+// NOTE: the txring_mutex should be held
+static ssize_t xmit_gather(pcnet32 *nic, cbuf *chain)
 {
-	uint16 index = 0;
-	ssize_t real_len = -1;
+	struct pcnet32_txdesc *desc;
+	uint16 first = TXRING_INDEX(nic, nic->txring_head);
+	uint16 index;
+	uint16 status;
+	addr_t phys;
+	cbuf *buf;
+	int segs = 0;
+	int i;
 
-	SHOW_FLOW(3, "nic %p data %p buf_len %d", nic, buf, buf_len);
+	for (buf = chain; buf != NULL; buf = buf->next) {
+		if (buf->len > 0)
+			segs++;
+	}
+	if (segs == 0 || segs > TX_MAX_SEGMENTS || segs >= nic->txring_count)
+		return ERR_NOT_ALLOWED;
+
+	// make sure the whole frame fits before touching anything
+	for (i = 0; i < segs; i++) {
+		if (nic->txring[TXRING_INDEX(nic, first + i)].status & PCNET_TXSTATUS_OWN) {
+			SHOW_FLOW0(3, "no more txbuffers.");
+			return ERR_VFS_INSUFFICIENT_BUF;
+		}
+	}
 
-	// here we loop through consuming rxring descriptors until we get
-	// one suitable for returning.
-	while (true)
-	{
-		// consume 1 descriptor at a time, whether it's an error or a
-		// valid packet.
-		sem_acquire(nic->rxring_sem, 1);
-		SHOW_FLOW(3, "nic %p rx semaphore was signalled", nic);
+	// the first descriptor is handed over last, so the controller can't start
+	// on the frame before all of it is there
+	i = 0;
+	for (buf = chain; buf != NULL; buf = buf->next) {
+		if (buf->len == 0)
+			continue;
+
+		index = TXRING_INDEX(nic, first + i);
+		txdesc_reclaim(nic, index);
+
+		// a cbuf never straddles a page, so each piece is physically contiguous
+		phys = 0;
+		vm_get_page_mapping(vm_get_kernel_aspace_id(), (addr_t)buf->data, &phys);
+
+		desc = nic->txring + index;
+		desc->buffer_addr = phys;
+		desc->buffer_length = -buf->len;
+		desc->misc = 0;
+
+		status = 0;
+		if (i == 0)
+			status |= PCNET_TXSTATUS_STP;
+		else
+			status |= PCNET_TXSTATUS_OWN;
+		if (i == segs - 1)
+			status |= PCNET_TXSTATUS_ENP;
+		desc->status = status;
+		i++;
+	}
 
-		// the semaphor has been released at least once, so we will
-		// lock the rxring and grab the next available descriptor.
-		mutex_lock(&nic->rxring_mutex);
+	// the chain is freed when its last descriptor gets reused
+	nic->tx_cbufs[TXRING_INDEX(nic, first + segs - 1)] = chain;
+
+	// hand the frame over
+	nic->txring[first].status |= PCNET_TXSTATUS_OWN;
+	nic->txring_head += segs;
+
+	return chain->total_len;
+}
+
+ssize_t pcnet32_xmit(pcnet32 *nic, const char *ptr, ssize_t len)
+{
+	ssize_t err;
 
+	SHOW_FLOW(3, "nic %p data %p len %d", nic, ptr, len);
+
+	mutex_lock(&nic->txring_mutex);
+	err = xmit_copy(nic, ptr, NULL, len);
+	mutex_unlock(&nic->txring_mutex);
+
+	// set the transmit demand bit in CSR0
+	if (err >= 0)
+		modify_csr(nic, PCNET_CSR_STATUS, PCNET_STATUS_TDMD, PCNET_STATUS_TDMD);
+
+	return err;
+}
+
+int pcnet32_xmit_frames(pcnet32 *nic, cbuf **frames, int count)
+{
+	ssize_t err;
+	int queued = 0;
+	int i;
+
+	SHOW_FLOW(3, "nic %p frames %p count %d", nic, frames, count);
+
+	mutex_lock(&nic->txring_mutex);
+	for (i = 0; i < count; i++) {
+		err = xmit_gather(nic, frames[i]);
+		if (err == ERR_NOT_ALLOWED) {
+			// too fragmented, flatten it into a tx buffer
+			err = xmit_copy(nic, NULL, frames[i], cbuf_get_len(frames[i]));
+			cbuf_free_chain(frames[i]);
+		} else if (err < 0) {
+			cbuf_free_chain(frames[i]);
+		}
+		if (err >= 0)
+			queued++;
+	}
+	mutex_unlock(&nic->txring_mutex);
+
+	// one transmit demand for the whole batch
+	if (queued > 0)
+		modify_csr(nic, PCNET_CSR_STATUS, PCNET_STATUS_TDMD, PCNET_STATUS_TDMD);
+
+	return queued;
+}
+
+// take the frame out of a descriptor that the controller is done with.
+// The loaned cbuf is handed over as is and the descriptor gets a fresh one.
+// NOTE: the rxring_mutex should be held
+static cbuf *rxdesc_take_frame(pcnet32 *nic, uint16 index)
+{
+	struct pcnet32_rxdesc *desc = nic->rxring + index;
+	size_t len = desc->message_length;
+	cbuf *frame = nic->rx_cbufs[index];
+
+	if (len == 0)
+		return NULL;
+
+	if (frame != NULL) {
+		if (len > RX_CBUF_LEN)
+			return NULL;
+		nic->rx_cbufs[index] = NULL;
+		frame->len = frame->total_len = len;
+	} else {
+		// the frame landed in the static buffer, copy it out
+		if (len > nic->rx_buffersize)
+			return NULL;
+		frame = cbuf_get_chain(len);
+		if (frame != NULL)
+			cbuf_memcpy_to_chain(frame, 0, RXRING_BUFFER(nic, index), len);
+	}
+
+	return frame;
+}
+
+int pcnet32_rx_frames(pcnet32 *nic, cbuf **frames, int max_frames)
+{
+	uint16 index;
+	int count = 0;
+
+	SHOW_FLOW(3, "nic %p max_frames %d", nic, max_frames);
+
+	// wait for the first frame, then grab whatever else is ready
+	sem_acquire(nic->rxring_sem, 1);
+
+	mutex_lock(&nic->rxring_mutex);
+
+	do {
 		// grab the index we want.
 		index = RXRING_INDEX(nic, nic->rxring_tail);
 
-		if (nic->rxring[index].status & PCNET_RXSTATUS_ERR)
-		{
+		if (nic->rxring[index].status & PCNET_RXSTATUS_OWN) {
+			SHOW_FLOW(3, "warning: descriptor %d should have been owned by the software is owned by the hardware.", index);
+		} else if (nic->rxring[index].status & PCNET_RXSTATUS_ERR) {
 			SHOW_FLOW(3, "rxring descriptor %d reported an error: 0x%.4x",
 				  index, nic->rxring[index].status);
+			rxdesc_init(nic, index);
+		} else {
+			frames[count] = rxdesc_take_frame(nic, index);
+			if (frames[count] != NULL)
+				count++;
+
+			// give the descriptor back to the controller.
+			rxdesc_init(nic, index);
 		}
 
-		if (nic->rxring[index].status & PCNET_RXSTATUS_OWN)
-		{
-			SHOW_FLOW(3, "warning: descriptor %d should have been owned by the software is owned by the hardware.", index);
+		// move the tail up.
+		nic->rxring_tail++;
+	} while (count < max_frames && sem_acquire_etc(nic->rxring_sem, 1, SEM_FLAG_TIMEOUT, 0, NULL) >= 0);
 
-			nic->rxring_tail++;
-			mutex_unlock(&nic->rxring_mutex);
-			continue; // skip this descriptor altogether.
-		}
-		else if ((size_t)buf_len >= nic->rxring[index].message_length) // got one
-		{
-			real_len = nic->rxring[index].message_length;
+	mutex_unlock(&nic->rxring_mutex);
 
-			// copy the buffer
-			memcpy(buf, RXRING_BUFFER(nic, index), real_len);
+	SHOW_FLOW(3, "nic %p returning %d frames", nic, count);
 
-			// reinitialize the buffer and give it back to the controller.
-			rxdesc_init(nic, index);
+	return count;
+}
 
-			SHOW_FLOW(3, "Got index %d, len %d and cleared it, returning to caller. rxstatus = 0x%x.", index,
-				  nic->rxring[index].message_length, nic->rxring[index].status);
+ssize_t pcnet32_rx(pcnet32 *nic, char *buf, ssize_t buf_len)
+{
+	cbuf *frame;
+	ssize_t len;
 
-			// move the tail up.
-			nic->rxring_tail++;
-			mutex_unlock(&nic->rxring_mutex);
-			return real_len;
-		} else {
-			// there is a packet, but it's too large for the buffer.
-			// So we don't want to do anything with the ring, we just
-			// want to unlock our mutex and return.
-			mutex_unlock(&nic->rxring_mutex);
-			return ERR_TOO_BIG;
-		}
-	}
+	SHOW_FLOW(3, "nic %p data %p buf_len %d", nic, buf, buf_len);
 
-	return real_len;
+	while (pcnet32_rx_frames(nic, &frame, 1) == 0)
+		;
+
+	len = cbuf_get_len(frame);
+	if (len <= buf_len)
+		cbuf_memcpy_from_chain(buf, frame, 0, len);
+	else
+		len = ERR_TOO_BIG;
+	cbuf_free_chain(frame);
+
+	return len;
 }
 
 // these two return false when there is nothing left to do.
@@ -8,6 +8,7 @@
 #include <kernel/kernel.h>
 #include <kernel/vm.h>
 #include <kernel/smp.h>
+#include <kernel/cbuf.h>
 #include <kernel/bus/pci/pci.h>
 
 struct pcnet32_rxdesc
@@ -72,9 +73,18 @@ typedef struct pcnet32
 	struct pcnet32_rxdesc *rxring;
 	addr_t rxring_phys;
 
+	// cbufs loaned to the rx descriptors, the controller dmas straight into them.
+	// A NULL entry means the descriptor fell back to its slot in rx_buffers.
+	cbuf **rx_cbufs;
+
 	// transmit ring
 	uint16 txring_count;
 	uint16 txring_head; // next place to insert a packet
+	mutex txring_mutex;
+
+	// chains being sent straight out of their cbufs, hung off of the frame's last
+	// descriptor and freed when the descriptor gets reused
+	cbuf **tx_cbufs;
 
 	region_id txring_region;
 	struct pcnet32_txdesc *txring;
@@ -109,7 +119,9 @@ void pcnet32_start(pcnet32 *nic);
 void pcnet32_stop(pcnet32 *nic);
 
 ssize_t pcnet32_xmit(pcnet32 *nic, const char *ptr, ssize_t len);
+int pcnet32_xmit_frames(pcnet32 *nic, cbuf **frames, int count);
 ssize_t pcnet32_rx(pcnet32 *nic, char *buf, ssize_t buf_len);
+int pcnet32_rx_frames(pcnet32 *nic, cbuf **frames, int max_frames);
 
 // PCNET 32-bit IO Resources:
 enum {
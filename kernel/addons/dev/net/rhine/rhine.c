@@ -102,6 +102,8 @@ static struct dev_calls rhine_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
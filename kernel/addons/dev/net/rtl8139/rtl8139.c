@@ -10,6 +10,7 @@
 #include <string.h>
 #include <newos/errors.h>
 #include <kernel/net/ethernet.h>
+#include <kernel/net/if.h>
 
 #include "rtl8139_priv.h"
 
@@ -46,6 +47,16 @@ static ssize_t rtl8139_read(dev_cookie cookie, void *buf, off_t pos, ssize_t len
 	return rtl8139_rx(rtl, buf, len);
 }
 
+static int rtl8139_rx_hook(void *cookie, cbuf **frames, int max_frames)
+{
+	return rtl8139_rx_frames((rtl8139 *)cookie, frames, max_frames);
+}
+
+static int rtl8139_tx_hook(void *cookie, cbuf **frames, int count)
+{
+	return rtl8139_xmit_frames((rtl8139 *)cookie, frames, count);
+}
+
 static ssize_t rtl8139_write(dev_cookie cookie, const void *buf, off_t pos, ssize_t len)
 {
 	rtl8139 *rtl = (rtl8139 *)cookie;
@@ -84,6 +95,22 @@ static int rtl8139_ioctl(dev_cookie cookie, int op, void *buf, size_t len)
 				err = ERR_VFS_INSUFFICIENT_BUF;
 			}
 			break;
+		case IOCTL_NET_IF_GET_RX_HOOK: // hand frames to the stack directly as cbufs
+			if(len >= sizeof(if_rx_hook)) {
+				((if_rx_hook *)buf)->cookie = rtl;
+				((if_rx_hook *)buf)->rx_frames = &rtl8139_rx_hook;
+			} else {
+				err = ERR_VFS_INSUFFICIENT_BUF;
+			}
+			break;
+		case IOCTL_NET_IF_GET_TX_HOOK: // queue cbuf chains without flattening them
+			if(len >= sizeof(if_tx_hook)) {
+				((if_tx_hook *)buf)->cookie = rtl;
+				((if_tx_hook *)buf)->tx_frames = &rtl8139_tx_hook;
+			} else {
+				err = ERR_VFS_INSUFFICIENT_BUF;
+			}
+			break;
 		default:
 			err = ERR_INVALID_ARGS;
 	}
@@ -102,6 +129,8 @@ static struct dev_calls rtl8139_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -334,47 +334,77 @@ void rtl8139_xmit(rtl8139 *rtl, const char *ptr, ssize_t len)
 	mutex_unlock(&rtl->lock);
 }
 
+// the tx slots are fixed contiguous buffers with no gather support, so each
+// chain gets copied exactly once, straight into the slot it goes out of
+int rtl8139_xmit_frames(rtl8139 *rtl, cbuf **frames, int count)
+{
+	size_t len;
+	int queued = 0;
+	int i;
+
+	for(i = 0; i < count; i++) {
+		len = cbuf_get_len(frames[i]);
+		if(len > ETHERNET_MAX_SIZE) {
+			cbuf_free_chain(frames[i]);
+			continue;
+		}
+
+		sem_acquire(rtl->tx_sem, 1);
+		mutex_lock(&rtl->lock);
+
+		// the slot is ours once we have the sem, fill it before grabbing the spinlock
+		cbuf_memcpy_from_chain((void *)(rtl->txbuf + rtl->txbn * 0x800), frames[i], 0, len);
+		if(len < ETHERNET_MIN_SIZE)
+			len = ETHERNET_MIN_SIZE;
+
+		int_disable_interrupts();
+		acquire_spinlock(&rtl->reg_spinlock);
+
+		RTL_WRITE_32(rtl, RT_TXSTATUS0 + rtl->txbn*4, len | 0x80000);
+		if(++rtl->txbn >= 4)
+			rtl->txbn = 0;
+
+		release_spinlock(&rtl->reg_spinlock);
+		int_restore_interrupts();
+
+		mutex_unlock(&rtl->lock);
+
+		cbuf_free_chain(frames[i]);
+		queued++;
+	}
+
+	return queued;
+}
+
 typedef struct rx_entry {
 	volatile uint16 status;
 	volatile uint16 len;
 	volatile uint8 data[1];
 } rx_entry;
 
-ssize_t rtl8139_rx(rtl8139 *rtl, char *buf, ssize_t buf_len)
+// pull the next frame off of the receive ring into buf. Returns the length of
+// the frame, 0 if there wasn't a complete one, or an error. *more is set if
+// there are more frames waiting behind it.
+// NOTE: the rtl's lock should be held
+static ssize_t rtl8139_rx_frame(rtl8139 *rtl, char *buf, ssize_t buf_len, bool *more)
 {
 	rx_entry *entry;
 	uint32 tail;
 	uint16 len;
-	int rc;
-	bool release_sem = false;
-
-//	dprintf("rtl8139_rx: entry\n");
-
-	if(buf_len < 1500)
-		return -1;
+	ssize_t rc = 0;
 
-restart:
-	sem_acquire(rtl->rx_sem, 1);
-	mutex_lock(&rtl->lock);
+	*more = false;
 
 	int_disable_interrupts();
 	acquire_spinlock(&rtl->reg_spinlock);
 
 	tail = TAILREG_TO_TAIL(RTL_READ_16(rtl, RT_RXBUFTAIL));
 //	dprintf("tailreg = 0x%x, actual tail 0x%x\n", RTL_READ_16(rtl, RT_RXBUFTAIL), tail);
-	if(tail == RTL_READ_16(rtl, RT_RXBUFHEAD)) {
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
-	}
+	if(tail == RTL_READ_16(rtl, RT_RXBUFHEAD))
+		goto out;
 
-	if(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY) {
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
-	}
+	if(RTL_READ_8(rtl, RT_CHIPCMD) & RT_CMD_RX_BUF_EMPTY)
+		goto out;
 
 	// grab another buffer
 	entry = (rx_entry *)((uint8 *)rtl->rxbuf + tail);
@@ -382,12 +412,8 @@ restart:
 //	dprintf("entry->len = 0x%x\n", entry->len);
 
 	// see if it's an unfinished buffer
-	if(entry->len == 0xfff0) {
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
-	}
+	if(entry->len == 0xfff0)
+		goto out;
 
 	// figure the len that we need to copy
 	len = entry->len - 4; // minus the crc
@@ -396,10 +422,7 @@ restart:
 	if((entry->status & RT_RX_STATUS_OK) == 0 || len > ETHERNET_MAX_SIZE) {
 		// error, lets reset the card
 		rtl8139_resetrx(rtl);
-		release_spinlock(&rtl->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&rtl->lock);
-		goto restart;
+		goto out;
 	}
 
 	// copy the buffer
@@ -407,7 +430,7 @@ restart:
 		dprintf("rtl8139_rx: packet too large for buffer (len %d, buf_len %ld)\n", len, (long)buf_len);
 		RTL_WRITE_16(rtl, RT_RXBUFTAIL, TAILREG_TO_TAIL(RTL_READ_16(rtl, RT_RXBUFHEAD)));
 		rc = ERR_TOO_BIG;
-		release_sem = true;
+		*more = true;
 		goto out;
 	}
 	if(tail + len > 0xffff) {
@@ -426,35 +449,81 @@ restart:
 
 	if(tail != RTL_READ_16(rtl, RT_RXBUFHEAD)) {
 		// we're at last one more packet behind
-		release_sem = true;
+		*more = true;
 	}
 
 out:
 	release_spinlock(&rtl->reg_spinlock);
 	int_restore_interrupts();
 
-	if(release_sem)
-		sem_release(rtl->rx_sem, 1);
-	mutex_unlock(&rtl->lock);
+	return rc;
+}
 
-#if 0
+ssize_t rtl8139_rx(rtl8139 *rtl, char *buf, ssize_t buf_len)
 {
-	int i;
-	dprintf("RX %x (%d)\n", buf, len);
+	ssize_t rc;
+	bool more;
 
-	dprintf("dumping packet:");
-	for(i=0; i<len; i++) {
-		if(i%8 == 0)
-			dprintf("\n");
-		dprintf("0x%02x ", buf[i]);
-	}
-	dprintf("\n");
-}
-#endif
+//	dprintf("rtl8139_rx: entry\n");
+
+	if(buf_len < 1500)
+		return -1;
+
+	do {
+		sem_acquire(rtl->rx_sem, 1);
+		mutex_lock(&rtl->lock);
+
+		rc = rtl8139_rx_frame(rtl, buf, buf_len, &more);
+
+		if(more)
+			sem_release(rtl->rx_sem, 1);
+		mutex_unlock(&rtl->lock);
+	} while(rc == 0);
 
 	return rc;
 }
 
+// the 8139 only has the one contiguous receive ring, so frames can't be received
+// in place. Copy each of them once, straight into the cbuf that goes up the stack.
+int rtl8139_rx_frames(rtl8139 *rtl, cbuf **frames, int max_frames)
+{
+	cbuf *frame = NULL;
+	ssize_t rc;
+	bool more = true;
+	int count = 0;
+
+	sem_acquire(rtl->rx_sem, 1);
+	mutex_lock(&rtl->lock);
+
+	while(count < max_frames) {
+		if(frame == NULL) {
+			frame = cbuf_get_chain(ETHERNET_MAX_SIZE);
+			if(frame == NULL)
+				break;
+		}
+
+		rc = rtl8139_rx_frame(rtl, frame->data, frame->len, &more);
+		if(rc > 0) {
+			frame->len = frame->total_len = rc;
+			frames[count++] = frame;
+			frame = NULL;
+		}
+		if(!more)
+			break;
+	}
+
+	if(more)
+		sem_release(rtl->rx_sem, 1);
+	mutex_unlock(&rtl->lock);
+
+	if(frame != NULL)
+		cbuf_free_chain(frame);
+
+	if(count == 0 && more)
+		return ERR_NO_MEMORY;
+	return count;
+}
+
 static int rtl8139_rxint(rtl8139 *rtl, uint16 int_status)
 {
 	int rc = INT_NO_RESCHEDULE;
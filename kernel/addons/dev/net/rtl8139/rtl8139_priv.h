@@ -8,6 +8,7 @@
 #include <kernel/kernel.h>
 #include <kernel/vm.h>
 #include <kernel/smp.h>
+#include <kernel/cbuf.h>
 
 typedef struct rtl8139 {
 	int irq;
@@ -32,6 +33,8 @@ typedef struct rtl8139 {
 int rtl8139_detect(rtl8139 **rtl);
 int rtl8139_init(rtl8139 *rtl);
 void rtl8139_xmit(rtl8139 *rtl, const char *ptr, ssize_t len);
+int rtl8139_xmit_frames(rtl8139 *rtl, cbuf **frames, int count);
 ssize_t rtl8139_rx(rtl8139 *rtl, char *buf, ssize_t buf_len);
+int rtl8139_rx_frames(rtl8139 *rtl, cbuf **frames, int max_frames);
 
 #endif
@@ -80,6 +80,12 @@
 #define RXBUF(r, num) (&(r)->rxbuf[(num) * BUFSIZE_PER_FRAME])
 #define TXBUF(r, num) (&(r)->txbuf[(num) * BUFSIZE_PER_FRAME])
 
+/* size of the cbufs loaned to the rx descriptors, must be a multiple of 8 and fit the rx mtu */
+#define RX_CBUF_LEN 1536
+
+/* chains in more pieces than this get copied into a tx buffer */
+#define TX_MAX_SEGMENTS 8
+
 static int rtl8169_int(void*);
 
 struct vendor_dev_match {
@@ -99,6 +105,31 @@ static addr_t vtophys(const void *virt)
 	return phys;
 }
 
+/* grab a cbuf to loan to a rx descriptor */
+static cbuf *rx_cbuf_alloc(addr_t *physaddr)
+{
+	cbuf *buf;
+
+	buf = cbuf_get_chain(RX_CBUF_LEN);
+	if (buf == NULL)
+		return NULL;
+
+	*physaddr = vtophys(buf->data);
+	if (*physaddr == 0) {
+		cbuf_free_chain(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+static void rxdesc_init(rtl8169 *r, int i, addr_t physaddr, uint16 size)
+{
+	r->rxdesc[i].rx_buffer_low = physaddr;
+	r->rxdesc[i].rx_buffer_high = (uint64)physaddr >> 32;
+	r->rxdesc[i].buffer_size = size;
+	r->rxdesc[i].flags = RTL_DESC_OWN | ((i == (NUM_RX_DESCRIPTORS - 1)) ? RTL_DESC_EOR : 0);
+}
+
 static inline int inc_rx_idx_full(rtl8169 *r)
 {
 	return (r->rx_idx_full = (r->rx_idx_full + 1) % NUM_RX_DESCRIPTORS);
@@ -185,13 +216,20 @@ static void rtl8169_setup_descriptors(rtl8169 *r)
 	for (i=0; i < NUM_RX_DESCRIPTORS; i++) {
 		addr_t physaddr;
 
-		physaddr = vtophys(RXBUF(r, i));
-		SHOW_FLOW(2, "setup_descriptors: rx buffer at %p, addr 0x%x\n", RXBUF(r, i), physaddr);
-
-		r->rxdesc[i].rx_buffer_low = physaddr;
-		r->rxdesc[i].rx_buffer_high = physaddr >> 32;
-		r->rxdesc[i].frame_len = BUFSIZE_PER_FRAME;
-		r->rxdesc[i].flags = RTL_DESC_OWN | ((i == (NUM_RX_DESCRIPTORS - 1)) ? RTL_DESC_EOR : 0);
+		/* the nic receives straight into cbufs when it can, the frames go up the stack as is */
+		if (r->rx_cbufs[i] == NULL)
+			r->rx_cbufs[i] = rx_cbuf_alloc(&physaddr);
+		else
+			physaddr = vtophys(r->rx_cbufs[i]->data);
+
+		if (r->rx_cbufs[i] != NULL) {
+			SHOW_FLOW(2, "setup_descriptors: rx cbuf at %p, addr 0x%x\n", r->rx_cbufs[i]->data, physaddr);
+			rxdesc_init(r, i, physaddr, RX_CBUF_LEN);
+		} else {
+			physaddr = vtophys(RXBUF(r, i));
+			SHOW_FLOW(2, "setup_descriptors: rx buffer at %p, addr 0x%x\n", RXBUF(r, i), physaddr);
+			rxdesc_init(r, i, physaddr, BUFSIZE_PER_FRAME);
+		}
 	}
 	for (i=0; i < NUM_TX_DESCRIPTORS; i++) {
 		addr_t physaddr;
@@ -320,40 +358,54 @@ err:
 	return err;
 }
 
-void rtl8169_xmit(rtl8169 *r, const char *ptr, ssize_t len)
+static void txdesc_init(rtl8169 *r, int i, addr_t physaddr, uint16 len, uint16 flags)
+{
+	r->txdesc[i].tx_buffer_low = physaddr;
+	r->txdesc[i].tx_buffer_high = (uint64)physaddr >> 32;
+	r->txdesc[i].frame_len = len;
+	r->txdesc[i].flags = flags | ((i == (NUM_TX_DESCRIPTORS - 1)) ? RTL_DESC_EOR : 0);
+}
+
+/* wait for count descriptors starting at tx_idx_free to be ours, and let go of
+ * any chains that were sent out of them. Returns with the lock held. */
+static void tx_get_descriptors(rtl8169 *r, int count)
 {
+	int idx;
 	int i;
 
-#if debug_level_flow >= 3
-	dprintf("rtl8169_xmit dumping packet:");
-	hexdump(ptr, len);
-#endif
+	for (;;) {
+		mutex_lock(&r->lock);
+		for (i = 0; i < count; i++) {
+			if (r->txdesc[(r->tx_idx_free + i) % NUM_TX_DESCRIPTORS].flags & RTL_DESC_OWN)
+				break;
+		}
+		if (i == count)
+			break;
 
-restart:
-	sem_acquire(r->tx_sem, 1);
-	mutex_lock(&r->lock);
+		/* card still owns some of them, wait for it to send more */
+		mutex_unlock(&r->lock);
+		sem_acquire(r->tx_sem, 1);
+	}
 
-	int_disable_interrupts();
-	acquire_spinlock(&r->reg_spinlock);
+	/* soak up a release from the tx interrupt so the sem doesn't keep counting up */
+	sem_acquire_etc(r->tx_sem, 1, SEM_FLAG_TIMEOUT, 0, NULL);
 
-	/* look at the descriptor pointed to by tx_idx_free */
-	if (r->txdesc[r->tx_idx_free].flags & RTL_DESC_OWN) {
-		/* card owns this one, wait and try again later */
-		release_spinlock(&r->reg_spinlock);
-		int_restore_interrupts();
-		mutex_unlock(&r->lock);
-//		sem_release(r->tx_sem, 1);
-		goto restart;
+	for (i = 0; i < count; i++) {
+		idx = (r->tx_idx_free + i) % NUM_TX_DESCRIPTORS;
+		if (r->tx_cbufs[idx] != NULL) {
+			cbuf_free_chain(r->tx_cbufs[idx]);
+			r->tx_cbufs[idx] = NULL;
+		}
 	}
+}
 
-	/* queue it up */
-	memcpy(TXBUF(r, r->tx_idx_free), ptr, len);
-	if (len < 64)
-		len = 64;
+/* the next count descriptors are filled in, get the card going on them and drop the lock */
+static void tx_queue_descriptors(rtl8169 *r, int count)
+{
+	int_disable_interrupts();
+	acquire_spinlock(&r->reg_spinlock);
 
-	r->txdesc[r->tx_idx_free].frame_len = len;
-	r->txdesc[r->tx_idx_free].flags = (r->txdesc[r->tx_idx_free].flags & RTL_DESC_EOR) | RTL_DESC_FS | RTL_DESC_LS | RTL_DESC_OWN;
-	inc_tx_idx_free(r);
+	r->tx_idx_free = (r->tx_idx_free + count) % NUM_TX_DESCRIPTORS;
 	RTL_WRITE_8(r, REG_TPPOLL, (1<<6)); // something is on the normal queue
 
 	release_spinlock(&r->reg_spinlock);
@@ -362,69 +414,206 @@ restart:
 	mutex_unlock(&r->lock);
 }
 
-ssize_t rtl8169_rx(rtl8169 *r, char *buf, ssize_t buf_len)
+void rtl8169_xmit(rtl8169 *r, const char *ptr, ssize_t len)
 {
-	uint32 tail;
+	int idx;
+
+#if debug_level_flow >= 3
+	dprintf("rtl8169_xmit dumping packet:");
+	hexdump(ptr, len);
+#endif
+
+	tx_get_descriptors(r, 1);
+	idx = r->tx_idx_free;
+
+	/* queue it up */
+	memcpy(TXBUF(r, idx), ptr, len);
+	if (len < 64)
+		len = 64;
+
+	txdesc_init(r, idx, vtophys(TXBUF(r, idx)), len, RTL_DESC_FS | RTL_DESC_LS | RTL_DESC_OWN);
+	tx_queue_descriptors(r, 1);
+}
+
+int rtl8169_xmit_frames(rtl8169 *r, cbuf **frames, int count)
+{
+	cbuf *chain;
+	cbuf *buf;
 	size_t len;
-	int rc;
-	bool release_sem = false;
+	int segs;
+	int idx;
+	int queued = 0;
+	int i, j;
+
+	for (i = 0; i < count; i++) {
+		chain = frames[i];
+		len = cbuf_get_len(chain);
+		if (len == 0 || len > ETHERNET_MAX_SIZE) {
+			cbuf_free_chain(chain);
+			continue;
+		}
 
-	SHOW_FLOW0(3, "rtl8169_rx: entry\n");
+		segs = 0;
+		for (buf = chain; buf != NULL; buf = buf->next) {
+			if (buf->len > 0)
+				segs++;
+		}
 
-	if(buf_len < 1500)
-		return -1;
+		if (len < 64 || segs > TX_MAX_SEGMENTS) {
+			/* runts need padding and long chains would eat the ring, copy those */
+			tx_get_descriptors(r, 1);
+			idx = r->tx_idx_free;
+
+			cbuf_memcpy_from_chain(TXBUF(r, idx), chain, 0, len);
+			cbuf_free_chain(chain);
+			if (len < 64)
+				len = 64;
+
+			txdesc_init(r, idx, vtophys(TXBUF(r, idx)), len, RTL_DESC_FS | RTL_DESC_LS | RTL_DESC_OWN);
+			tx_queue_descriptors(r, 1);
+		} else {
+			/* one descriptor per piece of the chain, the card gathers them up */
+			tx_get_descriptors(r, segs);
+
+			/* the first descriptor is handed over last so the card can't start on half a frame */
+			j = 0;
+			for (buf = chain; buf != NULL; buf = buf->next) {
+				if (buf->len == 0)
+					continue;
+				idx = (r->tx_idx_free + j) % NUM_TX_DESCRIPTORS;
+				txdesc_init(r, idx, vtophys(buf->data), buf->len,
+					((j == 0) ? RTL_DESC_FS : RTL_DESC_OWN) | ((j == segs - 1) ? RTL_DESC_LS : 0));
+				j++;
+			}
+			r->tx_cbufs[(r->tx_idx_free + segs - 1) % NUM_TX_DESCRIPTORS] = chain;
+			r->txdesc[r->tx_idx_free].flags |= RTL_DESC_OWN;
+
+			tx_queue_descriptors(r, segs);
+		}
+		queued++;
+	}
+
+	return queued;
+}
+
+int rtl8169_rx_frames(rtl8169 *r, cbuf **frames, int max_frames)
+{
+	cbuf *spare = NULL;
+	addr_t spare_phys = 0;
+	cbuf *frame;
+	size_t len;
+	int idx;
+	int count = 0;
+	bool more = true;
+
+	SHOW_FLOW0(3, "rtl8169_rx_frames: entry\n");
 
-restart:
 	sem_acquire(r->rx_sem, 1);
 	mutex_lock(&r->lock);
 
-	int_disable_interrupts();
-	acquire_spinlock(&r->reg_spinlock);
+	while (count < max_frames) {
+		/* have the replacement for the descriptor's cbuf ready before touching the ring */
+		if (spare == NULL)
+			spare = rx_cbuf_alloc(&spare_phys);
+
+		int_disable_interrupts();
+		acquire_spinlock(&r->reg_spinlock);
+
+		/* look at the descriptor pointed to by rx_idx_free */
+		idx = r->rx_idx_free;
+		if (r->rxdesc[idx].flags & RTL_DESC_OWN) {
+			/* owned by the card, nothing more to pick up */
+			release_spinlock(&r->reg_spinlock);
+			int_restore_interrupts();
+			more = false;
+			break;
+		}
+
+		/* process this packet */
+		len = r->rxdesc[idx].frame_len & 0x3fff;
+		SHOW_FLOW(3, "rtl8169_rx_frames: desc idx %d: len %d\n", idx, len);
+
+		if (r->rx_cbufs[idx] != NULL && spare != NULL && len <= RX_CBUF_LEN) {
+			/* pass the loaned cbuf up and put the spare in its place */
+			frame = r->rx_cbufs[idx];
+			r->rx_cbufs[idx] = spare;
+			spare = NULL;
+			frame->len = frame->total_len = len;
+			frames[count++] = frame;
+			rxdesc_init(r, idx, spare_phys, RX_CBUF_LEN);
+		} else if (r->rx_cbufs[idx] == NULL && spare != NULL && len <= RX_CBUF_LEN) {
+			/*
+			 * it landed in the static buffer, copy it into the spare and give the
+			 * static buffer back to the card. The descriptor is ours until then,
+			 * and rx_idx_free only moves under r->lock, so the copy can be done
+			 * with interrupts on.
+			 */
+			release_spinlock(&r->reg_spinlock);
+			int_restore_interrupts();
+
+			frame = spare;
+			spare = NULL;
+			memcpy(frame->data, RXBUF(r, idx), len);
+			frame->len = frame->total_len = len;
+			frames[count++] = frame;
+
+			int_disable_interrupts();
+			acquire_spinlock(&r->reg_spinlock);
+
+			r->rxdesc[idx].buffer_size = BUFSIZE_PER_FRAME;
+			r->rxdesc[idx].flags = (r->rxdesc[idx].flags & RTL_DESC_EOR) | RTL_DESC_OWN;
+		} else {
+			/* drop it and give the same buffer back to the card */
+			r->rxdesc[idx].buffer_size = r->rx_cbufs[idx] ? RX_CBUF_LEN : BUFSIZE_PER_FRAME;
+			r->rxdesc[idx].flags = (r->rxdesc[idx].flags & RTL_DESC_EOR) | RTL_DESC_OWN;
+		}
+		inc_rx_idx_free(r);
+
+		/* see if there are more packets pending */
+		more = (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) == 0;
 
-	/* look at the descriptor pointed to by rx_idx_free */
-	if (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) {
-		/* for some reason it's owned by the card, wait for more packets */
 		release_spinlock(&r->reg_spinlock);
 		int_restore_interrupts();
-		mutex_unlock(&r->lock);
-		goto restart;
+
+		if (!more)
+			break;
 	}
 
-	/* process this packet */
-	len =  r->rxdesc[r->rx_idx_free].frame_len & 0x3fff;
-	SHOW_FLOW(3, "rtl8169_rx: desc idx %d: len %d\n", r->rx_idx_free, len);
+	if (more)
+		sem_release(r->rx_sem, 1); // let the next reader get a shot at the rest
+	mutex_unlock(&r->lock);
 
-	if (len > buf_len) {
-		rc = ERR_TOO_BIG;
-		release_sem = true;
-		goto out;
-	}
+	if (spare != NULL)
+		cbuf_free_chain(spare);
 
-	memcpy(buf, RXBUF(r, r->rx_idx_free), len);
-	rc = len;
+	return count;
+}
 
-#if debug_level_flow >= 3
-	hexdump(RXBUF(r, r->rx_idx_free), len);
-#endif
+ssize_t rtl8169_rx(rtl8169 *r, char *buf, ssize_t buf_len)
+{
+	cbuf *frame;
+	ssize_t len;
 
-	/* stick it back in the free list */
-	r->rxdesc[r->rx_idx_free].buffer_size = BUFSIZE_PER_FRAME;
-	r->rxdesc[r->rx_idx_free].flags = (r->rxdesc[r->rx_idx_free].flags & RTL_DESC_EOR) | RTL_DESC_OWN;
-	inc_rx_idx_free(r);
+	SHOW_FLOW0(3, "rtl8169_rx: entry\n");
 
-	/* see if there are more packets pending */
-	if ((r->rxdesc[r->rx_idx_free].flags & RTL_DESC_OWN) == 0)
-		release_sem = true; // if so, release the rx sem so the next reader gets a shot
+	if(buf_len < 1500)
+		return -1;
 
-out:
-	release_spinlock(&r->reg_spinlock);
-	int_restore_interrupts();
+	while (rtl8169_rx_frames(r, &frame, 1) == 0)
+		;
 
-	if(release_sem)
-		sem_release(r->rx_sem, 1);
-	mutex_unlock(&r->lock);
+#if debug_level_flow >= 3
+	hexdump(frame->data, frame->len);
+#endif
 
-	return rc;
+	len = cbuf_get_len(frame);
+	if (len <= buf_len)
+		cbuf_memcpy_from_chain(buf, frame, 0, len);
+	else
+		len = ERR_TOO_BIG;
+	cbuf_free_chain(frame);
+
+	return len;
 }
 
 static int rtl8169_rxint(rtl8169 *r, uint16 int_status)
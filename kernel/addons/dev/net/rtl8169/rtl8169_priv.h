@@ -8,6 +8,7 @@
 #include <kernel/kernel.h>
 #include <kernel/vm.h>
 #include <kernel/smp.h>
+#include <kernel/cbuf.h>
 #include "rtl8169_dev.h"
 
 typedef struct rtl8169 {
@@ -32,6 +33,7 @@ typedef struct rtl8169 {
 	int tx_idx_free; // first free descriptor (owned by us)
 	int tx_idx_full; // first full descriptor (owned by the NIC)
 	sem_id tx_sem;
+	cbuf *tx_cbufs[NUM_TX_DESCRIPTORS]; // chains being sent in place, kept on the frame's last descriptor
 
 	region_id rxdesc_region;
 	struct rtl_rx_descriptor *rxdesc;
@@ -41,6 +43,7 @@ typedef struct rtl8169 {
 	int rx_idx_free; // first free descriptor (owned by us)
 	int rx_idx_full; // first full descriptor (owned by the NIC)
 	sem_id rx_sem;
+	cbuf *rx_cbufs[NUM_RX_DESCRIPTORS]; // loaned to the rx descriptors, NULL if using rxbuf
 } rtl8169;
 
 #if 0
@@ -53,6 +56,8 @@ typedef struct rtl8169 {
 int rtl8169_detect(rtl8169 **rtl);
 int rtl8169_init(rtl8169 *rtl);
 void rtl8169_xmit(rtl8169 *rtl, const char *ptr, ssize_t len);
+int rtl8169_xmit_frames(rtl8169 *rtl, cbuf **frames, int count);
 ssize_t rtl8169_rx(rtl8169 *rtl, char *buf, ssize_t buf_len);
+int rtl8169_rx_frames(rtl8169 *rtl, cbuf **frames, int max_frames);
 
 #endif
@@ -86,8 +86,10 @@ static int tty_insert_char(struct line_buffer *lbuf, char c, bool move_line_star
 	INC_HEAD(lbuf);
 	if(move_line_start)
 		lbuf->line_start = lbuf->head;
-	if(was_empty && AVAILABLE_READ(lbuf) > 0)
+	if(was_empty && AVAILABLE_READ(lbuf) > 0) {
 		sem_release(lbuf->read_sem, 1);
+		poll_notify(&lbuf->poll, EVQ_IN);
+	}
 
 	return 0;
 }
@@ -235,8 +237,11 @@ ssize_t tty_read(tty_desc *tty, void *buf, ssize_t len, int endpoint)
 		sem_release(lbuf->read_sem, 1);
 
 	// did it used to be full?
-	if(data_len == lbuf->len - 1)
+	if(data_len == lbuf->len - 1) {
 		sem_release(lbuf->write_sem, 1);
+		// the other buffer is the one whoever writes into this one reads from
+		poll_notify(&tty->buf[1 - endpoint].poll, EVQ_OUT);
+	}
 
 err:
 	mutex_unlock(&tty->lock);
@@ -414,6 +419,32 @@ exit_loop:
 	return bytes_written;
 }
 
+int tty_poll(tty_desc *tty, struct poll_waiter *waiter, int endpoint)
+{
+	struct line_buffer *read_lbuf;
+	struct line_buffer *write_lbuf;
+	int events = 0;
+
+	ASSERT(endpoint == ENDPOINT_MASTER_READ || endpoint == ENDPOINT_SLAVE_READ);
+	read_lbuf = &tty->buf[endpoint];
+	write_lbuf = &tty->buf[(endpoint == ENDPOINT_MASTER_READ) ? ENDPOINT_MASTER_WRITE : ENDPOINT_SLAVE_WRITE];
+
+	mutex_lock(&tty->lock);
+
+	if(AVAILABLE_READ(read_lbuf) > 0)
+		events |= EVQ_IN;
+	if(AVAILABLE_WRITE(write_lbuf) > 0)
+		events |= EVQ_OUT;
+
+	// both kinds of change get reported on the list of the buffer we read
+	if(waiter)
+		poll_list_add(&read_lbuf->poll, waiter);
+
+	mutex_unlock(&tty->lock);
+
+	return events;
+}
+
 int dev_bootstrap(void);
 
 int dev_bootstrap(void)
@@ -451,6 +482,7 @@ int dev_bootstrap(void)
 			thetty.ttys[i].buf[j].line_start = 0;
 			thetty.ttys[i].buf[j].len = TTY_BUFFER_SIZE;
 			thetty.ttys[i].buf[j].state = TTY_STATE_NORMAL;
+			poll_list_init(&thetty.ttys[i].buf[j].poll);
 			if(j == ENDPOINT_SLAVE_WRITE)
 				thetty.ttys[i].buf[j].flags = TTY_FLAG_DEFAULT_OUTPUT; // slave writes to this one, translate LR to CRLF
 			else if(j == ENDPOINT_MASTER_WRITE)
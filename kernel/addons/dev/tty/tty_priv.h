@@ -2,6 +2,7 @@
 #define _NEWOS_KERNEL_DEV_TTY_TTY_PRIV_H
 
 #include <kernel/lock.h>
+#include <kernel/evq.h>
 #include <newos/tty_priv.h>
 
 #define TTY_TRACE 0
@@ -37,6 +38,7 @@ struct line_buffer {
 	char buffer[TTY_BUFFER_SIZE];
 	int state;
 	int flags;
+	poll_list poll; /* for whoever reads this buffer, which is also who writes the other one */
 };
 
 typedef struct tty_desc {
@@ -65,6 +67,7 @@ void inc_tty_ref(tty_desc *tty);
 void dec_tty_ref(tty_desc *tty);
 ssize_t tty_read(tty_desc *tty, void *buf, ssize_t len, int endpoint);
 ssize_t tty_write(tty_desc *tty, const void *buf, ssize_t len, int endpoint);
+int tty_poll(tty_desc *tty, struct poll_waiter *waiter, int endpoint);
 int tty_ioctl(tty_desc *tty, int op, void *buf, size_t len);
 
 #endif
@@ -110,6 +110,15 @@ static ssize_t ttys_write(dev_cookie _cookie, const void *buf, off_t pos, ssize_
 }
 
 
+static int ttys_poll(dev_cookie _cookie, struct poll_waiter *waiter)
+{
+	tty_slave_cookie *cookie = (tty_slave_cookie *)_cookie;
+
+	TRACE(("ttys_poll: tty %d cookie %p, waiter %p\n", cookie->tty->index, cookie, waiter));
+
+	return tty_poll(cookie->tty, waiter, ENDPOINT_SLAVE_READ);
+}
+
 struct dev_calls ttys_hooks = {
 	&ttys_open,
 	&ttys_close,
@@ -121,6 +130,7 @@ struct dev_calls ttys_hooks = {
 	/* cannot page from /dev/tty */
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	&ttys_poll
 };
 
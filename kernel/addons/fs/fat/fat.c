@@ -177,9 +177,9 @@ int fat_mount(fs_cookie *fs, fs_id id, const char *device, void *args, vnode_id
 	if(err < 0)
 		goto err3;
 
-	// create a semaphore to lock the fs
-	fat->sem = sem_create(FAT_WRITE_COUNT, "fat lock");
-	if(fat->sem < 0)
+	// create a lock for the fs
+	err = rw_lock_init(&fat->lock, "fat lock");
+	if(err < 0)
 		goto err3;
 
 	if(fat->fat_type == 32) {
@@ -212,7 +212,7 @@ int fat_unmount(fs_cookie fs)
 	vfs_put_vnode_ptr(fat->dev_vnode);
 	sys_close(fat->fd);
 
-	sem_delete(fat->sem);
+	rw_lock_destroy(&fat->lock);
 
 	kfree(fat);
 
@@ -264,7 +264,9 @@ static struct fs_calls fat_calls = {
 	&fat_rmdir,
 
 	&fat_rstat,
-	&fat_wstat
+	&fat_wstat,
+
+	NULL
 };
 
 int fs_bootstrap(void);
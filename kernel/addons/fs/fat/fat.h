@@ -6,6 +6,7 @@
 #define _FAT_H
 
 #include <kernel/vfs.h>
+#include <kernel/lock.h>
 #include "fat_fs.h"
 
 /* mount structure */
@@ -14,7 +15,7 @@ typedef struct fat_fs {
 	int fd;
 	void *dev_vnode;
 	vnode_id root_vnid;
-	sem_id sem;
+	rw_lock lock;
 
 	int fat_type; // 12/16/32
 	uint32 first_data_sector;
@@ -29,11 +30,10 @@ typedef struct fat_fs {
 } fat_fs;
 
 /* reader/writer lock for fat */
-#define FAT_WRITE_COUNT 1024
-#define LOCK_READ(sem) sem_acquire(sem, 1)
-#define UNLOCK_READ(sem) sem_release(sem, 1)
-#define LOCK_WRITE(sem) sem_acquire(sem, FAT_WRITE_COUNT)
-#define UNLOCK_WRITE(sem) sem_release(sem, FAT_WRITE_COUNT)
+#define LOCK_READ(lock) rw_lock_read_lock(&(lock))
+#define UNLOCK_READ(lock) rw_lock_read_unlock(&(lock))
+#define LOCK_WRITE(lock) rw_lock_write_lock(&(lock))
+#define UNLOCK_WRITE(lock) rw_lock_write_unlock(&(lock))
 
 /* vnode structure */
 typedef struct fat_vnode {
@@ -32,7 +32,7 @@ int fat_getvnode(fs_cookie fs, vnode_id id, fs_vnode *_v, bool r)
 
 	SHOW_FLOW(3, "fs %p, vnode_id 0x%Lx, r %d", fs, id, r);
 
-	LOCK_READ(fat->sem);
+	LOCK_READ(fat->lock);
 
 	// break the vnid out into the parts
 	dir_cluster = VNID_TO_DIR_CLUSTER(id);
@@ -61,7 +61,7 @@ int fat_getvnode(fs_cookie fs, vnode_id id, fs_vnode *_v, bool r)
 	err = NO_ERROR;
 
 out:
-	UNLOCK_READ(fat->sem);
+	UNLOCK_READ(fat->lock);
 
 	return err;
 }
@@ -73,11 +73,11 @@ int fat_putvnode(fs_cookie fs, fs_vnode _v, bool r)
 
 	SHOW_FLOW(3, "fs %p, v %p, r %d", fs, v, r);
 
-	LOCK_READ(fat->sem);
+	LOCK_READ(fat->lock);
 
 	kfree(v);
 	
-	UNLOCK_READ(fat->sem);
+	UNLOCK_READ(fat->lock);
 
 	return NO_ERROR;
 }
@@ -138,13 +138,13 @@ int fat_rstat(fs_cookie fs, fs_vnode _v, struct file_stat *stat)
 
 	SHOW_FLOW(3, "fs %p, v %p", fs, v);
 
-	LOCK_READ(fat->sem);
+	LOCK_READ(fat->lock);
 
 	stat->vnid = v->id;
 	stat->type = v->is_dir ? STREAM_TYPE_DIR : STREAM_TYPE_FILE;
 	stat->size = v->size;
 
-	UNLOCK_READ(fat->sem);
+	UNLOCK_READ(fat->lock);
 
 	return 0;
 }
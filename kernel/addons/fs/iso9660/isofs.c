@@ -964,7 +964,9 @@ static struct fs_calls isofs_calls = {
 	&isofs_rmdir,		// rmdir
 
 	&isofs_rstat,		// rstat
-	&isofs_wstat		// wstat
+	&isofs_wstat,		// wstat
+
+	NULL			// poll
 };
 
 int fs_bootstrap(void);
@@ -1390,7 +1390,9 @@ static struct fs_calls nfs_calls = {
 	&nfs_rmdir,
 
 	&nfs_rstat,
-	&nfs_wstat
+	&nfs_wstat,
+
+	NULL
 };
 
 int fs_bootstrap(void);
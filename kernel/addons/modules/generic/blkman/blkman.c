@@ -784,6 +784,7 @@ struct dev_calls dev_interface = {
 	(int (*)(dev_ident))						blkman_canpage,
 	(ssize_t (*)(dev_ident, iovecs *, off_t))	blkman_readpage,
 	(ssize_t (*)(dev_ident, iovecs *, off_t))	blkman_writepage,
+	NULL,
 };
 
 
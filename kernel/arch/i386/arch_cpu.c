@@ -9,6 +9,7 @@
 #include <kernel/vm.h>
 #include <kernel/debug.h>
 #include <kernel/smp.h>
+#include <kernel/int.h>
 #include <kernel/debug.h>
 #include <kernel/console.h>
 #include <kernel/arch/i386/selector.h>
@@ -58,6 +59,34 @@ static void (*fsave_swap_func)(void *old_fpu_state, void *new_fpu_state);
 static void (*fsave_func)(void *fpu_state);
 static void (*frstor_func)(void *fpu_state);
 
+/* the checksum code can use sse2 if every cpu has it turned on */
+static bool sse2_cksum = false;
+
+// borrow the fpu without touching the lazy fpu state. Interrupts stay off
+// so nobody can switch threads on us, the sse routine saves the xmm
+// registers it uses and the task switched bit gets put back.
+static unsigned int ones_sum_get_fpu(void)
+{
+	unsigned int cr0;
+
+	int_disable_interrupts();
+	read_cr0(cr0);
+	if(cr0 & 0x8)
+		i386_clear_task_switched();
+	return cr0;
+}
+
+static void ones_sum_put_fpu(unsigned int cr0)
+{
+	if(cr0 & 0x8)
+		i386_set_task_switched();
+	int_restore_interrupts();
+}
+
+#define I386_ONES_SUM_GET_FPU() ones_sum_get_fpu()
+#define I386_ONES_SUM_PUT_FPU(cr0) ones_sum_put_fpu(cr0)
+#include <kernel/arch/i386/ones_sum.h>
+
 int arch_cpu_preboot_init(kernel_args *ka)
 {
 	write_dr3(0);
@@ -260,6 +289,13 @@ int arch_cpu_init_percpu(kernel_args *ka, int curr_cpu)
 {
 	detect_cpu(ka, curr_cpu);
 
+	// turn on the sse instructions and have fxsave/fxrstor carry the xmm registers
+	if(i386_check_feature(X86_FXSR, FEATURE_COMMON) && i386_check_feature(X86_SSE2, FEATURE_COMMON)) {
+		unsigned int cr4;
+		read_cr4(cr4);
+		write_cr4(cr4 | (1<<9)); // OSFXSR bit in cr4
+	}
+
 	return 0;
 }
 
@@ -357,6 +393,7 @@ int arch_cpu_init2(kernel_args *ka)
 		fsave_swap_func = &i386_fxsave_swap;
 		fsave_func = &i386_fxsave;
 		frstor_func = &i386_fxrstor;
+		sse2_cksum = i386_check_feature(X86_SSE2, FEATURE_COMMON);
 	} else {
 		fsave_swap_func = &i386_fsave_swap;
 		fsave_func = &i386_fsave;
@@ -418,6 +455,11 @@ void i386_swap_fpu_context(void *old_fpu_state, void *new_fpu_state)
 	(*fsave_swap_func)(old_fpu_state, new_fpu_state);
 }
 
+uint32 i386_ones_sum(uint32 sum, const void *buf, size_t len)
+{
+	return i386_ones_sum_split(sum, buf, len, sse2_cksum);
+}
+
 void arch_cpu_invalidate_TLB_range(addr_t start, addr_t end)
 {
 	int num_pages = end/PAGE_SIZE - start/PAGE_SIZE;
@@ -196,7 +196,7 @@ void arch_smp_ack_interrupt(void)
 	apic_write(APIC_EOI, 0);
 }
 
-#define MIN_TIMEOUT 1000
+#define MIN_TIMEOUT 50
 
 int arch_smp_set_apic_timer(bigtime_t relative_timeout, int type)
 {
@@ -228,9 +228,6 @@ int arch_smp_set_apic_timer(bigtime_t relative_timeout, int type)
 
 	apic_write(APIC_LVTT, config);
 
-	dprintf("arch_smp_set_apic_timer: config 0x%x, timeout %Ld, tics/sec %d, tics %d\n", 
-		config, relative_timeout, apic_timer_tics_per_sec, ticks);
-
 	apic_write(APIC_ICRT, ticks); // start it up
 
 	int_restore_interrupts();
@@ -9,6 +9,7 @@
 #include <kernel/heap.h>
 #include <kernel/thread.h>
 #include <kernel/arch/thread.h>
+#include <kernel/arch/i386/vm.h>
 #include <kernel/int.h>
 #include <string.h>
 
@@ -108,18 +109,8 @@ void arch_thread_context_switch(struct thread *t_from, struct thread *t_to, stru
 
 	// if we're switching to a new translation map, look up the page directory
 	// and switch to it.
-	if(new_tmap) {
-		addr_t new_pgdir = vm_translation_map_get_pgdir(new_tmap);
-
-		if((new_pgdir % PAGE_SIZE) != 0)
-			panic("arch_thread_context_switch: bad pgdir %p\n", (void*)new_pgdir);
-
-#if 0
-		dprintf("new_pgdir is 0x%x\n", new_pgdir);
-#endif
-
-		i386_swap_pgdir(new_pgdir);
-	}
+	if(new_tmap)
+		i386_vm_translation_map_switch(new_tmap);
 
 	i386_set_task_switched(); // disables the fpu
 	i386_set_kstack(t_to->kernel_stack_base + KSTACK_SIZE);
@@ -6,20 +6,133 @@
 #include <kernel/debug.h>
 #include <kernel/console.h>
 #include <kernel/arch/time.h>
+#include <kernel/arch/cpu.h>
 #include <kernel/arch/i386/cpu.h>
 
 static uint64 last_rdtsc;
 static bool use_rdtsc;
 
+// the tsc at boot, for running system_time straight off of it
+static uint64 boot_rdtsc;
+static bool tsc_clocksource;
+
+// number of times each ap and the boot cpu take turns reading the tsc
+#define TSC_SYNC_LOOPS 10000
+
+// the ap the boot cpu is checking its tsc against, and the last one that
+// showed up for it and finished
+static volatile int tsc_sync_cpu;
+static volatile int tsc_sync_arrived;
+static volatile int tsc_sync_finished;
+
+// the last tsc read by either side, and the lock they take turns with
+static volatile int tsc_sync_lock;
+static volatile uint64 tsc_sync_last;
+static volatile bool tsc_warped;
+
+// rdtsc can be run ahead of the instructions before it, cpuid waits for them
+static uint64 tsc_read_ordered(void)
+{
+	unsigned int data[4];
+
+	i386_cpuid(0, data);
+	return i386_rdtsc();
+}
+
+// each side reads the tsc right after the other one. If a read ever comes out
+// behind the other cpu's last one the two aren't in sync.
+static void tsc_warp_check(void)
+{
+	uint64 prev;
+	uint64 now;
+	int i;
+
+	for(i = 0; i < TSC_SYNC_LOOPS; i++) {
+		while(atomic_set(&tsc_sync_lock, 1) != 0)
+			arch_cpu_pause();
+		prev = tsc_sync_last;
+		now = tsc_read_ordered();
+		tsc_sync_last = now;
+		tsc_sync_lock = 0;
+
+		if(now < prev)
+			tsc_warped = true;
+	}
+}
+
+// run by every cpu as it enters the kernel, before the aps are trapped. The boot
+// cpu checks its tsc against each ap in turn.
+int arch_time_preboot_init(kernel_args *ka, int cpu_num)
+{
+	unsigned int i;
+
+	if(!ka->arch_args.supports_rdtsc || ka->num_cpus < 2)
+		return 0;
+
+	if(cpu_num == 0) {
+		for(i = 1; i < ka->num_cpus; i++) {
+			tsc_sync_cpu = i;
+			while(tsc_sync_arrived != (int)i)
+				arch_cpu_pause();
+			tsc_warp_check();
+			while(tsc_sync_finished != (int)i)
+				arch_cpu_pause();
+		}
+		tsc_sync_cpu = 0;
+	} else {
+		while(tsc_sync_cpu != cpu_num)
+			arch_cpu_pause();
+		tsc_sync_arrived = cpu_num;
+		tsc_warp_check();
+		tsc_sync_finished = cpu_num;
+	}
+
+	return 0;
+}
+
+// the tsc can only keep system time if it ticks at the same rate no matter
+// what power state the cpu is in
+static bool tsc_is_invariant(void)
+{
+	unsigned int data[4];
+
+	i386_cpuid(0x80000000, data);
+	if(data[0] < 0x80000007)
+		return false;
+
+	i386_cpuid(0x80000007, data);
+	return (data[3] & X86_APM_INVARIANT_TSC) != 0;
+}
+
 int arch_time_init(kernel_args *ka)
 {
 	last_rdtsc = 0;
 
 	use_rdtsc = ka->arch_args.supports_rdtsc;
 
+	// the bootloader measured the tsc against the pit, so it can keep time on its own
+	// if it's invariant and every cpu's agrees. otherwise stay on the periodic pit/apic tick.
+	if(tsc_warped)
+		dprintf("arch_time_init: the tscs on the cpus aren't in sync\n");
+	tsc_clocksource = use_rdtsc && ka->arch_args.system_time_cv_factor != 0 && tsc_is_invariant() && !tsc_warped;
+	if(tsc_clocksource)
+		boot_rdtsc = i386_rdtsc();
+	else
+		dprintf("arch_time_init: tsc isn't usable as a clocksource, using the periodic tick\n");
+
 	return 0;
 }
 
+bool arch_time_has_clocksource(void)
+{
+	return tsc_clocksource;
+}
+
+bigtime_t arch_get_clocksource_time(void)
+{
+	return i386_cycles_to_time(i386_rdtsc() - boot_rdtsc);
+}
+
 void arch_time_tick(void)
 {
 	if(use_rdtsc)
@@ -14,6 +14,7 @@
 #include <kernel/arch/cpu.h>
 
 #include <kernel/arch/i386/interrupts.h>
+#include <kernel/arch/i386/vm.h>
 
 int arch_vm_init(kernel_args *ka)
 {
@@ -55,7 +56,7 @@ int arch_vm_init_endvm(kernel_args *ka)
 
 void arch_vm_aspace_swap(vm_address_space *aspace)
 {
-	i386_swap_pgdir(vm_translation_map_get_pgdir(&aspace->translation_map));
+	i386_vm_translation_map_switch(&aspace->translation_map);
 }
 
 
@@ -11,6 +11,7 @@
 #include <kernel/vm_page.h>
 #include <kernel/vm_priv.h>
 #include <kernel/arch/cpu.h>
+#include <kernel/arch/i386/vm.h>
 #include <kernel/debug.h>
 #include <kernel/lock.h>
 #include <kernel/sem.h>
@@ -49,10 +50,14 @@ static sem_id iospace_full_sem;
 typedef struct vm_translation_map_arch_info_struct {
 	pdentry *pgdir_virt;
 	pdentry *pgdir_phys;
+	volatile int active_cpus; // bitmap of the cpus that have this pgdir loaded
 	int num_invalidate_pages;
 	addr_t pages_to_invalidate[PAGE_INVALIDATE_CACHE_SIZE];
 } vm_translation_map_arch_info;
 
+// the map each cpu has loaded, NULL until the first switch
+static vm_translation_map *active_tmap[_MAX_CPUS];
+
 static ptentry *page_hole = NULL;
 static pdentry *page_hole_pgdir = NULL;
 static pdentry *kernel_pgdir_phys = NULL;
@@ -398,22 +403,71 @@ static int clear_flags_tmap(vm_translation_map *map, addr_t va, unsigned int fla
 
 static void flush_tmap(vm_translation_map *map)
 {
-	if(map->arch_data->num_invalidate_pages <= 0)
+	vm_translation_map_arch_info *info = map->arch_data;
+	unsigned int cpu_mask;
+	int curr_cpu;
+
+	if(info->num_invalidate_pages <= 0)
 		return;
 
 	int_disable_interrupts();
-	if(map->arch_data->num_invalidate_pages > PAGE_INVALIDATE_CACHE_SIZE) {
-		// invalidate all pages
-//		dprintf("flush_tmap: %d pages to invalidate, doing global invalidation\n", map->arch_data->num_invalidate_pages);
-		arch_cpu_global_TLB_invalidate();
-		smp_send_broadcast_ici(SMP_MSG_GLOBAL_INVL_PAGE, 0, 0, 0, NULL, SMP_MSG_FLAG_SYNC);
+	curr_cpu = smp_get_current_cpu();
+
+	if(info->pgdir_virt == kernel_pgdir_virt) {
+		// kernel mappings show up in every pgdir, everyone has to flush
+		cpu_mask = (smp_get_num_cpus() >= 32) ? 0xffffffff : (1U << smp_get_num_cpus()) - 1;
 	} else {
-//		dprintf("flush_tmap: %d pages to invalidate, doing local invalidation\n", map->arch_data->num_invalidate_pages);
-		arch_cpu_invalidate_TLB_list(map->arch_data->pages_to_invalidate, map->arch_data->num_invalidate_pages);
-		smp_send_broadcast_ici(SMP_MSG_INVL_PAGE_LIST, (unsigned long)map->arch_data->pages_to_invalidate,
-			map->arch_data->num_invalidate_pages, 0, NULL, SMP_MSG_FLAG_SYNC);
+		// only the cpus that have this map loaded can have its entries cached. Everyone
+		// else picks up the new ptes when they load the pgdir. The locked op keeps the
+		// read from being moved ahead of the pte updates.
+		cpu_mask = atomic_or(&info->active_cpus, 0);
+	}
+
+	if(CHECK_BIT(cpu_mask, curr_cpu)) {
+		if(info->num_invalidate_pages > PAGE_INVALIDATE_CACHE_SIZE)
+			arch_cpu_global_TLB_invalidate();
+		else
+			arch_cpu_invalidate_TLB_list(info->pages_to_invalidate, info->num_invalidate_pages);
 	}
-	map->arch_data->num_invalidate_pages = 0;
+
+	cpu_mask &= ~(1U << curr_cpu);
+	if(cpu_mask != 0) {
+		if(info->num_invalidate_pages > PAGE_INVALIDATE_CACHE_SIZE) {
+			// invalidate all pages
+//			dprintf("flush_tmap: %d pages to invalidate, doing global invalidation\n", info->num_invalidate_pages);
+			smp_send_multicast_ici(cpu_mask, SMP_MSG_GLOBAL_INVL_PAGE, 0, 0, 0, NULL, SMP_MSG_FLAG_SYNC);
+		} else {
+//			dprintf("flush_tmap: %d pages to invalidate, doing local invalidation\n", info->num_invalidate_pages);
+			smp_send_multicast_ici(cpu_mask, SMP_MSG_INVL_PAGE_LIST, (unsigned long)info->pages_to_invalidate,
+				info->num_invalidate_pages, 0, NULL, SMP_MSG_FLAG_SYNC);
+		}
+	}
+
+	info->num_invalidate_pages = 0;
+	int_restore_interrupts();
+}
+
+void i386_vm_translation_map_switch(vm_translation_map *map)
+{
+	addr_t new_pgdir = vm_translation_map_get_pgdir(map);
+	vm_translation_map *old_map;
+	int curr_cpu;
+
+	if((new_pgdir % PAGE_SIZE) != 0)
+		panic("i386_vm_translation_map_switch: bad pgdir %p\n", (void*)new_pgdir);
+
+	int_disable_interrupts();
+	curr_cpu = smp_get_current_cpu();
+	old_map = active_tmap[curr_cpu];
+
+	// mark ourselves before loading the pgdir. A flush that doesn't see us
+	// finished its pte updates before the load flushed our tlb.
+	atomic_or(&map->arch_data->active_cpus, 1U << curr_cpu);
+	i386_swap_pgdir(new_pgdir);
+	if(old_map != NULL && old_map != map)
+		atomic_and(&old_map->arch_data->active_cpus, ~(1U << curr_cpu));
+	active_tmap[curr_cpu] = map;
+
 	int_restore_interrupts();
 }
 
@@ -578,6 +632,7 @@ int vm_translation_map_create(vm_translation_map *new_map, bool kernel)
 	}
 
 	new_map->arch_data->num_invalidate_pages = 0;
+	new_map->arch_data->active_cpus = 0;
 
 	if(!kernel) {
 		// user
@@ -658,6 +713,7 @@ int vm_translation_map_module_init(kernel_args *ka)
 	memset(iospace_pgtables, 0, PAGE_SIZE * (IOSPACE_SIZE / (PAGE_SIZE * 1024)));
 	iospace_mutex.sem = -1;
 	iospace_mutex.holder = -1;
+	iospace_mutex.name = "iospace_mutex";
 	iospace_full_sem = -1;
 
 	dprintf("mapping iospace_pgtables\n");
@@ -693,7 +749,6 @@ int vm_translation_map_module_init(kernel_args *ka)
 
 void vm_translation_map_module_init_post_sem(kernel_args *ka)
 {
-	mutex_init(&iospace_mutex, "iospace_mutex");
 	iospace_full_sem = sem_create(1, "iospace_full_sem");
 }
 
@@ -11,6 +11,12 @@
 
 void ppc_timer_reset(void);
 
+// nothing here has to be compared across cpus
+int arch_time_preboot_init(kernel_args *ka, int cpu_num)
+{
+	return 0;
+}
+
 int arch_time_init(kernel_args *ka)
 {
 	return 0;
@@ -24,7 +30,19 @@ void arch_time_tick(void)
 
 bigtime_t arch_get_time_delta(void)
 {
-	// XXX implement
+	// nothing to interpolate with yet, system time only moves on the periodic tick
+	return 0;
+}
+
+// no clocksource here, system time is kept by the periodic decrementer tick
+bool arch_time_has_clocksource(void)
+{
+	return false;
+}
+
+bigtime_t arch_get_clocksource_time(void)
+{
+	// never called, arch_time_has_clocksource() is false
 	return 0;
 }
 
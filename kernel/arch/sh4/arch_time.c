@@ -7,6 +7,12 @@
 #include <kernel/console.h>
 #include <kernel/arch/time.h>
 
+// nothing here has to be compared across cpus
+int arch_time_preboot_init(kernel_args *ka, int cpu_num)
+{
+	return 0;
+}
+
 int arch_time_init(kernel_args *ka)
 {
 	return 0;
@@ -21,6 +27,16 @@ bigtime_t arch_get_time_delta(void)
 	return 0;
 }
 
+bool arch_time_has_clocksource(void)
+{
+	return false;
+}
+
+bigtime_t arch_get_clocksource_time(void)
+{
+	return 0;
+}
+
 bigtime_t arch_get_rtc_delta(void)
 {
 	return 0;
@@ -10,6 +10,12 @@
 
 static uint64 last_rdtsc;
 
+// nothing here has to be compared across cpus
+int arch_time_preboot_init(kernel_args *ka, int cpu_num)
+{
+	return 0;
+}
+
 int arch_time_init(kernel_args *ka)
 {
 	last_rdtsc = 0;
@@ -42,6 +48,18 @@ bigtime_t arch_get_time_delta(void)
 	return x86_64_cycles_to_time(delta_rdtsc);
 }
 
+// no clocksource here, system time is kept by the periodic tick
+bool arch_time_has_clocksource(void)
+{
+	return false;
+}
+
+bigtime_t arch_get_clocksource_time(void)
+{
+	// never called, arch_time_has_clocksource() is false
+	return 0;
+}
+
 /* MC146818 RTC code */
 static uint8 read_rtc(uint8 reg)
 {
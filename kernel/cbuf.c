@@ -19,20 +19,42 @@
 #define VALIDATE_CBUFS 0
 #endif
 
-#define ALLOCATE_CHUNK (PAGE_SIZE * 16)
-#define CBUF_REGION_SIZE (1*1024*1024)
-#define CBUF_BITMAP_SIZE (CBUF_REGION_SIZE / CBUF_LEN)
-
-static cbuf *cbuf_free_list;
-static mutex cbuf_free_list_lock;
-static cbuf *cbuf_free_noblock_list;
-static spinlock_t noblock_spin;
-
-static spinlock_t cbuf_lowlevel_spinlock;
-static region_id cbuf_region_id;
-static cbuf *cbuf_region;
-static region_id cbuf_bitmap_region_id;
-static uint8 *cbuf_bitmap;
+// cbufs are handed out of per-cpu caches that are only touched with interrupts
+// disabled, so the common case takes no locks and is safe from interrupt handlers.
+// Each cpu keeps a loaded list plus at most one full batch behind it, and trades
+// whole batches with a shared depot in O(1) under a spinlock. When the depot runs
+// dry the arena grows by another wired region.
+
+// number of cbufs moved between a cpu and the depot at a time
+#define CBUF_BATCH 16
+// size of each region the arena grows by, a multiple of CBUF_BATCH cbufs
+#define CBUF_ARENA_GROW (256*1024)
+// the arena won't grow past this
+#define CBUF_ARENA_MAX (16*1024*1024)
+
+// only ever touched by the cpu that owns it
+struct cbuf_cpu_cache {
+	cbuf *loaded;
+	int loaded_count;
+	cbuf *previous; // a full batch or NULL
+	unsigned int alloc_hits;
+	unsigned int alloc_misses;
+	unsigned int free_hits;
+	unsigned int free_misses;
+} _ALIGNED(64);
+
+static struct cbuf_cpu_cache cbuf_cpu[_MAX_CPUS];
+
+// full batches, linked through the packet_next pointer of their first cbuf
+static spinlock_t cbuf_depot_lock;
+static cbuf *cbuf_depot;
+static unsigned int cbuf_depot_count;
+static unsigned int cbuf_depot_gets;
+static unsigned int cbuf_depot_puts;
+
+static mutex cbuf_arena_lock;
+static size_t cbuf_arena_size;
+static unsigned int cbuf_arena_regions;
 
 /* initialize most of the cbuf structure */
 /* does not initialize the next pointer, because it may already be in a chain */
@@ -97,194 +119,181 @@ static int validate_cbuf(cbuf *head)
 	return 0;
 }
 
-static void *_cbuf_alloc(size_t *size)
+// NOTE: interrupts must be disabled
+static cbuf *depot_get_batch(void)
 {
-	void *buf;
-	int i;
-	int start;
-	size_t len_found = 0;
-
-//	dprintf("cbuf_alloc: asked to allocate size %d\n", *size);
-
-	int_disable_interrupts();
-	acquire_spinlock(&cbuf_lowlevel_spinlock);
-
-	// scan through the allocation bitmap, looking for the first free block
-	// XXX not optimal
-	start = -1;
-	for(i = 0; i < CBUF_BITMAP_SIZE; i++) {
-		// skip bytes of the bitmap at a time
-		if((i % 8) == 0 && cbuf_bitmap[i/8] == 0xff) {
-			i += 8;
-			continue;
-		}
-
-		if(!CHECK_BIT(cbuf_bitmap[i/8], i%8)) {
-			cbuf_bitmap[i/8] = SET_BIT(cbuf_bitmap[i/8], i%8);
-			if(start < 0)
-				start = i;
-			len_found += CBUF_LEN;
-			if(len_found >= *size) {
-				// we're done
-				break;
-			}
-		} else if(start >= 0) {
-			// we've found a start of a run before, so we're done now
-			break;
-		}
-	}
-
-	if(start < 0) {
-		// couldn't find any memory
-		buf = NULL;
-		*size = 0;
-	} else {
-		buf = &cbuf_region[start];
-		*size = len_found;
+	cbuf *batch;
+
+	acquire_spinlock(&cbuf_depot_lock);
+	batch = cbuf_depot;
+	if(batch != NULL) {
+		cbuf_depot = batch->packet_next;
+		cbuf_depot_count--;
+		cbuf_depot_gets++;
 	}
+	release_spinlock(&cbuf_depot_lock);
 
-	release_spinlock(&cbuf_lowlevel_spinlock);
-	int_restore_interrupts();
+	if(batch != NULL)
+		batch->packet_next = NULL;
+	return batch;
+}
 
-	return buf;
+// NOTE: interrupts must be disabled
+static void depot_put_batch(cbuf *batch)
+{
+	acquire_spinlock(&cbuf_depot_lock);
+	batch->packet_next = cbuf_depot;
+	cbuf_depot = batch;
+	cbuf_depot_count++;
+	cbuf_depot_puts++;
+	release_spinlock(&cbuf_depot_lock);
 }
 
-static cbuf *allocate_cbuf_mem(size_t size)
+// NOTE: interrupts must be disabled
+static cbuf *cpu_cache_alloc(struct cbuf_cpu_cache *cc)
 {
 	cbuf *buf;
-	cbuf *last_buf = NULL;
-	cbuf *head_buf = NULL;
-	size_t found_size;
+	bool hit = true;
 
-	size = PAGE_ALIGN(size);
-
-	while(size > 0) {
-		found_size = size;
-		buf = (cbuf *)_cbuf_alloc(&found_size);
-		if(!buf) {
-			// couldn't allocate, lets bail with what we have
-			break;
-		}
-		if(!head_buf) {
-			head_buf = last_buf = buf;
-			head_buf->total_len = 0;
-		}
-		
-		size -= found_size;
-//		dprintf("allocate_cbuf_mem: returned %d of memory, %d left\n", found_size, size);
-
-		ASSERT(found_size % CBUF_LEN == 0);
-		for (; found_size > 0; found_size -= CBUF_LEN) {
-			initialize_cbuf(buf);
-			head_buf->total_len += buf->len;
-			last_buf->next = buf;
-			
-			last_buf = buf;
-			buf++;
+	if(cc->loaded_count == 0) {
+		if(cc->previous != NULL) {
+			cc->loaded = cc->previous;
+			cc->previous = NULL;
+		} else {
+			// both are empty, trade for a full batch from the depot
+			cc->alloc_misses++;
+			cc->loaded = depot_get_batch();
+			if(cc->loaded == NULL)
+				return NULL;
+			hit = false;
 		}
-	}
-	if(head_buf) {
-		head_buf->flags |= CBUF_FLAG_CHAIN_HEAD;
-		last_buf->flags |= CBUF_FLAG_CHAIN_TAIL;
-		last_buf->next = NULL;
+		cc->loaded_count = CBUF_BATCH;
 	}
 
-	return head_buf;
+	buf = cc->loaded;
+	cc->loaded = buf->next;
+	cc->loaded_count--;
+	if(hit)
+		cc->alloc_hits++;
+
+	return buf;
 }
 
-static void _clear_chain(cbuf *head, cbuf **tail)
+// NOTE: interrupts must be disabled
+static void cpu_cache_free(struct cbuf_cpu_cache *cc, cbuf *buf)
 {
-	cbuf *buf;
-
-	buf = head;
-	*tail = NULL;
-	while(buf) {
-		initialize_cbuf(buf); // doesn't touch the next ptr
-		*tail = buf;
-		buf = buf->next;
+	if(cc->loaded_count == CBUF_BATCH) {
+		// both are full, push the older batch out to the depot
+		if(cc->previous != NULL) {
+			cc->free_misses++;
+			depot_put_batch(cc->previous);
+		} else {
+			cc->free_hits++;
+		}
+		cc->previous = cc->loaded;
+		cc->loaded = NULL;
+		cc->loaded_count = 0;
+	} else {
+		cc->free_hits++;
 	}
 
-	return;
+	buf->next = cc->loaded;
+	cc->loaded = buf;
+	cc->loaded_count++;
 }
 
-void cbuf_free_chain_noblock(cbuf *buf)
+// add another region worth of cbufs to the depot
+static int cbuf_arena_grow(void)
 {
-	cbuf *head, *last;
+	region_id id;
+	addr_t base;
+	cbuf *buf;
+	int count;
+	int i;
 
-	if(buf == NULL)
-		return;
+	mutex_lock(&cbuf_arena_lock);
 
-	head = buf;
-	_clear_chain(head, &last);
+	// someone else may have just refilled it
+	if(cbuf_depot_count > 0) {
+		mutex_unlock(&cbuf_arena_lock);
+		return NO_ERROR;
+	}
 
-	int_disable_interrupts();
-	acquire_spinlock(&noblock_spin);
+	if(cbuf_arena_size + CBUF_ARENA_GROW > CBUF_ARENA_MAX) {
+		mutex_unlock(&cbuf_arena_lock);
+		return ERR_NO_MEMORY;
+	}
 
-	last->next = cbuf_free_noblock_list;
-	cbuf_free_noblock_list = head;
+	// wired, so drivers can point dma straight at a cbuf
+	id = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "cbuf arena", (void **)&base,
+		REGION_ADDR_ANY_ADDRESS, CBUF_ARENA_GROW, REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL);
+	if(id < 0) {
+		mutex_unlock(&cbuf_arena_lock);
+		return id;
+	}
+	cbuf_arena_size += CBUF_ARENA_GROW;
+	cbuf_arena_regions++;
+
+	// carve it up into batches
+	count = CBUF_ARENA_GROW / CBUF_LEN;
+	for(i = 0; i < count; i++) {
+		buf = (cbuf *)(base + i * CBUF_LEN);
+		initialize_cbuf(buf);
+		if((i + 1) % CBUF_BATCH)
+			buf->next = (cbuf *)(base + (i + 1) * CBUF_LEN);
+		else
+			buf->next = NULL;
+	}
 
-	release_spinlock(&noblock_spin);
+	// the batches have to be in the depot before the lock is dropped, or the
+	// next caller sees it still empty and grows the arena again
+	int_disable_interrupts();
+	for(i = 0; i < count; i += CBUF_BATCH)
+		depot_put_batch((cbuf *)(base + i * CBUF_LEN));
 	int_restore_interrupts();
-}
 
-void cbuf_free_chain(cbuf *buf)
-{
-	cbuf *head, *last;
-
-	if(buf == NULL)
-		return;
-
-	head = buf;
-	_clear_chain(head, &last);
-
-	mutex_lock(&cbuf_free_list_lock);
+	mutex_unlock(&cbuf_arena_lock);
 
-	last->next = cbuf_free_list;
-	cbuf_free_list = head;
-
-	mutex_unlock(&cbuf_free_list_lock);
+	return NO_ERROR;
 }
 
-cbuf *cbuf_get_chain(size_t len)
+static cbuf *_cbuf_get_chain(size_t len, bool can_block)
 {
+	struct cbuf_cpu_cache *cc;
 	cbuf *chain = NULL;
 	cbuf *tail = NULL;
-	cbuf *temp;
+	cbuf *buf = NULL;
 	size_t chain_len = 0;
+	int n;
 
-	if(len == 0)
-		panic("cbuf_get_chain: passed size 0\n");
+	while(chain_len < len) {
+		// don't keep interrupts off for more than a batch at a time
+		int_disable_interrupts();
+		cc = &cbuf_cpu[smp_get_current_cpu()];
+		for(n = 0; n < CBUF_BATCH && chain_len < len; n++) {
+			buf = cpu_cache_alloc(cc);
+			if(buf == NULL)
+				break;
 
-	mutex_lock(&cbuf_free_list_lock);
+			buf->next = chain;
+			if(chain == NULL)
+				tail = buf;
+			chain = buf;
 
-	while(chain_len < len) {
-		if(cbuf_free_list == NULL) {
-			// we need to allocate some more cbufs
-			mutex_unlock(&cbuf_free_list_lock);
-			temp = allocate_cbuf_mem(ALLOCATE_CHUNK);
-			if(!temp) {
-				// no more ram
-				if(chain)
+			chain_len += buf->len;
+		}
+		int_restore_interrupts();
+
+		if(buf == NULL) {
+			// the cpu cache and depot are dry, get some more if we're allowed to
+			if(!can_block || cbuf_arena_grow() < 0) {
+				dprintf("cbuf_get_chain: asked to allocate %ld bytes but out of memory\n", (long)len);
+				if(chain != NULL)
 					cbuf_free_chain(chain);
-				dprintf("cbuf_get_chain: asked to allocate %ld bytes but out of memory\n", len);
 				return NULL;
 			}
-			cbuf_free_chain(temp);
-			mutex_lock(&cbuf_free_list_lock);
-			continue;
 		}
-
-		temp = cbuf_free_list;
-		cbuf_free_list = cbuf_free_list->next;
-		temp->flags = 0;
-		temp->next = chain;
-		if(chain == NULL)
-			tail = temp;
-		chain = temp;
-
-		chain_len += chain->len;
 	}
-	mutex_unlock(&cbuf_free_list_lock);
 
 	// now we have a chain, fixup the first and last entry
 	chain->total_len = len;
@@ -297,47 +306,46 @@ cbuf *cbuf_get_chain(size_t len)
 	return chain;
 }
 
-cbuf *cbuf_get_chain_noblock(size_t len)
+void cbuf_free_chain(cbuf *buf)
 {
-	cbuf *chain = NULL;
-	cbuf *tail = NULL;
-	cbuf *temp;
-	size_t chain_len = 0;
-
-	int_disable_interrupts();
-	acquire_spinlock(&noblock_spin);
-
-	while(chain_len < len) {
-		if(cbuf_free_noblock_list == NULL) {
-			dprintf("cbuf_get_chain_noblock: not enough cbufs\n");
-			release_spinlock(&noblock_spin);
-			int_restore_interrupts();
-
-			if(chain != NULL)
-				cbuf_free_chain_noblock(chain);
-
-			return NULL;
+	struct cbuf_cpu_cache *cc;
+	cbuf *next;
+	int n;
+
+	while(buf != NULL) {
+		int_disable_interrupts();
+		cc = &cbuf_cpu[smp_get_current_cpu()];
+		for(n = 0; n < CBUF_BATCH && buf != NULL; n++) {
+			next = buf->next;
+			initialize_cbuf(buf); // doesn't touch the next ptr
+			cpu_cache_free(cc, buf);
+			buf = next;
 		}
+		int_restore_interrupts();
+	}
+}
 
-		temp = cbuf_free_noblock_list;
-		cbuf_free_noblock_list = cbuf_free_noblock_list->next;
-		temp->next = chain;
-		if(chain == NULL)
-			tail = temp;
-		chain = temp;
+// freeing never blocks anymore, this is only here for the callers that care
+void cbuf_free_chain_noblock(cbuf *buf)
+{
+	cbuf_free_chain(buf);
+}
 
-		chain_len += chain->len;
-	}
-	release_spinlock(&noblock_spin);
-	int_restore_interrupts();
+cbuf *cbuf_get_chain(size_t len)
+{
+	if(len == 0)
+		panic("cbuf_get_chain: passed size 0\n");
 
-	// now we have a chain, fixup the first and last entry
-	chain->total_len = len;
-	chain->flags |= CBUF_FLAG_CHAIN_HEAD;
-	tail->len -= chain_len - len;
-	tail->flags |= CBUF_FLAG_CHAIN_TAIL;
+	return _cbuf_get_chain(len, true);
+}
 
-	return chain;
+// safe to call from interrupt handlers, fails instead of growing the arena
+cbuf *cbuf_get_chain_noblock(size_t len)
+{
+	if(len == 0)
+		return NULL;
+
+	return _cbuf_get_chain(len, false);
 }
 
 int cbuf_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size_t len)
@@ -389,11 +397,15 @@ int cbuf_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size_t le
 	return NO_ERROR;
 }
 
-int cbuf_user_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size_t len)
+// if sum is passed in, the data is checksummed a cbuf at a time right after it's
+// copied, while it's still in the cache. The sum is of the copied bytes on their own,
+// counted from the start of src.
+static int _cbuf_user_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size_t len, uint16 *sum)
 {
 	cbuf *buf;
 	char *src = (char *)_src;
 	int buf_offset;
+	size_t pos;
 	int err;
 
 	validate_cbuf(chain);
@@ -420,7 +432,11 @@ int cbuf_user_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size
 		buf = buf->next;
 	}
 
+	if(sum)
+		*sum = 0;
+
 	err = NO_ERROR;
+	pos = 0;
 	while(len > 0) {
 		int to_copy;
 
@@ -429,18 +445,36 @@ int cbuf_user_memcpy_to_chain(cbuf *chain, size_t offset, const void *_src, size
 			return ERR_GENERAL;
 		}
 		to_copy = min(len, buf->len - buf_offset);
-		if ((err = user_memcpy((char *)buf->data + buf_offset, src, to_copy) < 0))
+		if((err = user_memcpy((char *)buf->data + buf_offset, src, to_copy)) < 0)
 			break; // memory exception
 
+		if(sum) {
+			uint16 part = ones_sum16(0, (char *)buf->data + buf_offset, to_copy);
+			if(pos & 1)
+				part = ((part & 0xff) << 8) | (part >> 8);
+			*sum = ones_sum16_add(*sum, part);
+		}
+
 		buf_offset = 0;
 		len -= to_copy;
 		src += to_copy;
+		pos += to_copy;
 		buf = buf->next;
 	}
 
 	return err;
 }
 
+int cbuf_user_memcpy_to_chain(cbuf *chain, size_t offset, const void *src, size_t len)
+{
+	return _cbuf_user_memcpy_to_chain(chain, offset, src, len, NULL);
+}
+
+int cbuf_user_memcpy_to_chain_cksum(cbuf *chain, size_t offset, const void *src, size_t len, uint16 *sum)
+{
+	return _cbuf_user_memcpy_to_chain(chain, offset, src, len, sum);
+}
+
 
 int cbuf_memcpy_from_chain(void *_dest, cbuf *chain, size_t offset, size_t len)
 {
@@ -545,13 +579,15 @@ int cbuf_user_memcpy_from_chain(void *_dest, cbuf *chain, size_t offset, size_t
 	return err;
 }
 
-cbuf *cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leading_space)
+static cbuf *_cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leading_space, bool cksum)
 {
 	cbuf *buf;
 	cbuf *newbuf;
 	cbuf *destbuf;
 	int dest_buf_offset;
 	int buf_offset;
+	uint16 sum;
+	size_t pos;
 
 	if(!chain)
 		return NULL;
@@ -590,6 +626,8 @@ cbuf *cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leadin
 
 	destbuf = newbuf;
 	dest_buf_offset = 0;
+	sum = 0;
+	pos = 0;
 	while(len > 0) {
 		size_t to_copy;
 
@@ -608,6 +646,14 @@ cbuf *cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leadin
 		to_copy = min(to_copy, len);
 		memcpy((char *)destbuf->data + dest_buf_offset, (char *)buf->data + buf_offset, to_copy);
 
+		if(cksum) {
+			uint16 part = ones_sum16(0, (char *)destbuf->data + dest_buf_offset, to_copy);
+			if(pos & 1)
+				part = ((part & 0xff) << 8) | (part >> 8);
+			sum = ones_sum16_add(sum, part);
+			pos += to_copy;
+		}
+
 		len -= to_copy;
 		if(to_copy + buf_offset == buf->len) {
 			buf = buf->next;
@@ -623,11 +669,27 @@ cbuf *cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leadin
 		}
 	}
 
+	if(cksum) {
+		newbuf->cksum = sum;
+		newbuf->flags |= CBUF_FLAG_CKSUM_VALID;
+	}
+
 	validate_cbuf(newbuf);
 
 	return newbuf;
 }
 
+cbuf *cbuf_duplicate_chain(cbuf *chain, size_t offset, size_t len, size_t leading_space)
+{
+	return _cbuf_duplicate_chain(chain, offset, len, leading_space, false);
+}
+
+// same as above, but checksums the data as it's copied and leaves the sum in the new chain
+cbuf *cbuf_duplicate_chain_cksum(cbuf *chain, size_t offset, size_t len, size_t leading_space)
+{
+	return _cbuf_duplicate_chain(chain, offset, len, leading_space, true);
+}
+
 
 cbuf *cbuf_merge_chains(cbuf *chain1, cbuf *chain2)
 {
@@ -655,7 +717,8 @@ cbuf *cbuf_merge_chains(cbuf *chain1, cbuf *chain2)
 	// modify the flags on the chain headers
 	buf->flags &= ~CBUF_FLAG_CHAIN_TAIL;
 	chain1->total_len += chain2->total_len;
-	chain2->flags &= ~CBUF_FLAG_CHAIN_HEAD;
+	chain1->flags &= ~CBUF_FLAG_CKSUM_VALID;
+	chain2->flags &= ~(CBUF_FLAG_CHAIN_HEAD | CBUF_FLAG_CKSUM_VALID);
 
 	return chain1;
 }
@@ -712,7 +775,7 @@ int cbuf_is_contig_region(cbuf *buf, size_t start, size_t end)
 
 static uint16 _cbuf_ones_cksum16(cbuf *buf, size_t offset, size_t len, uint16 sum)
 {
-	int swapped = 0;
+	size_t pos;
 
 	if(!buf)
 		return sum;
@@ -723,34 +786,29 @@ static uint16 _cbuf_ones_cksum16(cbuf *buf, size_t offset, size_t len, uint16 su
 	while(buf) {
 		if(buf->len > offset)
 			break;
-		if(buf->len > offset)
-			return 0;
 		offset -= buf->len;
 		buf = buf->next;
 	}
 
-	// start checksumming
+	// checksum each piece on its own and add it in, swapping the pieces
+	// that start at an odd position
+	pos = 0;
 	while(buf && len > 0) {
 		void *ptr = (void *)((addr_t)buf->data + offset);
 		size_t plen = min(len, buf->len - offset);
+		uint16 part;
 
-		sum = ones_sum16(sum, ptr, plen);
+		part = ones_sum16(0, ptr, plen);
+		if(pos & 1)
+			part = ((part & 0xff) << 8) | (part >> 8);
+		sum = ones_sum16_add(sum, part);
 
 		len -= plen;
+		pos += plen;
 		buf = buf->next;
-
-		// if the pointer was odd, or the length was odd, but not both,
-		// the checksum was swapped
-		if((buf && len > 0) && (((offset % 2) && ((plen % 2) == 0)) || (((offset % 2) == 0) && (plen % 2)))) {
-			swapped ^= 1;
-			sum = ((sum & 0xff) << 8) | ((sum >> 8) & 0xff);
-		}
 		offset = 0;
 	}
 
-	if (swapped)
-		sum = ((sum & 0xff) << 8) | ((sum >> 8) & 0xff);
-
 	return sum;
 }
 
@@ -776,6 +834,8 @@ cbuf *cbuf_truncate_head(cbuf *buf, size_t trunc_bytes, bool free_unused)
 	//dprintf("cbuf_truncate_head - buf: total_len: %d, len: %d\n", buf->total_len, buf->len);
 	validate_cbuf(buf);
 
+	head->flags &= ~CBUF_FLAG_CKSUM_VALID;
+
 	while(buf && trunc_bytes > 0) {
 		int to_trunc;
 
@@ -824,6 +884,8 @@ int cbuf_truncate_tail(cbuf *buf, size_t trunc_bytes, bool free_unused)
 
 	validate_cbuf(buf);
 
+	head->flags &= ~CBUF_FLAG_CKSUM_VALID;
+
 	if(trunc_bytes > buf->total_len)
 		trunc_bytes = buf->total_len;
 
@@ -878,6 +940,8 @@ int cbuf_extend_head(cbuf **_buf, size_t extend_bytes)
 
 	validate_cbuf(buf);
 
+	buf->flags &= ~CBUF_FLAG_CKSUM_VALID;
+
 	// first, see how much space we can allocate off the front of the chain
 	if(buf->len < sizeof(buf->dat) && (addr_t)buf->data != (addr_t)buf->dat) {
 		// there is some space at the front of this buffer, lets see how much
@@ -934,6 +998,8 @@ int cbuf_extend_tail(cbuf *head, size_t extend_bytes)
 
 	validate_cbuf(head);
 
+	head->flags &= ~CBUF_FLAG_CKSUM_VALID;
+
 	// walk to the end of this buffer
 	for(temp = head; temp->next != NULL; temp = temp->next)
 		;
@@ -974,17 +1040,21 @@ int cbuf_extend_tail(cbuf *head, size_t extend_bytes)
 
 static void dbg_dump_cbuf_freelists(int argc, char **argv)
 {
-	cbuf *buf;
-
-	dprintf("cbuf_free_list:\n");
-	for(buf = cbuf_free_list; buf; buf = buf->next)
-		dprintf("%p ", buf);
-	dprintf("\n");
+	struct cbuf_cpu_cache *cc;
+	int i;
 
-	dprintf("cbuf_free_noblock_list:\n");
-	for(buf = cbuf_free_noblock_list; buf; buf = buf->next)
-		dprintf("%p ", buf);
-	dprintf("\n");
+	dprintf("cbuf arena: %ld bytes in %d regions, max %d\n",
+		(long)cbuf_arena_size, cbuf_arena_regions, CBUF_ARENA_MAX);
+	dprintf("depot: %d batches of %d (%ld bytes), %d gets, %d puts\n",
+		cbuf_depot_count, CBUF_BATCH, (long)(cbuf_depot_count * CBUF_BATCH * CBUF_LEN),
+		cbuf_depot_gets, cbuf_depot_puts);
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		cc = &cbuf_cpu[i];
+		dprintf("cpu %d: %d loaded, %d previous, alloc hits %d misses %d, free hits %d misses %d\n",
+			i, cc->loaded_count, cc->previous ? CBUF_BATCH : 0,
+			cc->alloc_hits, cc->alloc_misses, cc->free_hits, cc->free_misses);
+	}
 }
 
 void cbuf_test()
@@ -1032,54 +1102,33 @@ void cbuf_test()
 
 int cbuf_init()
 {
-	cbuf *buf;
-	int i;
 	int err;
 
-	cbuf_free_list = NULL;
-	cbuf_free_noblock_list = NULL;
-	noblock_spin = 0;
-	cbuf_lowlevel_spinlock = 0;
+	// the arena is carved up into CBUF_LEN pieces
+	ASSERT(sizeof(cbuf) == CBUF_LEN);
+
+	memset(cbuf_cpu, 0, sizeof(cbuf_cpu));
+	cbuf_depot = NULL;
+	cbuf_depot_count = 0;
+	cbuf_depot_lock = 0;
+	cbuf_arena_size = 0;
+	cbuf_arena_regions = 0;
 
 	// add the debug command
-	dbg_add_command(&dbg_dump_cbuf_freelists, "cbuf_freelist", "Dumps the cbuf free lists");
+	dbg_add_command(&dbg_dump_cbuf_freelists, "cbuf_freelist", "Dumps the cbuf cache and depot stats");
 
-	err = mutex_init(&cbuf_free_list_lock, "cbuf_free_list_lock");
+	err = mutex_init(&cbuf_arena_lock, "cbuf_arena_lock");
 	if(err < 0) {
-		panic("cbuf_init: error creating cbuf_free_list_lock\n");
-		return ERR_NO_MEMORY;
-	}
-
-	cbuf_region_id = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "cbuf region",
-		(void **)&cbuf_region, REGION_ADDR_ANY_ADDRESS, CBUF_REGION_SIZE, REGION_WIRING_LAZY, LOCK_RW|LOCK_KERNEL);
-	if(cbuf_region_id < 0) {
-		panic("cbuf_init: error creating cbuf region\n");
+		panic("cbuf_init: error creating cbuf_arena_lock\n");
 		return ERR_NO_MEMORY;
 	}
 
-	cbuf_bitmap_region_id = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "cbuf bitmap region",
-		(void **)&cbuf_bitmap, REGION_ADDR_ANY_ADDRESS,
-		CBUF_BITMAP_SIZE / 8, REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL);
-	if(cbuf_region_id < 0) {
-		panic("cbuf_init: error creating cbuf bitmap region\n");
-		return ERR_NO_MEMORY;
+	// prime the depot
+	err = cbuf_arena_grow();
+	if(err < 0) {
+		panic("cbuf_init: error creating cbuf arena\n");
+		return err;
 	}
 
-	// initialize the bitmap
-	for(i=0; i<CBUF_BITMAP_SIZE/8; i++)
-		cbuf_bitmap[i] = 0;
-
-#if 0
-	buf = allocate_cbuf_mem(ALLOCATE_CHUNK);
-	if(buf == NULL)
-		return ERR_NO_MEMORY;
-	cbuf_free_chain_noblock(buf);
-#endif
-	buf = allocate_cbuf_mem(ALLOCATE_CHUNK);
-	if(buf == NULL)
-		return ERR_NO_MEMORY;
-
-	cbuf_free_chain(buf);
-
 	return NO_ERROR;
 }
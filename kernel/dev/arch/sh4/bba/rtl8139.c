@@ -96,6 +96,8 @@ static struct dev_calls rtl8139_hooks = {
 	/* no paging here */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -225,6 +225,8 @@ struct dev_calls keyboard_hooks = {
 	/* cannot page from keyboard */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
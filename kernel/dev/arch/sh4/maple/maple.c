@@ -302,6 +302,8 @@ struct dev_calls maple_hooks = {
 	/* cannot page from maple devices */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -70,7 +70,8 @@ struct dev_calls translation_hooks = {
 	&translation_write,
 	&translation_canpage,
 	&translation_readpage,
-	&translation_writepage
+	&translation_writepage,
+	NULL
 };
 
 isa_module_info isa = {
@@ -56,6 +56,8 @@ static struct dev_calls null_hooks = {
 	/* no paging from /dev/null */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -63,6 +63,8 @@ static struct dev_calls zero_hooks = {
 	/* no paging from /dev/zero */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
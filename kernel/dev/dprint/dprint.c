@@ -74,6 +74,8 @@ static struct dev_calls dprint_hooks = {
 	/* no paging from /dev/dprint */
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
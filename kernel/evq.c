@@ -0,0 +1,806 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/evq.h>
+#include <kernel/vfs.h>
+#include <kernel/sem.h>
+#include <kernel/lock.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
+#include <kernel/heap.h>
+#include <kernel/khash.h>
+#include <kernel/debug.h>
+#include <kernel/vm.h>
+#include <newos/errors.h>
+
+#include <string.h>
+
+/*
+ * Event queues let one thread wait on any number of open files at once.
+ * Each file added to a queue gets a registration, whose poll_waiter sits on
+ * the file's poll_list. When the file says something changed the registration
+ * goes on the queue's ready list, and evq_wait takes things off that list,
+ * asks each file what it actually looks like now and reports that.
+ *
+ * Level triggered registrations go back on the ready list after they're
+ * reported, so the next wait looks at them again and keeps reporting them
+ * until whatever made them ready is used up. Edge triggered ones only go back
+ * on when the file notifies again.
+ *
+ * A registration holds a reference to the open file, but a watched one:
+ * once the file is closed everywhere and only registrations are left, the
+ * vfs calls evq_file_closed() and they're all dropped, which closes it for
+ * real. To find them, every registration is also hashed by its file.
+ *
+ * Lock order is queue lock, then the file hash lock or whatever lock the file
+ * has, then the file's poll_list lock, then the queue's ready_lock.
+ */
+typedef struct evq_reg {
+	struct evq_reg *next;			// hash chain
+	struct list_node node;			// on the queue's list of registrations
+	struct list_node ready_node;	// on the ready list, or a wait's private list, while ready is set
+	struct list_node file_node;		// in the file hash
+	poll_waiter waiter;
+	struct evq *q;
+	int fd;
+	void *file;
+	int events;		// what was asked for, plus EVQ_EDGE and EVQ_ONESHOT
+	void *data;
+	bool ready;
+	bool disabled;	// a oneshot that has gone off
+	unsigned int reported;	// wait_seq of the last wait that reported it
+} evq_reg;
+
+typedef struct evq {
+	struct evq *next;			// hash chain
+	evq_id id;
+	proc_id owner;
+	char name[SYS_MAX_OS_NAME_LEN];
+	int ref_count;
+	bool deleted;
+
+	// held by evq_ctl, and by evq_wait while it goes through the ready list
+	mutex lock;
+	void *reg_hash;
+	struct list_node regs;
+	int num_regs;
+	unsigned int wait_seq;
+
+	spinlock_t ready_lock;
+	struct list_node ready;
+	sem_id sem;
+	int waiters;
+} evq;
+
+#define EVQ_HASH_SIZE 64
+#define EVQ_REG_HASH_SIZE 256
+#define EVQ_FILE_HASH_SIZE 256
+
+static void *evq_table;
+static mutex evq_table_lock;
+static evq_id next_evq_id;
+
+// every registration, by the file it's on
+static struct list_node evq_file_hash[EVQ_FILE_HASH_SIZE];
+static mutex evq_file_lock;
+
+static int evq_compare_func(void *_q, const void *_key)
+{
+	evq *q = _q;
+	const evq_id *id = _key;
+
+	if(q->id == *id)
+		return 0;
+	else
+		return 1;
+}
+
+static unsigned int evq_hash_func(void *_q, const void *_key, unsigned int range)
+{
+	evq *q = _q;
+	const evq_id *id = _key;
+
+	if(q)
+		return q->id % range;
+	else
+		return *id % range;
+}
+
+static struct list_node *evq_file_bucket(void *file)
+{
+	return &evq_file_hash[((addr_t)file >> 4) % EVQ_FILE_HASH_SIZE];
+}
+
+static int evq_reg_compare_func(void *_r, const void *_key)
+{
+	evq_reg *reg = _r;
+	const int *fd = _key;
+
+	if(reg->fd == *fd)
+		return 0;
+	else
+		return 1;
+}
+
+static unsigned int evq_reg_hash_func(void *_r, const void *_key, unsigned int range)
+{
+	evq_reg *reg = _r;
+	const int *fd = _key;
+
+	if(reg)
+		return reg->fd % range;
+	else
+		return *fd % range;
+}
+
+void poll_list_init(poll_list *list)
+{
+	list->lock = 0;
+	list_initialize(&list->waiters);
+}
+
+void poll_list_add(poll_list *list, poll_waiter *waiter)
+{
+	int_disable_interrupts();
+	acquire_spinlock(&list->lock);
+
+	list_add_tail(&list->waiters, &waiter->node);
+	waiter->list = list;
+
+	release_spinlock(&list->lock);
+	int_restore_interrupts();
+}
+
+// once this returns the waiter's notify won't be called again
+void poll_list_remove(poll_waiter *waiter)
+{
+	poll_list *list = waiter->list;
+
+	if(list == NULL)
+		return;
+
+	int_disable_interrupts();
+	acquire_spinlock(&list->lock);
+
+	list_delete(&waiter->node);
+	waiter->list = NULL;
+
+	release_spinlock(&list->lock);
+	int_restore_interrupts();
+}
+
+void poll_notify(poll_list *list, int events)
+{
+	poll_waiter *waiter;
+
+	int_disable_interrupts();
+	acquire_spinlock(&list->lock);
+
+	list_for_every_entry(&list->waiters, waiter, poll_waiter, node)
+		waiter->notify(waiter, events);
+
+	release_spinlock(&list->lock);
+	int_restore_interrupts();
+}
+
+static evq *evq_get(evq_id id)
+{
+	evq *q;
+
+	mutex_lock(&evq_table_lock);
+	q = hash_lookup(evq_table, &id);
+	if(q)
+		atomic_add(&q->ref_count, 1);
+	mutex_unlock(&evq_table_lock);
+
+	return q;
+}
+
+static void evq_put(evq *q)
+{
+	if(atomic_add(&q->ref_count, -1) == 1) {
+		ASSERT(q->num_regs == 0);
+
+		hash_uninit(q->reg_hash);
+		mutex_destroy(&q->lock);
+		kfree(q);
+	}
+}
+
+// puts the registration on the ready list and wakes up one waiter for it.
+// Called with the ready_lock held.
+static void evq_make_ready(evq *q, evq_reg *reg)
+{
+	if(reg->ready || reg->disabled)
+		return;
+
+	list_add_tail(&q->ready, &reg->ready_node);
+	reg->ready = true;
+
+	if(q->waiters > 0) {
+		q->waiters--;
+		sem_release_etc(q->sem, 1, SEM_FLAG_NO_RESCHED);
+	}
+}
+
+static void evq_notify(poll_waiter *waiter, int events)
+{
+	evq_reg *reg = containerof(waiter, evq_reg, waiter);
+	evq *q = reg->q;
+
+	acquire_spinlock(&q->ready_lock);
+	if(events & (reg->events | EVQ_ERR | EVQ_HUP))
+		evq_make_ready(q, reg);
+	release_spinlock(&q->ready_lock);
+}
+
+// looks at the file's readiness now, and queues the registration if it's
+// something that was asked for. Called with the queue lock held.
+static int evq_check_reg(evq *q, evq_reg *reg, poll_waiter *waiter)
+{
+	int revents;
+
+	revents = vfs_poll_file(reg->file, waiter);
+	if(revents < 0)
+		return revents;
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->ready_lock);
+	if(revents & (reg->events | EVQ_ERR | EVQ_HUP))
+		evq_make_ready(q, reg);
+	release_spinlock(&q->ready_lock);
+	int_restore_interrupts();
+
+	return NO_ERROR;
+}
+
+// called with the queue lock held
+static void evq_remove_reg(evq *q, evq_reg *reg)
+{
+	// once it's off the file's list nothing else can put it on the ready list
+	poll_list_remove(&reg->waiter);
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->ready_lock);
+	if(reg->ready) {
+		list_delete(&reg->ready_node);
+		reg->ready = false;
+	}
+	release_spinlock(&q->ready_lock);
+	int_restore_interrupts();
+
+	hash_remove(q->reg_hash, reg);
+	list_delete(&reg->node);
+	q->num_regs--;
+
+	mutex_lock(&evq_file_lock);
+	list_delete(&reg->file_node);
+	mutex_unlock(&evq_file_lock);
+
+	// this may be the last reference to the file, which closes it
+	vfs_put_watched_file_ptr(reg->file);
+	kfree(reg);
+}
+
+void evq_file_closed(void *file)
+{
+	struct list_node *bucket = evq_file_bucket(file);
+	evq *q;
+	evq_reg *reg;
+	int fd;
+
+	for(;;) {
+		// the registration can't go away while it's in the hash, and its queue
+		// can't go away while it has registrations
+		mutex_lock(&evq_file_lock);
+		q = NULL;
+		list_for_every_entry(bucket, reg, evq_reg, file_node) {
+			if(reg->file == file) {
+				q = reg->q;
+				fd = reg->fd;
+				atomic_add(&q->ref_count, 1);
+				break;
+			}
+		}
+		mutex_unlock(&evq_file_lock);
+
+		if(q == NULL)
+			return;
+
+		mutex_lock(&q->lock);
+		reg = hash_lookup(q->reg_hash, &fd);
+		if(reg != NULL && reg->file == file)
+			evq_remove_reg(q, reg);
+		mutex_unlock(&q->lock);
+
+		evq_put(q);
+	}
+}
+
+static evq_id _evq_create(const char *name, proc_id owner)
+{
+	evq *q;
+
+	q = kmalloc(sizeof(evq));
+	if(q == NULL)
+		return ERR_NO_MEMORY;
+	memset(q, 0, sizeof(evq));
+
+	q->reg_hash = hash_init(EVQ_REG_HASH_SIZE, offsetof(evq_reg, next), &evq_reg_compare_func, &evq_reg_hash_func);
+	if(q->reg_hash == NULL)
+		goto err;
+	if(mutex_init(&q->lock, "evq lock") < 0)
+		goto err1;
+	// the kernel owns the sem so the proc can't delete it out from under the queue
+	q->sem = sem_create_etc(0, "evq sem", proc_get_kernel_proc_id());
+	if(q->sem < 0)
+		goto err2;
+
+	strlcpy(q->name, name ? name : "unnamed evq", sizeof(q->name));
+	q->owner = owner;
+	q->ref_count = 1;
+	list_initialize(&q->regs);
+	list_initialize(&q->ready);
+	q->ready_lock = 0;
+
+	mutex_lock(&evq_table_lock);
+	q->id = next_evq_id++;
+	hash_insert(evq_table, q);
+	mutex_unlock(&evq_table_lock);
+
+	return q->id;
+
+err2:
+	mutex_destroy(&q->lock);
+err1:
+	hash_uninit(q->reg_hash);
+err:
+	kfree(q);
+	return ERR_NO_MEMORY;
+}
+
+evq_id evq_create(const char *name)
+{
+	return _evq_create(name, proc_get_kernel_proc_id());
+}
+
+int evq_delete(evq_id id)
+{
+	evq *q;
+	evq_reg *reg;
+
+	mutex_lock(&evq_table_lock);
+	q = hash_lookup(evq_table, &id);
+	if(q) {
+		hash_remove(evq_table, q);
+		q->deleted = true;
+	}
+	mutex_unlock(&evq_table_lock);
+
+	if(q == NULL)
+		return ERR_INVALID_HANDLE;
+
+	// kicks out anyone sleeping in evq_wait
+	sem_delete(q->sem);
+
+	mutex_lock(&q->lock);
+	while((reg = list_peek_head_type(&q->regs, evq_reg, node)) != NULL)
+		evq_remove_reg(q, reg);
+	mutex_unlock(&q->lock);
+
+	// drop the reference the table had
+	evq_put(q);
+
+	return NO_ERROR;
+}
+
+static int _evq_ctl(evq_id id, int op, int fd, int events, void *data, bool kernel)
+{
+	evq *q;
+	evq_reg *reg;
+	void *file;
+	void *put_file = NULL;
+	int err;
+
+	q = evq_get(id);
+	if(q == NULL)
+		return ERR_INVALID_HANDLE;
+
+	mutex_lock(&q->lock);
+
+	if(q->deleted) {
+		err = ERR_INVALID_HANDLE;
+		goto out;
+	}
+
+	reg = hash_lookup(q->reg_hash, &fd);
+
+	switch(op) {
+		case EVQ_CTL_ADD:
+			err = vfs_get_file_from_fd(fd, kernel, &file);
+			if(err < 0)
+				break;
+
+			// the registration takes its own watched ref. This one keeps the
+			// file open until we're done and is put once the queue lock is
+			// dropped, since if the fd got closed in the meantime putting it
+			// finds only watchers left and comes back here for the lock.
+			put_file = file;
+
+			if(reg) {
+				if(reg->file == file) {
+					err = ERR_VFS_ALREADY_EXISTS;
+					break;
+				}
+				// the fd was closed and reused since it was added
+				evq_remove_reg(q, reg);
+			}
+
+			reg = kmalloc(sizeof(evq_reg));
+			if(reg == NULL) {
+				err = ERR_NO_MEMORY;
+				break;
+			}
+			memset(reg, 0, sizeof(evq_reg));
+			reg->q = q;
+			reg->fd = fd;
+			reg->file = file;
+			reg->events = events;
+			reg->data = data;
+			reg->waiter.notify = &evq_notify;
+
+			vfs_watch_file(file);
+			mutex_lock(&evq_file_lock);
+			list_add_tail(evq_file_bucket(file), &reg->file_node);
+			mutex_unlock(&evq_file_lock);
+
+			hash_insert(q->reg_hash, reg);
+			list_add_tail(&q->regs, &reg->node);
+			q->num_regs++;
+
+			// hang it on the file, and report whatever is already ready
+			err = evq_check_reg(q, reg, &reg->waiter);
+			if(err < 0)
+				evq_remove_reg(q, reg);
+			break;
+		case EVQ_CTL_MODIFY:
+			if(reg == NULL) {
+				err = ERR_NOT_FOUND;
+				break;
+			}
+
+			int_disable_interrupts();
+			acquire_spinlock(&q->ready_lock);
+			reg->events = events;
+			reg->disabled = false;
+			release_spinlock(&q->ready_lock);
+			int_restore_interrupts();
+			reg->data = data;
+
+			// it's already on the file's list, just see if it's ready under the new mask
+			err = evq_check_reg(q, reg, NULL);
+			break;
+		case EVQ_CTL_REMOVE:
+			if(reg == NULL) {
+				err = ERR_NOT_FOUND;
+				break;
+			}
+			evq_remove_reg(q, reg);
+			err = NO_ERROR;
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+
+out:
+	mutex_unlock(&q->lock);
+	evq_put(q);
+
+	if(put_file != NULL)
+		vfs_put_file_ptr(put_file);
+
+	return err;
+}
+
+int evq_ctl(evq_id id, int op, int fd, int events, void *data)
+{
+	return _evq_ctl(id, op, fd, events, data, true);
+}
+
+// takes up to max_events registrations off the ready list and reports the ones
+// that are still ready. Called with the queue lock held.
+static int evq_collect(evq *q, struct evq_event *events, int max_events, bool kernel)
+{
+	struct list_node again;
+	struct evq_event ev;
+	evq_reg *reg;
+	unsigned int seq;
+	int revents;
+	int count = 0;
+	int err = NO_ERROR;
+
+	// things that have to go back on the ready list wait here until we're
+	// done, so the loop doesn't see them again. They stay marked ready so a
+	// notify in the meantime leaves them alone.
+	list_initialize(&again);
+	seq = ++q->wait_seq;
+
+	while(count < max_events) {
+		int_disable_interrupts();
+		acquire_spinlock(&q->ready_lock);
+		reg = list_remove_head_type(&q->ready, evq_reg, ready_node);
+		if(reg != NULL) {
+			if(reg->reported == seq) {
+				// notified again since we reported it, leave it for the next wait
+				list_add_tail(&again, &reg->ready_node);
+			} else {
+				reg->ready = false;
+			}
+		}
+		release_spinlock(&q->ready_lock);
+		int_restore_interrupts();
+
+		if(reg == NULL)
+			break;
+		if(reg->reported == seq)
+			continue;
+
+		revents = vfs_poll_file(reg->file, NULL);
+		if(revents < 0)
+			revents = EVQ_ERR;
+		revents &= reg->events | EVQ_ERR | EVQ_HUP;
+		if(revents == 0) {
+			// not ready anymore, the notify will queue it again when it is
+			continue;
+		}
+
+		ev.fd = reg->fd;
+		ev.events = revents;
+		ev.data = reg->data;
+		if(kernel) {
+			memcpy(&events[count], &ev, sizeof(ev));
+		} else {
+			err = user_memcpy(&events[count], &ev, sizeof(ev));
+		}
+
+		int_disable_interrupts();
+		acquire_spinlock(&q->ready_lock);
+		if(err < 0) {
+			// put it back for whoever comes along with a better buffer
+			if(!reg->ready) {
+				list_add_head(&q->ready, &reg->ready_node);
+				reg->ready = true;
+			}
+		} else {
+			reg->reported = seq;
+			if(reg->events & EVQ_ONESHOT) {
+				reg->disabled = true;
+			} else if(!(reg->events & EVQ_EDGE) && !reg->ready) {
+				// level triggered, look at it again on the next wait
+				list_add_tail(&again, &reg->ready_node);
+				reg->ready = true;
+			}
+		}
+		release_spinlock(&q->ready_lock);
+		int_restore_interrupts();
+
+		if(err < 0)
+			break;
+		count++;
+	}
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->ready_lock);
+	while((reg = list_remove_head_type(&again, evq_reg, ready_node)) != NULL) {
+		if(reg->disabled) {
+			reg->ready = false;
+			continue;
+		}
+		list_add_tail(&q->ready, &reg->ready_node);
+	}
+	// there's still something left, so let another waiter have a go at it
+	if(!list_is_empty(&q->ready) && q->waiters > 0) {
+		q->waiters--;
+		sem_release_etc(q->sem, 1, SEM_FLAG_NO_RESCHED);
+	}
+	release_spinlock(&q->ready_lock);
+	int_restore_interrupts();
+
+	if(count == 0 && err < 0)
+		return err;
+	return count;
+}
+
+static int _evq_wait(evq_id id, struct evq_event *events, int max_events, int flags, bigtime_t timeout, bool kernel)
+{
+	evq *q;
+	bigtime_t deadline = 0;
+	bool empty;
+	int err;
+
+	if(max_events <= 0)
+		return ERR_INVALID_ARGS;
+
+	q = evq_get(id);
+	if(q == NULL)
+		return ERR_INVALID_HANDLE;
+
+	if(flags & EVQ_FLAG_TIMEOUT)
+		deadline = system_time() + timeout;
+
+	for(;;) {
+		if(q->deleted) {
+			err = ERR_INVALID_HANDLE;
+			break;
+		}
+
+		int_disable_interrupts();
+		acquire_spinlock(&q->ready_lock);
+		empty = list_is_empty(&q->ready);
+		if(empty)
+			q->waiters++;
+		release_spinlock(&q->ready_lock);
+		int_restore_interrupts();
+
+		if(empty) {
+			if(flags & EVQ_FLAG_TIMEOUT) {
+				timeout = deadline - system_time();
+				if(timeout < 0)
+					timeout = 0;
+			}
+
+			err = sem_acquire_etc(q->sem, 1, flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
+			if(err < 0) {
+				// if nobody released us, take ourselves back off the count
+				int_disable_interrupts();
+				acquire_spinlock(&q->ready_lock);
+				if(q->waiters > 0)
+					q->waiters--;
+				release_spinlock(&q->ready_lock);
+				int_restore_interrupts();
+
+				if(q->deleted)
+					err = ERR_INVALID_HANDLE;
+				else if(err == ERR_SEM_TIMED_OUT)
+					err = ERR_TIMED_OUT;
+				break;
+			}
+			continue;
+		}
+
+		mutex_lock(&q->lock);
+		err = evq_collect(q, events, max_events, kernel);
+		mutex_unlock(&q->lock);
+
+		// everything on the list may have stopped being ready before we got to it
+		if(err != 0)
+			break;
+	}
+
+	evq_put(q);
+
+	return err;
+}
+
+int evq_wait(evq_id id, struct evq_event *events, int max_events, int flags, bigtime_t timeout)
+{
+	return _evq_wait(id, events, max_events, flags, timeout, true);
+}
+
+/* deletes all the queues the proc made, called when it exits */
+int evq_delete_owned_evqs(proc_id owner)
+{
+	struct hash_iterator i;
+	evq *q;
+	evq_id id;
+	int count = 0;
+
+	for(;;) {
+		id = -1;
+
+		mutex_lock(&evq_table_lock);
+		hash_open(evq_table, &i);
+		while((q = hash_next(evq_table, &i)) != NULL) {
+			if(q->owner == owner) {
+				id = q->id;
+				break;
+			}
+		}
+		hash_close(evq_table, &i, false);
+		mutex_unlock(&evq_table_lock);
+
+		if(id < 0)
+			break;
+
+		evq_delete(id);
+		count++;
+	}
+
+	return count;
+}
+
+evq_id user_evq_create(const char *uname)
+{
+	if(uname != NULL) {
+		char name[SYS_MAX_OS_NAME_LEN];
+		int rc;
+
+		if(is_kernel_address(uname))
+			return ERR_VM_BAD_USER_MEMORY;
+
+		rc = user_strncpy(name, uname, SYS_MAX_OS_NAME_LEN-1);
+		if(rc < 0)
+			return rc;
+		name[SYS_MAX_OS_NAME_LEN-1] = 0;
+
+		return _evq_create(name, proc_get_current_proc_id());
+	} else {
+		return _evq_create(NULL, proc_get_current_proc_id());
+	}
+}
+
+int user_evq_delete(evq_id id)
+{
+	return evq_delete(id);
+}
+
+int user_evq_ctl(evq_id id, int op, int fd, int events, void *data)
+{
+	return _evq_ctl(id, op, fd, events, data, false);
+}
+
+int user_evq_wait(evq_id id, struct evq_event *uevents, int max_events, int flags, bigtime_t timeout)
+{
+	if(is_kernel_address(uevents))
+		return ERR_VM_BAD_USER_MEMORY;
+
+	// without a timeout, only a signal gets the thread out of a queue that never becomes ready
+	flags |= EVQ_FLAG_INTERRUPTABLE;
+
+	return _evq_wait(id, uevents, max_events, flags, timeout, false);
+}
+
+static void dump_evqs(int argc, char **argv)
+{
+	struct hash_iterator i;
+	evq *q;
+	evq_reg *reg;
+
+	hash_open(evq_table, &i);
+	while((q = hash_next(evq_table, &i)) != NULL) {
+		dprintf("evq 0x%x '%s' owner 0x%x: %d registered, sem 0x%x, %d waiters, ready list %s\n",
+			q->id, q->name, q->owner, q->num_regs, q->sem, q->waiters, list_is_empty(&q->ready) ? "empty" : "not empty");
+		list_for_every_entry(&q->regs, reg, evq_reg, node) {
+			dprintf("\tfd %d events 0x%x data %p%s%s\n", reg->fd, reg->events, reg->data,
+				reg->ready ? " ready" : "", reg->disabled ? " disabled" : "");
+		}
+	}
+	hash_close(evq_table, &i, false);
+}
+
+int evq_init(kernel_args *ka)
+{
+	int i;
+
+	next_evq_id = 0;
+
+	if(mutex_init(&evq_table_lock, "evq table lock") < 0)
+		panic("evq_init: could not create evq table lock\n");
+
+	evq_table = hash_init(EVQ_HASH_SIZE, offsetof(evq, next), &evq_compare_func, &evq_hash_func);
+	if(evq_table == NULL)
+		panic("evq_init: could not create evq table\n");
+
+	if(mutex_init(&evq_file_lock, "evq file hash lock") < 0)
+		panic("evq_init: could not create evq file hash lock\n");
+	for(i = 0; i < EVQ_FILE_HASH_SIZE; i++)
+		list_initialize(&evq_file_hash[i]);
+
+	dbg_add_command(&dump_evqs, "evqs", "Dump the event queues and what's registered on them");
+
+	return 0;
+}
@@ -983,6 +983,8 @@ static struct fs_calls bootfs_calls = {
 
 	&bootfs_rstat,
 	&bootfs_wstat,
+
+	NULL,
 };
 
 int bootstrap_bootfs(void)
@@ -12,6 +12,7 @@
 #include <kernel/heap.h>
 #include <kernel/lock.h>
 #include <kernel/vm.h>
+#include <kernel/evq.h>
 #include <newos/errors.h>
 #include <newos/drivers.h>
 
@@ -884,6 +885,22 @@ static int devfs_ioctl(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, int op,
 	}
 }
 
+static int devfs_poll(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, struct poll_waiter *waiter)
+{
+	struct devfs_vnode *v = _v;
+	struct devfs_cookie *cookie = _cookie;
+
+	TRACE(("devfs_poll: vnode 0x%x, cookie 0x%x, waiter 0x%x\n", _v, _cookie, waiter));
+
+	if(v->stream.type == STREAM_TYPE_DEVICE) {
+		if(!v->stream.u.dev.calls->dev_poll)
+			return EVQ_IN | EVQ_OUT;
+		return v->stream.u.dev.calls->dev_poll(cookie->u.dev.dcookie, waiter);
+	} else {
+		return ERR_VFS_IS_DIR;
+	}
+}
+
 static int devfs_canpage(fs_cookie _fs, fs_vnode _v)
 {
 	struct devfs_vnode *v = _v;
@@ -1077,6 +1094,8 @@ static struct fs_calls devfs_calls = {
 
 	&devfs_rstat,
 	&devfs_wstat,
+
+	&devfs_poll,
 };
 
 int bootstrap_devfs(void)
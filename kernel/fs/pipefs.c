@@ -12,6 +12,8 @@
 #include <kernel/vm.h>
 #include <kernel/sem.h>
 #include <kernel/thread.h>
+#include <kernel/slab.h>
+#include <kernel/evq.h>
 #include <newos/errors.h>
 #include <newos/drivers.h>
 #include <newos/pipefs_priv.h>
@@ -32,10 +34,30 @@
 #define TRACE(x)
 #endif
 
-#define PIPE_BUFFER_LEN 256
+// pipe data lives in whole pages that are allocated as the pipe fills up and
+// handed back as the reader drains it, up to the pipe's max_len
+#define PIPE_DEFAULT_MAX_LEN (64*1024)
+#define PIPE_MAX_LEN (1024*1024)
+
+// writes this small are never split up by another writer
+#define PIPE_ATOMIC_LEN 512
+
+// a blocked reader is woken in the middle of a write once this much data is
+// buffered, and always when the write finishes
+#define PIPE_DEFAULT_LOW_WATER PAGE_SIZE
+
+// writes at least this big lend their pages to the reader, which copies
+// straight out of them, instead of going through the pipe's buffer
+#define PIPE_LOAN_MIN (4*PAGE_SIZE)
 
 #define PIPE_FLAGS_ANONYMOUS 1
 
+struct pipe_page {
+	char *data;
+	int start; // first byte that hasn't been read
+	int end;   // one past the last byte written
+};
+
 struct pipefs_stream {
 	stream_type type;
 	union {
@@ -53,11 +75,26 @@ struct pipefs_stream {
 			mutex lock;
 			sem_id write_sem;
 			sem_id read_sem;
-
-			char *buf;
-			int buf_len;
-			int head;
-			int tail;
+			sem_id loan_sem;
+			int read_waiters;
+			int write_waiters;
+
+			// ring of pages holding the buffered data
+			struct pipe_page *pages;
+			int num_slots;
+			int first_page;
+			int num_pages;
+			char *spare_page;
+			int data_len;
+			int max_len;
+			int low_water;
+
+			// pages of a writer that's blocked until the reader gets through them
+			vm_page_loan *loan;
+			addr_t loan_pos;
+
+			// event queues waiting for the pipe to become readable or writable
+			poll_list poll;
 		} pipe;
 	} u;
 };
@@ -97,6 +134,190 @@ struct pipefs_cookie {
 /* the one and only allowed pipefs instance */
 static struct pipefs *thepipefs = NULL;
 
+static object_cache *pipe_page_cache;
+
+// the first page may be partly read, so it takes one more slot than the max
+#define PIPE_SLOTS(max_len) (((max_len) + PAGE_SIZE - 1) / PAGE_SIZE + 1)
+#define PIPE_SLOT(p, i) (&(p)->pages[((p)->first_page + (i)) % (p)->num_slots])
+
+static void pipe_free_first_page(struct stream_pipe *p)
+{
+	struct pipe_page *page = PIPE_SLOT(p, 0);
+
+	// keep one page around so a pipe that's just trickling along doesn't churn
+	if(p->spare_page == NULL)
+		p->spare_page = page->data;
+	else
+		object_cache_free(pipe_page_cache, page->data);
+	page->data = NULL;
+
+	p->first_page = (p->first_page + 1) % p->num_slots;
+	p->num_pages--;
+}
+
+// returns the page the next write should go into, adding one if needed
+static struct pipe_page *pipe_get_write_page(struct stream_pipe *p)
+{
+	struct pipe_page *page;
+
+	if(p->num_pages > 0) {
+		page = PIPE_SLOT(p, p->num_pages - 1);
+		if(page->end < PAGE_SIZE)
+			return page;
+	}
+
+	if(p->num_pages == p->num_slots)
+		return NULL;
+
+	page = PIPE_SLOT(p, p->num_pages);
+	if(p->spare_page) {
+		page->data = p->spare_page;
+		p->spare_page = NULL;
+	} else {
+		page->data = object_cache_alloc(pipe_page_cache);
+		if(page->data == NULL)
+			return NULL;
+	}
+	page->start = page->end = 0;
+	p->num_pages++;
+
+	return page;
+}
+
+static ssize_t pipe_copy_in(struct stream_pipe *p, const void *buf, ssize_t len)
+{
+	struct pipe_page *page;
+	ssize_t written = 0;
+	ssize_t copy_len;
+	int err;
+
+	while(len > 0) {
+		page = pipe_get_write_page(p);
+		if(page == NULL)
+			return written > 0 ? written : ERR_NO_MEMORY;
+
+		copy_len = min(len, PAGE_SIZE - page->end);
+		err = user_memcpy(page->data + page->end, (const char *)buf + written, copy_len);
+		if(err < 0)
+			return written > 0 ? written : err;
+
+		page->end += copy_len;
+		p->data_len += copy_len;
+		written += copy_len;
+		len -= copy_len;
+	}
+
+	return written;
+}
+
+static ssize_t pipe_copy_out(struct stream_pipe *p, void *buf, ssize_t len)
+{
+	struct pipe_page *page;
+	ssize_t read_len = 0;
+	ssize_t copy_len;
+	int err;
+
+	while(len > 0 && p->num_pages > 0) {
+		page = PIPE_SLOT(p, 0);
+
+		copy_len = min(len, page->end - page->start);
+		err = user_memcpy((char *)buf + read_len, page->data + page->start, copy_len);
+		if(err < 0)
+			return read_len > 0 ? read_len : err;
+
+		page->start += copy_len;
+		p->data_len -= copy_len;
+		read_len += copy_len;
+		len -= copy_len;
+
+		// the writer only moves on to a new page once this one is full, so an
+		// emptied page can always go
+		if(page->start == page->end)
+			pipe_free_first_page(p);
+	}
+
+	return read_len;
+}
+
+// wake up everyone waiting on one of the pipe's sems
+static void pipe_wake(sem_id sem, int *waiters)
+{
+	if(*waiters > 0) {
+		sem_release(sem, *waiters);
+		*waiters = 0;
+	}
+}
+
+// drops the lock and waits on the sem, returns with the lock held again
+static int pipe_wait(struct stream_pipe *p, sem_id sem, int *waiters)
+{
+	int err;
+
+	if(sem < 0)
+		return ERR_PIPE_WIDOW;
+
+	(*waiters)++;
+	mutex_unlock(&p->lock);
+	err = sem_acquire_etc(sem, 1, SEM_FLAG_INTERRUPTABLE, 0, NULL);
+	mutex_lock(&p->lock);
+
+	// if nobody released us, take ourselves back off the count
+	if(err < 0 && *waiters > 0)
+		(*waiters)--;
+
+	return err;
+}
+
+// wake up the readers, and tell anyone polling there's something to read
+static void pipe_wake_readers(struct stream_pipe *p)
+{
+	pipe_wake(p->read_sem, &p->read_waiters);
+	poll_notify(&p->poll, EVQ_IN);
+}
+
+// same for writers, there's room in the pipe again
+static void pipe_wake_writers(struct stream_pipe *p)
+{
+	pipe_wake(p->write_sem, &p->write_waiters);
+	poll_notify(&p->poll, EVQ_OUT);
+}
+
+static int pipe_set_max_len(struct stream_pipe *p, int max_len)
+{
+	struct pipe_page *pages;
+	int num_slots;
+	int i;
+
+	if(max_len < PAGE_SIZE || max_len > PIPE_MAX_LEN)
+		return ERR_INVALID_ARGS;
+	max_len = ROUNDUP(max_len, PAGE_SIZE);
+
+	// can't shrink it out from under data that's already in it
+	num_slots = PIPE_SLOTS(max_len);
+	if(num_slots < p->num_pages || max_len < p->data_len)
+		return ERR_NOT_ALLOWED;
+
+	pages = kmalloc(sizeof(struct pipe_page) * num_slots);
+	if(pages == NULL)
+		return ERR_NO_MEMORY;
+
+	for(i = 0; i < p->num_pages; i++)
+		pages[i] = *PIPE_SLOT(p, i);
+
+	kfree(p->pages);
+	p->pages = pages;
+	p->num_slots = num_slots;
+	p->first_page = 0;
+	p->max_len = max_len;
+	if(p->low_water > max_len)
+		p->low_water = max_len;
+
+	// there may be more room now
+	pipe_wake_writers(p);
+
+	return NO_ERROR;
+}
+
 #define PIPEFS_HASH_SIZE 16
 static unsigned int pipefs_vnode_hash_func(void *_v, const void *_key, unsigned int range)
 {
@@ -144,28 +365,39 @@ static struct pipefs_vnode *pipefs_create_vnode(struct pipefs *fs, const char *n
 				goto err;
 			break;
 		case STREAM_TYPE_PIPE:
-			v->stream.u.pipe.buf = kmalloc(PIPE_BUFFER_LEN);
-			if(v->stream.u.pipe.buf == NULL)
+			v->stream.u.pipe.max_len = PIPE_DEFAULT_MAX_LEN;
+			v->stream.u.pipe.low_water = PIPE_DEFAULT_LOW_WATER;
+			v->stream.u.pipe.num_slots = PIPE_SLOTS(PIPE_DEFAULT_MAX_LEN);
+			v->stream.u.pipe.pages = kmalloc(sizeof(struct pipe_page) * v->stream.u.pipe.num_slots);
+			if(v->stream.u.pipe.pages == NULL)
 				goto err;
-			v->stream.u.pipe.buf_len = PIPE_BUFFER_LEN;
 
 			if(mutex_init(&v->stream.u.pipe.lock, "pipe_lock") < 0) {
-				kfree(v->stream.u.pipe.buf);
+				kfree(v->stream.u.pipe.pages);
 				goto err;
 			}
 			v->stream.u.pipe.read_sem = sem_create(0, "pipe_read_sem");
 			if(v->stream.u.pipe.read_sem < 0) {
 				mutex_destroy(&v->stream.u.pipe.lock);
-				kfree(v->stream.u.pipe.buf);
+				kfree(v->stream.u.pipe.pages);
 				goto err;
 			}
-			v->stream.u.pipe.write_sem = sem_create(1, "pipe_write_sem");
+			v->stream.u.pipe.write_sem = sem_create(0, "pipe_write_sem");
 			if(v->stream.u.pipe.write_sem < 0) {
 				sem_delete(v->stream.u.pipe.read_sem);
 				mutex_destroy(&v->stream.u.pipe.lock);
-				kfree(v->stream.u.pipe.buf);
+				kfree(v->stream.u.pipe.pages);
 				goto err;
 			}
+			v->stream.u.pipe.loan_sem = sem_create(0, "pipe_loan_sem");
+			if(v->stream.u.pipe.loan_sem < 0) {
+				sem_delete(v->stream.u.pipe.write_sem);
+				sem_delete(v->stream.u.pipe.read_sem);
+				mutex_destroy(&v->stream.u.pipe.lock);
+				kfree(v->stream.u.pipe.pages);
+				goto err;
+			}
+			poll_list_init(&v->stream.u.pipe.poll);
 			break;
 	}
 
@@ -190,10 +422,15 @@ static int pipefs_delete_vnode(struct pipefs *fs, struct pipefs_vnode *v, bool f
 	hash_remove(fs->vnode_list_hash, v);
 
 	if(v->stream.type == STREAM_TYPE_PIPE) {
+		sem_delete(v->stream.u.pipe.loan_sem);
 		sem_delete(v->stream.u.pipe.write_sem);
 		sem_delete(v->stream.u.pipe.read_sem);
 		mutex_destroy(&v->stream.u.pipe.lock);
-		kfree(v->stream.u.pipe.buf);
+		while(v->stream.u.pipe.num_pages > 0)
+			pipe_free_first_page(&v->stream.u.pipe);
+		if(v->stream.u.pipe.spare_page)
+			object_cache_free(pipe_page_cache, v->stream.u.pipe.spare_page);
+		kfree(v->stream.u.pipe.pages);
 	}
 
 	if(v->name != NULL)
@@ -694,6 +931,9 @@ static int pipefs_close(fs_cookie _fs, fs_vnode _v, file_cookie _cookie)
 			v->stream.u.pipe.write_sem = -1;
 			sem_delete(v->stream.u.pipe.read_sem);
 			v->stream.u.pipe.read_sem = -1;
+			sem_delete(v->stream.u.pipe.loan_sem);
+			v->stream.u.pipe.loan_sem = -1;
+			poll_notify(&v->stream.u.pipe.poll, EVQ_HUP);
 		}
 	}
 	mutex_unlock(&v->stream.u.pipe.lock);
@@ -729,9 +969,10 @@ static ssize_t pipefs_read(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, void
 	struct pipefs *fs = _fs;
 	struct pipefs_vnode *v = _v;
 	struct pipefs_cookie *cookie = _cookie;
+	struct stream_pipe *p = &v->stream.u.pipe;
 	ssize_t err = 0;
 	ssize_t read_len = 0;
-	ssize_t data_len;
+	ssize_t copy_len;
 
 	TRACE(("pipefs_read: vnode 0x%x, cookie 0x%x, pos 0x%Lx, len 0x%x\n", v, cookie, pos, len));
 
@@ -753,69 +994,113 @@ static ssize_t pipefs_read(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, void
 		goto err;
 	}
 
-	// wait for data in the buffer
-	err = sem_acquire_etc(v->stream.u.pipe.read_sem, 1, SEM_FLAG_INTERRUPTABLE, 0, NULL);
-	if(err == ERR_INTERRUPTED)
-		goto err;
+	mutex_lock(&p->lock);
+
+	// wait for data in the buffer, or for a writer to lend us some
+	while(p->data_len == 0 && p->loan == NULL) {
+		// see if the other endpoint is active
+		if(p->flags & PIPE_FLAGS_ANONYMOUS) {
+			// this is an anonymous pipe, check the overall open count
+			// and make sure it's >1, otherwise we're the only one holding it open
+			if(p->open_count < 2) {
+				err = ERR_PIPE_WIDOW;
+				goto done_pipe;
+			}
+		}
 
-	mutex_lock(&v->stream.u.pipe.lock);
+		err = pipe_wait(p, p->read_sem, &p->read_waiters);
+		if(err == ERR_INTERRUPTED || err == ERR_PIPE_WIDOW)
+			goto done_pipe;
+	}
 
-	// see if the other endpoint is active
-	if(v->stream.u.pipe.flags & PIPE_FLAGS_ANONYMOUS) {
-		// this is an anonymous pipe, check the overall open count
-		// and make sure it's >1, otherwise we're the only one holding it open
-		if(v->stream.u.pipe.open_count < 2) {
-			err = ERR_PIPE_WIDOW;
+	// whatever is in the buffer was written before anything on loan
+	read_len = pipe_copy_out(p, buf, len);
+	if(read_len < 0) {
+		err = read_len;
+		goto done_pipe;
+	}
+
+	if(read_len < len && p->loan != NULL) {
+		copy_len = min(len - read_len, (ssize_t)(p->loan->len - p->loan_pos));
+		err = vm_loan_copy_to_user(p->loan, p->loan_pos, (char *)buf + read_len, copy_len);
+		if(err >= 0) {
+			p->loan_pos += copy_len;
+			read_len += copy_len;
+
+			// all done, hand the pages back to the writer
+			if(p->loan_pos == p->loan->len) {
+				p->loan = NULL;
+				sem_release(p->loan_sem, 1);
+			}
+		} else if(read_len == 0) {
 			goto done_pipe;
 		}
 	}
 
-	ASSERT(v->stream.u.pipe.head < v->stream.u.pipe.buf_len);
-	ASSERT(v->stream.u.pipe.tail < v->stream.u.pipe.buf_len);
+	// let the writers back in once there's a decent amount of room
+	if(p->loan == NULL && p->data_len <= p->max_len / 2)
+		pipe_wake_writers(p);
 
-	// read data
-	if(v->stream.u.pipe.head >= v->stream.u.pipe.tail)
-		data_len = v->stream.u.pipe.head - v->stream.u.pipe.tail;
-	else
-		data_len = (v->stream.u.pipe.head + v->stream.u.pipe.buf_len) - v->stream.u.pipe.tail;
-	len = min(data_len, len);
+	// leave the rest for any other readers
+	if(p->data_len > 0 || p->loan != NULL)
+		pipe_wake_readers(p);
 
-	ASSERT(len > 0);
+	err = read_len;
 
-	while(len > 0) {
-		ssize_t copy_len = len;
+done_pipe:
+	mutex_unlock(&p->lock);
+err:
+	return err;
+}
+
+// lends the reader as much of the buffer as fits in one loan and waits for it
+// to be copied out. A buffer that can't be loaned, like a kernel one, comes
+// back with nothing written and no error. Called and returns with the pipe
+// lock held.
+static int pipe_write_loan(struct stream_pipe *p, const void *buf, ssize_t len, ssize_t *_written)
+{
+	vm_page_loan loan;
+	ssize_t loan_len;
+	int err = NO_ERROR;
 
-		if(v->stream.u.pipe.tail + copy_len > v->stream.u.pipe.buf_len) {
-			copy_len = v->stream.u.pipe.buf_len - v->stream.u.pipe.tail;
+	*_written = 0;
+
+	loan_len = vm_loan_user_pages(buf, len, &loan);
+	if(loan_len <= 0)
+		return NO_ERROR;
+
+	p->loan = &loan;
+	p->loan_pos = 0;
+	pipe_wake_readers(p);
+
+	while(p->loan == &loan) {
+		if((p->flags & PIPE_FLAGS_ANONYMOUS) && p->open_count < 2) {
+			err = ERR_PIPE_WIDOW;
+			break;
 		}
 
-		err = user_memcpy((char *)buf + read_len, v->stream.u.pipe.buf + v->stream.u.pipe.tail, copy_len);
+		mutex_unlock(&p->lock);
+		err = sem_acquire_etc(p->loan_sem, 1, SEM_FLAG_INTERRUPTABLE, 0, NULL);
+		mutex_lock(&p->lock);
 		if(err < 0) {
-			sem_release(v->stream.u.pipe.read_sem, 1);
-			goto done_pipe;
+			if(p->loan_sem < 0)
+				err = ERR_PIPE_WIDOW;
+			break;
 		}
-
-		// update the buffer pointers
-		v->stream.u.pipe.tail += copy_len;
-		if(v->stream.u.pipe.tail == v->stream.u.pipe.buf_len)
-			v->stream.u.pipe.tail = 0;
-		len -= copy_len;
-		read_len += copy_len;
 	}
 
-	// is there more data available?
-	if(read_len < data_len)
-		sem_release(v->stream.u.pipe.read_sem, 1);
-
-	// did it used to be full?
-	if(data_len == v->stream.u.pipe.buf_len - 1)
-		sem_release(v->stream.u.pipe.write_sem, 1);
-
-	err = read_len;
+	if(p->loan == &loan) {
+		// take back whatever the reader didn't get to
+		loan_len = p->loan_pos;
+		p->loan = NULL;
+		pipe_wake_writers(p);
+	} else {
+		// the reader got all of it, whatever woke us up
+		err = NO_ERROR;
+	}
+	vm_unloan_pages(&loan);
 
-done_pipe:
-	mutex_unlock(&v->stream.u.pipe.lock);
-err:
+	*_written = loan_len;
 	return err;
 }
 
@@ -824,9 +1109,12 @@ static ssize_t pipefs_write(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, con
 	struct pipefs *fs = _fs;
 	struct pipefs_vnode *v = _v;
 	struct pipefs_cookie *cookie = _cookie;
-	int err = 0;
+	struct stream_pipe *p = &v->stream.u.pipe;
+	ssize_t err = 0;
 	ssize_t written = 0;
 	ssize_t free_space;
+	ssize_t need;
+	bool try_loan = true;
 
 	TRACE(("pipefs_write: vnode 0x%x, cookie 0x%x, pos 0x%Lx, len 0x%x\n", v, cookie, pos, len));
 
@@ -848,75 +1136,78 @@ static ssize_t pipefs_write(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, con
 		goto err;
 	}
 
-	// wait on space in the circular buffer
-	err = sem_acquire_etc(v->stream.u.pipe.write_sem, 1, SEM_FLAG_INTERRUPTABLE, 0, NULL);
-	if(err == ERR_INTERRUPTED)
-		goto err;
-
-	mutex_lock(&v->stream.u.pipe.lock);
+	// small writes go in all at once, bigger ones a piece at a time
+	need = (len <= PIPE_ATOMIC_LEN) ? len : 1;
+
+	mutex_lock(&p->lock);
+
+	while(written < len) {
+		// see if the other endpoint is active
+		if(p->flags & PIPE_FLAGS_ANONYMOUS) {
+			// this is an anonymous pipe, check the overall open count
+			// and make sure it's >1, otherwise we're the only one holding it open
+			if(p->open_count < 2) {
+				// XXX deliver real SIGPIPE when we get it
+				proc_kill_proc(proc_get_current_proc_id());
+				err = ERR_PIPE_WIDOW;
+				goto done_pipe;
+			}
+		}
 
-	// see if the other endpoint is active
-	if(v->stream.u.pipe.flags & PIPE_FLAGS_ANONYMOUS) {
-		// this is an anonymous pipe, check the overall open count
-		// and make sure it's >1, otherwise we're the only one holding it open
-		if(v->stream.u.pipe.open_count < 2) {
-			// XXX deliver real SIGPIPE when we get it
-			proc_kill_proc(proc_get_current_proc_id());
-			err = ERR_PIPE_WIDOW;
-			goto done_pipe;
+		// only one writer can have pages out on loan, and nothing else goes
+		// in the buffer until the reader is done with them
+		if(try_loan && p->loan == NULL && len - written >= PIPE_LOAN_MIN) {
+			ssize_t loaned;
+
+			err = pipe_write_loan(p, (const char *)buf + written, len - written, &loaned);
+			written += loaned;
+			if(err == ERR_PIPE_WIDOW)
+				continue;
+			if(err < 0)
+				goto done_pipe;
+			if(loaned > 0)
+				continue;
+			// couldn't loan any of it, copy the rest the old way
+			try_loan = false;
 		}
-	}
 
-	ASSERT(v->stream.u.pipe.head < v->stream.u.pipe.buf_len);
-	ASSERT(v->stream.u.pipe.tail < v->stream.u.pipe.buf_len);
+		free_space = p->max_len - p->data_len;
+		if(p->loan != NULL || free_space < need) {
+			// make sure the reader knows about what's there before blocking
+			if(p->data_len > 0)
+				pipe_wake_readers(p);
 
-	// figure out how much data we can write to it
-	if(v->stream.u.pipe.head >= v->stream.u.pipe.tail)
-		free_space = v->stream.u.pipe.buf_len - (v->stream.u.pipe.head - v->stream.u.pipe.tail);
-	else
-		free_space = v->stream.u.pipe.buf_len - ((v->stream.u.pipe.head + v->stream.u.pipe.buf_len) - v->stream.u.pipe.tail);
-	free_space--; // can't completely fill it
-	len = min(free_space, len);
+			err = pipe_wait(p, p->write_sem, &p->write_waiters);
+			if(err == ERR_INTERRUPTED)
+				goto done_pipe;
+			continue;
+		}
 
 #if PIPEFS_TRACE
-	dprintf("pipefs_write: buffer free space %d, len to write %d, head %d, tail %d\n", free_space, len, v->stream.u.pipe.head, v->stream.u.pipe.tail);
+		dprintf("pipefs_write: buffer free space %d, len to write %d, data_len %d, pages %d\n", free_space, len - written, p->data_len, p->num_pages);
 #endif
 
-	ASSERT(len > 0);
-
-	while(len > 0) {
-		ssize_t copy_len = len;
-
-		if(v->stream.u.pipe.head + copy_len > v->stream.u.pipe.buf_len) {
-			copy_len = v->stream.u.pipe.buf_len - v->stream.u.pipe.head;
-		}
-
-		err = user_memcpy(v->stream.u.pipe.buf + v->stream.u.pipe.head, (char *)buf + written, copy_len);
-		if(err < 0) {
-			sem_release(v->stream.u.pipe.write_sem, 1);
+		err = pipe_copy_in(p, (const char *)buf + written, min(len - written, free_space));
+		if(err < 0)
 			goto done_pipe;
-		}
+		written += err;
 
-		// update the buffer pointers
-		v->stream.u.pipe.head += copy_len;
-		if(v->stream.u.pipe.head == v->stream.u.pipe.buf_len)
-			v->stream.u.pipe.head = 0;
-		len -= copy_len;
-		written += copy_len;
+		// enough to be worth waking the reader up for
+		if(p->data_len >= p->low_water)
+			pipe_wake_readers(p);
 	}
 
-	// is there more space available?
-	if(written < free_space)
-		sem_release(v->stream.u.pipe.write_sem, 1);
-
-	// did it used to be empty?
-	if(free_space == v->stream.u.pipe.buf_len - 1)
-		sem_release(v->stream.u.pipe.read_sem, 1);
-
 	err = written;
 
 done_pipe:
-	mutex_unlock(&v->stream.u.pipe.lock);
+	// whatever made it in is ready to be read
+	if(p->data_len > 0)
+		pipe_wake_readers(p);
+
+	mutex_unlock(&p->lock);
+
+	if(err < 0 && err != ERR_PIPE_WIDOW && written > 0)
+		err = written;
 
 err:
 	return err;
@@ -1019,6 +1310,40 @@ static int pipefs_ioctl(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, int op,
 					err = user_memcpy(buf, new_fds, sizeof(new_fds));
 					break;
 				}
+				case _PIPEFS_IOCTL_SET_BUFFER_SIZE:
+				case _PIPEFS_IOCTL_SET_LOW_WATER: {
+					int val;
+
+					if(v == fs->anon_vnode || len < sizeof(val)) {
+						err = ERR_INVALID_ARGS;
+						goto err;
+					}
+					err = user_memcpy(&val, buf, sizeof(val));
+					if(err < 0)
+						goto err;
+
+					mutex_lock(&v->stream.u.pipe.lock);
+					if(op == _PIPEFS_IOCTL_SET_BUFFER_SIZE) {
+						err = pipe_set_max_len(&v->stream.u.pipe, val);
+					} else if(val < 1 || val > v->stream.u.pipe.max_len) {
+						err = ERR_INVALID_ARGS;
+					} else {
+						v->stream.u.pipe.low_water = val;
+						err = NO_ERROR;
+					}
+					mutex_unlock(&v->stream.u.pipe.lock);
+					break;
+				}
+				case _PIPEFS_IOCTL_GET_BUFFER_SIZE: {
+					int val = v->stream.u.pipe.max_len;
+
+					if(len < sizeof(val)) {
+						err = ERR_INVALID_ARGS;
+						goto err;
+					}
+					err = user_memcpy(buf, &val, sizeof(val));
+					break;
+				}
 				default:
 					err = ERR_INVALID_ARGS;
 			}
@@ -1031,6 +1356,39 @@ err:
 	return err;
 }
 
+static int pipefs_poll(fs_cookie _fs, fs_vnode _v, file_cookie _cookie, struct poll_waiter *waiter)
+{
+	struct pipefs *fs = _fs;
+	struct pipefs_vnode *v = _v;
+	struct stream_pipe *p = &v->stream.u.pipe;
+	int events = 0;
+
+	TRACE(("pipefs_poll: vnode 0x%x, cookie 0x%x, waiter 0x%x\n", v, _cookie, waiter));
+
+	if(v->stream.type == STREAM_TYPE_DIR)
+		return ERR_VFS_IS_DIR;
+	if(v == fs->anon_vnode)
+		return ERR_NOT_ALLOWED;
+
+	mutex_lock(&p->lock);
+
+	if(p->data_len > 0 || p->loan != NULL)
+		events |= EVQ_IN;
+	// enough room that a small write goes in without blocking
+	if(p->loan == NULL && p->max_len - p->data_len >= PIPE_ATOMIC_LEN)
+		events |= EVQ_OUT;
+	if((p->flags & PIPE_FLAGS_ANONYMOUS) && p->open_count < 2)
+		events |= EVQ_HUP;
+
+	// hang it on the pipe before letting go of the lock, so it can't miss anything
+	if(waiter)
+		poll_list_add(&p->poll, waiter);
+
+	mutex_unlock(&p->lock);
+
+	return events;
+}
+
 static int pipefs_canpage(fs_cookie _fs, fs_vnode _v)
 {
 	return ERR_NOT_ALLOWED;
@@ -1080,7 +1438,10 @@ static int pipefs_rstat(fs_cookie _fs, fs_vnode _v, struct file_stat *stat)
 
 	stat->vnid = v->id;
 	stat->type = v->stream.type;
-	stat->size = 0;
+	if(v->stream.type == STREAM_TYPE_PIPE)
+		stat->size = v->stream.u.pipe.data_len;
+	else
+		stat->size = 0;
 
 	return 0;
 }
@@ -1137,12 +1498,18 @@ static struct fs_calls pipefs_calls = {
 
 	&pipefs_rstat,
 	&pipefs_wstat,
+
+	&pipefs_poll,
 };
 
 int bootstrap_pipefs(void)
 {
 	dprintf("bootstrap_pipefs: entry\n");
 
+	pipe_page_cache = object_cache_create("pipe_page", PAGE_SIZE, PAGE_SIZE, NULL, NULL, NULL);
+	if(pipe_page_cache == NULL)
+		return ERR_NO_MEMORY;
+
 	return vfs_register_filesystem("pipefs", &pipefs_calls);
 }
 
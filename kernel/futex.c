@@ -0,0 +1,253 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/futex.h>
+#include <kernel/sem.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/debug.h>
+#include <kernel/vm.h>
+#include <kernel/list.h>
+#include <newos/errors.h>
+
+#include <stdio.h>
+
+/*
+ * Futexes let user space build locks out of a plain int that it changes with
+ * atomic ops, only coming into the kernel to sleep when the lock is held and to
+ * wake sleepers up when there are any. Nothing is allocated per futex: sleepers
+ * hang off a hash bucket picked by the address space and virtual address of the
+ * word, and each thread blocks on a sem of its own.
+ *
+ * That makes futexes private to a process. They can't be keyed by the physical
+ * page instead, since the page stealer is free to move or page out the one
+ * behind the word while someone sleeps on it, and then a waker would come up
+ * with a different key.
+ *
+ * A waiter goes on the bucket before it looks at the word, so a waker that
+ * changed the word after that look is sure to find it there.
+ */
+typedef struct futex_key {
+	aspace_id	aspace;
+	addr_t		addr;
+} futex_key;
+
+typedef struct futex_waiter {
+	struct list_node node;
+	futex_key	key;
+	thread_id	thread;
+	sem_id		sem;
+	bool		queued;		// cleared by the waker when it takes us off the bucket
+} futex_waiter;
+
+typedef struct futex_bucket {
+	spinlock_t	lock;
+	struct list_node waiters;
+} futex_bucket;
+
+// must be a power of 2
+#define FUTEX_HASH_SIZE 256
+
+// how many sleepers a waker collects before it drops the bucket lock to wake them
+#define FUTEX_WAKE_BATCH 16
+
+static futex_bucket futex_hash[FUTEX_HASH_SIZE];
+
+static futex_bucket *futex_get_bucket(futex_key *key)
+{
+	unsigned int hash;
+
+	hash = (key->addr / sizeof(int)) * 31 + key->aspace * 17;
+	hash ^= hash >> 8;
+
+	return &futex_hash[hash & (FUTEX_HASH_SIZE - 1)];
+}
+
+static bool futex_key_equal(futex_key *a, futex_key *b)
+{
+	return a->aspace == b->aspace && a->addr == b->addr;
+}
+
+// the word is looked at through user_memcpy by the wait itself, so a bad
+// address turns up there
+static int futex_get_key(int *uaddr, futex_key *key)
+{
+	if((addr_t)uaddr % sizeof(int) != 0)
+		return ERR_INVALID_ARGS;
+	if(is_kernel_address(uaddr))
+		return ERR_VM_BAD_USER_MEMORY;
+
+	key->aspace = vm_get_current_user_aspace_id();
+	key->addr = (addr_t)uaddr;
+
+	return NO_ERROR;
+}
+
+// takes the waiter back off its bucket, returns false if a waker beat us to it
+static bool futex_unqueue(futex_bucket *bucket, futex_waiter *waiter)
+{
+	bool was_queued;
+
+	int_disable_interrupts();
+	acquire_spinlock(&bucket->lock);
+
+	was_queued = waiter->queued;
+	if(was_queued) {
+		list_delete(&waiter->node);
+		waiter->queued = false;
+	}
+
+	release_spinlock(&bucket->lock);
+	int_restore_interrupts();
+
+	return was_queued;
+}
+
+int user_futex_wait(int *uaddr, int val, int flags, bigtime_t timeout)
+{
+	struct thread *t = thread_get_current_thread();
+	futex_bucket *bucket;
+	futex_waiter waiter;
+	int curr_val;
+	int err;
+
+	// the sleep is on the thread's own futex sem, let a signal break it
+	flags |= FUTEX_FLAG_INTERRUPTABLE;
+
+	err = futex_get_key(uaddr, &waiter.key);
+	if(err < 0)
+		return err;
+
+	// the sem is created the first time the thread has to sleep on a futex
+	if(t->futex_sem < 0) {
+		char temp[64];
+
+		sprintf(temp, "thread_0x%x_futex_sem", t->id);
+		t->futex_sem = sem_create_etc(0, temp, proc_get_kernel_proc_id());
+		if(t->futex_sem < 0)
+			return t->futex_sem;
+	}
+
+	waiter.thread = t->id;
+	waiter.sem = t->futex_sem;
+	waiter.queued = true;
+
+	bucket = futex_get_bucket(&waiter.key);
+
+	int_disable_interrupts();
+	acquire_spinlock(&bucket->lock);
+	list_add_tail(&bucket->waiters, &waiter.node);
+	release_spinlock(&bucket->lock);
+	int_restore_interrupts();
+
+	// now that we're on the bucket, see if the word still says to sleep
+	if(user_memcpy(&curr_val, uaddr, sizeof(curr_val)) < 0) {
+		err = ERR_VM_BAD_USER_MEMORY;
+		goto unqueue;
+	}
+	if(curr_val != val) {
+		// it changed already, go back and look at it again
+		err = NO_ERROR;
+		goto unqueue;
+	}
+
+	err = sem_acquire_etc(waiter.sem, 1, flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
+	if(err >= 0)
+		return NO_ERROR;
+
+	if(err == ERR_SEM_TIMED_OUT)
+		err = ERR_TIMED_OUT;
+
+unqueue:
+	if(!futex_unqueue(bucket, &waiter)) {
+		// a waker took us off and is releasing the sem, eat the count so
+		// the next wait doesn't return early. That counts as being woken.
+		sem_acquire(waiter.sem, 1);
+		err = NO_ERROR;
+	}
+
+	return err;
+}
+
+int user_futex_wake(int *uaddr, int count)
+{
+	futex_bucket *bucket;
+	futex_waiter *waiter;
+	futex_waiter *temp;
+	futex_key key;
+	sem_id wake_sems[FUTEX_WAKE_BATCH];
+	int num_wake;
+	int woken = 0;
+	int err;
+	int i;
+
+	if(count <= 0)
+		return 0;
+
+	err = futex_get_key(uaddr, &key);
+	if(err < 0)
+		return err;
+
+	bucket = futex_get_bucket(&key);
+
+	do {
+		num_wake = 0;
+
+		int_disable_interrupts();
+		acquire_spinlock(&bucket->lock);
+
+		list_for_every_entry_safe(&bucket->waiters, waiter, temp, futex_waiter, node) {
+			if(woken + num_wake >= count || num_wake >= FUTEX_WAKE_BATCH)
+				break;
+			if(!futex_key_equal(&waiter->key, &key))
+				continue;
+
+			// once it's off the list the waiter may look at its own stack again,
+			// so everything we need out of it has to be copied first
+			wake_sems[num_wake++] = waiter->sem;
+			list_delete(&waiter->node);
+			waiter->queued = false;
+		}
+
+		release_spinlock(&bucket->lock);
+		int_restore_interrupts();
+
+		// only the last one of each batch gets to reschedule
+		for(i = 0; i < num_wake; i++)
+			sem_release_etc(wake_sems[i], 1, (i < num_wake - 1) ? SEM_FLAG_NO_RESCHED : 0);
+
+		woken += num_wake;
+	} while(num_wake == FUTEX_WAKE_BATCH && woken < count);
+
+	return woken;
+}
+
+static void dump_futexes(int argc, char **argv)
+{
+	futex_waiter *waiter;
+	int i;
+
+	for(i = 0; i < FUTEX_HASH_SIZE; i++) {
+		list_for_every_entry(&futex_hash[i].waiters, waiter, futex_waiter, node) {
+			dprintf("bucket %3d: thread 0x%x aspace 0x%x addr 0x%lx sem 0x%x\n",
+				i, waiter->thread, waiter->key.aspace, waiter->key.addr, waiter->sem);
+		}
+	}
+}
+
+int futex_init(kernel_args *ka)
+{
+	int i;
+
+	for(i = 0; i < FUTEX_HASH_SIZE; i++) {
+		futex_hash[i].lock = 0;
+		list_initialize(&futex_hash[i].waiters);
+	}
+
+	dbg_add_command(&dump_futexes, "futexes", "Dump the threads sleeping on futexes");
+
+	return 0;
+}
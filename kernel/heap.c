@@ -117,9 +117,8 @@ int heap_init(addr_t new_heap_base, unsigned int new_heap_size)
 	// zero out the heap alloc table at the base of the heap
 	memset((void *)heap_alloc_table, 0, (heap_size / PAGE_SIZE) * sizeof(struct heap_page));
 
-	// pre-init the mutex to at least fall through any semaphore calls
-	heap_lock.sem = -1;
-	heap_lock.holder = -1;
+	// the mutex works without a semaphore until someone has to wait on it
+	mutex_init(&heap_lock, "heap_mutex");
 
 	// set up some debug commands
 	dprintf("adding debug commands\n");
@@ -131,7 +130,8 @@ int heap_init(addr_t new_heap_base, unsigned int new_heap_size)
 
 int heap_init_postsem(kernel_args *ka)
 {
-	if(mutex_init(&heap_lock, "heap_mutex") < 0) {
+	// the sem can't be created lazily, since sem_create allocates from the heap
+	if(mutex_init_etc(&heap_lock, "heap_mutex", MUTEX_FLAG_CREATE_SEM) < 0) {
 		panic("error creating heap mutex\n");
 	}
 	return 0;
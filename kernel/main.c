@@ -15,6 +15,8 @@
 #include <kernel/smp.h>
 #include <kernel/sem.h>
 #include <kernel/port.h>
+#include <kernel/futex.h>
+#include <kernel/evq.h>
 #include <kernel/vfs.h>
 #include <kernel/dev.h>
 #include <kernel/net/net.h>
@@ -49,6 +51,9 @@ int _start(kernel_args *oldka, int cpu_num)
 	// do any pre-booting cpu config
 	cpu_preboot_init(&global_kernel_args);
 
+	// let the cpus compare clocks while they're all still here
+	time_preboot_init(&global_kernel_args, cpu_num);
+
 	// if we're not a boot cpu, spin here until someone wakes us up
 	if(smp_trap_non_boot_cpus(&global_kernel_args, cpu_num) == NO_ERROR) {
 		// we're the boot processor, so wait for all of the APs to enter the kernel
@@ -80,8 +85,9 @@ int _start(kernel_args *oldka, int cpu_num)
 
 		faults_init(&global_kernel_args);
 		smp_init(&global_kernel_args);
-		timer_init(&global_kernel_args);
+		// time first, the timer picks its mode by whether there's a clocksource
 		time_init(&global_kernel_args);
+		timer_init(&global_kernel_args);
 
 		arch_cpu_init2(&global_kernel_args);
 
@@ -93,6 +99,8 @@ int _start(kernel_args *oldka, int cpu_num)
 		vfs_init(&global_kernel_args);
 		thread_init(&global_kernel_args);
 		port_init(&global_kernel_args);
+		futex_init(&global_kernel_args);
+		evq_init(&global_kernel_args);
 
 		vm_init_postthread(&global_kernel_args);
 		elf_init(&global_kernel_args);
@@ -70,6 +70,18 @@ int ethernet_input(cbuf *buf, ifnet *i)
 	return err;
 }
 
+int ethernet_ip_offset(cbuf *buf)
+{
+	ethernet2_header e2_head;
+
+	if(cbuf_memcpy_from_chain(&e2_head, buf, 0, sizeof(e2_head)) < 0)
+		return -1;
+	if(ntohs(e2_head.type) != PROT_TYPE_IPV4)
+		return -1;
+
+	return sizeof(ethernet2_header);
+}
+
 int ethernet_output(cbuf *buf, ifnet *i, netaddr *target, int protocol_type)
 {
 	cbuf *eheader_buf;
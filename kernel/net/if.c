@@ -16,17 +16,21 @@
 #include <kernel/net/loopback.h>
 #include <kernel/net/ethernet.h>
 #include <kernel/net/if.h>
+#include <kernel/net/net_rx.h>
 #include <string.h>
 #include <stdlib.h>
 
 #define TX_QUEUE_SIZE 64
 
+// most frames pulled from a driver per wakeup of the rx thread
+#define RX_BATCH_SIZE 16
+
+// most frames pulled off of the transmit queue and handed to a driver at once
+#define TX_BATCH_SIZE 16
+
 #define LOSE_RX_PACKETS 0
 #define LOSE_RX_PERCENTAGE 5
 
-#define LOSE_TX_PACKETS 0
-#define LOSE_TX_PERCENTAGE 5
-
 static void *ifhash;
 static mutex ifhash_lock;
 static if_id next_id;
@@ -109,6 +113,11 @@ int if_register_interface(const char *path, ifnet **_i)
 		if(err < 0) {
 			goto err2;
 		}
+		/* see if the driver can hand us frames directly, otherwise we read() them */
+		if(sys_ioctl(i->fd, IOCTL_NET_IF_GET_RX_HOOK, &i->rx_hook, sizeof(i->rx_hook)) < 0)
+			i->rx_hook.rx_frames = NULL;
+		if(sys_ioctl(i->fd, IOCTL_NET_IF_GET_TX_HOOK, &i->tx_hook, sizeof(i->tx_hook)) < 0)
+			i->tx_hook.tx_frames = NULL;
 	}
 
 	// find the appropriate function calls to the link layer drivers
@@ -209,10 +218,37 @@ int if_output(cbuf *b, ifnet *i)
 	return NO_ERROR;
 }
 
+// pull up to max packets off of the transmit queue
+static int if_tx_dequeue(ifnet *i, cbuf **frames, int max)
+{
+	cbuf *buf;
+	int count = 0;
+
+	mutex_lock(&i->tx_queue_lock);
+	while(count < max) {
+		buf = fixed_queue_dequeue(&i->tx_queue);
+		if(!buf)
+			break;
+
+#if LOSE_TX_PACKETS
+		if(rand() % 100 < LOSE_TX_PERCENTAGE) {
+			cbuf_free_chain(buf);
+			continue;
+		}
+#endif
+		frames[count++] = buf;
+	}
+	mutex_unlock(&i->tx_queue_lock);
+
+	return count;
+}
+
 static int if_tx_thread(void *args)
 {
 	ifnet *i = args;
-	cbuf *buf;
+	cbuf *frames[TX_BATCH_SIZE];
+	int count;
+	int j;
 	ssize_t len;
 
 	if(i->fd < 0)
@@ -221,33 +257,84 @@ static int if_tx_thread(void *args)
 	for(;;) {
  		sem_acquire(i->tx_queue_sem, 1);
 
-		for(;;) {
-	 		// pull a packet out of the queue
-			mutex_lock(&i->tx_queue_lock);
-			buf = fixed_queue_dequeue(&i->tx_queue);
-			mutex_unlock(&i->tx_queue_lock);
-			if(!buf)
-				break;
-
-#if LOSE_TX_PACKETS
-			if(rand() % 100 < LOSE_TX_PERCENTAGE) {
-				cbuf_free_chain(buf);
+		while((count = if_tx_dequeue(i, frames, TX_BATCH_SIZE)) > 0) {
+			// the driver takes the chains as they are
+			if(i->tx_hook.tx_frames) {
+#if NET_CHATTY
+				dprintf("if_tx_thread: sending %d packets\n", count);
+#endif
+				i->tx_hook.tx_frames(i->tx_hook.cookie, frames, count);
 				continue;
 			}
+
+			for(j = 0; j < count; j++) {
+				// put the cbuf chain into a flat buffer
+				len = cbuf_get_len(frames[j]);
+				cbuf_memcpy_from_chain(i->tx_buf, frames[j], 0, len);
+
+				cbuf_free_chain(frames[j]);
+
+#if NET_CHATTY
+				dprintf("if_tx_thread: sending packet size %Ld\n", (long long)len);
 #endif
+				sys_write(i->fd, i->tx_buf, 0, len);
+			}
+		}
+	}
+}
 
-			// put the cbuf chain into a flat buffer
-			len = cbuf_get_len(buf);
-			cbuf_memcpy_from_chain(i->tx_buf, buf, 0, len);
+// pass a received frame on to the link layer by way of the receive queues, which take ownership of it
+static void if_rx_input(ifnet *i, cbuf *b)
+{
+	int ip_offset;
 
-			cbuf_free_chain(buf);
+#if LOSE_RX_PACKETS
+	if(rand() % 100 < LOSE_RX_PERCENTAGE) {
+		dprintf("if_rx_input: purposely lost packet, size %ld\n", cbuf_get_len(b));
+		cbuf_free_chain(b);
+		return;
+	}
+#endif
+
+	// check to see if we have a link layer address attached to us
+	if(!i->link_addr) {
+#if NET_CHATTY
+		dprintf("if_rx_input: dumping packet because of no link address (%p)\n", i);
+#endif
+		cbuf_free_chain(b);
+		return;
+	}
+
+	// the link layer knows where the ip header is, which is what the flow hash needs
+	ip_offset = -1;
+	if(i->type == IF_TYPE_ETHERNET)
+		ip_offset = ethernet_ip_offset(b);
+
+	net_rx_queue_packet(b, i, i->link_input, ip_offset);
+}
+
+// the driver hands over frames in cbufs it received them into, a batch at a time
+static int if_rx_hook_thread(ifnet *i)
+{
+	cbuf *frames[RX_BATCH_SIZE];
+	int count;
+	int j;
 
+	for(;;) {
+		count = i->rx_hook.rx_frames(i->rx_hook.cookie, frames, RX_BATCH_SIZE);
 #if NET_CHATTY
-		dprintf("if_tx_thread: sending packet size %Ld\n", (long long)len);
+		dprintf("if_rx_hook_thread: got %d ethernet packets\n", count);
 #endif
-			sys_write(i->fd, i->tx_buf, 0, len);
+		if(count < 0) {
+			thread_snooze(10000);
+			continue;
 		}
+
+		for(j = 0; j < count; j++)
+			if_rx_input(i, frames[j]);
 	}
+
+	return 0;
 }
 
 static int if_rx_thread(void *args)
@@ -258,6 +345,9 @@ static int if_rx_thread(void *args)
 	if(i->fd < 0)
 		return -1;
 
+	if(i->rx_hook.rx_frames)
+		return if_rx_hook_thread(i);
+
 	for(;;) {
 		ssize_t len;
 
@@ -272,21 +362,6 @@ static int if_rx_thread(void *args)
 		if(len == 0)
 			continue;
 
-#if LOSE_RX_PACKETS
-		if(rand() % 100 < LOSE_RX_PERCENTAGE) {
-			dprintf("if_rx_thread: purposely lost packet, size %d\n", len);
-			continue;
-		}
-#endif
-
-		// check to see if we have a link layer address attached to us
-		if(!i->link_addr) {
-#if NET_CHATTY
-			dprintf("if_rx_thread: dumping packet because of no link address (%p)\n", i);
-#endif
-			continue;
-		}
-
 		// for now just move it over into a cbuf
 		b = cbuf_get_chain(len);
 		if(!b) {
@@ -295,7 +370,7 @@ static int if_rx_thread(void *args)
 		}
 		cbuf_memcpy_to_chain(b, 0, i->rx_buf, len);
 
-		i->link_input(b, i);
+		if_rx_input(i, b);
 	}
 
 	return 0;
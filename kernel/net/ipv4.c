@@ -36,22 +36,6 @@ typedef struct ipv4_header {
 #define IPV4_FLAG_MAY_NOT_FRAG 0x4000
 #define IPV4_FRAG_OFFSET_MASK  0x1fff
 
-typedef struct ipv4_routing_entry {
-	struct ipv4_routing_entry *next;
-	ipv4_addr network_addr;
-	ipv4_addr netmask;
-	ipv4_addr gw_addr;
-	ipv4_addr if_addr;
-	if_id interface_id;
-	int flags;
-} ipv4_routing_entry;
-
-#define ROUTE_FLAGS_GW 1
-
-// routing table
-static ipv4_routing_entry *route_table;
-static mutex route_table_mutex;
-
 typedef struct ipv4_fragment {
 	struct ipv4_fragment *hash_next;
 	struct ipv4_fragment *frag_next;
@@ -175,115 +159,30 @@ static void ipv4_frag_killer(void *unused)
 	}
 }
 
-static int ipv4_route_add_etc(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num, int flags, ipv4_addr gw_addr)
-{
-	ipv4_routing_entry *e;
-	ipv4_routing_entry *temp;
-	ipv4_routing_entry *last;
-
-	// make sure the netmask makes sense
-	if((netmask | (netmask - 1)) != 0xffffffff) {
-		return ERR_INVALID_ARGS;
-	}
-
-	e = kmalloc(sizeof(ipv4_routing_entry));
-	if(!e)
-		return ERR_NO_MEMORY;
-
-	e->network_addr = network_addr;
-	e->netmask = netmask;
-	e->gw_addr = gw_addr;
-	e->if_addr = if_addr;
-	e->interface_id = interface_num;
-	e->flags = flags;
-
-	mutex_lock(&route_table_mutex);
-
-	// add it to the list, sorted by netmask 'completeness'
-	last = NULL;
-	for(temp = route_table; temp; temp = temp->next) {
-		if((netmask | e->netmask) == e->netmask) {
-			// insert our route entry here
-			break;
-		}
-		last = temp;
-	}
-	if(last)
-		last->next = e;
-	else
-		route_table = e;
-	e->next = temp;
-
-	mutex_unlock(&route_table_mutex);
-
-	return NO_ERROR;
-}
-
-int ipv4_route_add(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num)
-{
-	return ipv4_route_add_etc(network_addr, netmask, if_addr, interface_num, 0, 0);
-}
-
-int ipv4_route_add_gateway(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num, ipv4_addr gw_addr)
-{
-	return ipv4_route_add_etc(network_addr, netmask, if_addr, interface_num, ROUTE_FLAGS_GW, gw_addr);
-}
-
-static int ipv4_route_match(ipv4_addr ip_addr, if_id *interface_num, ipv4_addr *target_addr, ipv4_addr *if_addr)
+int ipv4_lookup_srcaddr_for_dest(ipv4_addr dest_addr, ipv4_addr *src_addr)
 {
-	ipv4_routing_entry *e;
-	ipv4_routing_entry *last_e = NULL;
+	ipv4_route_cache route;
 	int err;
 
-	// walk through the routing table, finding the last entry to match
-	mutex_lock(&route_table_mutex);
-	for(e = route_table; e; e = e->next) {
-		ipv4_addr masked_addr = ip_addr & e->netmask;
-		if(masked_addr == e->network_addr)
-			last_e = e;
-	}
-
-	if(last_e) {
-		*interface_num = last_e->interface_id;
-		*if_addr = last_e->if_addr;
-		if(last_e->flags & ROUTE_FLAGS_GW) {
-			*target_addr = last_e->gw_addr;
-		} else {
-			*target_addr = ip_addr;
-		}
-		err = NO_ERROR;
-	} else {
-		*interface_num = -1;
-		*target_addr = 0;
-		*if_addr = 0;
-		err = ERR_NET_NO_ROUTE;
-	}
-	mutex_unlock(&route_table_mutex);
+	ipv4_route_cache_init(&route);
+	err = ipv4_route_lookup(dest_addr, &route);
+	*src_addr = route.if_addr;
 
 	return err;
 }
 
-int ipv4_lookup_srcaddr_for_dest(ipv4_addr dest_addr, ipv4_addr *src_addr)
-{
-	if_id id;
-	ipv4_addr target_addr;
-
-	return ipv4_route_match(dest_addr, &id, &target_addr, src_addr);
-}
-
 int ipv4_get_mss_for_dest(ipv4_addr dest_addr, uint32 *mss)
 {
-	if_id id;
+	ipv4_route_cache route;
 	ifnet *i;
-	ipv4_addr target_addr;
-	ipv4_addr src_addr;
 	int err;
 
-	err = ipv4_route_match(dest_addr, &id, &target_addr, &src_addr);
+	ipv4_route_cache_init(&route);
+	err = ipv4_route_lookup(dest_addr, &route);
 	if(err < 0)
 		return err;
 
-	i = if_id_to_ifnet(id);
+	i = if_id_to_ifnet(route.interface_id);
 	if(i == NULL)
 		return ERR_NET_NO_ROUTE;
 
@@ -309,11 +208,17 @@ static void ipv4_arp_callback(int arp_code, void *args, ifnet *i, netaddr *link_
 }
 
 int ipv4_output(cbuf *buf, ipv4_addr target_addr, int protocol)
+{
+	return ipv4_output_route(buf, target_addr, protocol, NULL);
+}
+
+// route is the caller's cached route for target_addr, if it keeps one
+int ipv4_output_route(cbuf *buf, ipv4_addr target_addr, int protocol, ipv4_route_cache *route)
 {
 	cbuf *header_buf;
 	ipv4_header *header;
 	netaddr link_addr;
-	if_id iid;
+	ipv4_route_cache local_route;
 	ifnet *i;
 	ipv4_addr transmit_addr;
 	ipv4_addr if_addr;
@@ -330,12 +235,18 @@ int ipv4_output(cbuf *buf, ipv4_addr target_addr, int protocol)
 #endif
 
 	// figure out what interface we will send this over
-	err = ipv4_route_match(target_addr, &iid, &transmit_addr, &if_addr);
+	if(route == NULL) {
+		ipv4_route_cache_init(&local_route);
+		route = &local_route;
+	}
+	err = ipv4_route_lookup(target_addr, route);
 	if(err < 0) {
 		cbuf_free_chain(buf);
 		return ERR_NO_MEMORY;
 	}
-	i = if_id_to_ifnet(iid);
+	transmit_addr = route->target_addr;
+	if_addr = route->if_addr;
+	i = if_id_to_ifnet(route->interface_id);
 	if(!i) {
 		cbuf_free_chain(buf);
 		return ERR_NO_MEMORY;
@@ -346,7 +257,7 @@ int ipv4_output(cbuf *buf, ipv4_addr target_addr, int protocol)
 	if(len + sizeof(ipv4_header) > i->mtu)
 		must_frag = true;
 
-//	dprintf("did route match, result iid %d, i 0x%x, transmit_addr 0x%x, if_addr 0x%x\n", iid, i, transmit_addr, if_addr);
+//	dprintf("did route match, result iid %d, i 0x%x, transmit_addr 0x%x, if_addr 0x%x\n", route->interface_id, i, transmit_addr, if_addr);
 
 	identification = atomic_add(&curr_identification, 1);
 	identification = htons(identification);
@@ -794,10 +705,9 @@ out:
 
 int ipv4_init(void)
 {
-	mutex_init(&route_table_mutex, "ipv4 routing table mutex");
+	ipv4_route_init();
 	mutex_init(&frag_table_mutex, "ipv4 fragment table mutex");
 
-	route_table = NULL;
 	curr_identification = system_time();
 
 	frag_table = hash_init(256, offsetof(ipv4_fragment, hash_next),
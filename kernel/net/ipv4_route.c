@@ -0,0 +1,535 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/debug.h>
+#include <kernel/lock.h>
+#include <kernel/heap.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/vm.h>
+#include <kernel/arch/cpu.h>
+#include <kernel/net/misc.h>
+#include <kernel/net/if.h>
+#include <kernel/net/ipv4.h>
+#include <newos/errors.h>
+#include <string.h>
+
+// The routing table is a path compressed binary trie keyed on the network
+// prefix, so a lookup is a walk down at most 33 nodes that remembers the
+// last node with a route on it: the longest matching prefix.
+//
+// Lookups don't take any locks. Writers serialize on route_table_mutex,
+// fill in new nodes completely before linking them in, and never touch a
+// node once it's been unlinked. Unlinked nodes and routes are freed after
+// every cpu has been seen outside of a lookup, tracked by a per-cpu
+// sequence number that's odd while a lookup is running on that cpu.
+
+typedef struct ipv4_routing_entry {
+	ipv4_addr network_addr;
+	ipv4_addr netmask;
+	ipv4_addr gw_addr;
+	ipv4_addr if_addr;
+	if_id interface_id;
+	int flags;
+} ipv4_routing_entry;
+
+typedef struct route_node {
+	struct route_node *child[2];
+	ipv4_addr prefix;
+	int prefix_len;
+	ipv4_routing_entry *route; // route for exactly this prefix, if there is one
+	struct route_node *free_next;
+} route_node;
+
+struct route_cpu {
+	volatile int seq;
+	uint64 lookups;
+	uint64 cache_hits;
+	uint64 cache_misses;
+	uint64 no_route;
+} _ALIGNED(64);
+
+static route_node * volatile route_root;
+static mutex route_table_mutex;
+static int route_generation;
+static int route_count;
+static int route_node_count;
+static struct route_cpu route_cpus[_MAX_CPUS];
+
+#define PREFIX_MASK(len) ((len) == 0 ? 0 : (0xffffffff << (32 - (len))))
+#define PREFIX_BIT(addr, bit) (((addr) >> (31 - (bit))) & 1)
+
+static struct route_cpu *route_read_begin(void)
+{
+	struct route_cpu *rc;
+
+	// no preemption in the middle of a lookup, so the seq stays on this cpu
+	int_disable_interrupts();
+	rc = &route_cpus[smp_get_current_cpu()];
+	atomic_add(&rc->seq, 1);
+	return rc;
+}
+
+static void route_read_end(struct route_cpu *rc)
+{
+	atomic_add(&rc->seq, 1);
+	int_restore_interrupts();
+}
+
+// wait until every lookup that could have seen the old trie is done
+static void route_synchronize(void)
+{
+	int seq[_MAX_CPUS];
+	int num_cpus = smp_get_num_cpus();
+	int i;
+
+	arch_cpu_memory_barrier();
+	for(i = 0; i < num_cpus; i++)
+		seq[i] = route_cpus[i].seq;
+	for(i = 0; i < num_cpus; i++) {
+		if((seq[i] & 1) == 0)
+			continue;
+		while(route_cpus[i].seq == seq[i])
+			;
+	}
+}
+
+static route_node *route_node_create(ipv4_addr prefix, int prefix_len, ipv4_routing_entry *route)
+{
+	route_node *n;
+
+	n = kmalloc(sizeof(route_node));
+	if(n == NULL)
+		return NULL;
+
+	n->child[0] = n->child[1] = NULL;
+	n->prefix = prefix & PREFIX_MASK(prefix_len);
+	n->prefix_len = prefix_len;
+	n->route = route;
+	n->free_next = NULL;
+	route_node_count++;
+	return n;
+}
+
+// how many of the leading bits the two prefixes have in common
+static int common_prefix_len(ipv4_addr a, int a_len, ipv4_addr b, int b_len)
+{
+	ipv4_addr diff = a ^ b;
+	int len = min(a_len, b_len);
+	int i;
+
+	for(i = 0; i < len; i++) {
+		if(diff & (0x80000000 >> i))
+			break;
+	}
+	return i;
+}
+
+// returns the route that was replaced, if any
+static int route_trie_insert(ipv4_routing_entry *e, int prefix_len, ipv4_routing_entry **old)
+{
+	route_node * volatile *link = &route_root;
+	ipv4_addr prefix = e->network_addr;
+	route_node *n;
+	route_node *new_node;
+	route_node *branch;
+	int common;
+
+	*old = NULL;
+
+	for(;;) {
+		n = *link;
+		if(n == NULL) {
+			new_node = route_node_create(prefix, prefix_len, e);
+			if(new_node == NULL)
+				return ERR_NO_MEMORY;
+			arch_cpu_memory_barrier();
+			*link = new_node;
+			return NO_ERROR;
+		}
+
+		common = common_prefix_len(prefix, prefix_len, n->prefix, n->prefix_len);
+		if(common == n->prefix_len && common == prefix_len) {
+			// there's already a node for this prefix
+			*old = n->route;
+			arch_cpu_memory_barrier();
+			n->route = e;
+			return NO_ERROR;
+		}
+		if(common == n->prefix_len) {
+			// this node's prefix covers ours, keep going
+			link = &n->child[PREFIX_BIT(prefix, n->prefix_len)];
+			continue;
+		}
+
+		if(common == prefix_len) {
+			// the new node goes above this one
+			new_node = route_node_create(prefix, prefix_len, e);
+			if(new_node == NULL)
+				return ERR_NO_MEMORY;
+			new_node->child[PREFIX_BIT(n->prefix, prefix_len)] = n;
+			arch_cpu_memory_barrier();
+			*link = new_node;
+			return NO_ERROR;
+		}
+
+		// the prefixes diverge partway through this node, branch off above it
+		new_node = route_node_create(prefix, prefix_len, e);
+		if(new_node == NULL)
+			return ERR_NO_MEMORY;
+		branch = route_node_create(prefix, common, NULL);
+		if(branch == NULL) {
+			kfree(new_node);
+			route_node_count--;
+			return ERR_NO_MEMORY;
+		}
+		branch->child[PREFIX_BIT(prefix, common)] = new_node;
+		branch->child[PREFIX_BIT(n->prefix, common)] = n;
+		arch_cpu_memory_barrier();
+		*link = branch;
+		return NO_ERROR;
+	}
+}
+
+// unhooks the route at the given prefix and any nodes that become useless.
+// A netmask of 0 with a nonzero address picks the most specific route for
+// that network address.
+static int route_trie_remove(ipv4_addr network_addr, ipv4_addr netmask, ipv4_routing_entry **_old, route_node **free_list)
+{
+	route_node * volatile *links[33];
+	route_node * volatile *link = &route_root;
+	route_node *n;
+	int depth = 0;
+	int found = -1;
+	int prefix_len = -1;
+	int i;
+
+	if(netmask != 0 || network_addr == 0) {
+		prefix_len = 0;
+		while(prefix_len < 32 && (netmask & (0x80000000 >> prefix_len)))
+			prefix_len++;
+	}
+
+	// walk down towards the address, remembering the way back up
+	while((n = *link) != NULL) {
+		if((network_addr ^ n->prefix) & PREFIX_MASK(n->prefix_len))
+			break;
+		links[depth] = link;
+		if(n->route) {
+			if(prefix_len >= 0 ? n->prefix_len == prefix_len : n->prefix == network_addr)
+				found = depth;
+		}
+		depth++;
+		if(n->prefix_len == 32 || (prefix_len >= 0 && n->prefix_len >= prefix_len))
+			break;
+		link = &n->child[PREFIX_BIT(network_addr, n->prefix_len)];
+	}
+	if(found < 0)
+		return ERR_NOT_FOUND;
+
+	n = *links[found];
+	*_old = n->route;
+	n->route = NULL;
+
+	// prune from the node we emptied up, leaving nodes that still branch or route
+	for(i = found; i >= 0; i--) {
+		route_node * volatile *l = links[i];
+		route_node *node = *l;
+
+		if(node->route != NULL || (node->child[0] != NULL && node->child[1] != NULL))
+			break;
+
+		*l = node->child[0] ? node->child[0] : node->child[1];
+		node->free_next = *free_list;
+		*free_list = node;
+		route_node_count--;
+	}
+
+	return NO_ERROR;
+}
+
+static int ipv4_route_add_etc(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num, int flags, ipv4_addr gw_addr)
+{
+	ipv4_routing_entry *e;
+	ipv4_routing_entry *old;
+	int prefix_len;
+	int err;
+
+	// make sure the netmask makes sense
+	if((netmask | (netmask - 1)) != 0xffffffff) {
+		return ERR_INVALID_ARGS;
+	}
+	prefix_len = 0;
+	while(prefix_len < 32 && (netmask & (0x80000000 >> prefix_len)))
+		prefix_len++;
+
+	e = kmalloc(sizeof(ipv4_routing_entry));
+	if(!e)
+		return ERR_NO_MEMORY;
+
+	e->network_addr = network_addr & netmask;
+	e->netmask = netmask;
+	e->gw_addr = gw_addr;
+	e->if_addr = if_addr;
+	e->interface_id = interface_num;
+	e->flags = flags;
+
+	mutex_lock(&route_table_mutex);
+
+	err = route_trie_insert(e, prefix_len, &old);
+	if(err < 0) {
+		mutex_unlock(&route_table_mutex);
+		kfree(e);
+		return err;
+	}
+	if(old == NULL)
+		route_count++;
+	atomic_add(&route_generation, 1);
+
+	// a route for the same prefix was replaced, free it once nobody can be looking at it
+	if(old) {
+		route_synchronize();
+		kfree(old);
+	}
+
+	mutex_unlock(&route_table_mutex);
+
+	return NO_ERROR;
+}
+
+int ipv4_route_add(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num)
+{
+	return ipv4_route_add_etc(network_addr, netmask, if_addr, interface_num, 0, 0);
+}
+
+int ipv4_route_add_gateway(ipv4_addr network_addr, ipv4_addr netmask, ipv4_addr if_addr, if_id interface_num, ipv4_addr gw_addr)
+{
+	return ipv4_route_add_etc(network_addr, netmask, if_addr, interface_num, ROUTE_FLAGS_GW, gw_addr);
+}
+
+int ipv4_route_delete(ipv4_addr network_addr, ipv4_addr netmask)
+{
+	ipv4_routing_entry *old;
+	route_node *free_list = NULL;
+	route_node *n;
+	int err;
+
+	mutex_lock(&route_table_mutex);
+
+	err = route_trie_remove(network_addr, netmask, &old, &free_list);
+	if(err >= 0) {
+		route_count--;
+		atomic_add(&route_generation, 1);
+
+		route_synchronize();
+		kfree(old);
+		while(free_list) {
+			n = free_list;
+			free_list = n->free_next;
+			kfree(n);
+		}
+	}
+
+	mutex_unlock(&route_table_mutex);
+
+	return err;
+}
+
+void ipv4_route_cache_init(ipv4_route_cache *cache)
+{
+	cache->dest_addr = 0;
+	cache->generation = -1;
+	cache->interface_id = -1;
+	cache->target_addr = 0;
+	cache->if_addr = 0;
+}
+
+int ipv4_route_lookup(ipv4_addr dest_addr, ipv4_route_cache *cache)
+{
+	struct route_cpu *rc;
+	ipv4_routing_entry *e;
+	ipv4_routing_entry *best;
+	route_node *n;
+	int generation;
+	int err;
+
+	// read the generation first, a change that races with the walk just
+	// makes the next lookup miss
+	generation = route_generation;
+	if(cache->generation == generation && cache->dest_addr == dest_addr) {
+		int_disable_interrupts();
+		route_cpus[smp_get_current_cpu()].cache_hits++;
+		int_restore_interrupts();
+		return NO_ERROR;
+	}
+
+	rc = route_read_begin();
+
+	rc->lookups++;
+	if(cache->generation >= 0)
+		rc->cache_misses++;
+
+	best = NULL;
+	n = route_root;
+	while(n != NULL) {
+		if((dest_addr ^ n->prefix) & PREFIX_MASK(n->prefix_len))
+			break;
+		e = n->route;
+		if(e != NULL)
+			best = e;
+		if(n->prefix_len == 32)
+			break;
+		n = n->child[PREFIX_BIT(dest_addr, n->prefix_len)];
+	}
+
+	if(best) {
+		cache->dest_addr = dest_addr;
+		cache->generation = generation;
+		cache->interface_id = best->interface_id;
+		cache->if_addr = best->if_addr;
+		if(best->flags & ROUTE_FLAGS_GW)
+			cache->target_addr = best->gw_addr;
+		else
+			cache->target_addr = dest_addr;
+		err = NO_ERROR;
+	} else {
+		rc->no_route++;
+		ipv4_route_cache_init(cache);
+		err = ERR_NET_NO_ROUTE;
+	}
+
+	route_read_end(rc);
+
+	return err;
+}
+
+static int route_list_node(route_node *n, struct _ioctl_net_route_entry *user_entries, int max_entries, int count)
+{
+	struct _ioctl_net_route_entry entry;
+	ifnet *i;
+
+	if(n == NULL)
+		return count;
+
+	if(n->route) {
+		if(count < max_entries) {
+			ipv4_routing_entry *e = n->route;
+
+			memset(&entry, 0, sizeof(entry));
+			entry.net_addr.len = entry.mask_addr.len = entry.if_addr.len = entry.gw_addr.len = 4;
+			entry.net_addr.type = entry.mask_addr.type = entry.if_addr.type = entry.gw_addr.type = ADDR_TYPE_IP;
+			NETADDR_TO_IPV4(entry.net_addr) = e->network_addr;
+			NETADDR_TO_IPV4(entry.mask_addr) = e->netmask;
+			NETADDR_TO_IPV4(entry.if_addr) = e->if_addr;
+			NETADDR_TO_IPV4(entry.gw_addr) = e->gw_addr;
+			entry.flags = e->flags;
+			i = if_id_to_ifnet(e->interface_id);
+			if(i)
+				strlcpy(entry.if_name, i->path, sizeof(entry.if_name));
+
+			if(user_memcpy(&user_entries[count], &entry, sizeof(entry)) < 0)
+				return ERR_VM_BAD_USER_MEMORY;
+		}
+		count++;
+	}
+
+	count = route_list_node(n->child[0], user_entries, max_entries, count);
+	if(count < 0)
+		return count;
+	return route_list_node(n->child[1], user_entries, max_entries, count);
+}
+
+// copies out up to max_entries routes in prefix order, returns how many there are
+int ipv4_route_list(struct _ioctl_net_route_entry *user_entries, int max_entries)
+{
+	int count;
+
+	mutex_lock(&route_table_mutex);
+	count = route_list_node(route_root, user_entries, max_entries, 0);
+	mutex_unlock(&route_table_mutex);
+
+	return count;
+}
+
+void ipv4_route_get_stats(struct _ioctl_net_route_stats *stats)
+{
+	int i;
+
+	memset(stats, 0, sizeof(*stats));
+
+	mutex_lock(&route_table_mutex);
+	stats->routes = route_count;
+	stats->nodes = route_node_count;
+	stats->generation = route_generation;
+	mutex_unlock(&route_table_mutex);
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		stats->lookups += route_cpus[i].lookups;
+		stats->cache_hits += route_cpus[i].cache_hits;
+		stats->cache_misses += route_cpus[i].cache_misses;
+		stats->no_route += route_cpus[i].no_route;
+	}
+}
+
+static void route_dump_node(route_node *n, int depth)
+{
+	ipv4_routing_entry *e;
+	int i;
+
+	if(n == NULL)
+		return;
+
+	for(i = 0; i < depth; i++)
+		dprintf("  ");
+	dump_ipv4_addr(n->prefix);
+	dprintf("/%d", n->prefix_len);
+	e = n->route;
+	if(e) {
+		dprintf(" if %d src ", e->interface_id);
+		dump_ipv4_addr(e->if_addr);
+		if(e->flags & ROUTE_FLAGS_GW) {
+			dprintf(" gw ");
+			dump_ipv4_addr(e->gw_addr);
+		}
+	}
+	dprintf("\n");
+
+	route_dump_node(n->child[0], depth + 1);
+	route_dump_node(n->child[1], depth + 1);
+}
+
+static void dbg_dump_routes(int argc, char **argv)
+{
+	struct _ioctl_net_route_stats stats;
+	int i;
+
+	memset(&stats, 0, sizeof(stats));
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		stats.lookups += route_cpus[i].lookups;
+		stats.cache_hits += route_cpus[i].cache_hits;
+		stats.cache_misses += route_cpus[i].cache_misses;
+		stats.no_route += route_cpus[i].no_route;
+	}
+
+	dprintf("%d routes in %d nodes, generation %d\n", route_count, route_node_count, route_generation);
+	dprintf("%Ld lookups, %Ld cache hits, %Ld cache misses, %Ld with no route\n",
+		stats.lookups, stats.cache_hits, stats.cache_misses, stats.no_route);
+	route_dump_node(route_root, 0);
+}
+
+int ipv4_route_init(void)
+{
+	mutex_init(&route_table_mutex, "ipv4 routing table mutex");
+
+	route_root = NULL;
+	route_generation = 0;
+	route_count = 0;
+	route_node_count = 0;
+	memset(route_cpus, 0, sizeof(route_cpus));
+
+	dbg_add_command(&dbg_dump_routes, "routes", "dump the ipv4 routing table");
+
+	return 0;
+}
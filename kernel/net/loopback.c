@@ -10,24 +10,8 @@
 #include <kernel/net/ethernet.h>
 #include <kernel/net/ipv4.h>
 #include <kernel/net/arp.h>
-
-static int _loopback_input(cbuf *buf, ifnet *i, int protocol_type)
-{
-	int err;
-
-	switch(protocol_type) {
-		case PROT_TYPE_IPV4:
-			err = ipv4_input(buf, i);
-			break;
-		case PROT_TYPE_ARP:
-			err = arp_input(buf, i);
-			break;
-		default:
-			err = -1;
-	}
-
-	return err;
-}
+#include <kernel/net/net_rx.h>
+#include <stdlib.h>
 
 int loopback_input(cbuf *buf, ifnet *i)
 {
@@ -38,9 +22,23 @@ int loopback_input(cbuf *buf, ifnet *i)
 
 int loopback_output(cbuf *buf, ifnet *i, netaddr *target, int protocol_type)
 {
-	_loopback_input(buf, i, protocol_type);
+#if LOSE_TX_PACKETS
+	if(rand() % 100 < LOSE_TX_PERCENTAGE) {
+		cbuf_free_chain(buf);
+		return NO_ERROR;
+	}
+#endif
 
-	return NO_ERROR;
+	// the other end picks it up on one of the receive threads, same as a real interface
+	switch(protocol_type) {
+		case PROT_TYPE_IPV4:
+			return net_rx_queue_packet(buf, i, &ipv4_input, 0);
+		case PROT_TYPE_ARP:
+			return net_rx_queue_packet(buf, i, &arp_input, -1);
+		default:
+			cbuf_free_chain(buf);
+			return NO_ERROR;
+	}
 }
 
 int loopback_init(void)
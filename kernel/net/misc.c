@@ -5,25 +5,17 @@
 #include <kernel/ktypes.h>
 #include <kernel/debug.h>
 #include <kernel/net/misc.h>
+#include <kernel/net/ones_sum.h>
 #include <string.h>
 
-uint16 ones_sum16(uint32 sum, const void *_buf, int len)
+#ifndef _ARCH_ONES_SUM
+#define _ARCH_ONES_SUM(sum, buf, len) ones_sum_generic(sum, buf, len)
+#endif
+
+uint16 ones_sum16(uint32 sum, const void *buf, int len)
 {
-	const uint16 *buf = _buf;
-
-	while(len >= 2) {
-		sum += *buf++;
-		if(sum & 0x80000000)
-			sum = (sum & 0xffff) + (sum >> 16);
-		len -= 2;
-	}
-
-	if (len) {
-		uint8 temp[2];
-		temp[0] = *(uint8 *) buf;
-		temp[1] = 0;
-		sum += *(uint16 *) temp;
-	}
+	if(len > 0)
+		sum = _ARCH_ONES_SUM(sum, buf, len);
 
 	while(sum >> 16)
 		sum = (sum & 0xffff) + (sum >> 16);
@@ -31,6 +23,13 @@ uint16 ones_sum16(uint32 sum, const void *_buf, int len)
 	return sum;
 }
 
+uint16 ones_sum16_add(uint16 sum1, uint16 sum2)
+{
+	uint32 sum = (uint32)sum1 + sum2;
+
+	return (sum & 0xffff) + (sum >> 16);
+}
+
 uint16 cksum16(void *_buf, int len)
 {
 	return ~ones_sum16(0, _buf, len);
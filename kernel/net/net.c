@@ -11,6 +11,7 @@
 #include <kernel/net/net.h>
 #include <kernel/net/net_control.h>
 #include <kernel/net/net_timer.h>
+#include <kernel/net/net_rx.h>
 #include <kernel/net/if.h>
 #include <kernel/net/ethernet.h>
 #include <kernel/net/loopback.h>
@@ -201,6 +202,7 @@ int net_init(kernel_args *ka)
 	dprintf("net_init: entry\n");
 
 	net_timer_init();
+	net_rx_init();
 	if_init();
 	ethernet_init();
 	arp_init();
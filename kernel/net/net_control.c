@@ -17,6 +17,7 @@
 #include <kernel/net/ipv4.h>
 #include <kernel/net/udp.h>
 #include <kernel/net/tcp.h>
+#include <kernel/net/tcp_cc.h>
 #include <kernel/net/socket.h>
 #include <kernel/net/misc.h>
 #include <string.h>
@@ -58,6 +59,7 @@ static int net_control_dev_ioctl(dev_cookie cookie, int op, void *buf, size_t le
 	union {
 		struct _ioctl_net_if_control_struct if_control;
 		struct _ioctl_net_route_struct route_control;
+		struct _ioctl_net_tcp_cc tcp_cc;
 	} u;
 
 	TRACE("ioctl: op %d, buf %p, len %ld\n", op, buf, len);
@@ -88,6 +90,12 @@ static int net_control_dev_ioctl(dev_cookie cookie, int op, void *buf, size_t le
 				u.route_control.if_name, NETADDR_TO_IPV4(u.route_control.if_addr),
 				NETADDR_TO_IPV4(u.route_control.mask_addr), NETADDR_TO_IPV4(u.route_control.net_addr));
 			break;
+		case IOCTL_NET_CONTROL_TCP_SET_CC:
+			err = user_memcpy(&u.tcp_cc, buf, sizeof(u.tcp_cc));
+			if(err < 0)
+				goto out;
+			u.tcp_cc.name[sizeof(u.tcp_cc.name) - 1] = 0;
+			break;
 	}
 
 	/* do the operation */
@@ -148,12 +156,12 @@ static int net_control_dev_ioctl(dev_cookie cookie, int op, void *buf, size_t le
 
 				if(NETADDR_TO_IPV4(u.route_control.mask_addr) == 0) {
 					/* this is a default gateway route */
-					ipv4_route_add_gateway(0, 0,
+					err = ipv4_route_add_gateway(0, 0,
 						NETADDR_TO_IPV4(u.route_control.if_addr), i->id,
 						NETADDR_TO_IPV4(u.route_control.net_addr));
 				} else {
 					/* regular ol' route */
-					ipv4_route_add(NETADDR_TO_IPV4(u.route_control.net_addr),
+					err = ipv4_route_add(NETADDR_TO_IPV4(u.route_control.net_addr),
 						NETADDR_TO_IPV4(u.route_control.mask_addr),
 						NETADDR_TO_IPV4(u.route_control.if_addr), i->id);
 				}
@@ -161,13 +169,45 @@ static int net_control_dev_ioctl(dev_cookie cookie, int op, void *buf, size_t le
 				err = ERR_UNIMPLEMENTED;
 				break;
 			}
-
-			err = NO_ERROR;
 			break;
 		}
 		case IOCTL_NET_CONTROL_ROUTE_DELETE:
+			if(u.route_control.net_addr.type != ADDR_TYPE_IP) {
+				err = ERR_UNIMPLEMENTED;
+				break;
+			}
+
+			err = ipv4_route_delete(NETADDR_TO_IPV4(u.route_control.net_addr),
+				NETADDR_TO_IPV4(u.route_control.mask_addr));
+			break;
 		case IOCTL_NET_CONTROL_ROUTE_LIST:
-			err = ERR_UNIMPLEMENTED;
+			/* fills in as many entries as fit, returns the total */
+			err = ipv4_route_list(buf, len / sizeof(struct _ioctl_net_route_entry));
+			break;
+		case IOCTL_NET_CONTROL_ROUTE_STATS: {
+			struct _ioctl_net_route_stats stats;
+
+			if(len < sizeof(stats)) {
+				err = ERR_INVALID_ARGS;
+				break;
+			}
+
+			ipv4_route_get_stats(&stats);
+			err = user_memcpy(buf, &stats, sizeof(stats));
+			break;
+		}
+		case IOCTL_NET_CONTROL_TCP_SET_CC:
+			err = tcp_cc_set_default(u.tcp_cc.name);
+			break;
+		case IOCTL_NET_CONTROL_TCP_GET_CC:
+			if(len < sizeof(u.tcp_cc)) {
+				err = ERR_INVALID_ARGS;
+				break;
+			}
+
+			memset(&u.tcp_cc, 0, sizeof(u.tcp_cc));
+			strlcpy(u.tcp_cc.name, tcp_cc_get_default()->name, sizeof(u.tcp_cc.name));
+			err = user_memcpy(buf, &u.tcp_cc, sizeof(u.tcp_cc));
 			break;
  		default:
 			err = ERR_INVALID_ARGS;
@@ -197,6 +237,8 @@ static struct dev_calls net_control_dev_hooks = {
 	&net_control_dev_write,
 	NULL,
 	NULL,
+	NULL,
+	/* no poll */
 	NULL
 };
 
@@ -0,0 +1,257 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/debug.h>
+#include <kernel/thread.h>
+#include <kernel/sem.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/cbuf.h>
+#include <kernel/arch/cpu.h>
+#include <kernel/net/net_rx.h>
+#include <kernel/net/misc.h>
+#include <newos/net.h>
+#include <string.h>
+#include <stdio.h>
+
+/*
+** Protocol processing for received packets is spread over a thread per cpu.
+** Each packet is hashed on its addresses, protocol and ports to pick a
+** queue, so everything belonging to one flow is handled by one thread in
+** the order it came in, while different flows go up the stack in parallel.
+**
+** A queue's thread only sleeps on its semaphore once it has drained the
+** queue, and only the packet that finds it asleep releases the semaphore,
+** so a busy queue takes one wakeup for a whole run of packets instead of
+** one per packet. While awake it pulls packets off in batches, a bit like
+** NAPI polling.
+**
+** With a single cpu there's nothing to spread the work over, so packets are
+** handled right away by whoever hands them in.
+*/
+
+#define NET_RX_QUEUE_SIZE 256
+
+// most packets pulled off of a queue at once
+#define NET_RX_BUDGET 32
+
+typedef struct net_rx_packet {
+	cbuf *buf;
+	ifnet *i;
+	net_rx_input_func input;
+} net_rx_packet;
+
+typedef struct net_rx_queue {
+	spinlock_t lock;
+	net_rx_packet packets[NET_RX_QUEUE_SIZE];
+	int head;
+	int tail;
+	int count;
+	bool idle; // the thread is, or is about to be, waiting on wakeup_sem
+	sem_id wakeup_sem;
+	thread_id thread;
+
+	// stats
+	uint64 queued;
+	uint64 dropped;
+	uint64 wakeups;
+	uint64 polls;
+	int max_count;
+} _ALIGNED(64) net_rx_queue;
+
+static net_rx_queue queues[_MAX_CPUS];
+static int num_queues;
+
+// the ipv4 header up through the addresses
+typedef struct net_rx_ipv4_header {
+	uint8 version_length;
+	uint8 tos;
+	uint16 total_length;
+	uint16 identification;
+	uint16 flags_frag_offset;
+	uint8 ttl;
+	uint8 protocol;
+	uint16 header_checksum;
+	ipv4_addr src;
+	ipv4_addr dest;
+} _PACKED net_rx_ipv4_header;
+
+#define IPV4_FLAG_MORE_FRAGS   0x2000
+#define IPV4_FRAG_OFFSET_MASK  0x1fff
+
+static unsigned int net_rx_flow_hash(cbuf *buf, int ip_offset)
+{
+	net_rx_ipv4_header header;
+	uint32 ports = 0;
+	uint32 hash;
+	int header_len;
+
+	if(ip_offset < 0)
+		return 0;
+	if(cbuf_memcpy_from_chain(&header, buf, ip_offset, sizeof(header)) < 0)
+		return 0;
+
+	// fragments past the first don't have the ports, so all of a fragmented
+	// packet has to go by the addresses alone to stay together
+	if((header.protocol == IP_PROT_TCP || header.protocol == IP_PROT_UDP)
+		&& (ntohs(header.flags_frag_offset) & (IPV4_FLAG_MORE_FRAGS | IPV4_FRAG_OFFSET_MASK)) == 0) {
+		header_len = (header.version_length & 0xf) * 4;
+		cbuf_memcpy_from_chain(&ports, buf, ip_offset + header_len, sizeof(ports));
+	}
+
+	hash = header.src ^ header.dest ^ ports ^ header.protocol;
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return hash;
+}
+
+int net_rx_queue_packet(cbuf *buf, ifnet *i, net_rx_input_func input, int ip_offset)
+{
+	net_rx_queue *q;
+	net_rx_packet *p;
+	bool wakeup = false;
+	bool dropped = false;
+
+	if(num_queues <= 1) {
+		input(buf, i);
+		return NO_ERROR;
+	}
+
+	q = &queues[net_rx_flow_hash(buf, ip_offset) % num_queues];
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->lock);
+
+	if(q->count == NET_RX_QUEUE_SIZE) {
+		q->dropped++;
+		dropped = true;
+	} else {
+		p = &q->packets[q->head];
+		p->buf = buf;
+		p->i = i;
+		p->input = input;
+		q->head = (q->head + 1) % NET_RX_QUEUE_SIZE;
+		q->count++;
+		q->queued++;
+		if(q->count > q->max_count)
+			q->max_count = q->count;
+
+		// only the first packet in after it went to sleep has to wake it up
+		if(q->idle) {
+			q->idle = false;
+			wakeup = true;
+		}
+	}
+
+	release_spinlock(&q->lock);
+	int_restore_interrupts();
+
+	if(dropped) {
+		cbuf_free_chain(buf);
+		return ERR_NO_MEMORY;
+	}
+
+	if(wakeup)
+		sem_release(q->wakeup_sem, 1);
+
+	return NO_ERROR;
+}
+
+// pull up to max packets off of the queue, marks it idle if there's nothing there
+static int net_rx_dequeue(net_rx_queue *q, net_rx_packet *packets, int max)
+{
+	int count = 0;
+
+	int_disable_interrupts();
+	acquire_spinlock(&q->lock);
+
+	while(count < max && q->count > 0) {
+		packets[count++] = q->packets[q->tail];
+		q->tail = (q->tail + 1) % NET_RX_QUEUE_SIZE;
+		q->count--;
+	}
+	if(count == 0)
+		q->idle = true;
+
+	release_spinlock(&q->lock);
+	int_restore_interrupts();
+
+	return count;
+}
+
+static int net_rx_thread(void *args)
+{
+	net_rx_queue *q = args;
+	net_rx_packet packets[NET_RX_BUDGET];
+	int count;
+	int j;
+
+	for(;;) {
+		sem_acquire(q->wakeup_sem, 1);
+		q->wakeups++;
+
+		// keep going until the queue runs dry
+		while((count = net_rx_dequeue(q, packets, NET_RX_BUDGET)) > 0) {
+			q->polls++;
+			for(j = 0; j < count; j++)
+				packets[j].input(packets[j].buf, packets[j].i);
+		}
+	}
+
+	return 0;
+}
+
+static void dump_rx_queues(int argc, char **argv)
+{
+	int j;
+
+	dprintf("%d receive queues\n", num_queues);
+	for(j = 0; j < num_queues; j++) {
+		dprintf("queue %d: thread 0x%x, count %d (max %d), queued %Ld, dropped %Ld, wakeups %Ld, polls %Ld\n",
+			j, queues[j].thread, queues[j].count, queues[j].max_count,
+			queues[j].queued, queues[j].dropped, queues[j].wakeups, queues[j].polls);
+	}
+}
+
+int net_rx_init(void)
+{
+	char name[SYS_MAX_NAME_LEN];
+	net_rx_queue *q;
+	int count;
+	int j;
+
+	memset(queues, 0, sizeof(queues));
+	num_queues = 0;
+
+	count = smp_get_num_cpus();
+	if(count <= 1)
+		return NO_ERROR;
+
+	for(j = 0; j < count; j++) {
+		q = &queues[j];
+
+		q->idle = true;
+		q->wakeup_sem = sem_create(0, "net_rx_queue_sem");
+		if(q->wakeup_sem < 0)
+			return q->wakeup_sem;
+
+		sprintf(name, "net_rx_queue_thread %d", j);
+		q->thread = thread_create_kernel_thread(name, &net_rx_thread, q);
+		if(q->thread < 0)
+			return q->thread;
+		thread_set_priority(q->thread, THREAD_MAX_RT_PRIORITY - 2);
+		thread_resume_thread(q->thread);
+	}
+
+	// nothing gets queued until they're all there
+	num_queues = count;
+
+	dbg_add_command(&dump_rx_queues, "net_rx_queues", "dump the per cpu receive queues");
+
+	return NO_ERROR;
+}
+
@@ -6,6 +6,7 @@
 #include <kernel/khash.h>
 #include <kernel/lock.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/arch/cpu.h>
 #include <kernel/net/udp.h>
 #include <kernel/net/tcp.h>
@@ -21,6 +22,7 @@ typedef struct netsocket {
 static netsocket *sock_table;
 static mutex sock_mutex;
 static sock_id next_sock_id;
+static object_cache *sock_cache;
 
 static int sock_compare_func(void *_s, const void *_key)
 {
@@ -61,7 +63,7 @@ static netsocket *create_netsocket(int type, void *prot_data)
 	netsocket *s;
 
 	// create the net socket
-	s = kmalloc(sizeof(netsocket));
+	s = object_cache_alloc(sock_cache);
 	if(!s)
 		return NULL;
 
@@ -84,7 +86,7 @@ static int destroy_netsocket(netsocket *s)
 	hash_remove(sock_table, s);
 	mutex_unlock(&sock_mutex);
 
-	kfree(s);
+	object_cache_free(sock_cache, s);
 
 	return 0;
 }
@@ -317,6 +319,28 @@ int socket_close(sock_id id)
 	return err;
 }
 
+int socket_poll(sock_id id, struct poll_waiter *waiter)
+{
+	netsocket *s;
+	int err;
+
+	s = lookup_socket(id);
+	if(!s)
+		return ERR_INVALID_HANDLE;
+
+	switch(s->type) {
+		case SOCK_PROTO_UDP:
+			err = udp_poll(s->prot_data, waiter);
+			break;
+		case SOCK_PROTO_TCP:
+			err = tcp_poll(s->prot_data, waiter);
+			break;
+		default:
+			err = ERR_INVALID_ARGS;
+	}
+	return err;
+}
+
 int socket_init(void)
 {
 	next_sock_id = 0;
@@ -327,6 +351,10 @@ int socket_init(void)
 	if(!sock_table)
 		return ERR_NO_MEMORY;
 
+	sock_cache = object_cache_create("netsocket", sizeof(netsocket), 0, NULL, NULL, NULL);
+	if(!sock_cache)
+		return ERR_NO_MEMORY;
+
 	socket_dev_init();
 
 	return 0;
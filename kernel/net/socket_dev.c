@@ -8,6 +8,7 @@
 #include <kernel/heap.h>
 #include <kernel/vm.h>
 #include <kernel/fs/devfs.h>
+#include <kernel/evq.h>
 #include <kernel/net/socket.h>
 #include <newos/socket_api.h>
 #include <string.h>
@@ -156,6 +157,17 @@ static ssize_t socket_dev_write(dev_cookie cookie, const void *buf, off_t pos, s
 		return ERR_NET_NOT_CONNECTED;
 }
 
+static int socket_dev_poll(dev_cookie cookie, struct poll_waiter *waiter)
+{
+	socket_dev *s = (socket_dev *)cookie;
+
+	// nothing will ever happen on a socket that was never created
+	if(s->id >= 0)
+		return socket_poll(s->id, waiter);
+	else
+		return EVQ_ERR;
+}
+
 static struct dev_calls socket_dev_hooks = {
 	&socket_dev_open,
 	&socket_dev_close,
@@ -167,7 +179,8 @@ static struct dev_calls socket_dev_hooks = {
 	/* no paging from /dev/null */
 	NULL,
 	NULL,
-	NULL
+	NULL,
+	&socket_dev_poll
 };
 
 int socket_dev_init(void)
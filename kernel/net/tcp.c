@@ -7,12 +7,16 @@
 #include <kernel/lock.h>
 #include <kernel/debug.h>
 #include <kernel/heap.h>
-#include <kernel/khash.h>
+#include <kernel/slab.h>
 #include <kernel/sem.h>
 #include <kernel/queue.h>
 #include <kernel/time.h>
+#include <kernel/evq.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
 #include <kernel/arch/cpu.h>
 #include <kernel/net/tcp.h>
+#include <kernel/net/tcp_cc.h>
 #include <kernel/net/ipv4.h>
 #include <kernel/net/misc.h>
 #include <kernel/net/net_timer.h>
@@ -52,6 +56,44 @@ typedef struct tcp_window_scale_option {
 	uint8 shift_count;
 } _PACKED tcp_window_scale_option;
 
+enum {
+	TCP_OPT_END = 0,
+	TCP_OPT_NOP = 1,
+	TCP_OPT_MSS = 2,
+	TCP_OPT_WINDOW_SCALE = 3,
+	TCP_OPT_SACK_PERMITTED = 4,
+	TCP_OPT_SACK = 5
+};
+
+#define TCP_MAX_OPTIONS_LEN 40
+#define TCP_MAX_SACK_BLOCKS 4 /* as many as fit in the options along with two NOPs */
+#define TCP_MAX_WINDOW_SHIFT 14
+#define SACK_SCOREBOARD_SIZE 8 /* sacked ranges the sender keeps track of */
+
+typedef struct tcp_sack_block {
+	uint32 start;
+	uint32 end; /* one past the last byte */
+} tcp_sack_block;
+
+/* out of order data waiting on the hole in front of it */
+#define REASSEMBLY_MAX_RANGES 32
+#define REASSEMBLY_MAX_BYTES (256*1024)
+
+typedef struct tcp_reassembly_range {
+	uint32 start;
+	uint32 end; /* one past the last byte */
+	cbuf *data; /* just the data, the header's been stripped */
+} tcp_reassembly_range;
+
+/* what was found in the options of an incoming segment */
+typedef struct tcp_options {
+	uint16 mss; /* 0 if there wasn't one */
+	int window_shift; /* -1 if there wasn't one */
+	bool sack_permitted;
+	int num_sacks;
+	tcp_sack_block sacks[TCP_MAX_SACK_BLOCKS];
+} tcp_options;
+
 typedef enum tcp_state {
 	STATE_CLOSED,
 	STATE_LISTEN,
@@ -77,7 +119,8 @@ typedef enum tcp_flags {
 
 typedef struct tcp_socket {
 	queue_element accept_next; // must be first
-	struct tcp_socket *next;
+	struct tcp_socket * volatile hash_next;
+	struct tcp_bucket *bucket; // the one it's hashed in, NULL if it isn't
 	tcp_state state;
 	mutex lock;
 	int ref_count;
@@ -87,15 +130,22 @@ typedef struct tcp_socket {
 	ipv4_addr remote_addr;
 	uint16 local_port;
 	uint16 remote_port;
+	ipv4_route_cache route; // to remote_addr
 
 	uint32 mss;
+	bool window_scaling; /* both sides sent a window scale option */
+	bool sack_permitted; /* both sides said they do sack */
 
 	/* rx */
 	sem_id read_sem;
 	uint32 rx_win_size;
 	uint32 rx_win_low;
 	uint32 rx_win_high;
-	cbuf *reassembly_q;
+	uint8 rx_window_shift;
+	tcp_reassembly_range reassembly[REASSEMBLY_MAX_RANGES]; /* sorted, never overlapping or touching */
+	int reassembly_count;
+	uint32 reassembly_bytes;
+	uint32 last_ooo_seq; /* start of the last out of order segment, it's sacked first */
 	cbuf *read_buffer;
 	net_timer_event ack_delay_timer;
 
@@ -105,57 +155,108 @@ typedef struct tcp_socket {
 	bool writers_waiting;
 	uint32 tx_win_low;
 	uint32 tx_win_high;
+	uint32 tx_max_seq; /* highest sequence sent, tx_win_low backs off from it after a timeout */
+	uint8 tx_window_shift;
 	uint32 retransmit_tx_seq;
 	int retransmit_timeout;
 	int tx_write_buf_size;
 	uint32 unacked_data_len;
-	int duplicate_ack_count;
 	cbuf *write_buffer;
 	net_timer_event retransmit_timer;
 	net_timer_event persist_timer;
 	net_timer_event fin_retransmit_timer;
 	net_timer_event time_wait_timer;
 
-	/* as per example in tcp/ip illustrated */
-	uint32 cwnd;
-	uint32 ssthresh;
-
-	/* rtt */
+	/* loss recovery */
+	int duplicate_ack_count;
+	bool in_recovery;
+	uint32 recover; /* tx_max_seq when the loss was found, recovery is over once it's acked */
+	int rto_backoffs;
+	tcp_sack_block sacked[SACK_SCOREBOARD_SIZE]; /* what they have past retransmit_tx_seq, sorted */
+	int num_sacked;
+	uint32 sack_rexmit_next; /* holes below this were already resent during this recovery */
+
+	/* congestion control */
+	tcp_cc_ops *cc_ops;
+	tcp_cc_state cc;
+
+	/* rtt, as per rfc 6298. srtt is in cc */
 	bool tracking_rtt;
 	uint32 rtt_seq;
 	bigtime_t rtt_seq_timestamp;
-	long smoothed_rtt;
-	long smoothed_deviation;
+	bigtime_t rttvar;
 	long rto;
 
+	/* stats */
+	int num_retransmits;
+	int num_fast_recoveries;
+	int num_timeouts;
+	int num_ooo_segments;
+	uint32 ooo_bytes_dropped; /* duplicates, and what didn't fit */
+	int max_reassembly_ranges;
+	uint32 max_reassembly_bytes;
+
 	/* accept queue */
 	queue accept_queue;
 	sem_id accept_sem;
-} tcp_socket;
+	struct tcp_socket *accept_parent; // listener to tell when we're established, holds a ref
 
-typedef struct tcp_socket_key {
-	ipv4_addr local_addr;
-	ipv4_addr remote_addr;
-	uint16 local_port;
-	uint16 remote_port;
-} tcp_socket_key;
+	/* event queues waiting on this socket */
+	poll_list poll;
+} tcp_socket;
 
-static tcp_socket *socket_table;
-static mutex socket_table_lock;
+/*
+** Sockets are found through two tables: connected ones by the whole address
+** 4-tuple, and the ones without a remote end (listening, or just bound) by
+** their local address and port.
+**
+** Lookups don't take any locks, so any number of rx threads can demux at
+** once. Inserts and removes take the bucket's spinlock, and a remove bumps
+** the bucket's seq to odd and back, so a lookup that comes up empty can tell
+** if the chain changed under it and look again. A socket is only freed once
+** every cpu has been seen outside of a lookup, tracked by a per-cpu sequence
+** number that's odd while a lookup is running on that cpu, same as the
+** routing table does it.
+*/
+typedef struct tcp_bucket {
+	tcp_socket * volatile head;
+	spinlock_t lock;
+	volatile int seq;
+} tcp_bucket;
+
+#define TCP_ESTABLISHED_HASH_SIZE 1024
+#define TCP_LISTEN_HASH_SIZE 64
+
+struct tcp_demux_cpu {
+	volatile int seq;
+	uint64 lookups;
+	uint64 retries;
+} _ALIGNED(64);
+
+static tcp_bucket established_table[TCP_ESTABLISHED_HASH_SIZE];
+static tcp_bucket listen_table[TCP_LISTEN_HASH_SIZE];
+static struct tcp_demux_cpu demux_cpus[_MAX_CPUS];
+static object_cache *socket_cache;
 static int next_ephemeral_port = 1024;
 
 /* the following are in bigtime_t units (microseconds) */
 #define SYN_RETRANSMIT_TIMEOUT 1000000
-#define MAX_RETRANSMIT_TIMEOUT 90000000 /* 90 secs */
 
+/* and these are in ms, like the net timers */
+#define INITIAL_RETRANSMIT_TIMEOUT 1000
+#define MIN_RETRANSMIT_TIMEOUT 200
+#define MAX_RETRANSMIT_TIMEOUT 60000
+#define TIMER_GRANULARITY 200 /* how often the net timers get looked at */
 #define FIN_RETRANSMIT_TIMEOUT 5000
 #define PERSIST_TIMEOUT 500
 #define ACK_DELAY 200
-#define DEFAULT_RX_WINDOW_SIZE (32*1024)
-#define DEFAULT_TX_WRITE_BUF_SIZE (128*1024)
+#define DEFAULT_RX_WINDOW_SIZE (256*1024)
+#define DEFAULT_TX_WRITE_BUF_SIZE (256*1024)
 #define DEFAULT_MAX_SEGMENT_SIZE 536
 #define MSL 30000 /* 30 seconds */
 
+#define DUPACK_THRESHOLD 3
+
 #define SEQUENCE_GTE(a, b) ((int)((a) - (b)) >= 0)
 #define SEQUENCE_LTE(a, b) ((int)((a) - (b)) <= 0)
 #define SEQUENCE_GT(a, b) ((int)((a) - (b)) > 0)
@@ -163,9 +264,9 @@ static int next_ephemeral_port = 1024;
 
 // forward decls
 static void tcp_send(ipv4_addr dest_addr, uint16 dest_port, ipv4_addr src_addr, uint16 source_port, cbuf *buf, tcp_flags flags,
-	uint32 ack, const void *options, uint16 options_length, uint32 sequence, uint16 window_size);
+	uint32 ack, const void *options, uint16 options_length, uint32 sequence, uint16 window_size, ipv4_route_cache *route);
 static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const void *options, uint16 options_length, uint32 sequence);
-static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data);
+static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data, tcp_options *opts);
 static void handle_data(tcp_socket *s, cbuf *buf);
 static void handle_ack_delay_timeout(void *_socket);
 static void handle_persist_timeout(void *_socket);
@@ -178,34 +279,157 @@ static void send_ack(tcp_socket *s);
 static void tcp_remote_close(tcp_socket *s);
 static int tcp_flush_pending_data(tcp_socket *s);
 static void tcp_retransmit(tcp_socket *s);
+static void tcp_retransmit_segment(tcp_socket *s, uint32 seq, uint32 len);
+static void tcp_send_syn(tcp_socket *s, tcp_flags flags);
+static void tcp_set_mss(tcp_socket *s, uint32 mss);
+static void tcp_reassembly_flush(tcp_socket *s);
 
-static int tcp_socket_compare_func(void *_s, const void *_key)
+static unsigned int tcp_hash(ipv4_addr local_addr, uint16 local_port, ipv4_addr remote_addr, uint16 remote_port)
 {
-	tcp_socket *s = _s;
-	const tcp_socket_key *key = _key;
+	uint32 hash;
 
-	if(s->local_addr == key->local_addr &&
-	   s->remote_addr == key->remote_addr &&
-	   s->local_port == key->local_port &&
-	   s->remote_port == key->remote_port)
-		return 0;
-	else
-		return 1;
+	hash = local_addr ^ remote_addr ^ (((uint32)local_port << 16) | remote_port);
+	hash ^= hash >> 16;
+	hash *= 0x45d9f3b;
+	hash ^= hash >> 16;
+
+	return hash;
 }
 
-static unsigned int tcp_socket_hash_func(void *_s, const void *_key, unsigned int range)
+// sockets without a remote end go in the listen table
+static tcp_bucket *tcp_bucket_for(ipv4_addr local_addr, uint16 local_port, ipv4_addr remote_addr, uint16 remote_port)
 {
-	tcp_socket *s = _s;
-	const tcp_socket_key *key = _key;
-	unsigned int hash;
+	if(remote_addr == 0 && remote_port == 0)
+		return &listen_table[tcp_hash(local_addr, local_port, 0, 0) % TCP_LISTEN_HASH_SIZE];
 
-	if(s) {
-		hash = *(uint32 *)&s->local_addr ^ *(uint32 *)&s->remote_addr ^ s->local_port ^ s->remote_port;
-	} else {
-		hash = *(uint32 *)&key->local_addr ^ *(uint32 *)&key->remote_addr ^ key->local_port ^ key->remote_port;
+	return &established_table[tcp_hash(local_addr, local_port, remote_addr, remote_port) % TCP_ESTABLISHED_HASH_SIZE];
+}
+
+static void tcp_hash_insert(tcp_socket *s)
+{
+	tcp_bucket *b = tcp_bucket_for(s->local_addr, s->local_port, s->remote_addr, s->remote_port);
+
+	int_disable_interrupts();
+	acquire_spinlock(&b->lock);
+
+	ASSERT(s->bucket == NULL);
+
+	// lookups don't take the lock, so it has to be all there before they can see it
+	s->hash_next = b->head;
+	s->bucket = b;
+	arch_cpu_memory_barrier();
+	b->head = s;
+
+	release_spinlock(&b->lock);
+	int_restore_interrupts();
+}
+
+// Unhooks the socket from whatever table it's in. hash_next is left alone,
+// since a lookup may be standing on it.
+static void tcp_hash_remove(tcp_socket *s)
+{
+	tcp_bucket *b = s->bucket;
+	tcp_socket * volatile *link;
+
+	if(b == NULL)
+		return;
+
+	int_disable_interrupts();
+	acquire_spinlock(&b->lock);
+
+	// somebody may have beaten us to it
+	if(s->bucket == b) {
+		atomic_add(&b->seq, 1);
+		for(link = &b->head; *link != s; link = &(*link)->hash_next)
+			ASSERT(*link != NULL);
+		*link = s->hash_next;
+		s->bucket = NULL;
+		atomic_add(&b->seq, 1);
+	}
+
+	release_spinlock(&b->lock);
+	int_restore_interrupts();
+}
+
+static struct tcp_demux_cpu *tcp_demux_read_begin(void)
+{
+	struct tcp_demux_cpu *dc;
+
+	// no preemption in the middle of a lookup, so the seq stays on this cpu
+	int_disable_interrupts();
+	dc = &demux_cpus[smp_get_current_cpu()];
+	atomic_add(&dc->seq, 1);
+	dc->lookups++;
+	return dc;
+}
+
+static void tcp_demux_read_end(struct tcp_demux_cpu *dc)
+{
+	atomic_add(&dc->seq, 1);
+	int_restore_interrupts();
+}
+
+// wait until every lookup that could have seen a socket that's been unhooked is done
+static void tcp_demux_synchronize(void)
+{
+	int seq[_MAX_CPUS];
+	int num_cpus = smp_get_num_cpus();
+	int i;
+
+	arch_cpu_memory_barrier();
+	for(i = 0; i < num_cpus; i++)
+		seq[i] = demux_cpus[i].seq;
+	for(i = 0; i < num_cpus; i++) {
+		if((seq[i] & 1) == 0)
+			continue;
+		while(demux_cpus[i].seq == seq[i])
+			;
 	}
+}
+
+// a lookup can find a socket whose last ref is already gone, it mustn't bring it back
+static bool tcp_socket_ref_if_live(tcp_socket *s)
+{
+	int ref;
+
+	do {
+		ref = *(volatile int *)&s->ref_count;
+		if(ref <= 0)
+			return false;
+	} while(test_and_set(&s->ref_count, ref + 1, ref) != ref);
+
+	return true;
+}
+
+static tcp_socket *tcp_bucket_lookup(tcp_bucket *b, ipv4_addr local_addr, uint16 local_port,
+	ipv4_addr remote_addr, uint16 remote_port, struct tcp_demux_cpu *dc)
+{
+	tcp_socket *s;
+	int seq;
+
+	for(;;) {
+		seq = b->seq;
+		arch_cpu_memory_barrier();
+
+		if((seq & 1) == 0) {
+			for(s = b->head; s != NULL; s = s->hash_next) {
+				if(s->local_addr == local_addr && s->local_port == local_port
+					&& s->remote_addr == remote_addr && s->remote_port == remote_port)
+					break;
+			}
+
+			// if it's on its way out, it's as good as not there
+			if(s != NULL)
+				return tcp_socket_ref_if_live(s) ? s : NULL;
+		}
 
-	return hash % range;
+		// a miss only counts if nothing was pulled out of the chain while we walked it,
+		// a socket that gets rehashed can take us off into another one
+		arch_cpu_memory_barrier();
+		if(b->seq == seq && (seq & 1) == 0)
+			return NULL;
+		dc->retries++;
+	}
 }
 
 #if DEBUG_REF_COUNT
@@ -235,67 +459,64 @@ static void dec_socket_ref(tcp_socket *s)
 {
 #endif
 	if(atomic_add(&s->ref_count, -1) == 1) {
-		// pull the socket out of the hash table
-		mutex_lock(&socket_table_lock);
-		hash_remove(socket_table, s);
-		mutex_unlock(&socket_table_lock);
+		// pull the socket out of the tables, and let anyone still looking at it finish
+		tcp_hash_remove(s);
+		tcp_demux_synchronize();
 
 		destroy_tcp_socket(s);
 	}
 }
 
+// finds the socket a segment is for, with a ref on it
 static tcp_socket *lookup_socket(ipv4_addr src_addr, ipv4_addr dest_addr, uint16 src_port, uint16 dest_port)
 {
-	tcp_socket_key key;
+	struct tcp_demux_cpu *dc;
 	tcp_socket *s;
 
-	key.local_addr = dest_addr;
-	key.local_port = dest_port;
-
-	// first search for a socket matching the remote address
-	key.remote_addr = src_addr;
-	key.remote_port = src_port;
+	for(;;) {
+		dc = tcp_demux_read_begin();
 
-	mutex_lock(&socket_table_lock);
+		// first search for a socket matching the remote address
+		s = tcp_bucket_lookup(tcp_bucket_for(dest_addr, dest_port, src_addr, src_port),
+			dest_addr, dest_port, src_addr, src_port, dc);
 
-	s = hash_lookup(socket_table, &key);
-	if(s)
-		goto found;
+		// didn't see it, lets search for one listening on the address
+		if(s == NULL)
+			s = tcp_bucket_lookup(tcp_bucket_for(dest_addr, dest_port, 0, 0), dest_addr, dest_port, 0, 0, dc);
 
-	// didn't see it, lets search for the null remote address (a socket in listen state)
-	key.remote_addr = 0;
-	key.remote_port = 0;
+		// one last search for a socket with 0.0.0.0 as the local addr (will accept to any local address)
+		if(s == NULL)
+			s = tcp_bucket_lookup(tcp_bucket_for(0, dest_port, 0, 0), 0, dest_port, 0, 0, dc);
 
-	s = hash_lookup(socket_table, &key);
-	if(s)
-		goto found;
+		tcp_demux_read_end(dc);
 
-	// one last search for a socket with 0.0.0.0 as the local addr (will accept to any local address)
-	key.local_addr = 0;
+		if(s == NULL)
+			return NULL;
 
-	s = hash_lookup(socket_table, &key);
-	if(!s)
-		goto out;
+		// it could have been rehashed between finding it and getting the ref
+		if(s->bucket != NULL && s->local_port == dest_port
+			&& (s->local_addr == dest_addr || s->local_addr == 0)
+			&& ((s->remote_addr == src_addr && s->remote_port == src_port)
+				|| (s->remote_addr == 0 && s->remote_port == 0)))
+			return s;
 
-found:
-	inc_socket_ref(s);
-out:
-	mutex_unlock(&socket_table_lock);
-	return s;
+		dec_socket_ref(s);
+	}
 }
 
 static tcp_socket *create_tcp_socket(void)
 {
 	tcp_socket *s;
 
-	s = kmalloc(sizeof(tcp_socket));
+	s = object_cache_alloc(socket_cache);
 	if(!s)
 		return NULL;
 
 	memset(s, 0, sizeof(tcp_socket));
 
 	// set up the new socket structure
-	s->next = NULL;
+	s->hash_next = NULL;
+	s->bucket = NULL;
 	s->state = STATE_CLOSED;
 	if(mutex_init(&s->lock, "socket lock") < 0)
 		goto err;
@@ -315,25 +536,37 @@ static tcp_socket *create_tcp_socket(void)
 	s->local_port = 0;
 	s->remote_addr = 0;
 	s->remote_port = 0;
-	s->mss = DEFAULT_MAX_SEGMENT_SIZE;
+	ipv4_route_cache_init(&s->route);
 	s->rx_win_size = DEFAULT_RX_WINDOW_SIZE;
 	s->rx_win_low = 0;
 	s->rx_win_high = 0;
 	s->tx_win_low = rand();
 	s->tx_win_high = s->tx_win_low;
+	s->tx_max_seq = s->tx_win_low;
 	s->retransmit_tx_seq = s->tx_win_low;
 	s->tx_write_buf_size = DEFAULT_TX_WRITE_BUF_SIZE;
 	s->write_buffer = NULL;
 	s->writers_waiting = false;
 
-	s->smoothed_deviation = 0;
-	s->smoothed_rtt = 500;
-	s->rto = 500;
+	// smallest shift that lets the whole receive window be advertised
+	s->rx_window_shift = 0;
+	while((s->rx_win_size >> s->rx_window_shift) > 0xffff && s->rx_window_shift < TCP_MAX_WINDOW_SHIFT)
+		s->rx_window_shift++;
+
+	s->recover = s->tx_win_low;
+
+	s->cc.srtt = 0;
+	s->rttvar = 0;
+	s->rto = INITIAL_RETRANSMIT_TIMEOUT;
+	s->retransmit_timeout = s->rto;
 
-	s->cwnd = s->mss;
-	s->ssthresh = 0x10000;
+	s->cc_ops = tcp_cc_get_default();
+	s->cc_ops->init(&s->cc);
+	tcp_set_mss(s, DEFAULT_MAX_SEGMENT_SIZE);
+	s->cc.ssthresh = s->tx_write_buf_size;
 
 	queue_init(&s->accept_queue);
+	poll_list_init(&s->poll);
 
 	return s;
 
@@ -346,7 +579,7 @@ err2:
 err1:
 	mutex_destroy(&s->lock);
 err:
-	kfree(s);
+	object_cache_free(socket_cache, s);
 	return NULL;
 }
 
@@ -354,29 +587,49 @@ static int destroy_tcp_socket(tcp_socket *s)
 {
 	ASSERT(s->state == STATE_CLOSED);
 
+	// never got established, so it still has a hold of the listener
+	if(s->accept_parent)
+		dec_socket_ref(s->accept_parent);
+
+	tcp_reassembly_flush(s);
+
 	sem_delete(s->accept_sem);
 	mutex_destroy(&s->write_lock);
 	sem_delete(s->write_sem);
 	sem_delete(s->read_sem);
 	mutex_destroy(&s->lock);
-	kfree(s);
+	object_cache_free(socket_cache, s);
 }
 
 static void dump_socket(tcp_socket *s)
 {
+	int i;
+
 	dprintf("tcp dump_socket on socket @ %p\n", s);
 	dprintf("\tstate %d ref_count %d\n", s->state, s->ref_count);
 	dprintf("\tlocal_addr: "); dump_ipv4_addr(s->local_addr); dprintf(".%d\n", s->local_port);
 	dprintf("\tremote_addr: "); dump_ipv4_addr(s->remote_addr); dprintf(".%d\n", s->remote_port);
-	dprintf("\tmss: %u\n", s->mss);
+	dprintf("\tmss: %u window_scaling %d (rx shift %d, tx shift %d) sack_permitted %d\n",
+		s->mss, s->window_scaling, s->rx_window_shift, s->tx_window_shift, s->sack_permitted);
 	dprintf("\tread_sem 0x%x\n", s->read_sem);
 	dprintf("\trx_win_size %u rx_win_low %u rx_win_high %u\n", s->rx_win_size, s->rx_win_low, s->rx_win_high);
 	dprintf("\tread_buffer %p (%ld)\n", s->read_buffer, cbuf_get_len(s->read_buffer));
-	dprintf("\treassembly_q %p\n", s->reassembly_q);
+	dprintf("\treassembly: %d ranges %u bytes (at most %d ranges %u bytes)\n", s->reassembly_count, s->reassembly_bytes,
+		s->max_reassembly_ranges, s->max_reassembly_bytes);
+	for(i = 0; i < s->reassembly_count; i++)
+		dprintf("\t\t%u - %u\n", s->reassembly[i].start, s->reassembly[i].end);
 	dprintf("\twrite_sem 0x%x writers_waiting %d\n", s->write_sem, s->writers_waiting);
 	dprintf("\ttx_win_low %u tx_win_high %u retransmit_tx_seq %u write_buf_size %d\n",
 		s->tx_win_low, s->tx_win_high, s->retransmit_tx_seq, s->tx_write_buf_size);
-	dprintf("\tunacked_data_len %d write_buffer %p (%ld)\n", s->unacked_data_len, s->write_buffer, cbuf_get_len(s->write_buffer));
+	dprintf("\tunacked_data_len %d write_buffer %p (%ld) tx_max_seq %u\n", s->unacked_data_len, s->write_buffer,
+		cbuf_get_len(s->write_buffer), s->tx_max_seq);
+	dprintf("\tcc %s cwnd %u ssthresh %u\n", s->cc_ops->name, s->cc.cwnd, s->cc.ssthresh);
+	dprintf("\tin_recovery %d recover %u duplicate_ack_count %d num_sacked %d sack_rexmit_next %u\n",
+		s->in_recovery, s->recover, s->duplicate_ack_count, s->num_sacked, s->sack_rexmit_next);
+	dprintf("\tsrtt %ld rttvar %ld (usecs) rto %ld retransmit_timeout %d\n",
+		(long)s->cc.srtt, (long)s->rttvar, s->rto, s->retransmit_timeout);
+	dprintf("\tretransmits %d fast recoveries %d timeouts %d\n", s->num_retransmits, s->num_fast_recoveries, s->num_timeouts);
+	dprintf("\tout of order segments %d ooo bytes dropped %u\n", s->num_ooo_segments, s->ooo_bytes_dropped);
 }
 
 static void dump_socket_info(int argc, char **argv)
@@ -398,14 +651,11 @@ static void dump_socket_info(int argc, char **argv)
 	}
 }
 
-static void list_sockets(int argc, char **argv)
+static void list_bucket(tcp_bucket *b)
 {
-	struct hash_iterator i;
 	tcp_socket *s;
 
-	dprintf("tcp sockets:\n");
-	hash_open(socket_table, &i);
-	while((s = hash_next(socket_table, &i)) != NULL) {
+	for(s = b->head; s != NULL; s = s->hash_next) {
 		dprintf("\t%p\tlocal ", s);
 		dump_ipv4_addr(s->local_addr); dprintf(".%d\t", s->local_port);
 		dprintf("remote ");
@@ -414,6 +664,25 @@ static void list_sockets(int argc, char **argv)
 	}
 }
 
+static void list_sockets(int argc, char **argv)
+{
+	uint64 lookups = 0;
+	uint64 retries = 0;
+	int i;
+
+	dprintf("tcp sockets:\n");
+	for(i = 0; i < TCP_LISTEN_HASH_SIZE; i++)
+		list_bucket(&listen_table[i]);
+	for(i = 0; i < TCP_ESTABLISHED_HASH_SIZE; i++)
+		list_bucket(&established_table[i]);
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		lookups += demux_cpus[i].lookups;
+		retries += demux_cpus[i].retries;
+	}
+	dprintf("%Ld lookups, %Ld retried after a remove\n", lookups, retries);
+}
+
 static int bind_local_address(tcp_socket *s, netaddr *remote_addr)
 {
 	int err = 0;
@@ -434,6 +703,338 @@ static int bind_local_address(tcp_socket *s, netaddr *remote_addr)
 	return err;
 }
 
+static void tcp_reassembly_remove(tcp_socket *s, int index, int count)
+{
+	memmove(&s->reassembly[index], &s->reassembly[index + count],
+		(s->reassembly_count - index - count) * sizeof(tcp_reassembly_range));
+	s->reassembly_count -= count;
+}
+
+// lets go of the range furthest out
+static void tcp_reassembly_drop_last(tcp_socket *s)
+{
+	tcp_reassembly_range *r = &s->reassembly[s->reassembly_count - 1];
+
+	s->ooo_bytes_dropped += r->end - r->start;
+	s->reassembly_bytes -= r->end - r->start;
+	cbuf_free_chain(r->data);
+	s->reassembly_count--;
+}
+
+// the first range that ends at or after seq, or reassembly_count if there isn't one
+static int tcp_reassembly_find(tcp_socket *s, uint32 seq)
+{
+	int low = 0;
+	int high = s->reassembly_count;
+	int mid;
+
+	while(low < high) {
+		mid = (low + high) / 2;
+		if(SEQUENCE_LT(s->reassembly[mid].end, seq))
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+// Holds on to data that came in past a hole. Whatever it overlaps is trimmed
+// so no byte is kept twice, and it's merged with the ranges it touches, so
+// there's one range per hole no matter how the data showed up.
+static void tcp_reassembly_insert(tcp_socket *s, uint32 seq, cbuf *data)
+{
+	tcp_reassembly_range *r;
+	uint32 end = seq + cbuf_get_len(data);
+	uint32 limit;
+	int first;
+	int i;
+
+	s->num_ooo_segments++;
+
+	// we've already got everything below rx_win_low
+	if(SEQUENCE_LTE(end, s->rx_win_low)) {
+		s->ooo_bytes_dropped += end - seq;
+		cbuf_free_chain(data);
+		return;
+	}
+	if(SEQUENCE_LT(seq, s->rx_win_low)) {
+		s->ooo_bytes_dropped += s->rx_win_low - seq;
+		data = cbuf_truncate_head(data, s->rx_win_low - seq, true);
+		seq = s->rx_win_low;
+	}
+
+	first = tcp_reassembly_find(s, seq);
+	for(i = first; i < s->reassembly_count && SEQUENCE_LTE(s->reassembly[i].start, end); i++) {
+		r = &s->reassembly[i];
+
+		if(SEQUENCE_LTE(r->start, seq) && SEQUENCE_GTE(r->end, end)) {
+			// nothing in it we don't have
+			s->ooo_bytes_dropped += end - seq;
+			cbuf_free_chain(data);
+			return;
+		}
+
+		if(SEQUENCE_LTE(r->start, seq)) {
+			// it covers our front, keep what was already there
+			s->ooo_bytes_dropped += r->end - seq;
+			data = cbuf_merge_chains(r->data, cbuf_truncate_head(data, r->end - seq, true));
+			seq = r->start;
+		} else if(SEQUENCE_GTE(r->end, end)) {
+			// it goes on past our end
+			s->ooo_bytes_dropped += end - r->start;
+			data = cbuf_merge_chains(data, cbuf_truncate_head(r->data, end - r->start, true));
+			end = r->end;
+		} else {
+			// we cover all of it
+			s->ooo_bytes_dropped += r->end - r->start;
+			cbuf_free_chain(r->data);
+		}
+		s->reassembly_bytes -= r->end - r->start;
+	}
+	tcp_reassembly_remove(s, first, i - first);
+
+	if(s->reassembly_count == REASSEMBLY_MAX_RANGES) {
+		// no room for another hole, the one furthest out is the one least needed
+		if(first == s->reassembly_count) {
+			s->ooo_bytes_dropped += end - seq;
+			cbuf_free_chain(data);
+			return;
+		}
+		tcp_reassembly_drop_last(s);
+	}
+
+	memmove(&s->reassembly[first + 1], &s->reassembly[first],
+		(s->reassembly_count - first) * sizeof(tcp_reassembly_range));
+	r = &s->reassembly[first];
+	r->start = seq;
+	r->end = end;
+	r->data = data;
+	s->reassembly_count++;
+	s->reassembly_bytes += end - seq;
+
+	// hold no more than we opened the window for, letting go from the top
+	limit = min(s->rx_win_size, REASSEMBLY_MAX_BYTES);
+	while(s->reassembly_bytes > limit)
+		tcp_reassembly_drop_last(s);
+
+	s->max_reassembly_ranges = max(s->max_reassembly_ranges, s->reassembly_count);
+	s->max_reassembly_bytes = max(s->max_reassembly_bytes, s->reassembly_bytes);
+}
+
+// moves whatever rx_win_low has caught up with over to the read buffer
+static void tcp_reassembly_pull(tcp_socket *s)
+{
+	tcp_reassembly_range *r;
+	cbuf *data;
+
+	while(s->reassembly_count > 0 && SEQUENCE_LTE(s->reassembly[0].start, s->rx_win_low)) {
+		r = &s->reassembly[0];
+		s->reassembly_bytes -= r->end - r->start;
+
+		if(SEQUENCE_GT(r->end, s->rx_win_low)) {
+			s->ooo_bytes_dropped += s->rx_win_low - r->start;
+			data = cbuf_truncate_head(r->data, s->rx_win_low - r->start, true);
+			s->rx_win_low = r->end;
+			s->read_buffer = cbuf_merge_chains(s->read_buffer, data);
+		} else {
+			s->ooo_bytes_dropped += r->end - r->start;
+			cbuf_free_chain(r->data);
+		}
+
+		tcp_reassembly_remove(s, 0, 1);
+	}
+}
+
+static void tcp_reassembly_flush(tcp_socket *s)
+{
+	while(s->reassembly_count > 0)
+		tcp_reassembly_drop_last(s);
+}
+
+static uint32 tcp_get_be32(const uint8 *p)
+{
+	return ((uint32)p[0] << 24) | ((uint32)p[1] << 16) | ((uint32)p[2] << 8) | p[3];
+}
+
+static void tcp_put_be32(uint8 *p, uint32 val)
+{
+	p[0] = val >> 24;
+	p[1] = val >> 16;
+	p[2] = val >> 8;
+	p[3] = val;
+}
+
+static void tcp_parse_options(cbuf *buf, int header_len, tcp_options *opts)
+{
+	uint8 options[TCP_MAX_OPTIONS_LEN];
+	int len = header_len - sizeof(tcp_header);
+	int opt_len;
+	int i, n;
+
+	opts->mss = 0;
+	opts->window_shift = -1;
+	opts->sack_permitted = false;
+	opts->num_sacks = 0;
+
+	if(len <= 0 || len > TCP_MAX_OPTIONS_LEN)
+		return;
+	if(cbuf_memcpy_from_chain(options, buf, sizeof(tcp_header), len) < 0)
+		return;
+
+	for(i = 0; i < len; i += opt_len) {
+		if(options[i] == TCP_OPT_END)
+			break;
+		if(options[i] == TCP_OPT_NOP) {
+			opt_len = 1;
+			continue;
+		}
+
+		// everything else has a length that covers the kind and itself
+		if(i + 1 >= len)
+			break;
+		opt_len = options[i + 1];
+		if(opt_len < 2 || i + opt_len > len)
+			break;
+
+		switch(options[i]) {
+			case TCP_OPT_MSS:
+				if(opt_len == sizeof(tcp_mss_option))
+					opts->mss = (options[i + 2] << 8) | options[i + 3];
+				break;
+			case TCP_OPT_WINDOW_SCALE:
+				if(opt_len == sizeof(tcp_window_scale_option))
+					opts->window_shift = options[i + 2];
+				break;
+			case TCP_OPT_SACK_PERMITTED:
+				if(opt_len == 2)
+					opts->sack_permitted = true;
+				break;
+			case TCP_OPT_SACK:
+				for(n = 2; n + 8 <= opt_len && opts->num_sacks < TCP_MAX_SACK_BLOCKS; n += 8) {
+					opts->sacks[opts->num_sacks].start = tcp_get_be32(&options[i + n]);
+					opts->sacks[opts->num_sacks].end = tcp_get_be32(&options[i + n + 4]);
+					opts->num_sacks++;
+				}
+				break;
+		}
+	}
+}
+
+// the largest segment that fits the route to them without fragmenting
+static uint32 tcp_route_mss(ipv4_addr dest_addr)
+{
+	uint32 mss;
+
+	if(ipv4_get_mss_for_dest(dest_addr, &mss) < 0)
+		return DEFAULT_MAX_SEGMENT_SIZE;
+
+	return mss - sizeof(tcp_header);
+}
+
+// only done before any data has gone out, so the initial window (rfc 3390) goes with it
+static void tcp_set_mss(tcp_socket *s, uint32 mss)
+{
+	s->mss = mss;
+	s->cc.mss = mss;
+	s->cc.cwnd = min(4 * mss, max(2 * mss, 4380));
+}
+
+// settles what both sides agreed to from the options on the SYN they sent
+static void tcp_apply_syn_options(tcp_socket *s, tcp_options *opts)
+{
+	// they didn't say, so rfc 1122's default it is
+	tcp_set_mss(s, min(s->mss, opts->mss ? opts->mss : DEFAULT_MAX_SEGMENT_SIZE));
+
+	s->window_scaling = (opts->window_shift >= 0);
+	if(s->window_scaling) {
+		s->tx_window_shift = min(opts->window_shift, TCP_MAX_WINDOW_SHIFT);
+	} else {
+		// they can't scale, so neither can we
+		s->tx_window_shift = 0;
+		s->rx_window_shift = 0;
+		s->rx_win_size = min(s->rx_win_size, 0xffff);
+	}
+
+	s->sack_permitted = opts->sack_permitted;
+}
+
+// sends a SYN, or a SYN-ACK that only has the options their SYN had
+static void tcp_send_syn(tcp_socket *s, tcp_flags flags)
+{
+	uint8 options[TCP_MAX_OPTIONS_LEN];
+	tcp_mss_option mss_option;
+	tcp_window_scale_option ws_option;
+	bool syn_ack = (flags & PKT_ACK) != 0;
+	int len = 0;
+
+	// advertise what our side can take, not what we settled on
+	mss_option.kind = TCP_OPT_MSS;
+	mss_option.len = sizeof(mss_option);
+	mss_option.mss = htons(tcp_route_mss(s->remote_addr));
+	memcpy(&options[len], &mss_option, sizeof(mss_option));
+	len += sizeof(mss_option);
+
+	if(!syn_ack || s->window_scaling) {
+		ws_option.kind = TCP_OPT_WINDOW_SCALE;
+		ws_option.len = sizeof(ws_option);
+		ws_option.shift_count = s->rx_window_shift;
+		options[len++] = TCP_OPT_NOP;
+		memcpy(&options[len], &ws_option, sizeof(ws_option));
+		len += sizeof(ws_option);
+	}
+
+	if(!syn_ack || s->sack_permitted) {
+		options[len++] = TCP_OPT_NOP;
+		options[len++] = TCP_OPT_NOP;
+		options[len++] = TCP_OPT_SACK_PERMITTED;
+		options[len++] = 2;
+	}
+
+	tcp_socket_send(s, NULL, flags, options, len, s->tx_win_low);
+}
+
+// Fills in a SACK option with the ranges sitting in the reassembly queue,
+// the one the latest segment went into first as rfc 2018 asks. Returns its length.
+static int tcp_build_sack_option(tcp_socket *s, uint8 *options)
+{
+	int first = 0;
+	int num_blocks;
+	int slot;
+	int i;
+
+	if(s->reassembly_count == 0)
+		return 0;
+
+	for(i = 0; i < s->reassembly_count; i++) {
+		if(SEQUENCE_LTE(s->reassembly[i].start, s->last_ooo_seq) && SEQUENCE_GT(s->reassembly[i].end, s->last_ooo_seq)) {
+			first = i;
+			break;
+		}
+	}
+
+	num_blocks = min(s->reassembly_count, TCP_MAX_SACK_BLOCKS);
+	options[0] = TCP_OPT_NOP;
+	options[1] = TCP_OPT_NOP;
+	options[2] = TCP_OPT_SACK;
+	options[3] = 2 + num_blocks * 8;
+
+	tcp_put_be32(&options[4], s->reassembly[first].start);
+	tcp_put_be32(&options[8], s->reassembly[first].end);
+
+	// the rest go in order after it
+	slot = 1;
+	for(i = 0; i < s->reassembly_count && slot < num_blocks; i++) {
+		if(i == first)
+			continue;
+		tcp_put_be32(&options[4 + 8 * slot], s->reassembly[i].start);
+		tcp_put_be32(&options[8 + 8 * slot], s->reassembly[i].end);
+		slot++;
+	}
+
+	return 4 + num_blocks * 8;
+}
+
 int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_address)
 {
 	tcp_header *header;
@@ -444,6 +1045,8 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	uint16 header_len;
 	uint16 data_len;
 	uint32 highest_sequence;
+	tcp_socket *parent = NULL;
+	tcp_options opts;
 
 	header = cbuf_get_ptr(buf, 0);
 	header_len = ((ntohs(header->length_flags) >> 12) & 0x0f) * 4;
@@ -454,7 +1057,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 #endif
 
 	// check to see if the length looks correct
-	if(header_len > cbuf_get_len(buf)) {
+	if(header_len > cbuf_get_len(buf) || header_len < sizeof(tcp_header)) {
 		// bogus packet length
 		dprintf("tcp_input: received packet with bad length: header len %d, len %ld\n", header_len, cbuf_get_len(buf));
 		goto ditch_packet;
@@ -494,7 +1097,8 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	// get some data from the packet
 	packet_flags = header->length_flags & 0x3f;
 	data_len = cbuf_get_len(buf) - header_len;
-	highest_sequence = header->seq_num + (data_len > 0) ? (data_len - 1) : 0;
+	highest_sequence = header->seq_num + data_len - 1;
+	tcp_parse_options(buf, header_len, &opts);
 
 	// see if it matches a socket we have
 	s = lookup_socket(source_address, target_address, header->source_port, header->dest_port);
@@ -536,9 +1140,11 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 		case STATE_SYN_SENT:
 			s->tx_win_low++;
 			s->retransmit_tx_seq = s->tx_win_low;
+			s->tx_max_seq = s->tx_win_low;
 			s->tx_win_high = s->tx_win_low + header->win_size;
 			if(packet_flags & PKT_SYN) {
 				s->rx_win_low = header->seq_num + 1;
+				tcp_apply_syn_options(s, &opts);
 				s->rx_win_high = s->rx_win_low + s->rx_win_size - 1;
 				if(packet_flags & PKT_ACK) {
 					// they're acking our SYN
@@ -548,6 +1154,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 					tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
 					s->state = STATE_ESTABLISHED;
 					sem_release(s->read_sem, 1);
+					poll_notify(&s->poll, EVQ_OUT);
 				} else {
 					// simultaneous open
 					// XXX handle
@@ -560,7 +1167,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			break;
 		case STATE_ESTABLISHED: {
 			if(packet_flags & PKT_ACK)
-				handle_ack(s, header->ack_num, header->win_size, data_len > 0);
+				handle_ack(s, header->ack_num, header->win_size, data_len > 0, &opts);
 
 			if(data_len > 0) {
 				handle_data(s, buf);
@@ -579,6 +1186,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 
 				// wake up any readers
 				sem_release(s->read_sem, 1);
+				poll_notify(&s->poll, EVQ_IN | EVQ_HUP);
 			}
 			break;
 		}
@@ -627,7 +1235,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 				s->state = STATE_CLOSING;
 				tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
 			} else if(packet_flags & PKT_ACK)
-				handle_ack(s, header->ack_num, header->win_size, data_len > 0);
+				handle_ack(s, header->ack_num, header->win_size, data_len > 0, &opts);
 			break;
 		case STATE_FIN_WAIT_2:
 			if(packet_flags & PKT_FIN) {
@@ -653,7 +1261,6 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 	/* passive open states */
 		case STATE_LISTEN: {
 			tcp_socket *accept_socket;
-			tcp_mss_option mss_option;
 
 			if(!(packet_flags & PKT_SYN)) {
 				// didn't have a SYN flag, send a reset
@@ -674,36 +1281,26 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 			// put it in the right state
 			accept_socket->state = STATE_SYN_RCVD;
 
-			// add it to the hash table
-			mutex_lock(&socket_table_lock);
-			hash_insert(socket_table, accept_socket);
-			mutex_unlock(&socket_table_lock);
-
-			// add it to the accept queue
-			queue_enqueue(&s->accept_queue, accept_socket);
-			sem_release(s->accept_sem, 1);
-
-			// record their sequence
+			// record their sequence and settle on the options
 			accept_socket->rx_win_low = header->seq_num + 1;
+			tcp_set_mss(accept_socket, tcp_route_mss(accept_socket->remote_addr));
+			tcp_apply_syn_options(accept_socket, &opts);
 			accept_socket->rx_win_high = accept_socket->rx_win_low + accept_socket->rx_win_size - 1;
 
-			// figure out what the mss will be
-			err = ipv4_get_mss_for_dest(accept_socket->remote_addr, &s->mss);
-			if(err < 0)
-				accept_socket->mss = DEFAULT_MAX_SEGMENT_SIZE;
-
-			accept_socket->mss -= sizeof(tcp_header);
-			accept_socket->cwnd = accept_socket->mss;
+			// add it to the hash table
+			tcp_hash_insert(accept_socket);
 
-			// set up the mss option
-			mss_option.kind = 0x2;
-			mss_option.len = 0x4;
-			mss_option.mss = htons(s->mss);
+			// add it to the accept queue. It tells us when the handshake is
+			// done, since that's when it's worth waking up anyone polling us
+			inc_socket_ref(s);
+			accept_socket->accept_parent = s;
+			queue_enqueue(&s->accept_queue, accept_socket);
+			sem_release(s->accept_sem, 1);
 
 			// grab a lock on the new socket and send an ack to the syn
 			inc_socket_ref(accept_socket);
 			mutex_lock(&accept_socket->lock);
-			tcp_socket_send(accept_socket, NULL, PKT_ACK|PKT_SYN, &mss_option, sizeof(mss_option), accept_socket->tx_win_low);
+			tcp_send_syn(accept_socket, PKT_ACK|PKT_SYN);
 			mutex_unlock(&accept_socket->lock);
 			dec_socket_ref(accept_socket);
 
@@ -712,8 +1309,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 		case STATE_SYN_RCVD: {
 			if(packet_flags & PKT_SYN) {
 				// they must have not received our ack to their syn, retransmit
-				// XXX implement
-				goto send_reset;
+				tcp_send_syn(s, PKT_ACK|PKT_SYN);
 				break;
 			}
 
@@ -723,10 +1319,19 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 					goto send_reset;
 				s->tx_win_low++;
 				s->retransmit_tx_seq = s->tx_win_low;
-				s->tx_win_high = s->tx_win_low + header->win_size;
+				s->tx_max_seq = s->tx_win_low;
+				s->tx_win_high = s->tx_win_low + (header->win_size << s->tx_window_shift);
 
 				s->state = STATE_ESTABLISHED;
 				sem_release(s->read_sem, 1);
+				poll_notify(&s->poll, EVQ_OUT);
+
+				// let the listener know there's something to accept. Its ref is
+				// dropped once we've let go of our own lock
+				parent = s->accept_parent;
+				s->accept_parent = NULL;
+				if(parent)
+					poll_notify(&parent->poll, EVQ_IN);
 			} else {
 				goto send_reset;
 			}
@@ -745,7 +1350,7 @@ int tcp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 send_reset:
 	if(!(packet_flags & PKT_RST))
 		tcp_send(source_address, header->source_port, target_address, header->dest_port,
-			NULL, PKT_RST|PKT_ACK, header->seq_num + 1, NULL, 0, header->ack_num, 0);
+			NULL, PKT_RST|PKT_ACK, header->seq_num + 1, NULL, 0, header->ack_num, 0, NULL);
 ditch_packet:
 	cbuf_free_chain(buf);
 	if(s) {
@@ -753,6 +1358,8 @@ ditch_packet:
 		mutex_unlock(&s->lock);
 		dec_socket_ref(s);
 	}
+	if(parent)
+		dec_socket_ref(parent);
 
 	return err;
 }
@@ -783,15 +1390,13 @@ int tcp_bind(void *prot_data, sockaddr *addr)
 		goto out;
 	}
 
-	mutex_lock(&socket_table_lock);
-	hash_remove(socket_table, s);
+	tcp_hash_remove(s);
 
 	// XXX check to see if this address is used or makes sense
 	s->local_port = addr->port;
 	s->local_addr = NETADDR_TO_IPV4(addr->addr);
 
-	hash_insert(socket_table, s);
-	mutex_unlock(&socket_table_lock);
+	tcp_hash_insert(s);
 
 out:
 	mutex_unlock(&s->lock);
@@ -805,7 +1410,6 @@ int tcp_connect(void *prot_data, sockaddr *addr)
 	tcp_socket *s = prot_data;
 	int err;
 	int i;
-	tcp_mss_option mss_option;
 
 	inc_socket_ref(s);
 	mutex_lock(&s->lock);
@@ -817,9 +1421,7 @@ int tcp_connect(void *prot_data, sockaddr *addr)
 	}
 
 	// pull the socket out of the hash table
-	mutex_lock(&socket_table_lock);
-	hash_remove(socket_table, s);
-	mutex_unlock(&socket_table_lock);
+	tcp_hash_remove(s);
 
 	// allocate a local address, if needed
 	if(s->local_port == 0 || s->local_addr == 0) {
@@ -831,28 +1433,16 @@ int tcp_connect(void *prot_data, sockaddr *addr)
 	s->remote_addr = NETADDR_TO_IPV4(addr->addr);
 	s->remote_port = addr->port;
 
-	mutex_lock(&socket_table_lock);
-	hash_insert(socket_table, s);
-	mutex_unlock(&socket_table_lock);
+	tcp_hash_insert(s);
 
-	// figure out what the mss will be
-	err = ipv4_get_mss_for_dest(s->remote_addr, &s->mss);
-	if(err < 0)
-		s->mss = DEFAULT_MAX_SEGMENT_SIZE;
-
-	s->mss -= sizeof(tcp_header);
-	s->cwnd = s->mss;
-
-	// set up the mss option
-	mss_option.kind = 0x2;
-	mss_option.len = 0x4;
-	mss_option.mss = htons(s->mss);
+	// figure out what the mss will be, their SYN may bring it down
+	tcp_set_mss(s, tcp_route_mss(s->remote_addr));
 
 	// welcome to the machine
 	s->state = STATE_SYN_SENT;
 	for(i=0; i < 3 && s->state != STATE_ESTABLISHED && s->state != STATE_CLOSED; i++) {
 		if(s->state == STATE_SYN_SENT)
-			tcp_socket_send(s, NULL, PKT_SYN, &mss_option, sizeof(mss_option), s->tx_win_low);
+			tcp_send_syn(s, PKT_SYN);
 		mutex_unlock(&s->lock);
 		sem_acquire_etc(s->read_sem, 1, SEM_FLAG_TIMEOUT, SYN_RETRANSMIT_TIMEOUT, NULL);
 		mutex_lock(&s->lock);
@@ -1002,6 +1592,7 @@ int tcp_close(void *prot_data)
 	sem_release(s->read_sem, 1);
 	sem_release(s->write_sem, 1);
 	s->writers_waiting = false;
+	poll_notify(&s->poll, EVQ_HUP);
 
 	err = NO_ERROR;
 
@@ -1176,10 +1767,258 @@ static void send_ack(tcp_socket *s)
 }
 
 
-static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data)
+// adds a range they told us they have to the scoreboard, merging it with
+// whatever it touches and keeping the scoreboard sorted
+static void tcp_sack_insert(tcp_socket *s, tcp_sack_block *b)
+{
+	int i;
+
+	for(i = 0; i < s->num_sacked; ) {
+		if(SEQUENCE_GT(s->sacked[i].start, b->end) || SEQUENCE_LT(s->sacked[i].end, b->start)) {
+			i++;
+			continue;
+		}
+		if(SEQUENCE_LT(s->sacked[i].start, b->start))
+			b->start = s->sacked[i].start;
+		if(SEQUENCE_GT(s->sacked[i].end, b->end))
+			b->end = s->sacked[i].end;
+		memmove(&s->sacked[i], &s->sacked[i + 1], (s->num_sacked - i - 1) * sizeof(tcp_sack_block));
+		s->num_sacked--;
+	}
+
+	for(i = 0; i < s->num_sacked && SEQUENCE_LT(s->sacked[i].start, b->start); i++)
+		;
+
+	if(s->num_sacked == SACK_SCOREBOARD_SIZE) {
+		// full, forget the highest range. Worst case it gets resent for nothing
+		if(i == s->num_sacked)
+			return;
+		s->num_sacked--;
+	}
+
+	memmove(&s->sacked[i + 1], &s->sacked[i], (s->num_sacked - i) * sizeof(tcp_sack_block));
+	s->sacked[i] = *b;
+	s->num_sacked++;
+}
+
+static void tcp_sack_update(tcp_socket *s, tcp_options *opts)
+{
+	tcp_sack_block b;
+	int i;
+
+	for(i = 0; i < opts->num_sacks; i++) {
+		b = opts->sacks[i];
+
+		// only what's between the last ack and what we've sent means anything
+		if(SEQUENCE_GTE(b.start, b.end) || SEQUENCE_GT(b.end, s->tx_max_seq))
+			continue;
+		if(SEQUENCE_LTE(b.end, s->retransmit_tx_seq))
+			continue;
+		if(SEQUENCE_LT(b.start, s->retransmit_tx_seq))
+			b.start = s->retransmit_tx_seq;
+
+		tcp_sack_insert(s, &b);
+	}
+}
+
+// drops whatever the cumulative ack has caught up with
+static void tcp_sack_trim(tcp_socket *s)
+{
+	int i;
+
+	for(i = 0; i < s->num_sacked && SEQUENCE_LTE(s->sacked[i].end, s->retransmit_tx_seq); i++)
+		;
+	if(i > 0) {
+		memmove(&s->sacked[0], &s->sacked[i], (s->num_sacked - i) * sizeof(tcp_sack_block));
+		s->num_sacked -= i;
+	}
+	if(s->num_sacked > 0 && SEQUENCE_LT(s->sacked[0].start, s->retransmit_tx_seq))
+		s->sacked[0].start = s->retransmit_tx_seq;
+
+	if(SEQUENCE_LT(s->sack_rexmit_next, s->retransmit_tx_seq))
+		s->sack_rexmit_next = s->retransmit_tx_seq;
+}
+
+static void tcp_sack_clear(tcp_socket *s)
+{
+	s->num_sacked = 0;
+	s->sack_rexmit_next = s->retransmit_tx_seq;
+}
+
+// the highest byte they've told us about, + 1
+static uint32 tcp_sack_fack(tcp_socket *s)
+{
+	if(s->num_sacked == 0)
+		return s->retransmit_tx_seq;
+
+	return s->sacked[s->num_sacked - 1].end;
+}
+
+static uint32 tcp_sacked_bytes(tcp_socket *s, uint32 below)
+{
+	uint32 bytes = 0;
+	int i;
+
+	for(i = 0; i < s->num_sacked && SEQUENCE_LT(s->sacked[i].start, below); i++) {
+		if(SEQUENCE_GT(s->sacked[i].end, below))
+			bytes += below - s->sacked[i].start;
+		else
+			bytes += s->sacked[i].end - s->sacked[i].start;
+	}
+
+	return bytes;
+}
+
+// Finds the first hole below the highest sacked byte that hasn't been resent
+// yet in this recovery. Returns false if there isn't one.
+static bool tcp_sack_next_hole(tcp_socket *s, uint32 *seq, uint32 *len)
+{
+	uint32 start = s->sack_rexmit_next;
+	int i;
+
+	if(SEQUENCE_LT(start, s->retransmit_tx_seq))
+		start = s->retransmit_tx_seq;
+
+	for(i = 0; i < s->num_sacked; i++) {
+		if(SEQUENCE_LTE(s->sacked[i].end, start))
+			continue;
+		if(SEQUENCE_LT(start, s->sacked[i].start)) {
+			*seq = start;
+			*len = s->sacked[i].start - start;
+			return true;
+		}
+		start = s->sacked[i].end;
+	}
+
+	return false;
+}
+
+// How much we think is still in the network. Outside of a sack recovery that's
+// everything unacked, during one it's what was sent past the highest sacked byte
+// plus the holes already resent (a simplified rfc 6675 pipe).
+static uint32 tcp_pipe(tcp_socket *s)
+{
+	uint32 fack;
+	uint32 pipe;
+
+	if(!s->in_recovery || !s->sack_permitted || s->num_sacked == 0)
+		return s->unacked_data_len;
+
+	fack = tcp_sack_fack(s);
+	pipe = SEQUENCE_GT(s->tx_win_low, fack) ? s->tx_win_low - fack : 0;
+	if(SEQUENCE_GT(s->sack_rexmit_next, s->retransmit_tx_seq))
+		pipe += (s->sack_rexmit_next - s->retransmit_tx_seq) - tcp_sacked_bytes(s, s->sack_rexmit_next);
+
+	return pipe;
+}
+
+// feeds a round trip measurement into the rto, as per rfc 6298
+static void tcp_rtt_sample(tcp_socket *s, bigtime_t rtt)
+{
+	bigtime_t err;
+
+	// srtt of 0 means there hasn't been a sample yet
+	if(rtt <= 0)
+		rtt = 1;
+
+	if(s->cc.srtt == 0) {
+		s->cc.srtt = rtt;
+		s->rttvar = rtt / 2;
+	} else {
+		err = rtt - s->cc.srtt;
+		if(err < 0)
+			err = -err;
+		s->rttvar = (3 * s->rttvar + err) / 4;
+		s->cc.srtt = (7 * s->cc.srtt + rtt) / 8;
+	}
+
+	// the variance term can't be any finer than the timers are
+	s->rto = (s->cc.srtt + max(4 * s->rttvar, TIMER_GRANULARITY * 1000)) / 1000;
+	if(s->rto < MIN_RETRANSMIT_TIMEOUT)
+		s->rto = MIN_RETRANSMIT_TIMEOUT;
+	if(s->rto > MAX_RETRANSMIT_TIMEOUT)
+		s->rto = MAX_RETRANSMIT_TIMEOUT;
+}
+
+static void tcp_restart_retransmit_timer(tcp_socket *s)
+{
+	if(cancel_net_timer(&s->retransmit_timer) >= 0)
+		dec_socket_ref(s);
+
+	s->retransmit_timeout = s->rto;
+	if(s->unacked_data_len > 0) {
+		if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0) >= 0)
+			inc_socket_ref(s);
+	}
+}
+
+// resends len bytes of the write buffer starting at seq
+static void tcp_retransmit_segment(tcp_socket *s, uint32 seq, uint32 len)
+{
+	cbuf *data;
+
+	ASSERT(SEQUENCE_GTE(seq, s->retransmit_tx_seq));
+	ASSERT(seq - s->retransmit_tx_seq + len <= cbuf_get_len(s->write_buffer));
+
+	data = cbuf_duplicate_chain_cksum(s->write_buffer, seq - s->retransmit_tx_seq, len, 0);
+	if(!data)
+		return;
+
+	if(s->tracking_rtt && SEQUENCE_LTE(seq, s->rtt_seq) && SEQUENCE_GT(seq + len, s->rtt_seq)) {
+		// Karn sez dont follow this sequence when calculating rtt
+		s->tracking_rtt = false;
+	}
+
+	s->num_retransmits++;
+	tcp_socket_send(s, data, PKT_PSH | PKT_ACK, NULL, 0, seq);
+}
+
+// fast retransmit, as per rfc 5681 and rfc 6582 (or rfc 6675 when they do sack)
+static void tcp_enter_recovery(tcp_socket *s)
+{
+	s->num_fast_recoveries++;
+	s->in_recovery = true;
+	s->recover = s->tx_max_seq;
+
+	s->cc.ssthresh = s->cc_ops->ssthresh(&s->cc, s->unacked_data_len);
+	if(s->sack_permitted) {
+		// the scoreboard keeps track of what left the network
+		s->cc.cwnd = s->cc.ssthresh;
+	} else {
+		// inflate by the segments the dup acks say have left
+		s->cc.cwnd = s->cc.ssthresh + DUPACK_THRESHOLD * s->mss;
+	}
+
+	s->sack_rexmit_next = s->retransmit_tx_seq;
+	tcp_retransmit(s);
+	tcp_restart_retransmit_timer(s);
+}
+
+static void tcp_duplicate_ack(tcp_socket *s)
+{
+	s->duplicate_ack_count++;
+
+	if(s->in_recovery) {
+		if(!s->sack_permitted)
+			s->cc.cwnd += s->mss;
+		return;
+	}
+
+	// these are for data sent before the last loss was dealt with, it's already been taken care of
+	if(SEQUENCE_LT(s->retransmit_tx_seq, s->recover))
+		return;
+
+	if(s->duplicate_ack_count >= DUPACK_THRESHOLD
+		|| (s->sack_permitted && tcp_sacked_bytes(s, s->tx_max_seq) > (DUPACK_THRESHOLD - 1) * s->mss))
+		tcp_enter_recovery(s);
+}
+
+static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool with_data, tcp_options *opts)
 {
 	bool wake_writers = false;
-	uint32 ack_len = 0;
+	uint32 old_win_high = s->tx_win_high;
+	uint32 win_high;
+	uint32 ack_len;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
@@ -1187,90 +2026,89 @@ static void handle_ack(tcp_socket *s, uint32 sequence, uint32 window_size, bool
 //	dprintf("\tretransmit_tx_seq %d tx_win_low %d tx_win_high %d tx_write_buf_size %d\n",
 //		s->retransmit_tx_seq, s->tx_win_low, s->tx_win_high, s->tx_write_buf_size);
 
-	if(sequence == s->retransmit_tx_seq
-		&& sequence + window_size == s->tx_win_high
-		&& !with_data) {
-		// the other side is telling us it got a packet out of date, do fast retransmit
-		if(++s->duplicate_ack_count == 3) {
-			s->retransmit_timeout = s->rto;
-			if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0) >= 0)
-				inc_socket_ref(s);
+	// an ack for something we haven't sent, or one that's older than what we've got
+	if(SEQUENCE_GT(sequence, s->tx_max_seq) || SEQUENCE_LT(sequence, s->retransmit_tx_seq))
+		goto out;
 
-			tcp_retransmit(s);
-			s->duplicate_ack_count = 0;
+	// the window starts at the ack, and we don't let it slide back
+	win_high = sequence + (window_size << s->tx_window_shift);
+	if(SEQUENCE_GT(win_high, s->tx_win_high))
+		s->tx_win_high = win_high;
 
-			// save 1/2 of the congestion window into ssthresh
-			s->ssthresh = min(s->mss * 2, s->cwnd / 2);
+	if(sequence == s->retransmit_tx_seq) {
+		if(s->sack_permitted)
+			tcp_sack_update(s, opts);
 
-			return;
-		}
+		// the other side is telling us it got a segment out of order
+		if(!with_data && win_high == old_win_high && s->unacked_data_len > 0)
+			tcp_duplicate_ack(s);
+		goto out;
 	}
-	s->duplicate_ack_count = 0;
 
-	if(SEQUENCE_GTE(sequence, s->retransmit_tx_seq)) {
-		if(s->tracking_rtt && SEQUENCE_GTE(sequence, s->rtt_seq)) {
-			// this sequence acked the data we are tracking to recalc rtt
-			// as per Jacobson
-			long Err = ((long)(system_time() - s->rtt_seq_timestamp) / 1000) - s->smoothed_rtt;
-			s->smoothed_rtt = s->smoothed_rtt + Err / 8;
-			s->smoothed_deviation = s->smoothed_deviation + ((Err < 0 ? -Err : Err) - s->smoothed_deviation) / 4;
-			s->rto = s->smoothed_rtt + 4 * s->smoothed_deviation;
-			s->tracking_rtt = false;
-		}
+	if(!s->write_buffer) {
+		dprintf("tcp: data was acked that we didn't send\n");
+		goto out;
+	}
 
+	// remove acked data from the transmit queue. Everything up to tx_max_seq
+	// is still in there, even if we backed off after a timeout
+	ack_len = sequence - s->retransmit_tx_seq;
+	ASSERT(cbuf_get_len(s->write_buffer) >= ack_len);
+	s->write_buffer = cbuf_truncate_head(s->write_buffer, ack_len, true);
+	s->retransmit_tx_seq = sequence;
+	if(SEQUENCE_LT(s->tx_win_low, sequence))
+		s->tx_win_low = sequence;
+	s->unacked_data_len = s->tx_win_low - sequence;
+	poll_notify(&s->poll, EVQ_OUT);
+
+	if(s->tracking_rtt && SEQUENCE_GT(sequence, s->rtt_seq)) {
+		// this sequence acked the data we are tracking to recalc rtt
+		tcp_rtt_sample(s, system_time() - s->rtt_seq_timestamp);
+		s->tracking_rtt = false;
+	}
 
-		if(SEQUENCE_GT(sequence, s->retransmit_tx_seq)) {
-			if(!s->write_buffer) {
-				dprintf("tcp: data was acked that we didn't send\n");
-				goto out;
-			}
+	s->duplicate_ack_count = 0;
+	s->rto_backoffs = 0;
 
-			ASSERT(cbuf_get_len(s->write_buffer) >= s->unacked_data_len);
+	if(s->sack_permitted) {
+		tcp_sack_trim(s);
+		tcp_sack_update(s, opts);
+	}
 
-			// remove acked data from the transmit queue
-			ack_len = sequence - s->retransmit_tx_seq;
-			if(ack_len == 0)
-				goto out;
-			if(ack_len > s->unacked_data_len)
-				ack_len = s->unacked_data_len;
-			s->write_buffer = cbuf_truncate_head(s->write_buffer, ack_len, true);
-			s->unacked_data_len -= ack_len;
-
-			s->retransmit_tx_seq = sequence;
-
-			// reset the retransmit timer
-			if(cancel_net_timer(&s->retransmit_timer) >= 0)
-				dec_socket_ref(s);
-			if(s->unacked_data_len > 0) {
-				s->retransmit_timeout = s->rto;
-				set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0);
-				inc_socket_ref(s);
+	if(s->in_recovery) {
+		if(SEQUENCE_GTE(sequence, s->recover)) {
+			// everything that was out when the loss was found made it, deflate the window
+			s->in_recovery = false;
+			s->cc.cwnd = min(s->cc.ssthresh, max(s->unacked_data_len, s->mss) + s->mss);
+		} else {
+			// a partial ack, the segment it stops at was lost too
+			if(SEQUENCE_LTE(s->sack_rexmit_next, s->retransmit_tx_seq))
+				tcp_retransmit(s);
+			if(!s->sack_permitted) {
+				s->cc.cwnd -= min(s->cc.cwnd - s->mss, ack_len);
+				if(ack_len >= s->mss)
+					s->cc.cwnd += s->mss;
 			}
+		}
+	} else {
+		// open the congestion window
+		s->cc_ops->ack(&s->cc, ack_len);
+		if(s->cc.cwnd > (uint32)s->tx_write_buf_size)
+			s->cc.cwnd = s->tx_write_buf_size;
+	}
 
-			// see if we need to wake up any writers
-			if(s->writers_waiting) {
-				if(s->write_buffer == NULL || cbuf_get_len(s->write_buffer) < s->tx_write_buf_size - s->mss) {
-					s->writers_waiting = false;
-					wake_writers = true;
-				}
-			}
+	// reset the retransmit timer
+	tcp_restart_retransmit_timer(s);
 
-			// open the congestion window
-			if(s->cwnd <= s->ssthresh) {
-				// doing slow start, increment the window by a mss per ack received
-				s->cwnd += s->mss;
-			} else {
-				// congestion avoidance, increment the congestion window by 1/cwnd
-				s->cwnd += s->mss * s->mss / s->cwnd;
-			}
-			// XXX need to clamp to max observed window
-			if(s->cwnd > 0xffff)
-				s->cwnd = 0xffff;
+	// see if we need to wake up any writers
+	if(s->writers_waiting) {
+		if(s->write_buffer == NULL || cbuf_get_len(s->write_buffer) < s->tx_write_buf_size - s->mss) {
+			s->writers_waiting = false;
+			wake_writers = true;
 		}
 	}
 
 out:
-	s->tx_win_high += ack_len;
 	tcp_flush_pending_data(s);
 	if(wake_writers)
 		sem_release(s->write_sem, 1);
@@ -1304,7 +2142,7 @@ static void handle_persist_timeout(void *_socket)
 
 		if(tcp_flush_pending_data(s) == 0) {
 			// we've flushed everything, send one byte past the end of the window
-			cbuf *data = cbuf_duplicate_chain(s->write_buffer, s->unacked_data_len, 1, 0);
+			cbuf *data = cbuf_duplicate_chain_cksum(s->write_buffer, s->unacked_data_len, 1, 0);
 			if(data == NULL)
 				goto out;
 			tcp_socket_send(s, data, PKT_PSH | PKT_ACK, NULL, 0, s->tx_win_low);
@@ -1322,13 +2160,30 @@ static void handle_retransmit_timeout(void *_socket)
 
 	mutex_lock(&s->lock);
 
+	// an ack set it up again while we were waiting for the lock
+	if(s->retransmit_timer.pending)
+		goto out;
+
+	if(s->unacked_data_len == 0
+		|| (s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_1))
+		goto out;
+
 	// XXX check here to see if we've retransmitted too many times
 
-	tcp_retransmit(s);
+	s->num_timeouts++;
 
-	// save 1/2 of the congestion window into ssthresh
-	s->ssthresh = max(s->mss * 2, s->cwnd / 2);
-	s->cwnd = s->mss; // slow start
+	// only the first timeout in a row says anything about how much the path can take
+	if(s->rto_backoffs++ == 0)
+		s->cc.ssthresh = s->cc_ops->ssthresh(&s->cc, s->unacked_data_len);
+	s->cc.cwnd = s->mss; // slow start
+
+	// whatever recovery was going on is over, and they're allowed to have
+	// thrown away what they sacked (rfc 2018 section 8)
+	s->in_recovery = false;
+	s->duplicate_ack_count = 0;
+	tcp_sack_clear(s);
+	s->recover = s->tx_max_seq;
+	s->tracking_rtt = false;
 
 	// exponentially backoff the retransmit timeout
 	s->retransmit_timeout *= 2;
@@ -1338,6 +2193,17 @@ static void handle_retransmit_timeout(void *_socket)
 	if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0)
 		inc_socket_ref(s);
 
+	if(s->state == STATE_FIN_WAIT_1) {
+		// the FIN went out at tx_win_low, so don't move it
+		tcp_retransmit(s);
+	} else {
+		// go back to the first unacked byte and send it all again as slow start allows
+		s->tx_win_low = s->retransmit_tx_seq;
+		s->unacked_data_len = 0;
+		tcp_flush_pending_data(s);
+	}
+
+out:
 	mutex_unlock(&s->lock);
 	dec_socket_ref(s);
 }
@@ -1381,131 +2247,101 @@ static void handle_data(tcp_socket *s, cbuf *buf)
 	tcp_header header;
 	int header_length;
 	uint32 seq_low, seq_high;
+	bool filled_hole;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
 	// copy the header
 	memcpy(&header, cbuf_get_ptr(buf, 0), sizeof(header));
-	header_length = ((header.length_flags >> 12) % 0xf) * 4;
+	header_length = ((header.length_flags >> 12) & 0xf) * 4;
 	seq_low = header.seq_num;
 	seq_high = seq_low + cbuf_get_len(buf) - header_length - 1;
 
 	if(SEQUENCE_LTE(seq_low, s->rx_win_low) && SEQUENCE_GTE(seq_high, s->rx_win_low)) {
 		// it's in order, so truncate from the head and add to the receive buffer
+		filled_hole = (s->reassembly_count > 0);
 		buf = cbuf_truncate_head(buf, header_length + (s->rx_win_low - seq_low), true);
 		s->rx_win_low += cbuf_get_len(buf);
 		s->read_buffer = cbuf_merge_chains(s->read_buffer, buf);
 
 		sem_release(s->read_sem, 1);
+		poll_notify(&s->poll, EVQ_IN);
 
-		// see if any reassembly packets can now be dealt with
-		while(s->reassembly_q) {
-			tcp_header *q_header = (tcp_header *)cbuf_get_ptr(s->reassembly_q, 0);
-			int packet_header_len = ((q_header->length_flags >> 12) % 0xf) * 4;
-			uint32 packet_low = q_header->seq_num;
-			uint32 packet_high = packet_low + cbuf_get_len(s->reassembly_q) - packet_header_len;
-
-			if(SEQUENCE_LT(packet_high, s->rx_win_low)) {
-				/* this packet is totally out of window */
-				cbuf *tmp = s->reassembly_q;
-				s->reassembly_q = tmp->packet_next;
-				cbuf_free_chain(tmp);
-			} else if(SEQUENCE_LTE(packet_low, s->rx_win_low)) {
-				/* a portion of this packet may be useful now */
-				cbuf *tmp = s->reassembly_q;
-				s->reassembly_q = tmp->packet_next;
-
-				tmp = cbuf_truncate_head(tmp, packet_header_len + (s->rx_win_low - packet_low), true);
-				s->rx_win_low += cbuf_get_len(tmp);
-
-				/* merge it with the read data */
-				if(s->read_buffer)
-					s->read_buffer = cbuf_merge_chains(s->read_buffer, tmp);
-				else
-					s->read_buffer = tmp;
-			} else {
-				break;
-			}
-		}
+		// see if any out of order data can now be dealt with
+		tcp_reassembly_pull(s);
 
-		// set up a delayed ack
-		if((int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
+		// set up a delayed ack, unless it plugged a hole and they'll want to hear about it now
+		if(filled_hole || (int)(s->rx_win_low + s->rx_win_size - s->rx_win_high) > (int)s->rx_win_size / 2) {
 			send_ack(s);
 		} else if(set_net_timer(&s->ack_delay_timer, ACK_DELAY, handle_ack_delay_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0) {
 			// a delayed ack timeout was set
 			inc_socket_ref(s);
 		}
 	} else {
-		// packet is out of order, stick it on the reassembly queue
-		if(s->reassembly_q == NULL ||
-		   SEQUENCE_GT(((tcp_header *)cbuf_get_ptr(s->reassembly_q, 0))->seq_num, seq_low)) {
-			// stick it on the head of the queue
-			buf->packet_next = s->reassembly_q;
-			s->reassembly_q = buf;
-		} else {
-			// find the spot in the queue where we need to stick it
-			cbuf *last = s->reassembly_q;
-
-			for(; last; last = last->packet_next) {
-				cbuf *next = last->packet_next;
-				if(next == NULL || SEQUENCE_GT(((tcp_header *)cbuf_get_ptr(next, 0))->seq_num, seq_low)) {
-					// we found a spot
-					buf->packet_next = next;
-					last->packet_next = buf;
-					break;
-				}
-			}
-		}
+		// packet is out of order, hold on to it until the hole in front is filled
+		s->last_ooo_seq = seq_low;
+		tcp_reassembly_insert(s, seq_low, cbuf_truncate_head(buf, header_length, true));
 
-		send_ack(s);
+		// a duplicate ack right away, with the sack blocks for what we've got (rfc 5681 section 4.2)
+		tcp_socket_send(s, NULL, PKT_ACK, NULL, 0, s->tx_win_low);
 	}
 }
 
+// resends the first unacked segment
 static void tcp_retransmit(tcp_socket *s)
 {
-	cbuf *retransmit_data;
-	int retransmit_len;
-	tcp_flags flags = PKT_PSH | PKT_ACK;
+	uint32 retransmit_len;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
-	if((s->state != STATE_ESTABLISHED && s->state != STATE_FIN_WAIT_1)
+	if((s->state != STATE_ESTABLISHED && s->state != STATE_CLOSE_WAIT && s->state != STATE_FIN_WAIT_1)
 		|| s->unacked_data_len == 0)
 		return;
 
-	// slice off some data to retransmit
 	retransmit_len = min(s->unacked_data_len, s->mss);
-	retransmit_data = cbuf_duplicate_chain(s->write_buffer, 0, retransmit_len, 0);
-	tcp_socket_send(s, retransmit_data, flags, NULL, 0, s->retransmit_tx_seq);
-
-	if(s->tracking_rtt) {
-		if(SEQUENCE_LTE(s->retransmit_tx_seq, s->rtt_seq)
-			&& SEQUENCE_GTE(s->retransmit_tx_seq + retransmit_len, s->rtt_seq)) {
-			// Karn sez dont follow this sequence when calculating rtt
-			s->tracking_rtt = false;
-		}
-	}
+	if(SEQUENCE_LT(s->sack_rexmit_next, s->retransmit_tx_seq + retransmit_len))
+		s->sack_rexmit_next = s->retransmit_tx_seq + retransmit_len;
+
+	tcp_retransmit_segment(s, s->retransmit_tx_seq, retransmit_len);
 }
 
 static int tcp_flush_pending_data(tcp_socket *s)
 {
 	int data_flushed = 0;
+	uint32 pipe;
+	uint32 seq;
+	uint32 len;
+	uint32 send_len;
+	cbuf *packet;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
 
 //	dprintf("tcp_flush_pending_data: write_buffer len %d, unacked_data_len %d, tx_win_low %d\n",
 //		cbuf_get_len(s->write_buffer), s->unacked_data_len, s->tx_win_low);
 
+	// sending drops the lock, so everything gets looked at again each time around
 	while(s->write_buffer != NULL
-		&& s->unacked_data_len < cbuf_get_len(s->write_buffer)
-		&& s->unacked_data_len < s->cwnd
-		&& s->state == STATE_ESTABLISHED) {
-		size_t send_len;
-		cbuf *packet;
+		&& (s->state == STATE_ESTABLISHED || s->state == STATE_CLOSE_WAIT)) {
 
-		ASSERT(s->tx_win_high >= s->tx_win_low);
-		ASSERT(s->cwnd >= s->unacked_data_len);
-		send_len = min(min(s->mss, s->tx_win_high - s->tx_win_low), s->cwnd - s->unacked_data_len);
+		// only whole segments, unless there's nothing out at all
+		pipe = tcp_pipe(s);
+		if(pipe > 0 && pipe + s->mss > s->cc.cwnd)
+			break;
+
+		// in a sack recovery the holes go out ahead of new data (rfc 6675)
+		if(s->in_recovery && s->sack_permitted && tcp_sack_next_hole(s, &seq, &len)) {
+			len = min(len, s->mss);
+			s->sack_rexmit_next = seq + len;
+			tcp_retransmit_segment(s, seq, len);
+			data_flushed += len;
+			continue;
+		}
+
+		if(s->unacked_data_len >= cbuf_get_len(s->write_buffer))
+			break;
+
+		ASSERT(SEQUENCE_GTE(s->tx_win_high, s->tx_win_low));
+		send_len = min(s->mss, s->tx_win_high - s->tx_win_low);
 
 		// XXX take care of silly window
 
@@ -1525,40 +2361,56 @@ static int tcp_flush_pending_data(tcp_socket *s)
 
 		send_len = min(send_len, cbuf_get_len(s->write_buffer) - s->unacked_data_len);
 
-		packet = cbuf_duplicate_chain(s->write_buffer, s->unacked_data_len, send_len, 0);
+		packet = cbuf_duplicate_chain_cksum(s->write_buffer, s->unacked_data_len, send_len, 0);
 		if(!packet)
-			return data_flushed;
+			break;
 
+		seq = s->tx_win_low;
 		s->unacked_data_len += send_len;
 		ASSERT(s->unacked_data_len <= cbuf_get_len(s->write_buffer));
 		s->tx_win_low += send_len;
-		if(s->tx_win_low > s->tx_win_high)
+		if(SEQUENCE_GT(s->tx_win_low, s->tx_win_high))
 			dump_socket(s);
-		ASSERT(s->tx_win_low <= s->tx_win_high);
+		ASSERT(SEQUENCE_LTE(s->tx_win_low, s->tx_win_high));
 		data_flushed += send_len;
-		if(!s->tracking_rtt) {
-			// track this packet
-			s->tracking_rtt = true;
-			s->rtt_seq = s->tx_win_low - send_len;
-			s->rtt_seq_timestamp = system_time();
+
+		if(SEQUENCE_GTE(seq, s->tx_max_seq)) {
+			// only time segments going out for the first time
+			if(!s->tracking_rtt) {
+				s->tracking_rtt = true;
+				s->rtt_seq = seq;
+				s->rtt_seq_timestamp = system_time();
+			}
+		} else {
+			// going back over it after a timeout
+			s->num_retransmits++;
 		}
-		tcp_socket_send(s, packet, PKT_ACK, NULL, 0, s->tx_win_low - send_len);
-		s->retransmit_timeout = s->rto;
-		if(cancel_net_timer(&s->retransmit_timer) >= 0)
-			dec_socket_ref(s);
-		if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, 0) >= 0)
+		if(SEQUENCE_GT(s->tx_win_low, s->tx_max_seq))
+			s->tx_max_seq = s->tx_win_low;
+
+		// the timer is for the oldest segment out, so leave it be if it's running
+		if(set_net_timer(&s->retransmit_timer, s->retransmit_timeout, &handle_retransmit_timeout, s, NET_TIMER_PENDING_IGNORE) >= 0)
 			inc_socket_ref(s);
+
+		tcp_socket_send(s, packet, PKT_ACK, NULL, 0, seq);
 	}
 
 	return data_flushed;
 }
 
 static void tcp_send(ipv4_addr dest_addr, uint16 dest_port, ipv4_addr src_addr, uint16 source_port, cbuf *buf, tcp_flags flags,
-	uint32 ack, const void *options, uint16 options_length, uint32 sequence, uint16 window_size)
+	uint32 ack, const void *options, uint16 options_length, uint32 sequence, uint16 window_size, ipv4_route_cache *route)
 {
 	tcp_pseudo_header pheader;
 	tcp_header *header;
 	cbuf *header_buf;
+	bool have_data_sum;
+	uint16 data_sum;
+	uint16 sum;
+
+	// segments cut from the write buffer come with the sum of their data
+	have_data_sum = (buf != NULL && (buf->flags & CBUF_FLAG_CKSUM_VALID));
+	data_sum = have_data_sum ? buf->cksum : 0;
 
 	// grab a buf large enough to hold the header + options
 	header_buf = cbuf_get_chain(sizeof(tcp_header) + options_length);
@@ -1586,9 +2438,16 @@ static void tcp_send(ipv4_addr dest_addr, uint16 dest_port, ipv4_addr src_addr,
 	pheader.tcp_length = htons(cbuf_get_len(header_buf));
 
 	header->checksum = 0;
-	header->checksum = cbuf_ones_cksum16_2(header_buf, 0, cbuf_get_len(header_buf), &pheader, sizeof(pheader));
+	if(have_data_sum) {
+		// the header is a multiple of 4 bytes long, so the data sum lines up as is
+		sum = ones_sum16(0, &pheader, sizeof(pheader));
+		sum = ones_sum16(sum, header, sizeof(tcp_header) + options_length);
+		header->checksum = ~ones_sum16_add(sum, data_sum);
+	} else {
+		header->checksum = cbuf_ones_cksum16_2(header_buf, 0, cbuf_get_len(header_buf), &pheader, sizeof(pheader));
+	}
 
-	ipv4_output(header_buf, dest_addr, IP_PROT_TCP);
+	ipv4_output_route(header_buf, dest_addr, IP_PROT_TCP, route);
 	return;
 
 error:
@@ -1597,7 +2456,10 @@ error:
 
 static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const void *options, uint16 options_length, uint32 sequence)
 {
+	ipv4_route_cache route;
+	uint8 sack_options[TCP_MAX_OPTIONS_LEN];
 	uint32 rx_win_high;
+	uint32 win;
 	uint16 win_size;
 
 	ASSERT_LOCKED_MUTEX(&s->lock);
@@ -1611,11 +2473,23 @@ static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const vo
 #endif
 	if(SEQUENCE_GTE(rx_win_high, s->rx_win_high)) {
 		s->rx_win_high = rx_win_high;
-		win_size = rx_win_high - s->rx_win_low;
+		win = rx_win_high - s->rx_win_low;
 	} else {
 		// the window size has shrunk, but we can't move the
 		// right edge of the window backwards
-		win_size = s->rx_win_high - s->rx_win_low;
+		win = s->rx_win_high - s->rx_win_low;
+	}
+
+	// the window in a SYN is never scaled (rfc 7323 section 2.2)
+	if(!(flags & PKT_SYN))
+		win >>= s->rx_window_shift;
+	win_size = min(win, 0xffff);
+
+	// acks let them know what we have past the hole
+	if(options == NULL && data == NULL && !(flags & PKT_SYN) && s->sack_permitted && s->reassembly_count > 0) {
+		options_length = tcp_build_sack_option(s, sack_options);
+		if(options_length > 0)
+			options = sack_options;
 	}
 
 	// we are piggybacking a pending ACK, so clear the delayed ACK timer
@@ -1624,9 +2498,13 @@ static void tcp_socket_send(tcp_socket *s, cbuf *data, tcp_flags flags, const vo
 			dec_socket_ref(s);
 	}
 
+	// refresh the socket's route while we hold the lock and send with a copy of it
+	ipv4_route_lookup(s->remote_addr, &s->route);
+	route = s->route;
+
 	mutex_unlock(&s->lock);
 	tcp_send(s->remote_addr, s->remote_port, s->local_addr, s->local_port, data, flags, s->rx_win_low,
-			options, options_length, sequence, win_size);
+			options, options_length, sequence, win_size, &route);
 	mutex_lock(&s->lock);
 }
 
@@ -1638,28 +2516,74 @@ static void tcp_remote_close(tcp_socket *s)
 	if(s->state == STATE_CLOSED)
 		return;
 
-	inc_socket_ref(s);
-	mutex_unlock(&s->lock);
-
 	// pull the socket out of the hash table
-	mutex_lock(&socket_table_lock);
-	hash_remove(socket_table, s);
-	mutex_unlock(&socket_table_lock);
-
-	mutex_lock(&s->lock);
+	tcp_hash_remove(s);
 
 	s->last_error = ERR_NET_REMOTE_CLOSE;
 	s->state = STATE_CLOSED;
+	poll_notify(&s->poll, EVQ_IN | EVQ_ERR | EVQ_HUP);
+}
+
+int tcp_poll(void *prot_data, struct poll_waiter *waiter)
+{
+	tcp_socket *s = prot_data;
+	tcp_socket *next;
+	int events = 0;
+
+	inc_socket_ref(s);
+	mutex_lock(&s->lock);
+
+	// a listener hears about new connections without its lock being held, so
+	// the waiter has to be on the list before looking at the accept queue
+	if(waiter)
+		poll_list_add(&s->poll, waiter);
+
+	switch(s->state) {
+		case STATE_LISTEN:
+			// accept takes the head of the queue and waits for it to be established
+			next = queue_peek(&s->accept_queue);
+			if(next && next->state == STATE_ESTABLISHED)
+				events |= EVQ_IN;
+			break;
+		case STATE_SYN_SENT:
+		case STATE_SYN_RCVD:
+			break;
+		case STATE_ESTABLISHED:
+		case STATE_CLOSE_WAIT:
+			if(s->read_buffer != NULL)
+				events |= EVQ_IN;
+			if(s->state == STATE_CLOSE_WAIT)
+				events |= EVQ_IN | EVQ_HUP;
+			if((int)cbuf_get_len(s->write_buffer) < s->tx_write_buf_size)
+				events |= EVQ_OUT;
+			break;
+		default:
+			// reads and writes come right back from here on
+			events |= EVQ_IN | EVQ_HUP;
+			if(s->last_error < 0)
+				events |= EVQ_ERR;
+	}
 
+	mutex_unlock(&s->lock);
 	dec_socket_ref(s);
+
+	return events;
 }
 
 int tcp_init(void)
 {
-	mutex_init(&socket_table_lock, "tcp socket table lock");
+	int err;
+
+	memset(established_table, 0, sizeof(established_table));
+	memset(listen_table, 0, sizeof(listen_table));
+	memset(demux_cpus, 0, sizeof(demux_cpus));
+
+	err = tcp_cc_init();
+	if(err < 0)
+		return err;
 
-	socket_table = hash_init(256, offsetof(tcp_socket, next), &tcp_socket_compare_func, &tcp_socket_hash_func);
-	if(!socket_table)
+	socket_cache = object_cache_create("tcp_socket", sizeof(tcp_socket), 0, NULL, NULL, NULL);
+	if(!socket_cache)
 		return ERR_NO_MEMORY;
 
 	next_ephemeral_port = rand() % 32000 + 1024;
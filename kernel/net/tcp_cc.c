@@ -0,0 +1,129 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/debug.h>
+#include <kernel/lock.h>
+#include <kernel/net/tcp_cc.h>
+#include <newos/errors.h>
+#include <string.h>
+
+static tcp_cc_ops *cc_list;
+static tcp_cc_ops *cc_default;
+static mutex cc_lock;
+
+bool tcp_cc_slow_start(tcp_cc_state *cc, uint32 bytes_acked)
+{
+	if(cc->cwnd >= cc->ssthresh)
+		return false;
+
+	// appropriate byte counting, but a delayed ack can't open it up by more than two segments
+	cc->cwnd += min(bytes_acked, 2 * cc->mss);
+	return true;
+}
+
+/*
+** NewReno (rfc 5681): one more segment per round trip, half of what was in
+** flight after a loss.
+*/
+static void newreno_init(tcp_cc_state *cc)
+{
+}
+
+static void newreno_ack(tcp_cc_state *cc, uint32 bytes_acked)
+{
+	uint32 incr;
+
+	if(tcp_cc_slow_start(cc, bytes_acked))
+		return;
+
+	incr = cc->mss * cc->mss / cc->cwnd;
+	cc->cwnd += max(incr, 1);
+}
+
+static uint32 newreno_ssthresh(tcp_cc_state *cc, uint32 flight_size)
+{
+	return max(flight_size / 2, 2 * cc->mss);
+}
+
+static tcp_cc_ops newreno_ops = {
+	NULL,
+	"newreno",
+	&newreno_init,
+	&newreno_ack,
+	&newreno_ssthresh
+};
+
+tcp_cc_ops *tcp_cc_find(const char *name)
+{
+	tcp_cc_ops *ops;
+
+	mutex_lock(&cc_lock);
+	for(ops = cc_list; ops; ops = ops->next) {
+		if(!strcmp(ops->name, name))
+			break;
+	}
+	mutex_unlock(&cc_lock);
+
+	return ops;
+}
+
+int tcp_cc_register(tcp_cc_ops *ops)
+{
+	if(tcp_cc_find(ops->name) != NULL)
+		return ERR_VFS_ALREADY_EXISTS;
+
+	mutex_lock(&cc_lock);
+	ops->next = cc_list;
+	cc_list = ops;
+	mutex_unlock(&cc_lock);
+
+	return NO_ERROR;
+}
+
+tcp_cc_ops *tcp_cc_get_default(void)
+{
+	return cc_default;
+}
+
+// sockets created from here on use it, the ones already around keep theirs
+int tcp_cc_set_default(const char *name)
+{
+	tcp_cc_ops *ops;
+
+	ops = tcp_cc_find(name);
+	if(!ops)
+		return ERR_NOT_FOUND;
+
+	cc_default = ops;
+	return NO_ERROR;
+}
+
+static void dump_cc(int argc, char **argv)
+{
+	tcp_cc_ops *ops;
+
+	for(ops = cc_list; ops; ops = ops->next)
+		dprintf("%s%s\n", ops->name, ops == cc_default ? " (default)" : "");
+}
+
+int tcp_cc_init(void)
+{
+	int err;
+
+	err = mutex_init(&cc_lock, "tcp cc lock");
+	if(err < 0)
+		return err;
+
+	tcp_cc_register(&newreno_ops);
+	tcp_cubic_init();
+
+	err = tcp_cc_set_default(TCP_CC_DEFAULT);
+	if(err < 0)
+		cc_default = &newreno_ops;
+
+	dbg_add_command(&dump_cc, "tcp_cc", "list the tcp congestion control algorithms");
+
+	return NO_ERROR;
+}
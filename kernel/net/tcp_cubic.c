@@ -0,0 +1,141 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/debug.h>
+#include <kernel/time.h>
+#include <kernel/net/tcp_cc.h>
+
+/*
+** CUBIC (rfc 8312). After a loss the window grows along a cubic curve in
+** real time that levels off at the size it was when the loss happened,
+** so a long fat pipe gets back up to speed without having to count round
+** trips the way reno does. It never does worse than reno would have.
+*/
+
+// C = 0.4 and beta = 0.7, the factors below are worked out from them
+#define CUBIC_BETA_NUM 7
+#define CUBIC_BETA_DEN 10
+
+// longest stretch of the curve that is followed, in ms, keeps the math in range
+#define CUBIC_MAX_T 60000
+
+typedef struct cubic_state {
+	bigtime_t epoch_start;	// 0 when the next ack starts a new epoch
+	uint32 w_max;		// window just before the last reduction, bytes
+	uint32 origin;		// the window the curve levels off at, bytes
+	uint32 k;		// ms into the epoch when the curve gets back to origin
+	uint32 w_est;		// the window reno would have by now, bytes
+} cubic_state;
+
+// the root of anything that fits in 63 bits fits in 21
+static uint32 cubic_cbrt(uint64 a)
+{
+	uint64 x = 0;
+	uint64 t;
+	int bit;
+
+	for(bit = 20; bit >= 0; bit--) {
+		t = x | ((uint64)1 << bit);
+		if(t * t * t <= a)
+			x = t;
+	}
+
+	return x;
+}
+
+static void cubic_init(tcp_cc_state *cc)
+{
+	cubic_state *c = (cubic_state *)cc->priv;
+
+	c->epoch_start = 0;
+	c->w_max = 0;
+	c->origin = 0;
+	c->k = 0;
+	c->w_est = 0;
+}
+
+static void cubic_ack(tcp_cc_state *cc, uint32 bytes_acked)
+{
+	cubic_state *c = (cubic_state *)cc->priv;
+	bigtime_t now = system_time();
+	int64 t;
+	int64 target;
+	int64 delta;
+	uint64 incr;
+
+	if(tcp_cc_slow_start(cc, bytes_acked))
+		return;
+
+	if(c->epoch_start == 0) {
+		c->epoch_start = now;
+		c->w_est = cc->cwnd;
+		if(cc->cwnd < c->w_max) {
+			// K = cbrt((w_max - cwnd) / (C * mss)) seconds, 2.5e9 is 1000^3 / C to get it in ms
+			c->k = cubic_cbrt((uint64)(c->w_max - cc->cwnd) * 2500000000ULL / cc->mss);
+			c->origin = c->w_max;
+		} else {
+			c->k = 0;
+			c->origin = cc->cwnd;
+		}
+	}
+
+	// aim for where the curve will be a round trip from now
+	t = (now - c->epoch_start + cc->srtt) / 1000 - c->k;
+	if(t > CUBIC_MAX_T)
+		t = CUBIC_MAX_T;
+	else if(t < -CUBIC_MAX_T)
+		t = -CUBIC_MAX_T;
+
+	// C * t^3 in segments, in 1/1024ths, then in bytes
+	delta = 4 * t * t * t * 1024 / 10000000000LL;
+	target = (int64)c->origin + delta * cc->mss / 1024;
+
+	// reno grows 3 * (1 - beta) / (1 + beta) segments a round trip at the reduced rate
+	c->w_est += (uint64)bytes_acked * cc->mss * 9 / (17 * (uint64)cc->cwnd);
+	if(target < c->w_est)
+		target = c->w_est;
+
+	if(target > cc->cwnd) {
+		// close the gap over the next round trip, but no faster than 1.5x a round trip
+		incr = (uint64)(target - cc->cwnd) * bytes_acked / cc->cwnd;
+		incr = min(incr, bytes_acked / 2);
+		cc->cwnd += max(incr, 1);
+	} else {
+		// sitting at the plateau, creep up very slowly
+		cc->cwnd += (uint64)cc->mss * bytes_acked / (100 * (uint64)cc->cwnd);
+	}
+}
+
+static uint32 cubic_ssthresh(tcp_cc_state *cc, uint32 flight_size)
+{
+	cubic_state *c = (cubic_state *)cc->priv;
+
+	c->epoch_start = 0;
+
+	// fast convergence: if we lost before getting back to the old max there's
+	// new competition, so let go of some more room for it
+	if(cc->cwnd < c->w_max)
+		c->w_max = (uint64)cc->cwnd * (CUBIC_BETA_DEN + CUBIC_BETA_NUM) / (2 * CUBIC_BETA_DEN);
+	else
+		c->w_max = cc->cwnd;
+
+	return max((uint32)((uint64)cc->cwnd * CUBIC_BETA_NUM / CUBIC_BETA_DEN), 2 * cc->mss);
+}
+
+static tcp_cc_ops cubic_ops = {
+	NULL,
+	"cubic",
+	&cubic_init,
+	&cubic_ack,
+	&cubic_ssthresh
+};
+
+int tcp_cubic_init(void)
+{
+	// the private state has to fit in the space tcp sets aside for it
+	ASSERT(sizeof(cubic_state) <= TCP_CC_PRIV_SIZE);
+
+	return tcp_cc_register(&cubic_ops);
+}
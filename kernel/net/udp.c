@@ -7,9 +7,11 @@
 #include <kernel/lock.h>
 #include <kernel/debug.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/khash.h>
 #include <kernel/sem.h>
 #include <kernel/arch/cpu.h>
+#include <kernel/evq.h>
 #include <kernel/net/udp.h>
 #include <kernel/net/ipv4.h>
 #include <kernel/net/misc.h>
@@ -54,10 +56,13 @@ typedef struct udp_endpoint {
 	uint16 port;
 	udp_queue q;
 	int ref_count;
+	ipv4_route_cache route; // last destination sent to, protected by lock
+	poll_list poll;
 } udp_endpoint;
 
 static udp_endpoint *endpoints;
 static mutex endpoints_lock;
+static object_cache *endpoint_cache;
 static int next_ephemeral_port;
 
 static int udp_endpoint_compare_func(void *_e, const void *_key)
@@ -131,6 +136,8 @@ static void udp_endpoint_release_ref(udp_endpoint *e)
 				cbuf_free_chain(qe->buf);
 			kfree(qe);
 		}
+
+		object_cache_free(endpoint_cache, e);
 	}
 }
 
@@ -212,6 +219,7 @@ int udp_input(cbuf *buf, ifnet *i, ipv4_addr source_address, ipv4_addr target_ad
 
 	mutex_lock(&e->lock);
 	udp_queue_push(&e->q, qe);
+	poll_notify(&e->poll, EVQ_IN);
 	mutex_unlock(&e->lock);
 
 	sem_release(e->blocking_sem, 1);
@@ -231,7 +239,7 @@ int udp_open(void **prot_data)
 {
 	udp_endpoint *e;
 
-	e = kmalloc(sizeof(udp_endpoint));
+	e = object_cache_alloc(endpoint_cache);
 	if(!e)
 		return ERR_NO_MEMORY;
 
@@ -240,6 +248,8 @@ int udp_open(void **prot_data)
 	e->port = 0;
 	e->ref_count = 1;
 	udp_init_queue(&e->q);
+	ipv4_route_cache_init(&e->route);
+	poll_list_init(&e->poll);
 
 	mutex_lock(&endpoints_lock);
 	hash_insert(endpoints, e);
@@ -368,6 +378,24 @@ out:
 	return ret;
 }
 
+int udp_poll(void *prot_data, struct poll_waiter *waiter)
+{
+	udp_endpoint *e = prot_data;
+	int events;
+
+	// sends never block
+	events = EVQ_OUT;
+
+	mutex_lock(&e->lock);
+	if(waiter)
+		poll_list_add(&e->poll, waiter);
+	if(e->q.count > 0)
+		events |= EVQ_IN;
+	mutex_unlock(&e->lock);
+
+	return events;
+}
+
 ssize_t udp_sendto(void *prot_data, const void *inbuf, ssize_t len, sockaddr *toaddr)
 {
 	udp_endpoint *e = prot_data;
@@ -375,7 +403,9 @@ ssize_t udp_sendto(void *prot_data, const void *inbuf, ssize_t len, sockaddr *to
 	int total_len;
 	cbuf *buf;
 	udp_pseudo_header pheader;
-	ipv4_addr srcaddr;
+	ipv4_route_cache route;
+	uint16 data_sum;
+	uint16 sum;
 	int err;
 
 	// make sure the args make sense
@@ -394,19 +424,25 @@ ssize_t udp_sendto(void *prot_data, const void *inbuf, ssize_t len, sockaddr *to
 	if(!buf)
 		return ERR_NO_MEMORY;
 
-	// copy the data to this new buffer
-	err = cbuf_user_memcpy_to_chain(buf, sizeof(udp_header), inbuf, len);
+	// copy the data to this new buffer, checksumming it on the way
+	err = cbuf_user_memcpy_to_chain_cksum(buf, sizeof(udp_header), inbuf, len, &data_sum);
 	if(err < 0) {
 		cbuf_free_chain(buf);
 		return ERR_VM_BAD_USER_MEMORY;
 	}
 
-	// set up the udp pseudo header
-	if(ipv4_lookup_srcaddr_for_dest(NETADDR_TO_IPV4(toaddr->addr), &srcaddr) < 0) {
+	// find the route, the endpoint remembers the one used for the last send
+	mutex_lock(&e->lock);
+	err = ipv4_route_lookup(NETADDR_TO_IPV4(toaddr->addr), &e->route);
+	route = e->route;
+	mutex_unlock(&e->lock);
+	if(err < 0) {
 		cbuf_free_chain(buf);
 		return ERR_NET_NO_ROUTE;
 	}
-	pheader.source_addr = htonl(srcaddr);
+
+	// set up the udp pseudo header
+	pheader.source_addr = htonl(route.if_addr);
 	pheader.dest_addr = htonl(NETADDR_TO_IPV4(toaddr->addr));
 	pheader.zero = 0;
 	pheader.protocol = IP_PROT_UDP;
@@ -418,12 +454,14 @@ ssize_t udp_sendto(void *prot_data, const void *inbuf, ssize_t len, sockaddr *to
 	header->dest_port = htons(toaddr->port);
 	header->length = htons(total_len);
 	header->checksum = 0;
-	header->checksum = cbuf_ones_cksum16_2(buf, 0, total_len, &pheader, sizeof(pheader));
+	sum = ones_sum16(0, &pheader, sizeof(pheader));
+	sum = ones_sum16(sum, header, sizeof(udp_header));
+	header->checksum = ~ones_sum16_add(sum, data_sum);
 	if(header->checksum == 0)
 		header->checksum = 0xffff;
 
 	// send it away
-	err = ipv4_output(buf, NETADDR_TO_IPV4(toaddr->addr), IP_PROT_UDP);
+	err = ipv4_output_route(buf, NETADDR_TO_IPV4(toaddr->addr), IP_PROT_UDP, &route);
 
 	// if it returns ARP_QUEUED, then it's actually okay
 	if(err == ERR_NET_ARP_QUEUED) {
@@ -444,6 +482,10 @@ int udp_init(void)
 	if(!endpoints)
 		return ERR_NO_MEMORY;
 
+	endpoint_cache = object_cache_create("udp_endpoint", sizeof(udp_endpoint), 0, NULL, NULL, NULL);
+	if(!endpoint_cache)
+		return ERR_NO_MEMORY;
+
 	return 0;
 }
 
@@ -7,18 +7,35 @@
 #include <kernel/port.h>
 #include <kernel/sem.h>
 #include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/thread.h>
+#include <kernel/time.h>
 #include <kernel/debug.h>
 #include <kernel/heap.h>
 #include <kernel/vm.h>
+#include <kernel/vm_page.h>
+#include <kernel/id_table.h>
 #include <kernel/cbuf.h>
+#include <kernel/arch/cpu.h>
 #include <newos/errors.h>
 
 #include <string.h>
 #include <stdlib.h>
 
+/*
+ * The message queue is a bounded ring that readers and writers claim slots in
+ * with a compare and swap on tail and head, so nothing serializes on the port
+ * lock. Each slot carries a turn number saying who gets it next: on lap L
+ * around the ring it's the writer's go at 2L and the reader's at 2L + 1.
+ * Readers and writers only go near the semaphores when the ring is empty or
+ * full, registering as a waiter first so the other side knows to wake them.
+ */
 struct port_msg {
+	int		turn;
 	int		msg_code;
 	cbuf*	data_cbuf;
+	vm_page	**data_pages;	// large messages are carried in whole pages instead
+	int		num_pages;
 	size_t	data_len;
 };
 
@@ -27,14 +44,22 @@ struct port_entry {
 	proc_id 			owner;
 	int32 				capacity;
 	int     			lock;
-	char				*name;
-	sem_id				read_sem;
-	sem_id				write_sem;
+	char				name[SYS_MAX_OS_NAME_LEN];
+	sem_id				read_sem;		// readers sleep here while the ring is empty
+	sem_id				write_sem;		// and writers while it's full
+	int					read_waiters;
+	int					write_waiters;
+	int					ref_count;		// threads in the middle of using the port
+	bool				deleted;
+	int					laps;			// head and tail wrap at capacity * laps
 	int					head;
 	int					tail;
 	int					total_count;
 	bool				closed;
 	struct port_msg*	msg_queue;
+	sem_id				page_sem;
+	int					page_waiters;
+	int					queued_pages;
 };
 
 // internal API
@@ -43,16 +68,31 @@ static void _dump_port_info(struct port_entry *port);
 static void dump_port_info(int argc, char **argv);
 
 
-// MAX_PORTS must be power of 2
-#define MAX_PORTS 4096
+// the table starts out with room for PORT_INITIAL_SLOTS and grows from there
+#define MAX_PORTS 16384
+#define PORT_INITIAL_SLOTS 256
 #define MAX_QUEUE_LENGTH 4096
-#define PORT_MAX_MESSAGE_SIZE 65536
 
-static struct port_entry *ports = NULL;
-static region_id port_region = 0;
+// head and tail wrap around before they can overflow the turn numbers
+#define PORT_POS_LIMIT 0x40000000
+
+// messages at least this big are copied into whole pages, which a reader
+// with a page aligned buffer takes over instead of copying them back out
+#define PORT_PAGE_MESSAGE_MIN (4 * PAGE_SIZE)
+// how many pages' worth of messages one port may have queued up before
+// writers block, which is also the biggest message that can be sent
+#define PORT_MAX_QUEUED_PAGES 256
+#define PORT_MAX_PAGE_MESSAGE_SIZE (PORT_MAX_QUEUED_PAGES * PAGE_SIZE)
+
+// pages held by all ports together, capped at a fraction of memory
+static int port_pages_in_use = 0;
+static int port_pages_limit = 0;
+
+static id_table port_table;
 static bool ports_active = false;
 
-static port_id next_port = 0;
+// stands in for ids that point past the end of the table, it never matches
+static struct port_entry invalid_port;
 
 static int port_spinlock = 0;
 #define GRAB_PORT_LIST_LOCK() acquire_spinlock(&port_spinlock)
@@ -60,23 +100,36 @@ static int port_spinlock = 0;
 #define GRAB_PORT_LOCK(s) acquire_spinlock(&(s).lock)
 #define RELEASE_PORT_LOCK(s) release_spinlock(&(s).lock)
 
-int port_init(kernel_args *ka)
+// fields other cpus change underneath us
+#define PORT_VOLATILE(x) (*(volatile int *)&(x))
+
+#define WRITE_TURN(port, pos) (((pos) / (port)->capacity) * 2)
+#define READ_TURN(port, pos) (WRITE_TURN(port, pos) + 1)
+
+static struct port_entry *port_lookup(port_id id)
 {
-	int i;
-	int sz;
+	struct port_entry *port = id_table_lookup(&port_table, id);
 
-	sz = sizeof(struct port_entry) * MAX_PORTS;
+	return port ? port : &invalid_port;
+}
+
+static void init_port_entry(void *_port)
+{
+	struct port_entry *port = (struct port_entry *)_port;
 
-	// create and initialize semaphore table
-	port_region = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "port_table", (void **)&ports,
-		REGION_ADDR_ANY_ADDRESS, sz, REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL);
-	if(port_region < 0) {
+	port->id = -1;
+}
+
+int port_init(kernel_args *ka)
+{
+	// create and initialize port table
+	if(id_table_init(&port_table, sizeof(struct port_entry), MAX_PORTS, PORT_INITIAL_SLOTS,
+		&port_spinlock, &init_port_entry) < 0) {
 		panic("unable to allocate kernel port table!\n");
 	}
+	invalid_port.id = -1;
 
-	memset(ports, 0, sz);
-	for(i=0; i<MAX_PORTS; i++)
-		ports[i].id = -1;
+	port_pages_limit = vm_get_mem_size() / PAGE_SIZE / 8;
 
 	// add debugger commands
 	dbg_add_command(&dump_port_list, "ports", "Dump a list of all active ports");
@@ -89,32 +142,36 @@ int port_init(kernel_args *ka)
 
 void dump_port_list(int argc, char **argv)
 {
+	struct port_entry *port;
 	int i;
 
-	for(i=0; i<MAX_PORTS; i++) {
-		if(ports[i].id >= 0) {
-			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", &ports[i], ports[i].id, ports[i].name);
+	for(i=0; i<port_table.num_slots; i++) {
+		port = id_table_slot(&port_table, i);
+		if(port->id >= 0) {
+			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", port, port->id, port->name);
 		}
 	}
+	dprintf("%d of %d slots free\n", port_table.free_count, port_table.num_slots);
+	dprintf("message pages in use: %d of %d\n", port_pages_in_use, port_pages_limit);
 }
 
 static void _dump_port_info(struct port_entry *port)
 {
-	int cnt;
 	dprintf("PORT:   %p\n", port);
 	dprintf("name:  '%s'\n", port->name);
 	dprintf("owner: 0x%x\n", port->owner);
 	dprintf("cap:  %d\n", port->capacity);
 	dprintf("head: %d\n", port->head);
 	dprintf("tail: %d\n", port->tail);
- 	sem_get_count(port->read_sem, &cnt);
- 	dprintf("read_sem:  %d\n", cnt);
- 	sem_get_count(port->write_sem, &cnt);
-	dprintf("write_sem: %d\n", cnt);
+	dprintf("refs: %d%s\n", port->ref_count, port->deleted ? " (deleted)" : "");
+	dprintf("queued pages: %d (%d waiting)\n", port->queued_pages, port->page_waiters);
+	dprintf("read_waiters:  %d\n", port->read_waiters);
+	dprintf("write_waiters: %d\n", port->write_waiters);
 }
 
 static void dump_port_info(int argc, char **argv)
 {
+	struct port_entry *port;
 	int i;
 
 	if(argc < 2) {
@@ -128,38 +185,389 @@ static void dump_port_info(int argc, char **argv)
 
 		if(is_kernel_address(num)) {
 			// XXX semi-hack
-			// one can use either address or a port_id, since KERNEL_BASE > MAX_PORTS assumed
+			// one can use either address or a port_id, since KERNEL_BASE > any port_id assumed
 			_dump_port_info((struct port_entry *)num);
 			return;
 		} else {
-			unsigned slot = num % MAX_PORTS;
-			if(ports[slot].id != (int)num) {
+			port = port_lookup(num);
+			if(port->id != (int)num) {
 				dprintf("port 0x%lx doesn't exist!\n", num);
 				return;
 			}
-			_dump_port_info(&ports[slot]);
+			_dump_port_info(port);
 			return;
 		}
 	}
 
 	// walk through the ports list, trying to match name
-	for(i=0; i<MAX_PORTS; i++) {
-		if (ports[i].name != NULL)
-			if(strcmp(argv[1], ports[i].name) == 0) {
-				_dump_port_info(&ports[i]);
-				return;
+	for(i=0; i<port_table.num_slots; i++) {
+		port = id_table_slot(&port_table, i);
+		if(port->id >= 0 && strcmp(argv[1], port->name) == 0) {
+			_dump_port_info(port);
+			return;
+		}
+	}
+}
+
+// Looks up a live port and keeps it from being torn down until
+// port_put_ref(). The ref goes up before the checks and port_delete marks
+// the port before it looks at the refs, so one of the two always sees the other.
+static struct port_entry *port_get_ref(port_id id)
+{
+	struct port_entry *port;
+
+	port = id_table_lookup(&port_table, id);
+	if(port == NULL)
+		return NULL;
+
+	atomic_add(&port->ref_count, 1);
+	arch_cpu_memory_barrier();
+
+	if(PORT_VOLATILE(port->id) != id || port->deleted) {
+		atomic_add(&port->ref_count, -1);
+		return NULL;
+	}
+
+	return port;
+}
+
+static void port_put_ref(struct port_entry *port)
+{
+	atomic_add(&port->ref_count, -1);
+}
+
+static int port_next_pos(struct port_entry *port, int pos)
+{
+	return (pos + 1 == port->capacity * port->laps) ? 0 : pos + 1;
+}
+
+static int port_queue_count(struct port_entry *port)
+{
+	int count = PORT_VOLATILE(port->head) - PORT_VOLATILE(port->tail);
+
+	if(count < 0)
+		count += port->capacity * port->laps;
+
+	return min(count, port->capacity);
+}
+
+static bool port_writable(struct port_entry *port)
+{
+	int pos = PORT_VOLATILE(port->head);
+
+	return PORT_VOLATILE(port->msg_queue[pos % port->capacity].turn) == WRITE_TURN(port, pos);
+}
+
+static bool port_readable(struct port_entry *port)
+{
+	int pos = PORT_VOLATILE(port->tail);
+
+	return PORT_VOLATILE(port->msg_queue[pos % port->capacity].turn) == READ_TURN(port, pos);
+}
+
+// claims the slot at the head of the ring for a writer, NULL if it's full
+static struct port_msg *port_claim_write_slot(struct port_entry *port, int *_pos)
+{
+	struct port_msg *msg;
+	int pos;
+
+	for(;;) {
+		pos = PORT_VOLATILE(port->head);
+		msg = &port->msg_queue[pos % port->capacity];
+
+		if(PORT_VOLATILE(msg->turn) == WRITE_TURN(port, pos)) {
+			if(test_and_set(&port->head, port_next_pos(port, pos), pos) == pos)
+				break;
+		} else if(PORT_VOLATILE(port->head) == pos) {
+			// still holding last lap's message
+			return NULL;
+		}
+	}
+
+	*_pos = pos;
+	return msg;
+}
+
+// claims the slot at the tail of the ring for a reader, NULL if it's empty
+static struct port_msg *port_claim_read_slot(struct port_entry *port, int *_pos)
+{
+	struct port_msg *msg;
+	int pos;
+
+	for(;;) {
+		pos = PORT_VOLATILE(port->tail);
+		msg = &port->msg_queue[pos % port->capacity];
+
+		if(PORT_VOLATILE(msg->turn) == READ_TURN(port, pos)) {
+			if(test_and_set(&port->tail, port_next_pos(port, pos), pos) == pos)
+				break;
+		} else if(PORT_VOLATILE(port->tail) == pos) {
+			// nothing written there yet
+			return NULL;
+		}
+	}
+
+	// don't look at the message before we've seen its turn come up
+	arch_cpu_memory_barrier();
+
+	*_pos = pos;
+	return msg;
+}
+
+static void port_unwait(int *waiters)
+{
+	int w;
+
+	while((w = PORT_VOLATILE(*waiters)) > 0) {
+		if(test_and_set(waiters, w - 1, w) == w)
+			break;
+	}
+}
+
+// wakes up one of the threads sleeping on the other end of the ring, if any
+static void port_wake(int *waiters, sem_id sem)
+{
+	int w;
+
+	// the slot we just handed over has to be visible before we look
+	arch_cpu_memory_barrier();
+
+	while((w = PORT_VOLATILE(*waiters)) > 0) {
+		if(test_and_set(waiters, w - 1, w) == w) {
+			sem_release(sem, 1);
+			break;
+		}
+	}
+}
+
+// Sleeps until the ring might have room (or a message, for a reader). The
+// waiter count goes up before the last look at the ring, so a wakeup can't
+// get lost in between. Spurious wakeups are fine, callers just try again.
+static int port_wait(struct port_entry *port, bool reader, uint32 flags, bigtime_t deadline)
+{
+	int *waiters = reader ? &port->read_waiters : &port->write_waiters;
+	sem_id sem = reader ? port->read_sem : port->write_sem;
+	bigtime_t timeout = 0;
+	int res;
+
+	if(flags & PORT_FLAG_TIMEOUT) {
+		timeout = deadline - system_time();
+		if(timeout < 0)
+			timeout = 0;
+	}
+
+	atomic_add(waiters, 1);
+	arch_cpu_memory_barrier();
+
+	if(port->deleted || (reader ? port_readable(port) : port_writable(port))) {
+		port_unwait(waiters);
+		return port->deleted ? ERR_PORT_DELETED : NO_ERROR;
+	}
+
+	res = sem_acquire_etc(sem, 1, flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
+	if(res < 0) {
+		port_unwait(waiters);
+
+		// the sem may have gone away before we even got to sleep on it
+		if(port->deleted)
+			return ERR_PORT_DELETED;
+		if(res == ERR_SEM_TIMED_OUT) {
+			// timed out, or, if timeout=0, 'would block'
+			return ERR_PORT_TIMED_OUT;
+		}
+		return res;
+	}
+
+	return NO_ERROR;
+}
+
+static void port_free_pages(vm_page **pages, int num_pages)
+{
+	int i;
+
+	// pages the reader took over are already NULLed out
+	for(i = 0; i < num_pages; i++) {
+		if(pages[i] != NULL)
+			vm_page_set_state(pages[i], PAGE_STATE_FREE);
+	}
+	kfree(pages);
+}
+
+// charges num_pages against the port and the global limit, waiting for
+// readers to drain the port if it has too many queued already
+static int port_reserve_pages(struct port_entry *port, int num_pages, uint32 flags, bigtime_t deadline)
+{
+	sem_id cached_semid;
+	bigtime_t timeout = 0;
+	int res;
+
+	for(;;) {
+		int_disable_interrupts();
+		GRAB_PORT_LOCK(*port);
+
+		if(port->deleted) {
+			RELEASE_PORT_LOCK(*port);
+			int_restore_interrupts();
+			return ERR_PORT_DELETED;
+		}
+
+		if(port->queued_pages + num_pages <= PORT_MAX_QUEUED_PAGES) {
+			if(atomic_add(&port_pages_in_use, num_pages) + num_pages > port_pages_limit) {
+				atomic_add(&port_pages_in_use, -num_pages);
+				RELEASE_PORT_LOCK(*port);
+				int_restore_interrupts();
+				return ERR_NO_MEMORY;
 			}
+			port->queued_pages += num_pages;
+			RELEASE_PORT_LOCK(*port);
+			int_restore_interrupts();
+			return NO_ERROR;
+		}
+
+		port->page_waiters++;
+		cached_semid = port->page_sem;
+
+		RELEASE_PORT_LOCK(*port);
+		int_restore_interrupts();
+
+		if(flags & PORT_FLAG_TIMEOUT) {
+			timeout = deadline - system_time();
+			if(timeout < 0)
+				timeout = 0;
+		}
+
+		res = sem_acquire_etc(cached_semid, 1,
+							flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
+		if (res < 0) {
+			// we never got woken up, so take ourselves off the count
+			int_disable_interrupts();
+			GRAB_PORT_LOCK(*port);
+			if(port->page_waiters > 0)
+				port->page_waiters--;
+			RELEASE_PORT_LOCK(*port);
+			int_restore_interrupts();
+
+			if(port->deleted)
+				return ERR_PORT_DELETED;
+			return (res == ERR_SEM_TIMED_OUT) ? ERR_PORT_TIMED_OUT : res;
+		}
 	}
 }
 
+static void port_unreserve_pages(struct port_entry *port, int num_pages)
+{
+	sem_id cached_semid;
+	int waiters;
+
+	atomic_add(&port_pages_in_use, -num_pages);
+
+	int_disable_interrupts();
+	GRAB_PORT_LOCK(*port);
+
+	port->queued_pages -= num_pages;
+	waiters = port->page_waiters;
+	port->page_waiters = 0;
+	cached_semid = port->page_sem;
+
+	RELEASE_PORT_LOCK(*port);
+	int_restore_interrupts();
+
+	if(waiters > 0)
+		sem_release(cached_semid, waiters);
+}
+
+// copies a message into freshly allocated pages
+static int port_copy_to_pages(vm_page ***_pages, int num_pages, const void *buf, size_t len, bool user)
+{
+	vm_page **pages;
+	addr_t va;
+	size_t copy_len;
+	int err = NO_ERROR;
+	int i;
+
+	pages = kmalloc(num_pages * sizeof(vm_page *));
+	if(pages == NULL)
+		return ERR_NO_MEMORY;
+
+	err = vm_page_allocate_pages(num_pages, PAGE_STATE_FREE, pages);
+	if(err < 0) {
+		kfree(pages);
+		return err;
+	}
+
+	for(i = 0; i < num_pages; i++) {
+		// nobody else knows about them, but keep the page scanner's hands off
+		vm_page_set_state(pages[i], PAGE_STATE_WIRED);
+
+		if(err < 0)
+			continue;
+
+		copy_len = min(len, PAGE_SIZE);
+		vm_get_physical_page(pages[i]->ppn * PAGE_SIZE, &va, PHYSICAL_PAGE_CAN_WAIT);
+		if(user)
+			err = user_memcpy((void *)va, buf, copy_len);
+		else
+			memcpy((void *)va, buf, copy_len);
+		vm_put_physical_page(va);
+
+		buf = (const char *)buf + copy_len;
+		len -= copy_len;
+	}
+
+	if(err < 0) {
+		port_free_pages(pages, num_pages);
+		return err;
+	}
+
+	*_pages = pages;
+	return NO_ERROR;
+}
+
+// copies a page message out to the reader. Whole pages going to a page aligned
+// user buffer are handed over to the reader's address space instead, and the
+// slots in the array they came from are NULLed out
+static int port_copy_from_pages(void *buf, vm_page **pages, size_t len, bool user)
+{
+	addr_t va;
+	size_t copy_len;
+	int moved = 0;
+	int err;
+	int i;
+
+	if(user && len >= PAGE_SIZE && ((addr_t)buf % PAGE_SIZE) == 0) {
+		moved = vm_move_pages_to_user(buf, pages, len / PAGE_SIZE);
+		for(i = 0; i < moved; i++)
+			pages[i] = NULL;
+		buf = (char *)buf + moved * PAGE_SIZE;
+		len -= moved * PAGE_SIZE;
+	}
+
+	for(i = moved; len > 0; i++) {
+		copy_len = min(len, PAGE_SIZE);
+		vm_get_physical_page(pages[i]->ppn * PAGE_SIZE, &va, PHYSICAL_PAGE_CAN_WAIT);
+		if(user) {
+			err = user_memcpy(buf, (void *)va, copy_len);
+		} else {
+			memcpy(buf, (void *)va, copy_len);
+			err = NO_ERROR;
+		}
+		vm_put_physical_page(va);
+		if(err < 0)
+			return err;
+
+		buf = (char *)buf + copy_len;
+		len -= copy_len;
+	}
+
+	return NO_ERROR;
+}
+
 port_id
 port_create(int32 queue_length, const char *name)
 {
-	int 	i;
-	sem_id 	sem_r, sem_w;
-	port_id retval;
-	char 	*temp_name;
-	int 	name_len;
+	struct port_entry *port;
+	sem_id 	sem_r, sem_w, sem_p;
+	port_id id;
 	void 	*q;
 	proc_id	owner;
 
@@ -169,125 +577,123 @@ port_create(int32 queue_length, const char *name)
 	if(name == NULL)
 		name = "unnamed port";
 
-	name_len = strlen(name) + 1;
-	name_len = min(name_len, SYS_MAX_OS_NAME_LEN);
-
-	temp_name = (char *)kmalloc(name_len);
-	if(temp_name == NULL)
-		return ERR_NO_MEMORY;
-
-	strlcpy(temp_name, name, name_len);
-
 	// check queue length
-	if (queue_length < 1 || queue_length > MAX_QUEUE_LENGTH) {
-		kfree(temp_name);
+	if (queue_length < 1 || queue_length > MAX_QUEUE_LENGTH)
 		return ERR_INVALID_ARGS;
-	}
 
-	// alloc a queue
+	// alloc a queue, every slot starts out on the writers' turn of lap 0
 	q = kmalloc( queue_length * sizeof(struct port_msg) );
-	if (q == NULL) {
-		kfree(temp_name); // dealloc name, too
+	if (q == NULL)
 		return ERR_NO_MEMORY;
-	}
+	memset(q, 0, queue_length * sizeof(struct port_msg));
 
-	// create sem_r with owner set to -1
-	sem_r = sem_create_etc(0, temp_name, -1);
+	// the sems only put threads to sleep, the ring keeps its own counts
+	sem_r = sem_create_etc(0, name, -1);
 	if (sem_r < 0) {
 		// cleanup
-		kfree(temp_name);
 		kfree(q);
 		return sem_r;
 	}
 
-	// create sem_w
-	sem_w = sem_create_etc(queue_length, temp_name, -1);
+	sem_w = sem_create_etc(0, name, -1);
 	if (sem_w < 0) {
 		// cleanup
 		sem_delete(sem_r);
-		kfree(temp_name);
 		kfree(q);
 		return sem_w;
 	}
+
+	// writers of page messages wait here when the port has too many queued
+	sem_p = sem_create_etc(0, name, -1);
+	if (sem_p < 0) {
+		sem_delete(sem_w);
+		sem_delete(sem_r);
+		kfree(q);
+		return sem_p;
+	}
 	owner = proc_get_current_proc_id();
 
+	// top the table back up before it runs dry
+	if(id_table_needs_grow(&port_table))
+		id_table_grow(&port_table);
+
 	int_disable_interrupts();
 	GRAB_PORT_LIST_LOCK();
 
-	// find the first empty spot
-	for(i=0; i<MAX_PORTS; i++) {
-		if(ports[i].id == -1) {
-			// make the port_id be a multiple of the slot it's in
-			if(i >= next_port % MAX_PORTS) {
-				next_port += i - next_port % MAX_PORTS;
-			} else {
-				next_port += MAX_PORTS - (next_port % MAX_PORTS - i);
-			}
-			ports[i].id		= next_port++;
-			ports[i].lock	= 0;
-			GRAB_PORT_LOCK(ports[i]);
-			RELEASE_PORT_LIST_LOCK();
+	// grab a free slot, the id it comes with says which slot it is
+	port = id_table_alloc(&port_table, &id);
+	if(port == NULL) {
+		// not enough ports...
+		RELEASE_PORT_LIST_LOCK();
+		int_restore_interrupts();
+		dprintf("port_create(): ERR_PORT_OUT_OF_SLOTS\n");
 
-			ports[i].capacity	= queue_length;
-			ports[i].name 		= temp_name;
-
-			// assign sem
-			ports[i].read_sem	= sem_r;
-			ports[i].write_sem	= sem_w;
-			ports[i].msg_queue	= q;
-			ports[i].head 		= 0;
-			ports[i].tail 		= 0;
-			ports[i].total_count= 0;
-			ports[i].owner 		= owner;
-			retval = ports[i].id;
-			RELEASE_PORT_LOCK(ports[i]);
-			goto out;
-		}
+		// cleanup
+		sem_delete(sem_p);
+		sem_delete(sem_w);
+		sem_delete(sem_r);
+		kfree(q);
+		return ERR_PORT_OUT_OF_SLOTS;
 	}
-	// not enough ports...
-	RELEASE_PORT_LIST_LOCK();
-	kfree(q);
-	kfree(temp_name);
-	retval = ERR_PORT_OUT_OF_SLOTS;
-	dprintf("port_create(): ERR_PORT_OUT_OF_SLOTS\n");
-
-	// cleanup
-	sem_delete(sem_w);
-	sem_delete(sem_r);
-	kfree(temp_name);
-	kfree(q);
 
-out:
+	GRAB_PORT_LOCK(*port);
+
+	port->capacity		= queue_length;
+	port->laps			= PORT_POS_LIMIT / queue_length;
+	strlcpy(port->name, name, sizeof(port->name));
+
+	// assign sem
+	port->read_sem		= sem_r;
+	port->write_sem		= sem_w;
+	port->read_waiters	= 0;
+	port->write_waiters	= 0;
+	port->page_sem		= sem_p;
+	port->page_waiters	= 0;
+	port->queued_pages	= 0;
+	port->msg_queue		= q;
+	port->head 			= 0;
+	port->tail 			= 0;
+	port->total_count	= 0;
+	port->owner 		= owner;
+	port->closed		= false;
+	port->deleted		= false;
+
+	// the lock free lookups go by the id alone, so it goes in last
+	arch_cpu_memory_barrier();
+	port->id			= id;
+
+	RELEASE_PORT_LOCK(*port);
+	RELEASE_PORT_LIST_LOCK();
 	int_restore_interrupts();
 
-	return retval;
+	return id;
 }
 
 int
 port_close(port_id id)
 {
-	int		slot;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
-	slot = id % MAX_PORTS;
+	port = port_lookup(id);
 
 	// walk through the sem list, trying to match name
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if (ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if (port->id != id || port->deleted) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		return ERR_INVALID_HANDLE;
 	}
 
 	// mark port to disable writing
-	ports[slot].closed = true;
+	port->closed = true;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -296,12 +702,11 @@ port_close(port_id id)
 int
 port_delete(port_id id)
 {
-	int slot;
-	sem_id	r_sem, w_sem;
+	struct port_entry *port;
+	sem_id	r_sem, w_sem, p_sem;
 	int capacity;
 	int i;
 
-	char *old_name;
 	struct port_msg *q;
 
 	if(ports_active == false)
@@ -309,43 +714,67 @@ port_delete(port_id id)
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = port_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id || port->deleted) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_delete: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	/* mark port as invalid */
-	ports[slot].id	 = -1;
-	old_name 		 = ports[slot].name;
-	q				 = ports[slot].msg_queue;
-	r_sem			 = ports[slot].read_sem;
-	w_sem			 = ports[slot].write_sem;
-	capacity		 = ports[slot].capacity;
-	ports[slot].name = NULL;
+	/* keep anybody new from getting at the port */
+	port->deleted = true;
+	r_sem			 = port->read_sem;
+	w_sem			 = port->write_sem;
+	p_sem			 = port->page_sem;
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
+	int_restore_interrupts();
+
+	arch_cpu_memory_barrier();
+
+	// release the threads that were blocking on this port by deleting the sems.
+	// Anybody on their way to sleep finds the sem gone and sees the port is deleted
+	sem_delete(r_sem);
+	sem_delete(w_sem);
+	sem_delete(p_sem);
+
+	// wait for everybody still in the middle of a call to let go, after
+	// that nobody can touch the queue anymore
+	while(PORT_VOLATILE(port->ref_count) > 0)
+		thread_snooze(1000);
+
+	int_disable_interrupts();
+	GRAB_PORT_LIST_LOCK();
+	GRAB_PORT_LOCK(*port);
+
+	/* mark port as invalid and give the slot back */
+	port->id		= -1;
+	q				= port->msg_queue;
+	capacity		= port->capacity;
+	port->name[0]	= 0;
+	port->msg_queue	= NULL;
+
+	RELEASE_PORT_LOCK(*port);
+	id_table_free(&port_table, id);
+	RELEASE_PORT_LIST_LOCK();
 	int_restore_interrupts();
 
 	// delete the cbuf's that are left in the queue (if any)
 	for (i=0; i<capacity; i++) {
 		if (q[i].data_cbuf != NULL)
 	 		cbuf_free_chain(q[i].data_cbuf);
+		if (q[i].data_pages != NULL) {
+			port_free_pages(q[i].data_pages, q[i].num_pages);
+			atomic_add(&port_pages_in_use, -q[i].num_pages);
+		}
 	}
 
 	kfree(q);
-	kfree(old_name);
-
-	// release the threads that were blocking on this port by deleting the sem
-	// read_port() will see the ERR_SEM_DELETED acq_sem() return value, and act accordingly
-	sem_delete(r_sem);
-	sem_delete(w_sem);
 
 	return NO_ERROR;
 }
@@ -366,15 +795,17 @@ port_find(const char *port_name)
 	GRAB_PORT_LIST_LOCK();
 
 	// loop over list
-	for(i=0; i<MAX_PORTS; i++) {
+	for(i=0; i<port_table.num_slots; i++) {
+		struct port_entry *port = id_table_slot(&port_table, i);
+
 		// lock every individual port before comparing
-		GRAB_PORT_LOCK(ports[i]);
-		if(ports[i].id >= 0 && strcmp(port_name, ports[i].name) == 0) {
-			ret_val = ports[i].id;
-			RELEASE_PORT_LOCK(ports[i]);
+		GRAB_PORT_LOCK(*port);
+		if(port->id >= 0 && !port->deleted && strcmp(port_name, port->name) == 0) {
+			ret_val = port->id;
+			RELEASE_PORT_LOCK(*port);
 			break;
 		}
-		RELEASE_PORT_LOCK(ports[i]);
+		RELEASE_PORT_LOCK(*port);
 	}
 
 	RELEASE_PORT_LIST_LOCK();
@@ -386,7 +817,7 @@ port_find(const char *port_name)
 int
 port_get_info(port_id id, struct port_info *info)
 {
-	int slot;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
@@ -395,27 +826,27 @@ port_get_info(port_id id, struct port_info *info)
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = port_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id || port->deleted) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_get_info: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
 	// fill a port_info struct with info
-	info->id			= ports[slot].id;
-	info->owner 		= ports[slot].owner;
-	strncpy(info->name, ports[slot].name, min(strlen(ports[slot].name),SYS_MAX_OS_NAME_LEN-1));
-	info->capacity		= ports[slot].capacity;
-	sem_get_count(ports[slot].read_sem, &info->queue_count);
-	info->total_count	= ports[slot].total_count;
-
-	RELEASE_PORT_LOCK(ports[slot]);
+	info->id			= port->id;
+	info->owner 		= port->owner;
+	strlcpy(info->name, port->name, sizeof(info->name));
+	info->capacity		= port->capacity;
+	info->queue_count	= port_queue_count(port);
+	info->total_count	= port->total_count;
+
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	// from our port_entry
@@ -427,6 +858,7 @@ port_get_next_port_info(proc_id proc,
 						uint32 *cookie,
 						struct port_info *info)
 {
+	struct port_entry *port;
 	int slot;
 
 	if(ports_active == false)
@@ -438,9 +870,9 @@ port_get_next_port_info(proc_id proc,
 		// return first found
 		slot = 0;
 	} else {
-		// start at index cookie, but check cookie against MAX_PORTS
+		// start at index cookie, but check cookie against the table size
 		slot = *cookie;
-		if (slot >= MAX_PORTS)
+		if (slot >= port_table.num_slots)
 			return ERR_INVALID_HANDLE;
 	}
 
@@ -449,23 +881,24 @@ port_get_next_port_info(proc_id proc,
 	GRAB_PORT_LIST_LOCK();
 
 	info->id = -1; // used as found flag
-	while (slot < MAX_PORTS) {
-		GRAB_PORT_LOCK(ports[slot]);
-		if (ports[slot].id != -1)
-			if (ports[slot].owner == proc) {
+	while (slot < port_table.num_slots) {
+		port = id_table_slot(&port_table, slot);
+		GRAB_PORT_LOCK(*port);
+		if (port->id != -1 && !port->deleted)
+			if (port->owner == proc) {
 				// found one!
 				// copy the info
-				info->id			= ports[slot].id;
-				info->owner 		= ports[slot].owner;
-				strncpy(info->name, ports[slot].name, min(strlen(ports[slot].name),SYS_MAX_OS_NAME_LEN-1));
-				info->capacity		= ports[slot].capacity;
-				sem_get_count(ports[slot].read_sem, &info->queue_count);
-				info->total_count	= ports[slot].total_count;
-				RELEASE_PORT_LOCK(ports[slot]);
+				info->id			= port->id;
+				info->owner 		= port->owner;
+				strlcpy(info->name, port->name, sizeof(info->name));
+				info->capacity		= port->capacity;
+				info->queue_count	= port_queue_count(port);
+				info->total_count	= port->total_count;
+				RELEASE_PORT_LOCK(*port);
 				slot++;
 				break;
 			}
-		RELEASE_PORT_LOCK(ports[slot]);
+		RELEASE_PORT_LOCK(*port);
 		slot++;
 	}
 	RELEASE_PORT_LIST_LOCK();
@@ -488,64 +921,59 @@ port_buffer_size_etc(port_id id,
 					uint32 flags,
 					bigtime_t timeout)
 {
-	int slot;
-	int res;
-	int t;
-	int len;
+	struct port_entry *port;
+	struct port_msg *msg;
+	bigtime_t deadline = 0;
+	ssize_t len;
+	int pos;
+	int err;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
-	if(id < 0)
-		return ERR_INVALID_HANDLE;
-
-	slot = id % MAX_PORTS;
 
-	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	flags = flags & (PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT);
+	if(flags & PORT_FLAG_TIMEOUT)
+		deadline = system_time() + timeout;
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
-		int_restore_interrupts();
-		dprintf("port_get_info: invalid port_id %d\n", id);
+	port = port_get_ref(id);
+	if(port == NULL) {
+		dprintf("port_buffer_size_etc: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
-	RELEASE_PORT_LOCK(ports[slot]);
-	int_restore_interrupts();
 
 	// block if no message,
 	// if TIMEOUT flag set, block with timeout
+	for(;;) {
+		if(port->deleted) {
+			len = ERR_PORT_DELETED;
+			break;
+		}
 
-	// XXX - is it a race condition to acquire a sem just after we
-	// unlocked the port ?
-	// XXX: call an acquire_sem which does the release lock, restore int & block the right way
-	res = sem_acquire_etc(ports[slot].read_sem, 1, flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
+		// peek at the length of the message at the tail, making sure
+		// no reader took it away while we were looking
+		pos = PORT_VOLATILE(port->tail);
+		msg = &port->msg_queue[pos % port->capacity];
+		if(PORT_VOLATILE(msg->turn) == READ_TURN(port, pos)) {
+			arch_cpu_memory_barrier();
+			len = msg->data_len;
+			arch_cpu_memory_barrier();
+			if(PORT_VOLATILE(port->tail) == pos)
+				break;
+			continue;
+		}
 
-	GRAB_PORT_LOCK(ports[slot]);
-	if (res == ERR_SEM_DELETED) {
-		// somebody deleted the port
-		RELEASE_PORT_LOCK(ports[slot]);
-		return ERR_PORT_DELETED;
-	}
-	if (res == ERR_SEM_TIMED_OUT) {
-		RELEASE_PORT_LOCK(ports[slot]);
-		return ERR_PORT_TIMED_OUT;
+		err = port_wait(port, true, flags, deadline);
+		if(err < 0) {
+			len = err;
+			break;
+		}
 	}
 
-	// once message arrived, read data's length
-
-	// determine tail
-	// read data's head length
-	t = ports[slot].head;
-	if (t < 0)
-		panic("port %id: tail < 0", ports[slot].id);
-	if (t > ports[slot].capacity)
-		panic("port %id: tail > cap %d", ports[slot].id, ports[slot].capacity);
-	len = ports[slot].msg_queue[t].data_len;
-
-	// restore readsem
-	sem_release(ports[slot].read_sem, 1);
+	// a reader may have gone to sleep behind us
+	if(port_readable(port))
+		port_wake(&port->read_waiters, port->read_sem);
 
-	RELEASE_PORT_LOCK(ports[slot]);
+	port_put_ref(port);
 
 	// return length of item at end of queue
 	return len;
@@ -554,35 +982,23 @@ port_buffer_size_etc(port_id id,
 int32
 port_count(port_id id)
 {
-	int slot;
+	struct port_entry *port;
 	int count;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
-	if(id < 0)
-		return ERR_INVALID_HANDLE;
-
-	slot = id % MAX_PORTS;
-
-	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
-		int_restore_interrupts();
+	port = port_get_ref(id);
+	if(port == NULL) {
 		dprintf("port_count: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	sem_get_count(ports[slot].read_sem, &count);
-	// do not return negative numbers
-	if (count < 0)
-		count = 0;
+	count = port_queue_count(port);
 
-	RELEASE_PORT_LOCK(ports[slot]);
-	int_restore_interrupts();
+	port_put_ref(port);
 
-	// return count of messages (sem_count)
+	// return count of messages
 	return count;
 }
 
@@ -603,12 +1019,14 @@ port_read_etc(port_id id,
 				uint32	flags,
 				bigtime_t	timeout)
 {
-	int		slot;
-	sem_id	cached_semid;
+	struct port_entry *port;
+	struct port_msg *msg;
+	bigtime_t deadline = 0;
 	size_t 	siz;
-	int		res;
-	int		t;
+	int		pos;
 	cbuf*	msg_store;
+	vm_page	**msg_pages;
+	int		num_pages;
 	int32	code;
 	int		err;
 
@@ -624,130 +1042,106 @@ port_read_etc(port_id id,
 		return ERR_INVALID_ARGS;
 
 	flags = flags & (PORT_FLAG_USE_USER_MEMCPY | PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT);
+	if(flags & PORT_FLAG_TIMEOUT)
+		deadline = system_time() + timeout;
 
-	slot = id % MAX_PORTS;
-
-	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
-
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
-		int_restore_interrupts();
+	port = port_get_ref(id);
+	if(port == NULL) {
 		dprintf("read_port_etc: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
-	// store sem_id in local variable
-	cached_semid = ports[slot].read_sem;
-
-	// unlock port && enable ints/
-	RELEASE_PORT_LOCK(ports[slot]);
-	int_restore_interrupts();
-
-	// XXX -> possible race condition if port gets deleted (->sem deleted too), therefore
-	// sem_id is cached in local variable up here
 
 	// get 1 entry from the queue, block if needed
-	res = sem_acquire_etc(cached_semid, 1,
-						flags, timeout, NULL);
-
-	// XXX: possible race condition if port read by two threads...
-	//      both threads will read in 2 different slots allocated above, simultaneously
-	// 		slot is a thread-local variable
-
-	if (res == ERR_SEM_DELETED) {
-		// somebody deleted the port
-		return ERR_PORT_DELETED;
-	}
+	for(;;) {
+		if(port->deleted) {
+			// somebody deleted the port
+			port_put_ref(port);
+			return ERR_PORT_DELETED;
+		}
 
-	if (res == ERR_INTERRUPTED) {
-		// XXX: somebody signaled the process the port belonged to, deleting the sem ?
-		return ERR_INTERRUPTED;
-	}
+		msg = port_claim_read_slot(port, &pos);
+		if(msg != NULL)
+			break;
 
-	if (res == ERR_SEM_TIMED_OUT) {
-		// timed out, or, if timeout=0, 'would block'
-		return ERR_PORT_TIMED_OUT;
+		err = port_wait(port, true, flags, deadline);
+		if(err < 0) {
+			port_put_ref(port);
+			return err;
+		}
 	}
 
-	if (res != NO_ERROR) {
-		dprintf("write_port_etc: res unknown error %d\n", res);
-		return res;
-	}
-
-	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
-
-	t = ports[slot].tail;
-	if (t < 0)
-		panic("port %id: tail < 0", ports[slot].id);
-	if (t > ports[slot].capacity)
-		panic("port %id: tail > cap %d", ports[slot].id, ports[slot].capacity);
-
-	ports[slot].tail = (ports[slot].tail + 1) % ports[slot].capacity;
-
-	msg_store	= ports[slot].msg_queue[t].data_cbuf;
-	code 		= ports[slot].msg_queue[t].msg_code;
-
-	// mark queue entry unused
-	ports[slot].msg_queue[t].data_cbuf	= NULL;
+	msg_store	= msg->data_cbuf;
+	msg_pages	= msg->data_pages;
+	num_pages	= msg->num_pages;
+	code 		= msg->msg_code;
 
 	// check output buffer size
-	siz	= min(buffer_size, ports[slot].msg_queue[t].data_len);
+	siz	= min(buffer_size, msg->data_len);
 
-	cached_semid = ports[slot].write_sem;
+	// mark queue entry unused and hand the slot to the writers' next lap
+	msg->data_cbuf	= NULL;
+	msg->data_pages	= NULL;
+	arch_cpu_memory_barrier();
+	msg->turn = WRITE_TURN(port, (pos + port->capacity) % (port->capacity * port->laps));
 
-	RELEASE_PORT_LOCK(ports[slot]);
-	int_restore_interrupts();
+	// make one spot in queue available again for write
+	port_wake(&port->write_waiters, port->write_sem);
 
 	// copy message
 	*msg_code = code;
-	if (siz > 0) {
+	err = NO_ERROR;
+	if (msg_pages != NULL) {
+		if (siz > 0)
+			err = port_copy_from_pages(msg_buffer, msg_pages, siz, (flags & PORT_FLAG_USE_USER_MEMCPY) != 0);
+
+		// free whatever the reader didn't take and let blocked writers in
+		port_free_pages(msg_pages, num_pages);
+		port_unreserve_pages(port, num_pages);
+	} else if (siz > 0) {
 		if (flags & PORT_FLAG_USE_USER_MEMCPY) {
-			if ((err = cbuf_user_memcpy_from_chain(msg_buffer, msg_store, 0, siz) < 0))	{
-				// leave the port intact, for other threads that might not crash
-				cbuf_free_chain(msg_store);
-				sem_release(cached_semid, 1);
-				return err;
-			}
+			// on a fault, leave the port intact for other threads that might not crash
+			err = cbuf_user_memcpy_from_chain(msg_buffer, msg_store, 0, siz);
 		} else
 			cbuf_memcpy_from_chain(msg_buffer, msg_store, 0, siz);
 	}
 	// free the cbuf
-	cbuf_free_chain(msg_store);
+	if (msg_store != NULL)
+		cbuf_free_chain(msg_store);
 
-	// make one spot in queue available again for write
-	sem_release(cached_semid, 1);
+	port_put_ref(port);
 
+	if (err < 0)
+		return err;
 	return siz;
 }
 
 int
 port_set_owner(port_id id, proc_id proc)
 {
-	int slot;
+	struct port_entry *port;
 
 	if(ports_active == false)
 		return ERR_PORT_NOT_ACTIVE;
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_PORTS;
+	port = port_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
+	GRAB_PORT_LOCK(*port);
 
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
+	if(port->id != id || port->deleted) {
+		RELEASE_PORT_LOCK(*port);
 		int_restore_interrupts();
 		dprintf("port_set_owner: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
 	// transfer ownership to other process
-	ports[slot].owner = proc;
+	port->owner = proc;
 
 	// unlock port
-	RELEASE_PORT_LOCK(ports[slot]);
+	RELEASE_PORT_LOCK(*port);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -770,12 +1164,13 @@ port_write_etc(port_id id,
 	uint32 flags,
 	bigtime_t timeout)
 {
-	int slot;
-	int res;
-	sem_id cached_semid;
-	int h;
+	struct port_entry *port;
+	struct port_msg *msg;
+	bigtime_t deadline = 0;
+	int pos;
 	cbuf* msg_store;
-	int c1, c2;
+	vm_page **msg_pages;
+	int num_pages;
 	int err;
 
 	if(ports_active == false)
@@ -785,107 +1180,110 @@ port_write_etc(port_id id,
 
 	// mask irrelevant flags
 	flags = flags & (PORT_FLAG_USE_USER_MEMCPY | PORT_FLAG_INTERRUPTABLE | PORT_FLAG_TIMEOUT);
-
-	slot = id % MAX_PORTS;
+	if(flags & PORT_FLAG_TIMEOUT)
+		deadline = system_time() + timeout;
 
 	// check buffer_size
-	if (buffer_size > PORT_MAX_MESSAGE_SIZE)
+	if (buffer_size > PORT_MAX_PAGE_MESSAGE_SIZE)
 		return ERR_INVALID_ARGS;
 
-	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
-
-	if(ports[slot].id != id) {
-		RELEASE_PORT_LOCK(ports[slot]);
-		int_restore_interrupts();
+	port = port_get_ref(id);
+	if(port == NULL) {
 		dprintf("write_port_etc: invalid port_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	if (ports[slot].closed) {
-		RELEASE_PORT_LOCK(ports[slot]);
-		int_restore_interrupts();
+	if (port->closed) {
+		port_put_ref(port);
 		dprintf("write_port_etc: port %d closed\n", id);
 		return ERR_PORT_CLOSED;
 	}
 
-	// store sem_id in local variable
-	cached_semid = ports[slot].write_sem;
-
-	RELEASE_PORT_LOCK(ports[slot]);
-	int_restore_interrupts();
-
-	// XXX -> possible race condition if port gets deleted (->sem deleted too),
-	// and queue is full therefore sem_id is cached in local variable up here
-
-	// get 1 entry from the queue, block if needed
-	// assumes flags
-	res = sem_acquire_etc(cached_semid, 1,
-						flags & (SEM_FLAG_TIMEOUT | SEM_FLAG_INTERRUPTABLE), timeout, NULL);
-
-	// XXX: possible race condition if port written by two threads...
-	//      both threads will write in 2 different slots allocated above, simultaneously
-	// 		slot is a thread-local variable
-
-	if (res == ERR_SEM_DELETED) {
-		// somebody deleted the port
-		return ERR_PORT_DELETED;
-	}
-
-	if (res == ERR_SEM_TIMED_OUT) {
-		// timed out, or, if timeout=0, 'would block'
-		return ERR_PORT_TIMED_OUT;
-	}
-
-	if (res != NO_ERROR) {
-		dprintf("write_port_etc: res unknown error %d\n", res);
-		return res;
-	}
-
-	if (buffer_size > 0) {
+	// copy the message before taking a slot, so readers of the slots after
+	// ours don't have to wait on the copy
+	msg_store = NULL;
+	msg_pages = NULL;
+	num_pages = 0;
+	if (buffer_size >= PORT_PAGE_MESSAGE_MIN) {
+		// big messages go into pages the reader can take over
+		num_pages = PAGE_ALIGN(buffer_size) / PAGE_SIZE;
+		err = port_reserve_pages(port, num_pages, flags, deadline);
+		if (err < 0) {
+			port_put_ref(port);
+			return err;
+		}
+		err = port_copy_to_pages(&msg_pages, num_pages, msg_buffer, buffer_size,
+			(flags & PORT_FLAG_USE_USER_MEMCPY) != 0);
+		if (err < 0) {
+			// memory exception
+			port_unreserve_pages(port, num_pages);
+			port_put_ref(port);
+			return err;
+		}
+	} else if (buffer_size > 0) {
 		msg_store = cbuf_get_chain(buffer_size);
-		if (msg_store == NULL)
+		if (msg_store == NULL) {
+			port_put_ref(port);
 			return ERR_NO_MEMORY;
+		}
 		if (flags & PORT_FLAG_USE_USER_MEMCPY) {
 			// copy from user memory
-			if ((err = cbuf_user_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size)) < 0)
-				return err; // memory exception
-		} else
+			err = cbuf_user_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size);
+		} else {
 			// copy from kernel memory
-			if ((err = cbuf_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size)) < 0)
-				return err; // memory exception
-	} else {
-		msg_store = NULL;
+			err = cbuf_memcpy_to_chain(msg_store, 0, msg_buffer, buffer_size);
+		}
+		if (err < 0) {
+			// memory exception
+			cbuf_free_chain(msg_store);
+			port_put_ref(port);
+			return err;
+		}
+	}
+
+	// get 1 entry from the queue, block if needed
+	for(;;) {
+		if (port->deleted) {
+			err = ERR_PORT_DELETED;
+			goto error;
+		}
+
+		msg = port_claim_write_slot(port, &pos);
+		if (msg != NULL)
+			break;
+
+		err = port_wait(port, false, flags, deadline);
+		if (err < 0)
+			goto error;
 	}
 
 	// attach copied message to queue
-	int_disable_interrupts();
-	GRAB_PORT_LOCK(ports[slot]);
-
-	h = ports[slot].head;
-	if (h < 0)
-		panic("port %id: head < 0", ports[slot].id);
-	if (h >= ports[slot].capacity)
-		panic("port %id: head > cap %d", ports[slot].id, ports[slot].capacity);
-	ports[slot].msg_queue[h].msg_code	= msg_code;
-	ports[slot].msg_queue[h].data_cbuf	= msg_store;
-	ports[slot].msg_queue[h].data_len	= buffer_size;
-	ports[slot].head = (ports[slot].head + 1) % ports[slot].capacity;
-	ports[slot].total_count++;
-
-	// store sem_id in local variable
-	cached_semid = ports[slot].read_sem;
-
-	RELEASE_PORT_LOCK(ports[slot]);
-	int_restore_interrupts();
+	msg->msg_code	= msg_code;
+	msg->data_cbuf	= msg_store;
+	msg->data_pages	= msg_pages;
+	msg->num_pages	= num_pages;
+	msg->data_len	= buffer_size;
+	arch_cpu_memory_barrier();
+	msg->turn = READ_TURN(port, pos);
+
+	atomic_add(&port->total_count, 1);
 
-	sem_get_count(ports[slot].read_sem, &c1);
-	sem_get_count(ports[slot].write_sem, &c2);
+	// let a reader at it (might reschedule)
+	port_wake(&port->read_waiters, port->read_sem);
 
-	// release sem, allowing read (might reschedule)
-	sem_release(cached_semid, 1);
+	port_put_ref(port);
 
 	return NO_ERROR;
+
+error:
+	if (msg_store != NULL)
+		cbuf_free_chain(msg_store);
+	if (msg_pages != NULL) {
+		port_free_pages(msg_pages, num_pages);
+		port_unreserve_pages(port, num_pages);
+	}
+	port_put_ref(port);
+	return err;
 }
 
 /* this function cycles through the ports table, deleting all the ports that are owned by
@@ -901,9 +1299,11 @@ int port_delete_owned_ports(proc_id owner)
 	int_disable_interrupts();
 	GRAB_PORT_LIST_LOCK();
 
-	for(i=0; i<MAX_PORTS; i++) {
-		if(ports[i].id != -1 && ports[i].owner == owner) {
-			port_id id = ports[i].id;
+	for(i=0; i<port_table.num_slots; i++) {
+		struct port_entry *port = id_table_slot(&port_table, i);
+
+		if(port->id != -1 && !port->deleted && port->owner == owner) {
+			port_id id = port->id;
 
 			RELEASE_PORT_LIST_LOCK();
 			int_restore_interrupts();
@@ -929,6 +1329,9 @@ int port_delete_owned_ports(proc_id owner)
 
 port_id test_p1, test_p2, test_p3, test_p4;
 
+static void port_test_mpmc(void);
+static void port_test_delete_race(void);
+
 void port_test()
 {
 	char testdata[5];
@@ -990,6 +1393,9 @@ void port_test()
 	dprintf("porttest: testing delete p2\n");
 	port_delete(test_p2);
 
+	port_test_mpmc();
+	port_test_delete_race();
+
 	dprintf("porttest: end test main thread\n");
 
 }
@@ -1018,6 +1424,158 @@ int port_test_thread_func(void* arg)
 	return 0;
 }
 
+/*
+ * N producers and N consumers hammering one small port. Each producer sends
+ * an increasing sequence number, which every consumer must see go up for any
+ * one producer, and between them they have to see every message exactly once.
+ */
+#define MPMC_TEST_THREADS 16
+#define MPMC_TEST_MESSAGES 200000
+#define MPMC_TEST_QUEUE_LEN 64
+
+static port_id mpmc_port;
+static int mpmc_num_threads;
+static int mpmc_received;
+static int mpmc_errors;
+
+static int port_test_producer(void *arg)
+{
+	int producer = (int)(addr_t)arg;
+	int count = MPMC_TEST_MESSAGES / mpmc_num_threads;
+	int seq;
+	int err;
+
+	for(seq = 0; seq < count; seq++) {
+		err = port_write(mpmc_port, producer, &seq, sizeof(seq));
+		if(err < 0) {
+			dprintf("porttest: producer %d: write returned %d\n", producer, err);
+			atomic_add(&mpmc_errors, 1);
+			break;
+		}
+	}
+
+	return 0;
+}
+
+static int port_test_consumer(void *arg)
+{
+	int last_seq[MPMC_TEST_THREADS];
+	int32 code;
+	int seq;
+	int received = 0;
+	ssize_t len;
+	int i;
+
+	for(i = 0; i < MPMC_TEST_THREADS; i++)
+		last_seq[i] = -1;
+
+	for(;;) {
+		len = port_read(mpmc_port, &code, &seq, sizeof(seq));
+		if(len < 0) {
+			dprintf("porttest: consumer: read returned %ld\n", (long)len);
+			atomic_add(&mpmc_errors, 1);
+			break;
+		}
+		if(code < 0)
+			break;
+		if(code >= mpmc_num_threads || len != sizeof(seq) || seq <= last_seq[code]) {
+			dprintf("porttest: consumer: bad message code %d len %ld seq %d (last %d)\n",
+				code, (long)len, seq, code < MPMC_TEST_THREADS ? last_seq[code] : -1);
+			atomic_add(&mpmc_errors, 1);
+			continue;
+		}
+		last_seq[code] = seq;
+		received++;
+	}
+
+	atomic_add(&mpmc_received, received);
+	return 0;
+}
+
+static void port_test_mpmc(void)
+{
+	thread_id producers[MPMC_TEST_THREADS];
+	thread_id consumers[MPMC_TEST_THREADS];
+	int total;
+	bigtime_t t;
+	int i;
+
+	// one of each per cpu, at least two so they actually contend
+	mpmc_num_threads = max(2, min(smp_get_num_cpus(), MPMC_TEST_THREADS));
+	total = (MPMC_TEST_MESSAGES / mpmc_num_threads) * mpmc_num_threads;
+	mpmc_received = 0;
+	mpmc_errors = 0;
+
+	dprintf("porttest: %d producers, %d consumers, %d messages through a %d entry port\n",
+		mpmc_num_threads, mpmc_num_threads, total, MPMC_TEST_QUEUE_LEN);
+
+	mpmc_port = port_create(MPMC_TEST_QUEUE_LEN, "mpmc test port");
+
+	for(i = 0; i < mpmc_num_threads; i++) {
+		consumers[i] = thread_create_kernel_thread("port_test_consumer", &port_test_consumer, NULL);
+		producers[i] = thread_create_kernel_thread("port_test_producer", &port_test_producer, (void *)(addr_t)i);
+	}
+
+	t = system_time();
+	for(i = 0; i < mpmc_num_threads; i++) {
+		thread_resume_thread(consumers[i]);
+		thread_resume_thread(producers[i]);
+	}
+	for(i = 0; i < mpmc_num_threads; i++)
+		thread_wait_on_thread(producers[i], NULL);
+
+	// one stop message per consumer
+	for(i = 0; i < mpmc_num_threads; i++)
+		port_write(mpmc_port, -1, NULL, 0);
+	for(i = 0; i < mpmc_num_threads; i++)
+		thread_wait_on_thread(consumers[i], NULL);
+	t = system_time() - t;
+
+	dprintf("porttest: %d of %d messages received, %d errors, %Ld usecs (%Ld msgs/sec) %s\n",
+		mpmc_received, total, mpmc_errors, t, t > 0 ? (bigtime_t)total * 1000000 / t : 0,
+		(mpmc_received == total && mpmc_errors == 0) ? "ok" : "BAD");
+
+	port_delete(mpmc_port);
+}
+
+static int port_test_blocked_reader(void *arg)
+{
+	int32 code;
+	int buf;
+
+	return port_read(mpmc_port, &code, &buf, sizeof(buf));
+}
+
+// readers sleeping on a port that goes away all have to come back with ERR_PORT_DELETED
+static void port_test_delete_race(void)
+{
+	thread_id readers[MPMC_TEST_THREADS];
+	int deleted = 0;
+	int retcode;
+	int i;
+
+	dprintf("porttest: deleting a port out from under %d blocked readers\n", mpmc_num_threads);
+
+	mpmc_port = port_create(MPMC_TEST_QUEUE_LEN, "delete test port");
+
+	for(i = 0; i < mpmc_num_threads; i++) {
+		readers[i] = thread_create_kernel_thread("port_test_reader", &port_test_blocked_reader, NULL);
+		thread_resume_thread(readers[i]);
+	}
+
+	thread_snooze(100000);
+	port_delete(mpmc_port);
+
+	for(i = 0; i < mpmc_num_threads; i++) {
+		thread_wait_on_thread(readers[i], &retcode);
+		if(retcode == ERR_PORT_DELETED)
+			deleted++;
+	}
+
+	dprintf("porttest: %d of %d readers saw the port get deleted %s\n", deleted, mpmc_num_threads,
+		deleted == mpmc_num_threads ? "ok" : "BAD");
+}
+
 /*
  *	user level ports
  */
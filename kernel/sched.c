@@ -0,0 +1,111 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/thread.h>
+#include <kernel/sched.h>
+
+/*
+ * Scheduler policy. thread.c decides which thread to run out of the run queues,
+ * this decides what priority a thread sits in the queues at and how long it gets
+ * to run once picked.
+ *
+ * Each thread keeps a decaying average of how long it runs each time it is
+ * scheduled and how long it sleeps each time it blocks. A thread coming out of a
+ * sem wait is boosted above its base priority in proportion to how much of its
+ * time is spent sleeping, and loses a level of boost each time it burns through
+ * a whole quantum. Threads that mostly run get shorter quanta, so they can't hold
+ * off the interactive ones for long.
+ */
+
+// weight new samples at 1/4
+#define DECAY(avg, sample) (((avg) * 3 + (sample)) / 4)
+
+static bool sched_can_boost(struct thread *t)
+{
+	// the idle threads and real time threads stay where they are put
+	return t->base_priority > THREAD_IDLE_PRIORITY && t->base_priority <= THREAD_MAX_PRIORITY;
+}
+
+void sched_init_thread(struct thread *t, int priority)
+{
+	t->priority = t->base_priority = priority;
+	t->sched_run_avg = 0;
+	t->sched_sleep_avg = 0;
+	t->sched_start = 0;
+	t->sleep_start = 0;
+	t->quantum = SCHED_MAX_QUANTUM;
+	t->context_switches = 0;
+	t->preemptions = 0;
+}
+
+// NOTE: the caller is responsible for moving the thread between run queues if
+// it's in one
+void sched_set_base_priority(struct thread *t, int priority)
+{
+	int boost = t->priority - t->base_priority;
+
+	t->base_priority = priority;
+	if(sched_can_boost(t) && boost > 0)
+		t->priority = min(priority + boost, THREAD_MAX_PRIORITY);
+	else
+		t->priority = priority;
+}
+
+void sched_thread_start_running(struct thread *t, bigtime_t now)
+{
+	t->sched_start = now;
+}
+
+void sched_thread_stop_running(struct thread *t, bigtime_t now, bool quantum_expired)
+{
+	if(t->sched_start != 0)
+		t->sched_run_avg = DECAY(t->sched_run_avg, now - t->sched_start);
+	t->sched_start = 0;
+
+	if(t->next_state == THREAD_STATE_WAITING)
+		t->sleep_start = now;
+
+	// used the whole quantum, lose some of the boost
+	if(quantum_expired && t->priority > t->base_priority)
+		t->priority--;
+}
+
+// called when a thread that blocked is put back into a run queue
+void sched_thread_woken(struct thread *t, bigtime_t now)
+{
+	bigtime_t total;
+	int boost;
+
+	if(t->sleep_start == 0)
+		return;
+
+	t->sched_sleep_avg = DECAY(t->sched_sleep_avg, now - t->sleep_start);
+	t->sleep_start = 0;
+
+	if(!sched_can_boost(t))
+		return;
+
+	total = t->sched_sleep_avg + t->sched_run_avg;
+	if(total <= 0)
+		return;
+
+	boost = (int)((SCHED_MAX_BOOST * t->sched_sleep_avg) / total);
+	if(t->base_priority + boost > t->priority)
+		t->priority = min(t->base_priority + boost, THREAD_MAX_PRIORITY);
+}
+
+bigtime_t sched_quantum(struct thread *t)
+{
+	bigtime_t total = t->sched_sleep_avg + t->sched_run_avg;
+
+	// nothing known about it yet, or it mostly sleeps anyway
+	if(total <= 0)
+		t->quantum = SCHED_MAX_QUANTUM;
+	else
+		t->quantum = SCHED_MAX_QUANTUM - ((SCHED_MAX_QUANTUM - SCHED_MIN_QUANTUM) * t->sched_run_avg) / total;
+
+	return t->quantum;
+}
+
@@ -11,6 +11,7 @@
 #include <kernel/heap.h>
 #include <kernel/thread.h>
 #include <kernel/vm.h>
+#include <kernel/id_table.h>
 #include <newos/errors.h>
 
 #include <boot/stage2.h>
@@ -22,18 +23,20 @@ struct sem_entry {
 	sem_id    id;
 	int       count;
 	struct list_node q;
-	const char *name;
+	char      name[SYS_MAX_OS_NAME_LEN];
 	int       lock;
 	proc_id   owner;		 // if set to -1, means owned by a port
 };
 
-#define MAX_SEMS 4096
+// the table starts out with room for SEM_INITIAL_SLOTS and grows from there
+#define MAX_SEMS 65536
+#define SEM_INITIAL_SLOTS 1024
 
-static struct sem_entry *sems = NULL;
-static region_id sem_region = 0;
+static id_table sem_table;
 static bool sems_active = false;
 
-static sem_id next_sem = 0;
+// stands in for ids that point past the end of the table, it never matches
+static struct sem_entry invalid_sem;
 
 static int sem_spinlock = 0;
 #define GRAB_SEM_LIST_LOCK() acquire_spinlock(&sem_spinlock)
@@ -52,15 +55,25 @@ struct sem_timeout_args {
 	int sem_count;
 };
 
+static struct sem_entry *sem_lookup(sem_id id)
+{
+	struct sem_entry *sem = id_table_lookup(&sem_table, id);
+
+	return sem ? sem : &invalid_sem;
+}
+
 static void dump_sem_list(int argc, char **argv)
 {
+	struct sem_entry *sem;
 	int i;
 
-	for(i=0; i<MAX_SEMS; i++) {
-		if(sems[i].id >= 0) {
-			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", &sems[i], sems[i].id, sems[i].name);
+	for(i=0; i<sem_table.num_slots; i++) {
+		sem = id_table_slot(&sem_table, i);
+		if(sem->id >= 0) {
+			dprintf("%p\tid: 0x%x\t\tname: '%s'\n", sem, sem->id, sem->name);
 		}
 	}
+	dprintf("%d of %d slots free\n", sem_table.free_count, sem_table.num_slots);
 }
 
 static void _dump_sem_info(struct sem_entry *sem)
@@ -74,6 +87,7 @@ static void _dump_sem_info(struct sem_entry *sem)
 
 static void dump_sem_info(int argc, char **argv)
 {
+	struct sem_entry *sem;
 	int i;
 
 	if(argc < 2) {
@@ -90,42 +104,43 @@ static void dump_sem_info(int argc, char **argv)
 			_dump_sem_info((struct sem_entry *)num);
 			return;
 		} else {
-			unsigned slot = num % MAX_SEMS;
-			if(sems[slot].id != (int)num) {
+			sem = sem_lookup(num);
+			if(sem->id != (int)num) {
 				dprintf("sem 0x%lx doesn't exist!\n", num);
 				return;
 			}
-			_dump_sem_info(&sems[slot]);
+			_dump_sem_info(sem);
 			return;
 		}
 	}
 
 	// walk through the sem list, trying to match name
-	for(i=0; i<MAX_SEMS; i++) {
-		if (sems[i].name != NULL)
-			if(strcmp(argv[1], sems[i].name) == 0) {
-				_dump_sem_info(&sems[i]);
-				return;
-			}
+	for(i=0; i<sem_table.num_slots; i++) {
+		sem = id_table_slot(&sem_table, i);
+		if(sem->id >= 0 && strcmp(argv[1], sem->name) == 0) {
+			_dump_sem_info(sem);
+			return;
+		}
 	}
 }
 
-int sem_init(kernel_args *ka)
+static void init_sem_entry(void *_sem)
 {
-	int i;
+	struct sem_entry *sem = (struct sem_entry *)_sem;
 
+	sem->id = -1;
+}
+
+int sem_init(kernel_args *ka)
+{
 	dprintf("sem_init: entry\n");
 
 	// create and initialize semaphore table
-	sem_region = vm_create_anonymous_region(vm_get_kernel_aspace_id(), "sem_table", (void **)&sems,
-		REGION_ADDR_ANY_ADDRESS, sizeof(struct sem_entry) * MAX_SEMS, REGION_WIRING_WIRED, LOCK_RW|LOCK_KERNEL);
-	if(sem_region < 0) {
+	if(id_table_init(&sem_table, sizeof(struct sem_entry), MAX_SEMS, SEM_INITIAL_SLOTS,
+		&sem_spinlock, &init_sem_entry) < 0) {
 		panic("unable to allocate semaphore table!\n");
 	}
-
-	memset(sems, 0, sizeof(struct sem_entry) * MAX_SEMS);
-	for(i=0; i<MAX_SEMS; i++)
-		sems[i].id = -1;
+	invalid_sem.id = -1;
 
 	// add debugger commands
 	dbg_add_command(&dump_sem_list, "sems", "Dump a list of all active semaphores");
@@ -140,10 +155,8 @@ int sem_init(kernel_args *ka)
 
 sem_id sem_create_etc(int count, const char *name, proc_id owner)
 {
-	int i;
-	sem_id retval = ERR_SEM_OUT_OF_SLOTS;
-	char *temp_name;
-	int name_len;
+	struct sem_entry *sem;
+	sem_id id;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -151,51 +164,35 @@ sem_id sem_create_etc(int count, const char *name, proc_id owner)
 	if(name == NULL)
 		name = "unnamed sem";
 
-	name_len = strlen(name) + 1;
-	name_len = min(name_len, SYS_MAX_OS_NAME_LEN);
-
-	temp_name = (char *)kmalloc(name_len);
-	if(temp_name == NULL)
-		return ERR_NO_MEMORY;
-
-	strlcpy(temp_name, name, name_len);
+	// top the table back up before it runs dry
+	if(id_table_needs_grow(&sem_table))
+		id_table_grow(&sem_table);
 
 	int_disable_interrupts();
 	GRAB_SEM_LIST_LOCK();
 
-	// find the first empty spot
-	for(i=0; i<MAX_SEMS; i++) {
-		if(sems[i].id == -1) {
-			// make the sem id be a multiple of the slot it's in
-			if(i >= next_sem % MAX_SEMS) {
-				next_sem += i - next_sem % MAX_SEMS;
-			} else {
-				next_sem += MAX_SEMS - (next_sem % MAX_SEMS - i);
-			}
-			sems[i].id = next_sem++;
-
-			sems[i].lock = 0;
-			GRAB_SEM_LOCK(sems[i]);
-			RELEASE_SEM_LIST_LOCK();
-
-			list_initialize(&sems[i].q);
-			sems[i].count = count;
-			sems[i].name = temp_name;
-			sems[i].owner = owner;
-			retval = sems[i].id;
-
-			RELEASE_SEM_LOCK(sems[i]);
-			goto out;
-		}
+	// grab a free slot, the id it comes with says which slot it is
+	sem = id_table_alloc(&sem_table, &id);
+	if(sem == NULL) {
+		RELEASE_SEM_LIST_LOCK();
+		int_restore_interrupts();
+		return ERR_SEM_OUT_OF_SLOTS;
 	}
 
+	sem->lock = 0;
+	GRAB_SEM_LOCK(*sem);
 	RELEASE_SEM_LIST_LOCK();
-	kfree(temp_name);
 
-out:
+	list_initialize(&sem->q);
+	sem->count = count;
+	strlcpy(sem->name, name, sizeof(sem->name));
+	sem->owner = owner;
+	sem->id = id;
+
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
-	return retval;
+	return id;
 }
 
 sem_id sem_create(int count, const char *name)
@@ -210,11 +207,10 @@ int sem_delete(sem_id id)
 
 int sem_delete_etc(sem_id id, int return_code)
 {
-	int slot;
+	struct sem_entry *sem;
 	int err = NO_ERROR;
 	struct thread *t;
 	int released_threads;
-	char *old_name;
 	struct list_node release_queue;
 
 	if(sems_active == false)
@@ -222,13 +218,13 @@ int sem_delete_etc(sem_id id, int return_code)
 	if(id < 0)
 		return ERR_INVALID_HANDLE;
 
-	slot = id % MAX_SEMS;
+	sem = sem_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("sem_delete: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
@@ -238,7 +234,7 @@ int sem_delete_etc(sem_id id, int return_code)
 	list_initialize(&release_queue);
 
 	// free any threads waiting for this semaphore
-	while((t = thread_dequeue(&sems[slot].q)) != NULL) {
+	while((t = thread_dequeue(&sem->q)) != NULL) {
 		t->state = THREAD_STATE_READY;
 		t->sem_errcode = ERR_SEM_DELETED;
 		t->sem_deleted_retcode = return_code;
@@ -247,11 +243,14 @@ int sem_delete_etc(sem_id id, int return_code)
 		released_threads++;
 	}
 
-	sems[slot].id = -1;
-	old_name = (char *)sems[slot].name;
-	sems[slot].name = NULL;
+	sem->id = -1;
+	sem->name[0] = 0;
+
+	RELEASE_SEM_LOCK(*sem);
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LIST_LOCK();
+	id_table_free(&sem_table, id);
+	RELEASE_SEM_LIST_LOCK();
 
 	if(released_threads > 0) {
 		GRAB_THREAD_LOCK();
@@ -264,8 +263,6 @@ int sem_delete_etc(sem_id id, int return_code)
 
 	int_restore_interrupts();
 
-	kfree(old_name);
-
 	return err;
 }
 
@@ -274,29 +271,29 @@ static int sem_timeout(void *data)
 {
 	struct sem_timeout_args *args = (struct sem_timeout_args *)data;
 	struct thread *t;
-	int slot;
+	struct sem_entry *sem;
 	struct list_node wakeup_queue;
 
 	t = thread_get_thread_struct(args->blocked_thread);
 	if(t == NULL)
 		return INT_NO_RESCHEDULE;
-	slot = args->blocked_sem_id % MAX_SEMS;
+	sem = sem_lookup(args->blocked_sem_id);
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
 //	dprintf("sem_timeout: called on 0x%x sem %d, tid %d\n", to, to->sem_id, to->thread_id);
 
-	if(sems[slot].id != args->blocked_sem_id) {
+	if(sem->id != args->blocked_sem_id) {
 		// this thread was not waiting on this semaphore
 		panic("sem_timeout: thid %d was trying to wait on sem %d which doesn't exist!\n",
 			args->blocked_thread, args->blocked_sem_id);
 	}
 
 	list_initialize(&wakeup_queue);
-	remove_thread_from_sem(t, &sems[slot], &wakeup_queue, ERR_SEM_TIMED_OUT);
+	remove_thread_from_sem(t, sem, &wakeup_queue, ERR_SEM_TIMED_OUT);
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 
 	GRAB_THREAD_LOCK();
 	// put the threads in the run q here to make sure we dont deadlock in sem_interrupt_thread
@@ -317,7 +314,7 @@ int sem_acquire(sem_id id, int count)
 
 int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *deleted_retcode)
 {
-	int slot = id % MAX_SEMS;
+	struct sem_entry *sem = sem_lookup(id);
 	int err = 0;
 
 	if(sems_active == false)
@@ -335,21 +332,21 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 		panic("sem_acquire_etc: sem attempted to be acquired with interrupts disabled\n");
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
+	if(sem->id != id) {
 		dprintf("sem_acquire_etc: bad sem_id %d\n", id);
 		err = ERR_INVALID_HANDLE;
 		goto err;
 	}
 
-	if(sems[slot].count - count < 0 && (flags & SEM_FLAG_TIMEOUT) != 0 && timeout <= 0) {
+	if(sem->count - count < 0 && (flags & SEM_FLAG_TIMEOUT) != 0 && timeout <= 0) {
 		// immediate timeout
 		err = ERR_SEM_TIMED_OUT;
 		goto err;
 	}
 
-	if((sems[slot].count -= count) < 0) {
+	if((sem->count -= count) < 0) {
 		// we need to block
 		struct thread *t = thread_get_current_thread();
 		struct timer_event timer; // stick it on the stack, since we may be blocking here
@@ -358,7 +355,7 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 		// do a quick check to see if the thread has any pending kill signals
 		// this should catch most of the cases where the thread had a signal
 		if((flags & SEM_FLAG_INTERRUPTABLE) && t->sig_pending) {
-			sems[slot].count += count;
+			sem->count += count;
 			err = ERR_INTERRUPTED;
 			goto err;
 		}
@@ -367,10 +364,10 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 		t->sem_flags = flags;
 		t->sem_blocking = id;
 		t->sem_acquire_count = count;
-		t->sem_count = min(-sems[slot].count, count); // store the count we need to restore upon release
+		t->sem_count = min(-sem->count, count); // store the count we need to restore upon release
 		t->sem_deleted_retcode = 0;
 		t->sem_errcode = NO_ERROR;
-		thread_enqueue(t, &sems[slot].q);
+		thread_enqueue(t, &sem->q);
 
 		if((flags & SEM_FLAG_TIMEOUT) != 0) {
 //			dprintf("sem_acquire_etc: setting timeout sem for %d %d usecs, semid %d, tid %d\n",
@@ -383,7 +380,7 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 			timer_set_event(timeout, TIMER_MODE_ONESHOT, &timer);
 		}
 
-		RELEASE_SEM_LOCK(sems[slot]);
+		RELEASE_SEM_LOCK(*sem);
 		GRAB_THREAD_LOCK();
 		// check again to see if a kill signal is pending.
 		// it may have been delivered while setting up the sem, though it's pretty unlikely
@@ -394,11 +391,11 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 			// here, since the threadlock is held. The previous check would have found most
 			// instances, but there was a race, so we have to handle it. It'll be more messy...
 			list_initialize(&wakeup_queue);
-			GRAB_SEM_LOCK(sems[slot]);
-			if(sems[slot].id == id) {
-				remove_thread_from_sem(t, &sems[slot], &wakeup_queue, ERR_INTERRUPTED);
+			GRAB_SEM_LOCK(*sem);
+			if(sem->id == id) {
+				remove_thread_from_sem(t, sem, &wakeup_queue, ERR_INTERRUPTED);
 			}
-			RELEASE_SEM_LOCK(sems[slot]);
+			RELEASE_SEM_LOCK(*sem);
 			while((t = thread_dequeue(&wakeup_queue)) != NULL) {
 				thread_enqueue_run_q(t);
 			}
@@ -422,7 +419,7 @@ int sem_acquire_etc(sem_id id, int count, int flags, bigtime_t timeout, int *del
 	}
 
 err:
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return err;
@@ -435,7 +432,7 @@ int sem_release(sem_id id, int count)
 
 int sem_release_etc(sem_id id, int count, int flags)
 {
-	int slot = id % MAX_SEMS;
+	struct sem_entry *sem = sem_lookup(id);
 	int released_threads = 0;
 	int err = 0;
 	struct list_node release_queue;
@@ -450,9 +447,9 @@ int sem_release_etc(sem_id id, int count, int flags)
 		return ERR_INVALID_ARGS;
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
+	if(sem->id != id) {
 		dprintf("sem_release_etc: invalid sem_id %d\n", id);
 		err = ERR_INVALID_HANDLE;
 		goto err;
@@ -466,14 +463,14 @@ int sem_release_etc(sem_id id, int count, int flags)
 
 	while(count > 0) {
 		int delta = count;
-		if(sems[slot].count < 0) {
-			struct thread *t = thread_lookat_queue(&sems[slot].q);
+		if(sem->count < 0) {
+			struct thread *t = thread_lookat_queue(&sem->q);
 
 			delta = min(count, t->sem_count);
 			t->sem_count -= delta;
 			if(t->sem_count <= 0) {
 				// release this thread
-				t = thread_dequeue(&sems[slot].q);
+				t = thread_dequeue(&sem->q);
 				thread_enqueue(t, &release_queue);
 				t->state = THREAD_STATE_READY;
 				released_threads++;
@@ -482,10 +479,10 @@ int sem_release_etc(sem_id id, int count, int flags)
 			}
 		}
 
-		sems[slot].count += delta;
+		sem->count += delta;
 		count -= delta;
 	}
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 
 	// pull off any items in the release queue and put them in the run queue
 	if(released_threads > 0) {
@@ -502,7 +499,7 @@ int sem_release_etc(sem_id id, int count, int flags)
 	goto outnolock;
 
 err:
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 outnolock:
 	int_restore_interrupts();
 
@@ -511,7 +508,7 @@ outnolock:
 
 int sem_get_count(sem_id id, int32* thread_count)
 {
-	int slot;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -520,21 +517,21 @@ int sem_get_count(sem_id id, int32* thread_count)
 	if (thread_count == NULL)
 		return ERR_INVALID_ARGS;
 
-	slot = id % MAX_SEMS;
+	sem = sem_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("sem_get_count: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	*thread_count = sems[slot].count;
+	*thread_count = sem->count;
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -542,7 +539,7 @@ int sem_get_count(sem_id id, int32* thread_count)
 
 int sem_get_sem_info(sem_id id, struct sem_info *info)
 {
-	int slot;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -551,25 +548,25 @@ int sem_get_sem_info(sem_id id, struct sem_info *info)
 	if (info == NULL)
 		return ERR_INVALID_ARGS;
 
-	slot = id % MAX_SEMS;
+	sem = sem_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("get_sem_info: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	info->sem			= sems[slot].id;
-	info->proc			= sems[slot].owner;
-	strncpy(info->name, sems[slot].name, SYS_MAX_OS_NAME_LEN-1);
-	info->count			= sems[slot].count;
+	info->sem			= sem->id;
+	info->proc			= sem->owner;
+	strncpy(info->name, sem->name, SYS_MAX_OS_NAME_LEN-1);
+	info->count			= sem->count;
 	info->latest_holder	= -1; // XXX fixme
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -577,6 +574,7 @@ int sem_get_sem_info(sem_id id, struct sem_info *info)
 
 int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info)
 {
+	struct sem_entry *sem;
 	int slot;
 
 	if(sems_active == false)
@@ -593,35 +591,36 @@ int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info)
 	} else {
 		// start at index cookie, but check cookie against MAX_PORTS
 		slot = *cookie;
-		if (slot >= MAX_SEMS)
+		if (slot >= sem_table.num_slots)
 			return ERR_INVALID_HANDLE;
 	}
 	// spinlock
 	int_disable_interrupts();
 	GRAB_SEM_LIST_LOCK();
 
-	while (slot < MAX_SEMS) {
-		GRAB_SEM_LOCK(sems[slot]);
-		if (sems[slot].id != -1)
-			if (sems[slot].owner == proc) {
+	while (slot < sem_table.num_slots) {
+		sem = id_table_slot(&sem_table, slot);
+		GRAB_SEM_LOCK(*sem);
+		if (sem->id != -1)
+			if (sem->owner == proc) {
 				// found one!
-				info->sem			= sems[slot].id;
-				info->proc			= sems[slot].owner;
-				strncpy(info->name, sems[slot].name, SYS_MAX_OS_NAME_LEN-1);
-				info->count			= sems[slot].count;
+				info->sem			= sem->id;
+				info->proc			= sem->owner;
+				strncpy(info->name, sem->name, SYS_MAX_OS_NAME_LEN-1);
+				info->count			= sem->count;
 				info->latest_holder	= -1; // XXX fixme
 
-				RELEASE_SEM_LOCK(sems[slot]);
+				RELEASE_SEM_LOCK(*sem);
 				slot++;
 				break;
 			}
-		RELEASE_SEM_LOCK(sems[slot]);
+		RELEASE_SEM_LOCK(*sem);
 		slot++;
 	}
 	RELEASE_SEM_LIST_LOCK();
 	int_restore_interrupts();
 
-	if (slot == MAX_SEMS)
+	if (slot == sem_table.num_slots)
 		return ERR_SEM_NOT_FOUND;
 	*cookie = slot;
 	return NO_ERROR;
@@ -629,7 +628,7 @@ int sem_get_next_sem_info(proc_id proc, uint32 *cookie, struct sem_info *info)
 
 int set_sem_owner(sem_id id, proc_id proc)
 {
-	int slot;
+	struct sem_entry *sem;
 
 	if(sems_active == false)
 		return ERR_SEM_NOT_ACTIVE;
@@ -642,21 +641,21 @@ int set_sem_owner(sem_id id, proc_id proc)
 //	if (proc_get_proc_struct(proc) == NULL)
 //		return ERR_INVALID_HANDLE; // proc_id doesn't exist right now
 
-	slot = id % MAX_SEMS;
+	sem = sem_lookup(id);
 
 	int_disable_interrupts();
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != id) {
-		RELEASE_SEM_LOCK(sems[slot]);
+	if(sem->id != id) {
+		RELEASE_SEM_LOCK(*sem);
 		int_restore_interrupts();
 		dprintf("set_sem_owner: invalid sem_id %d\n", id);
 		return ERR_INVALID_HANDLE;
 	}
 
-	sems[slot].owner = proc;
+	sem->owner = proc;
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 	int_restore_interrupts();
 
 	return NO_ERROR;
@@ -666,7 +665,7 @@ int set_sem_owner(sem_id id, proc_id proc)
 // this function must be entered with interrupts disabled and THREADLOCK held
 int sem_interrupt_thread(struct thread *t)
 {
-	int slot;
+	struct sem_entry *sem;
 	struct list_node wakeup_queue;
 
 //	dprintf("sem_interrupt_thread: called on thread %p (%d), blocked on sem 0x%x\n", t, t->id, t->sem_blocking);
@@ -678,19 +677,19 @@ int sem_interrupt_thread(struct thread *t)
 	if((t->sem_flags & SEM_FLAG_INTERRUPTABLE) == 0)
 		return ERR_SEM_NOT_INTERRUPTABLE;
 
-	slot = t->sem_blocking % MAX_SEMS;
+	sem = sem_lookup(t->sem_blocking);
 
-	GRAB_SEM_LOCK(sems[slot]);
+	GRAB_SEM_LOCK(*sem);
 
-	if(sems[slot].id != t->sem_blocking) {
+	if(sem->id != t->sem_blocking) {
 		panic("sem_interrupt_thread: thread 0x%x sez it's blocking on sem 0x%x, but that sem doesn't exist!\n", t->id, t->sem_blocking);
 	}
 
 	list_initialize(&wakeup_queue);
-	if(remove_thread_from_sem(t, &sems[slot], &wakeup_queue, ERR_INTERRUPTED) == ERR_NOT_FOUND)
+	if(remove_thread_from_sem(t, sem, &wakeup_queue, ERR_INTERRUPTED) == ERR_NOT_FOUND)
 		panic("sem_interrupt_thread: thread 0x%x not found in sem 0x%x's wait queue\n", t->id, t->sem_blocking);
 
-	RELEASE_SEM_LOCK(sems[slot]);
+	RELEASE_SEM_LOCK(*sem);
 
 	while((t = thread_dequeue(&wakeup_queue)) != NULL) {
 		thread_enqueue_run_q(t);
@@ -741,9 +740,11 @@ int sem_delete_owned_sems(proc_id owner)
 	int_disable_interrupts();
 	GRAB_SEM_LIST_LOCK();
 
-	for(i=0; i<MAX_SEMS; i++) {
-		if(sems[i].id != -1 && sems[i].owner == owner) {
-			sem_id id = sems[i].id;
+	for(i=0; i<sem_table.num_slots; i++) {
+		struct sem_entry *sem = id_table_slot(&sem_table, i);
+
+		if(sem->id != -1 && sem->owner == owner) {
+			sem_id id = sem->id;
 
 			RELEASE_SEM_LIST_LOCK();
 			int_restore_interrupts();
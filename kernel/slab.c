@@ -0,0 +1,694 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/slab.h>
+#include <kernel/heap.h>
+#include <kernel/lock.h>
+#include <kernel/smp.h>
+#include <kernel/int.h>
+#include <kernel/debug.h>
+#include <kernel/list.h>
+#include <kernel/vm.h>
+#include <kernel/vm_page.h>
+#include <kernel/arch/cpu.h>
+#include <newos/errors.h>
+
+#include <string.h>
+
+// object caches are built in three layers:
+// a pair of magazines per cpu, accessed only with interrupts disabled and no locks,
+// a depot of full and empty magazines per cache, protected by a spinlock,
+// and the slabs themselves, protected by a mutex since growing them may map pages.
+
+// number of objects a magazine holds (keeps a magazine at 64 bytes)
+#define SLAB_MAGAZINE_SIZE 14
+// largest slab in pages, must be a power of two
+#define SLAB_MAX_PAGES 8
+// try to fit at least this many objects in a slab
+#define SLAB_MIN_OBJECTS 8
+// number of completely empty slabs a cache keeps before giving pages back
+#define SLAB_EMPTY_SLAB_LIMIT 1
+
+// virtual space that slab pages get mapped into once the vm is up
+#define SLAB_ARENA_SIZE (32*1024*1024)
+#define SLAB_ARENA_PAGES (SLAB_ARENA_SIZE / PAGE_SIZE)
+
+struct slab_magazine {
+	struct slab_magazine *next;
+	int rounds;
+	void *round[SLAB_MAGAZINE_SIZE];
+};
+
+// only ever touched by the cpu that owns it
+struct slab_cpu_cache {
+	struct slab_magazine *loaded;
+	struct slab_magazine *previous;
+	unsigned int alloc_hits;
+	unsigned int free_hits;
+	unsigned int depot_trips;
+} _ALIGNED(64);
+
+// slab header, lives at the very end of the slab it describes
+struct slab {
+	struct list_node node;
+	object_cache *cache;
+	void *free_list;
+	addr_t base;
+	unsigned int in_use;
+	void *heap_chunk; // non NULL if the slab was carved out of the heap during boot
+};
+
+struct object_cache {
+	struct slab_cpu_cache cpu[_MAX_CPUS];
+
+	struct list_node node;
+	char name[SYS_MAX_OS_NAME_LEN];
+	size_t object_size;
+	size_t link_offset;
+	size_t slab_size;
+	unsigned int objects_per_slab;
+	object_cache_ctor ctor;
+	object_cache_dtor dtor;
+	void *cookie;
+
+	// slab layer
+	mutex lock;
+	struct list_node partial_slabs;
+	struct list_node full_slabs;
+	struct list_node empty_slabs;
+	unsigned int slab_count;
+	unsigned int empty_slab_count;
+	unsigned int slab_allocs;
+	unsigned int slab_frees;
+
+	// magazine depot
+	spinlock_t depot_lock;
+	struct slab_magazine *full_magazines;
+	struct slab_magazine *empty_magazines;
+	unsigned int full_magazine_count;
+	unsigned int empty_magazine_count;
+};
+
+// free list link of a free object
+#define OBJECT_LINK(cache, object) (*(void **)((addr_t)(object) + (cache)->link_offset))
+
+static struct list_node cache_list;
+static mutex cache_list_lock;
+
+static addr_t arena_base;
+static uint32 arena_map[SLAB_ARENA_PAGES / 32];
+static unsigned int arena_pages_used;
+static mutex arena_lock;
+static vm_translation_map *kernel_map;
+
+static struct slab *object_to_slab(object_cache *cache, void *object)
+{
+	addr_t base = (addr_t)object & ~(cache->slab_size - 1);
+
+	return (struct slab *)(base + cache->slab_size - sizeof(struct slab));
+}
+
+static addr_t arena_alloc(unsigned int pages)
+{
+	unsigned int start;
+	unsigned int i;
+	addr_t va = 0;
+
+	mutex_lock(&arena_lock);
+
+	// slabs need to be aligned to their size, so only look at runs starting on a multiple of it
+	for(start = 0; start + pages <= SLAB_ARENA_PAGES; start += pages) {
+		for(i = start; i < start + pages; i++) {
+			if(arena_map[i / 32] & (1 << (i % 32)))
+				break;
+		}
+		if(i == start + pages) {
+			for(i = start; i < start + pages; i++)
+				arena_map[i / 32] |= (1 << (i % 32));
+			arena_pages_used += pages;
+			va = arena_base + start * PAGE_SIZE;
+			break;
+		}
+	}
+
+	mutex_unlock(&arena_lock);
+
+	return va;
+}
+
+static void arena_free(addr_t va, unsigned int pages)
+{
+	unsigned int start = (va - arena_base) / PAGE_SIZE;
+	unsigned int i;
+
+	mutex_lock(&arena_lock);
+	for(i = start; i < start + pages; i++)
+		arena_map[i / 32] &= ~(1 << (i % 32));
+	arena_pages_used -= pages;
+	mutex_unlock(&arena_lock);
+}
+
+static void slab_release_memory(object_cache *cache, addr_t base, void *heap_chunk)
+{
+	addr_t pa[SLAB_MAX_PAGES];
+	unsigned int pages = cache->slab_size / PAGE_SIZE;
+	unsigned int flags;
+	unsigned int i;
+	vm_page *page;
+
+	if(heap_chunk != NULL) {
+		kfree(heap_chunk);
+		return;
+	}
+
+	(*kernel_map->ops->lock)(kernel_map);
+	for(i = 0; i < pages; i++)
+		(*kernel_map->ops->query)(kernel_map, base + i * PAGE_SIZE, &pa[i], &flags);
+	(*kernel_map->ops->unmap)(kernel_map, base, base + (cache->slab_size - 1));
+	(*kernel_map->ops->unlock)(kernel_map);
+
+	// the tlbs have been flushed by the unlock, the pages can go back now
+	for(i = 0; i < pages; i++) {
+		page = vm_lookup_page(pa[i] / PAGE_SIZE);
+		if(page == NULL)
+			panic("slab_release_memory: no page for pa 0x%lx in slab 0x%lx\n", pa[i], base);
+		vm_page_set_state(page, PAGE_STATE_FREE);
+	}
+
+	arena_free(base, pages);
+}
+
+static struct slab *slab_create(object_cache *cache)
+{
+	struct slab *slab;
+	void *heap_chunk = NULL;
+	vm_page *pages[SLAB_MAX_PAGES];
+	addr_t base;
+	addr_t va;
+	unsigned int i;
+
+	if(arena_base != 0) {
+		base = arena_alloc(cache->slab_size / PAGE_SIZE);
+		if(base == 0)
+			return NULL;
+
+		if(vm_page_allocate_pages(cache->slab_size / PAGE_SIZE, PAGE_STATE_FREE, pages) < 0) {
+			arena_free(base, cache->slab_size / PAGE_SIZE);
+			return NULL;
+		}
+
+		(*kernel_map->ops->lock)(kernel_map);
+		for(i = 0, va = base; va < base + cache->slab_size; i++, va += PAGE_SIZE) {
+			vm_page_set_state(pages[i], PAGE_STATE_WIRED);
+			(*kernel_map->ops->map)(kernel_map, va, pages[i]->ppn * PAGE_SIZE, LOCK_RW|LOCK_KERNEL);
+		}
+		(*kernel_map->ops->unlock)(kernel_map);
+	} else {
+		// the page allocator isn't up yet, borrow an aligned chunk from the heap
+		heap_chunk = kmalloc(cache->slab_size * 2);
+		if(heap_chunk == NULL)
+			return NULL;
+		base = ROUNDUP((addr_t)heap_chunk, cache->slab_size);
+	}
+
+	if(cache->ctor != NULL) {
+		for(i = 0; i < cache->objects_per_slab; i++) {
+			if(cache->ctor(cache->cookie, (void *)(base + i * cache->object_size)) < 0)
+				break;
+		}
+		if(i < cache->objects_per_slab) {
+			// back out the ones that did get constructed
+			while(i > 0) {
+				i--;
+				if(cache->dtor != NULL)
+					cache->dtor(cache->cookie, (void *)(base + i * cache->object_size));
+			}
+			slab_release_memory(cache, base, heap_chunk);
+			return NULL;
+		}
+	}
+
+	slab = (struct slab *)(base + cache->slab_size - sizeof(struct slab));
+	list_clear_node(&slab->node);
+	slab->cache = cache;
+	slab->base = base;
+	slab->in_use = 0;
+	slab->heap_chunk = heap_chunk;
+
+	// thread the objects back to front so they get handed out in address order
+	slab->free_list = NULL;
+	for(i = cache->objects_per_slab; i > 0; i--) {
+		void *object = (void *)(base + (i - 1) * cache->object_size);
+
+		OBJECT_LINK(cache, object) = slab->free_list;
+		slab->free_list = object;
+	}
+
+	return slab;
+}
+
+static void slab_destroy(object_cache *cache, struct slab *slab)
+{
+	unsigned int i;
+
+	if(slab->in_use != 0)
+		panic("slab_destroy: slab %p in cache '%s' still has %d objects in use\n", slab, cache->name, slab->in_use);
+
+	if(cache->dtor != NULL) {
+		for(i = 0; i < cache->objects_per_slab; i++)
+			cache->dtor(cache->cookie, (void *)(slab->base + i * cache->object_size));
+	}
+
+	slab_release_memory(cache, slab->base, slab->heap_chunk);
+}
+
+static void *slab_alloc_object(object_cache *cache)
+{
+	struct slab *slab;
+	void *object;
+
+	mutex_lock(&cache->lock);
+
+	slab = list_peek_head_type(&cache->partial_slabs, struct slab, node);
+	if(slab == NULL) {
+		slab = list_remove_head_type(&cache->empty_slabs, struct slab, node);
+		if(slab != NULL) {
+			cache->empty_slab_count--;
+		} else {
+			slab = slab_create(cache);
+			if(slab == NULL) {
+				mutex_unlock(&cache->lock);
+				return NULL;
+			}
+			cache->slab_count++;
+		}
+		list_add_head(&cache->partial_slabs, &slab->node);
+	}
+
+	object = slab->free_list;
+	slab->free_list = OBJECT_LINK(cache, object);
+	slab->in_use++;
+	if(slab->free_list == NULL) {
+		list_delete(&slab->node);
+		list_add_head(&cache->full_slabs, &slab->node);
+	}
+	cache->slab_allocs++;
+
+	mutex_unlock(&cache->lock);
+
+	return object;
+}
+
+static void slab_free_object(object_cache *cache, void *object)
+{
+	struct slab *slab = object_to_slab(cache, object);
+	struct slab *release = NULL;
+
+	if(slab->cache != cache)
+		panic("slab_free_object: object %p does not belong to cache '%s'\n", object, cache->name);
+
+	mutex_lock(&cache->lock);
+
+	if(slab->free_list == NULL) {
+		// was full
+		list_delete(&slab->node);
+		list_add_head(&cache->partial_slabs, &slab->node);
+	}
+	OBJECT_LINK(cache, object) = slab->free_list;
+	slab->free_list = object;
+	slab->in_use--;
+	cache->slab_frees++;
+
+	if(slab->in_use == 0) {
+		list_delete(&slab->node);
+		if(cache->empty_slab_count < SLAB_EMPTY_SLAB_LIMIT) {
+			list_add_head(&cache->empty_slabs, &slab->node);
+			cache->empty_slab_count++;
+		} else {
+			cache->slab_count--;
+			release = slab;
+		}
+	}
+
+	mutex_unlock(&cache->lock);
+
+	if(release != NULL)
+		slab_destroy(cache, release);
+}
+
+static void magazine_flush(object_cache *cache, struct slab_magazine *mag)
+{
+	while(mag->rounds > 0)
+		slab_free_object(cache, mag->round[--mag->rounds]);
+}
+
+void *object_cache_alloc(object_cache *cache)
+{
+	struct slab_cpu_cache *cc;
+	struct slab_magazine *mag;
+	void *object;
+
+	int_disable_interrupts();
+	cc = &cache->cpu[smp_get_current_cpu()];
+
+	for(;;) {
+		if(cc->loaded != NULL && cc->loaded->rounds > 0) {
+			object = cc->loaded->round[--cc->loaded->rounds];
+			cc->alloc_hits++;
+			int_restore_interrupts();
+			return object;
+		}
+		if(cc->previous != NULL && cc->previous->rounds > 0) {
+			mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		// both magazines are empty, trade for a full one from the depot
+		cc->depot_trips++;
+		acquire_spinlock(&cache->depot_lock);
+		mag = cache->full_magazines;
+		if(mag != NULL) {
+			cache->full_magazines = mag->next;
+			cache->full_magazine_count--;
+			if(cc->previous != NULL) {
+				cc->previous->next = cache->empty_magazines;
+				cache->empty_magazines = cc->previous;
+				cache->empty_magazine_count++;
+			}
+			cc->previous = cc->loaded;
+			cc->loaded = mag;
+		}
+		release_spinlock(&cache->depot_lock);
+
+		if(mag == NULL)
+			break;
+	}
+
+	int_restore_interrupts();
+
+	// nothing cached anywhere, go to the slabs
+	return slab_alloc_object(cache);
+}
+
+void object_cache_free(object_cache *cache, void *object)
+{
+	struct slab_cpu_cache *cc;
+	struct slab_magazine *mag;
+
+	int_disable_interrupts();
+	cc = &cache->cpu[smp_get_current_cpu()];
+
+	for(;;) {
+		if(cc->loaded != NULL && cc->loaded->rounds < SLAB_MAGAZINE_SIZE) {
+			cc->loaded->round[cc->loaded->rounds++] = object;
+			cc->free_hits++;
+			int_restore_interrupts();
+			return;
+		}
+		if(cc->previous != NULL && cc->previous->rounds == 0) {
+			mag = cc->loaded;
+			cc->loaded = cc->previous;
+			cc->previous = mag;
+			continue;
+		}
+
+		// both magazines are full, trade for an empty one from the depot
+		cc->depot_trips++;
+		acquire_spinlock(&cache->depot_lock);
+		mag = cache->empty_magazines;
+		if(mag != NULL) {
+			cache->empty_magazines = mag->next;
+			cache->empty_magazine_count--;
+			if(cc->previous != NULL) {
+				cc->previous->next = cache->full_magazines;
+				cache->full_magazines = cc->previous;
+				cache->full_magazine_count++;
+			}
+			cc->previous = cc->loaded;
+			cc->loaded = mag;
+		}
+		release_spinlock(&cache->depot_lock);
+
+		if(mag != NULL)
+			continue;
+
+		// the depot is out of empty magazines, make a new one
+		int_restore_interrupts();
+
+		mag = (struct slab_magazine *)kmalloc(sizeof(struct slab_magazine));
+		if(mag == NULL) {
+			slab_free_object(cache, object);
+			return;
+		}
+		mag->rounds = 0;
+
+		int_disable_interrupts();
+		acquire_spinlock(&cache->depot_lock);
+		mag->next = cache->empty_magazines;
+		cache->empty_magazines = mag;
+		cache->empty_magazine_count++;
+		release_spinlock(&cache->depot_lock);
+
+		// we may be on another cpu now
+		cc = &cache->cpu[smp_get_current_cpu()];
+	}
+}
+
+void object_cache_reclaim(object_cache *cache)
+{
+	struct slab_magazine *full;
+	struct slab_magazine *empty;
+	struct slab_magazine *mag;
+	struct list_node release_list;
+	struct slab *slab;
+
+	// pull everything out of the depot
+	int_disable_interrupts();
+	acquire_spinlock(&cache->depot_lock);
+	full = cache->full_magazines;
+	empty = cache->empty_magazines;
+	cache->full_magazines = cache->empty_magazines = NULL;
+	cache->full_magazine_count = cache->empty_magazine_count = 0;
+	release_spinlock(&cache->depot_lock);
+	int_restore_interrupts();
+
+	while(full != NULL) {
+		mag = full;
+		full = full->next;
+		magazine_flush(cache, mag);
+		kfree(mag);
+	}
+	while(empty != NULL) {
+		mag = empty;
+		empty = empty->next;
+		kfree(mag);
+	}
+
+	// hand all of the empty slabs back to the page allocator
+	list_initialize(&release_list);
+	mutex_lock(&cache->lock);
+	while((slab = list_remove_head_type(&cache->empty_slabs, struct slab, node)) != NULL) {
+		list_add_head(&release_list, &slab->node);
+		cache->empty_slab_count--;
+		cache->slab_count--;
+	}
+	mutex_unlock(&cache->lock);
+
+	while((slab = list_remove_head_type(&release_list, struct slab, node)) != NULL)
+		slab_destroy(cache, slab);
+}
+
+void slab_reclaim(void)
+{
+	object_cache *cache;
+
+	mutex_lock(&cache_list_lock);
+	list_for_every_entry(&cache_list, cache, object_cache, node)
+		object_cache_reclaim(cache);
+	mutex_unlock(&cache_list_lock);
+}
+
+object_cache *object_cache_create(const char *name, size_t object_size, size_t alignment,
+	object_cache_ctor ctor, object_cache_dtor dtor, void *cookie)
+{
+	object_cache *cache;
+	unsigned int pages;
+
+	if(name == NULL || object_size == 0)
+		return NULL;
+	if(alignment < sizeof(void *))
+		alignment = sizeof(void *);
+	if((alignment & (alignment - 1)) != 0)
+		return NULL;
+
+	cache = (object_cache *)kmalloc(sizeof(object_cache));
+	if(cache == NULL)
+		return NULL;
+	memset(cache, 0, sizeof(object_cache));
+
+	strncpy(cache->name, name, SYS_MAX_OS_NAME_LEN-1);
+	cache->name[SYS_MAX_OS_NAME_LEN-1] = 0;
+
+	// constructed objects have to keep their contents while they sit on a
+	// free list, so put the link past the end of the object instead of over it
+	if(ctor != NULL) {
+		cache->link_offset = ROUNDUP(object_size, sizeof(void *));
+		object_size = cache->link_offset + sizeof(void *);
+	} else {
+		cache->link_offset = 0;
+	}
+	cache->object_size = ROUNDUP(object_size, alignment);
+
+	for(pages = 1; pages < SLAB_MAX_PAGES; pages *= 2) {
+		if((pages * PAGE_SIZE - sizeof(struct slab)) / cache->object_size >= SLAB_MIN_OBJECTS)
+			break;
+	}
+	cache->slab_size = pages * PAGE_SIZE;
+	if(cache->slab_size < cache->object_size + sizeof(struct slab)) {
+		dprintf("object_cache_create: object size %ld too large for cache '%s'\n", (long)object_size, name);
+		kfree(cache);
+		return NULL;
+	}
+	cache->objects_per_slab = (cache->slab_size - sizeof(struct slab)) / cache->object_size;
+
+	cache->ctor = ctor;
+	cache->dtor = dtor;
+	cache->cookie = cookie;
+
+	mutex_init(&cache->lock, cache->name);
+	list_initialize(&cache->partial_slabs);
+	list_initialize(&cache->full_slabs);
+	list_initialize(&cache->empty_slabs);
+	cache->depot_lock = 0;
+
+	mutex_lock(&cache_list_lock);
+	list_add_tail(&cache_list, &cache->node);
+	mutex_unlock(&cache_list_lock);
+
+	return cache;
+}
+
+void object_cache_destroy(object_cache *cache)
+{
+	struct slab_magazine *mag;
+	int i;
+
+	if(cache == NULL)
+		return;
+
+	mutex_lock(&cache_list_lock);
+	list_delete(&cache->node);
+	mutex_unlock(&cache_list_lock);
+
+	// the caller guarantees nobody is using the cache anymore, so it's safe
+	// to reach into the other cpus' magazines
+	for(i = 0; i < _MAX_CPUS; i++) {
+		mag = cache->cpu[i].loaded;
+		if(mag != NULL) {
+			magazine_flush(cache, mag);
+			kfree(mag);
+		}
+		mag = cache->cpu[i].previous;
+		if(mag != NULL) {
+			magazine_flush(cache, mag);
+			kfree(mag);
+		}
+		cache->cpu[i].loaded = cache->cpu[i].previous = NULL;
+	}
+
+	object_cache_reclaim(cache);
+
+	if(!list_is_empty(&cache->partial_slabs) || !list_is_empty(&cache->full_slabs))
+		panic("object_cache_destroy: cache '%s' destroyed with objects still allocated\n", cache->name);
+
+	mutex_destroy(&cache->lock);
+	kfree(cache);
+}
+
+static void dump_slabs(int argc, char **argv)
+{
+	object_cache *cache;
+	struct slab *slab;
+	unsigned int in_use;
+	unsigned int cached;
+	unsigned int hits;
+	unsigned int trips;
+	int i;
+
+	dprintf("%-24s %6s %6s %5s %6s %7s %7s %9s %9s %7s\n",
+		"name", "objsz", "slabsz", "obj/s", "slabs", "in use", "cached", "mag hits", "slab ops", "depot");
+
+	list_for_every_entry(&cache_list, cache, object_cache, node) {
+		// objects handed out by the slab layer, some of which may be sitting in magazines
+		in_use = 0;
+		list_for_every_entry(&cache->partial_slabs, slab, struct slab, node)
+			in_use += slab->in_use;
+		list_for_every_entry(&cache->full_slabs, slab, struct slab, node)
+			in_use += slab->in_use;
+
+		cached = 0;
+		for(i = 0; i < _MAX_CPUS; i++) {
+			if(cache->cpu[i].loaded)
+				cached += cache->cpu[i].loaded->rounds;
+			if(cache->cpu[i].previous)
+				cached += cache->cpu[i].previous->rounds;
+		}
+		cached += cache->full_magazine_count * SLAB_MAGAZINE_SIZE;
+
+		hits = trips = 0;
+		for(i = 0; i < _MAX_CPUS; i++) {
+			hits += cache->cpu[i].alloc_hits + cache->cpu[i].free_hits;
+			trips += cache->cpu[i].depot_trips;
+		}
+
+		dprintf("%-24s %6ld %6ld %5d %6d %7d %7d %9d %9d %7d\n",
+			cache->name, (long)cache->object_size, (long)cache->slab_size, cache->objects_per_slab,
+			cache->slab_count, in_use - cached, cached, hits,
+			cache->slab_allocs + cache->slab_frees, trips);
+	}
+
+	dprintf("slab arena at 0x%lx, %d of %d pages in use\n", arena_base, arena_pages_used, SLAB_ARENA_PAGES);
+}
+
+int slab_init(kernel_args *ka)
+{
+	list_initialize(&cache_list);
+	mutex_init(&cache_list_lock, "object cache list lock");
+
+	// until slab_init2 runs slabs come out of the heap
+	arena_base = 0;
+	arena_pages_used = 0;
+	memset(arena_map, 0, sizeof(arena_map));
+	mutex_init(&arena_lock, "slab arena lock");
+
+	dbg_add_command(&dump_slabs, "slabs", "Dump object cache statistics");
+
+	return 0;
+}
+
+int slab_init2(kernel_args *ka)
+{
+	vm_address_space *aspace;
+	void *address;
+	region_id rid;
+
+	// reserve an extra max sized slab worth of space so the base can be aligned
+	rid = vm_create_null_region(vm_get_kernel_aspace_id(), "kernel_slab_arena", &address,
+		REGION_ADDR_ANY_ADDRESS, SLAB_ARENA_SIZE + SLAB_MAX_PAGES * PAGE_SIZE);
+	if(rid < 0)
+		panic("slab_init2: could not reserve slab arena\n");
+
+	aspace = vm_get_kernel_aspace();
+	kernel_map = &aspace->translation_map;
+	vm_put_aspace(aspace);
+
+	arena_base = ROUNDUP((addr_t)address, SLAB_MAX_PAGES * PAGE_SIZE);
+
+	dprintf("slab_init2: arena at 0x%lx\n", arena_base);
+
+	return 0;
+}
@@ -7,6 +7,7 @@
 #include <kernel/console.h>
 #include <kernel/debug.h>
 #include <kernel/int.h>
+#include <kernel/timer.h>
 #include <kernel/smp_priv.h>
 #include <kernel/smp.h>
 #include <kernel/heap.h>
@@ -58,6 +59,9 @@ static int smp_num_cpus = 1;
 
 static int smp_process_pending_ici(int curr_cpu);
 
+#define IS_TLB_MESSAGE(message) ((message) == SMP_MSG_INVL_PAGE_RANGE \
+	|| (message) == SMP_MSG_INVL_PAGE_LIST || (message) == SMP_MSG_GLOBAL_INVL_PAGE)
+
 void acquire_spinlock(spinlock_t *lock)
 {
 	if(smp_num_cpus > 1) {
@@ -244,6 +248,9 @@ static int smp_process_pending_ici(int curr_cpu)
 		return retval;
 
 //	dprintf("  message = %d\n", msg->message);
+	if(IS_TLB_MESSAGE(msg->message))
+		get_cpu_struct(curr_cpu)->tlb_shootdowns_received++;
+
 	switch(msg->message) {
 		case SMP_MSG_INVL_PAGE_RANGE:
 			arch_cpu_invalidate_TLB_range((addr_t)msg->data, (addr_t)msg->data2);
@@ -261,6 +268,9 @@ static int smp_process_pending_ici(int curr_cpu)
 			halt = true;
 			dprintf("cpu %d halted!\n", curr_cpu);
 			break;
+		case SMP_MSG_TIMER_REPROGRAM:
+			timer_reprogram();
+			break;
 		case SMP_MSG_1:
 		default:
 			dprintf("smp_intercpu_int_handler: got unknown message %d\n", msg->message);
@@ -302,13 +312,16 @@ void smp_send_ici(int target_cpu, int message, unsigned long data, unsigned long
 		// set up the message
 		msg->message = message;
 		msg->data = data;
-		msg->data = data2;
-		msg->data = data3;
+		msg->data2 = data2;
+		msg->data3 = data3;
 		msg->data_ptr = data_ptr;
 		msg->ref_count = 1;
 		msg->flags = flags;
 		msg->done = false;
 
+		if(IS_TLB_MESSAGE(message))
+			get_cpu_struct(curr_cpu)->tlb_shootdowns_sent++;
+
 		// stick it in the appropriate cpu's mailbox
 		acquire_spinlock_nocheck(&cpu_msg_spinlock[target_cpu]);
 		msg->next = smp_msgs[target_cpu];
@@ -359,6 +372,9 @@ void smp_send_broadcast_ici(int message, unsigned long data, unsigned long data2
 
 //		dprintf("smp_send_broadcast_ici%d: inserting msg 0x%x into broadcast mbox\n", smp_get_current_cpu(), msg);
 
+		if(IS_TLB_MESSAGE(message))
+			get_cpu_struct(curr_cpu)->tlb_shootdowns_sent++;
+
 		// stick it in the appropriate cpu's mailbox
 		acquire_spinlock_nocheck(&broadcast_msg_spinlock);
 		msg->next = smp_broadcast_msgs;
@@ -387,6 +403,85 @@ void smp_send_broadcast_ici(int message, unsigned long data, unsigned long data2
 //	dprintf("smp_send_broadcast_ici: done\n");
 }
 
+// like a broadcast, but only interrupts the cpus in the mask. It goes through the
+// broadcast mailbox, with every other cpu marked as having already handled it.
+void smp_send_multicast_ici(unsigned int cpu_mask, int message, unsigned long data, unsigned long data2, unsigned long data3, void *data_ptr, int flags)
+{
+	struct smp_msg *msg;
+
+	if(ici_enabled) {
+		int curr_cpu;
+		int count;
+		int i;
+
+		// find_free_message leaves interrupts disabled
+		find_free_message(&msg);
+
+		curr_cpu = smp_get_current_cpu();
+		cpu_mask &= ~(1U << curr_cpu);
+
+		count = 0;
+		for(i = 0; i < smp_num_cpus; i++) {
+			if(CHECK_BIT(cpu_mask, i))
+				count++;
+		}
+		if(count == 0) {
+			// no one to send it to
+			return_free_message(msg);
+			if(data_ptr != NULL)
+				kfree(data_ptr);
+			int_restore_interrupts();
+			return;
+		}
+
+		msg->message = message;
+		msg->data = data;
+		msg->data2 = data2;
+		msg->data3 = data3;
+		msg->data_ptr = data_ptr;
+		msg->ref_count = count;
+		msg->flags = flags;
+		msg->proc_bitmap = ~cpu_mask;
+		msg->done = false;
+
+		if(IS_TLB_MESSAGE(message))
+			get_cpu_struct(curr_cpu)->tlb_shootdowns_sent++;
+
+		acquire_spinlock_nocheck(&broadcast_msg_spinlock);
+		msg->next = smp_broadcast_msgs;
+		smp_broadcast_msgs = msg;
+		release_spinlock(&broadcast_msg_spinlock);
+
+		for(i = 0; i < smp_num_cpus; i++) {
+			if(CHECK_BIT(cpu_mask, i))
+				arch_smp_send_ici(i);
+		}
+
+		if(flags == SMP_MSG_FLAG_SYNC) {
+			// wait for the targets to finish processing it
+			while(msg->done == false)
+				smp_process_pending_ici(curr_cpu);
+			// for SYNC messages, it's our responsibility to put it
+			// back into the free list
+			return_free_message(msg);
+		}
+
+		int_restore_interrupts();
+	}
+}
+
+static void dump_tlb_stats(int argc, char **argv)
+{
+	int i;
+
+	dprintf("cpu  shootdowns sent  received\n");
+	for(i = 0; i < smp_num_cpus; i++) {
+		cpu_ent *c = get_cpu_struct(i);
+
+		dprintf("%3d  %15d  %8d\n", i, c->tlb_shootdowns_sent, c->tlb_shootdowns_received);
+	}
+}
+
 int smp_trap_non_boot_cpus(kernel_args *ka, int cpu)
 {
 	if(cpu > 0) {
@@ -495,6 +590,8 @@ int smp_init(kernel_args *ka)
 		}
 		smp_num_cpus = ka->num_cpus;
 	}
+
+	dbg_add_command(&dump_tlb_stats, "tlb_stats", "Dump per-cpu tlb shootdown counts");
 #endif
 	dprintf("smp_init: calling arch_smp_init\n");
 	return arch_smp_init(ka);
@@ -10,6 +10,8 @@
 #include <kernel/thread.h>
 #include <kernel/sem.h>
 #include <kernel/port.h>
+#include <kernel/futex.h>
+#include <kernel/evq.h>
 #include <kernel/vm.h>
 #include <kernel/cpu.h>
 #include <kernel/time.h>
@@ -119,6 +121,12 @@ const struct syscall_table_entry syscall_table[] = {
 	SYSCALL_ENTRY(setpgid),
 	SYSCALL_ENTRY(getpgid),
 	SYSCALL_ENTRY(setsid),
+	SYSCALL_ENTRY(user_futex_wait),
+	SYSCALL_ENTRY(user_futex_wake),				/* 90 */
+	SYSCALL_ENTRY(user_evq_create),
+	SYSCALL_ENTRY(user_evq_delete),
+	SYSCALL_ENTRY(user_evq_ctl),
+	SYSCALL_ENTRY(user_evq_wait),
 };
 
 int num_syscall_table_entries = sizeof(syscall_table) / sizeof(struct syscall_table_entry);
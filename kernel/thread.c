@@ -6,6 +6,7 @@
 #include <kernel/debug.h>
 #include <kernel/console.h>
 #include <kernel/thread.h>
+#include <kernel/sched.h>
 #include <kernel/arch/thread.h>
 #include <kernel/khash.h>
 #include <kernel/int.h>
@@ -18,9 +19,11 @@
 #include <kernel/arch/vm.h>
 #include <kernel/sem.h>
 #include <kernel/port.h>
+#include <kernel/evq.h>
 #include <kernel/vfs.h>
 #include <kernel/elf.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/signal.h>
 #include <kernel/list.h>
 #include <newos/user_runtime.h>
@@ -97,6 +100,7 @@ static struct sid_node *create_session_struct(sess_id sid);
 static struct thread *idle_threads[_MAX_CPUS];
 static void *thread_hash = NULL;
 static thread_id next_thread_id = 1;
+static object_cache *thread_cache;
 
 static sem_id snooze_sem = -1;
 
@@ -113,10 +117,14 @@ static unsigned int volatile death_stack_bitmap;
 static sem_id death_stack_sem;
 
 // thread queues
-static struct list_node run_q[THREAD_NUM_PRIORITY_LEVELS] = { { NULL, NULL }, };
 static struct list_node dead_q;
 
+// run queues live in the per-cpu structure
+#define GRAB_RUN_Q_LOCK(rq) acquire_spinlock(&(rq)->lock)
+#define RELEASE_RUN_Q_LOCK(rq) release_spinlock(&(rq)->lock)
+
 static int _rand(void);
+static void thread_finish_switch(bool thread_locked);
 //static struct proc *proc_get_proc_struct(proc_id id); // unused
 static struct proc *proc_get_proc_struct_locked(proc_id id);
 
@@ -141,25 +149,262 @@ void thread_dequeue_thread(struct thread *t)
 	list_delete(&t->q_node);
 }
 
+static void run_q_init(struct run_queue *rq)
+{
+	int i;
+
+	rq->lock = 0;
+	for(i = 0; i < THREAD_RUN_Q_BITMAP_WORDS; i++)
+		rq->bitmap[i] = 0;
+	rq->count = 0;
+	rq->curr_priority = THREAD_IDLE_PRIORITY;
+	rq->steal_count = 0;
+	for(i = 0; i < THREAD_NUM_PRIORITY_LEVELS; i++)
+		list_initialize(&rq->q[i]);
+}
+
+// returns the highest non-empty priority level below limit, or -1
+// NOTE: expects the run queue lock to be held
+static int run_q_highest_below(struct run_queue *rq, int limit)
+{
+	int word;
+	int bit;
+	uint32 bits;
+
+	if(limit <= 0)
+		return -1;
+
+	limit--;
+	word = limit / 32;
+	bits = rq->bitmap[word] & (0xffffffff >> (31 - (limit % 32)));
+	for(;;) {
+		if(bits != 0) {
+			bit = 31;
+			while(!(bits & (1 << bit)))
+				bit--;
+			return word * 32 + bit;
+		}
+		if(--word < 0)
+			return -1;
+		bits = rq->bitmap[word];
+	}
+}
+
+// NOTE: expects the run queue lock to be held
+static void run_q_insert(struct run_queue *rq, struct thread *t, int cpu_num)
+{
+	thread_enqueue(t, &rq->q[t->priority]);
+	rq->bitmap[t->priority / 32] |= (1 << (t->priority % 32));
+	if(t->priority != THREAD_IDLE_PRIORITY)
+		rq->count++;
+	t->run_q_cpu = cpu_num;
+}
+
+// NOTE: expects the run queue lock to be held
+static void run_q_remove(struct run_queue *rq, struct thread *t)
+{
+	thread_dequeue_thread(t);
+	if(list_is_empty(&rq->q[t->priority]))
+		rq->bitmap[t->priority / 32] &= ~(1 << (t->priority % 32));
+	if(t->priority != THREAD_IDLE_PRIORITY)
+		rq->count--;
+	t->run_q_cpu = -1;
+}
+
+// NOTE: expects the run queue lock to be held
+static struct thread *run_q_dequeue(struct run_queue *rq, int priority)
+{
+	struct thread *t;
+
+	t = thread_lookat_queue(&rq->q[priority]);
+	if(t)
+		run_q_remove(rq, t);
+	return t;
+}
+
+// pick a cpu to put a newly readied thread on
+// NOTE: the other cpus' queues are only looked at as hints, without their locks
+static int thread_choose_cpu(struct thread *t)
+{
+	int num_cpus = smp_get_num_cpus();
+	int target;
+	int i;
+
+	if(num_cpus == 1)
+		return 0;
+
+	// idle threads never leave their cpu
+	if(t->priority == THREAD_IDLE_PRIORITY)
+		return t->last_cpu;
+
+	// go back to where we last ran to keep the cache warm, as long as
+	// we'd be preempting whatever is running there now
+	target = (t->last_cpu >= 0) ? t->last_cpu : smp_get_current_cpu();
+	if(cpu[target].run_q.curr_priority < t->priority)
+		return target;
+
+	// the old cpu is busy with something at least as important, use an idle cpu if there is one
+	for(i = 0; i < num_cpus; i++) {
+		if(cpu[i].run_q.curr_priority == THREAD_IDLE_PRIORITY && cpu[i].run_q.count == 0)
+			return i;
+	}
+
+	// everyone is busy, stay put and let the idle cpus steal it later if need be
+	return target;
+}
+
 struct thread *thread_lookat_run_q(int priority)
 {
-	return thread_lookat_queue(&run_q[priority]);
+	struct run_queue *rq = &get_curr_cpu_struct()->run_q;
+	struct thread *t;
+
+	GRAB_RUN_Q_LOCK(rq);
+	t = thread_lookat_queue(&rq->q[priority]);
+	RELEASE_RUN_Q_LOCK(rq);
+
+	return t;
 }
 
+// NOTE: expects the thread lock to be held
 void thread_enqueue_run_q(struct thread *t)
 {
+	struct run_queue *rq;
+	int target;
+	bool poke;
+
 	// these shouldn't exist
 	if(t->priority > THREAD_MAX_PRIORITY)
 		t->priority = THREAD_MAX_PRIORITY;
 	if(t->priority < 0)
 		t->priority = 0;
 
-	thread_enqueue(t, &run_q[t->priority]);
+	// coming out of a sem wait, let the policy decide if it gets a boost
+	if(t->sleep_start != 0)
+		sched_thread_woken(t, system_time());
+
+	target = thread_choose_cpu(t);
+	rq = &cpu[target].run_q;
+
+	GRAB_RUN_Q_LOCK(rq);
+	run_q_insert(rq, t, target);
+	poke = (target != smp_get_current_cpu() && rq->curr_priority < t->priority);
+	RELEASE_RUN_Q_LOCK(rq);
+
+	// poke the target cpu if it's running something less important
+	if(poke)
+		smp_send_ici(target, SMP_MSG_RESCHEDULE, 0, 0, 0, NULL, SMP_MSG_FLAG_ASYNC);
+}
+
+// the cpu whose run queue lock covers a thread: the one it's queued on, or
+// the one it's running on. -1 if it's neither, in which case it only changes
+// state under the thread lock.
+static int thread_run_q_owner(struct thread *t)
+{
+	if(t->run_q_cpu >= 0)
+		return t->run_q_cpu;
+	if(t->state == THREAD_STATE_RUNNING)
+		return t->last_cpu;
+	return -1;
+}
+
+// locks the run queue that covers a ready or running thread, so it can't be
+// picked, stolen or requeued out from under us. Returns NULL if there is none.
+// NOTE: expects the thread lock to be held
+static struct run_queue *thread_lock_run_q(struct thread *t)
+{
+	struct run_queue *rq;
+	int owner;
+
+	for(;;) {
+		owner = thread_run_q_owner(t);
+		if(owner < 0)
+			return NULL;
+
+		rq = &cpu[owner].run_q;
+		GRAB_RUN_Q_LOCK(rq);
+		if(thread_run_q_owner(t) == owner)
+			return rq;
+
+		// it moved while we were waiting for the lock
+		RELEASE_RUN_Q_LOCK(rq);
+	}
+}
+
+// picks the next thread to run off of this cpu's run queue, or NULL if
+// there is nothing but the idle thread left on it
+// NOTE: expects this cpu's run queue lock to be held
+static struct thread *thread_dequeue_run_q(void)
+{
+	struct run_queue *rq = &get_curr_cpu_struct()->run_q;
+	struct thread *t = NULL;
+	int last_thread_pri = -1;
+	int i;
+
+	// search the real-time queue
+	i = run_q_highest_below(rq, THREAD_NUM_PRIORITY_LEVELS);
+	if(i >= THREAD_MIN_RT_PRIORITY) {
+		t = run_q_dequeue(rq, i);
+		goto out;
+	}
+
+	// search the regular queue
+	for(; i > THREAD_IDLE_PRIORITY; i = run_q_highest_below(rq, i)) {
+		// skip it sometimes
+		if(_rand() > 0x3000) {
+			t = run_q_dequeue(rq, i);
+			goto out;
+		}
+		last_thread_pri = i;
+	}
+	if(last_thread_pri != -1) {
+		t = run_q_dequeue(rq, last_thread_pri);
+		if(t == NULL)
+			panic("next_thread == NULL! last_thread_pri = %d\n", last_thread_pri);
+	}
+
+out:
+	return t;
 }
 
-static struct thread *thread_dequeue_run_q(int priority)
+// pulls the highest priority thread off of the run queue of the busiest other cpu.
+// Its lock is only tried: two cpus going after each other's queues at once would
+// deadlock, and a queue that's busy now will still be worth stealing from next time.
+// NOTE: expects this cpu's run queue lock to be held
+static struct thread *thread_steal_run_q(int curr_cpu)
 {
-	return thread_dequeue(&run_q[priority]);
+	struct run_queue *rq;
+	struct thread *t = NULL;
+	int num_cpus = smp_get_num_cpus();
+	int busiest = -1;
+	int busiest_count = 0;
+	int pri;
+	int i;
+
+	for(i = 0; i < num_cpus; i++) {
+		if(i != curr_cpu && cpu[i].run_q.count > busiest_count) {
+			busiest = i;
+			busiest_count = cpu[i].run_q.count;
+		}
+	}
+	if(busiest < 0)
+		return NULL;
+
+	rq = &cpu[busiest].run_q;
+	if(atomic_set(&rq->lock, 1) != 0)
+		return NULL;
+
+	pri = run_q_highest_below(rq, THREAD_NUM_PRIORITY_LEVELS);
+	if(pri > THREAD_IDLE_PRIORITY) {
+		t = run_q_dequeue(rq, pri);
+		// hand it over to our queue's lock before letting go of theirs
+		t->state = THREAD_STATE_RUNNING;
+		t->last_cpu = curr_cpu;
+		cpu[curr_cpu].run_q.steal_count++;
+	}
+
+	RELEASE_RUN_Q_LOCK(rq);
+
+	return t;
 }
 
 static void insert_thread_into_proc(struct proc *p, struct thread *t)
@@ -288,7 +533,7 @@ static struct thread *create_thread_struct(const char *name)
 	int_restore_interrupts();
 
 	if(t == NULL) {
-		t = (struct thread *)kmalloc(sizeof(struct thread));
+		t = (struct thread *)object_cache_alloc(thread_cache);
 		if(t == NULL)
 			goto err;
 	}
@@ -299,16 +544,19 @@ static struct thread *create_thread_struct(const char *name)
 	t->id = atomic_add(&next_thread_id, 1);
 	t->proc = NULL;
 	t->cpu = NULL;
+	t->last_cpu = -1;
+	t->run_q_cpu = -1;
 	t->fpu_cpu = NULL;
 	t->fpu_state_saved = true;
 	t->sem_blocking = -1;
+	t->futex_sem = -1;
 	t->fault_handler = 0;
 	t->kernel_stack_region_id = -1;
 	t->kernel_stack_base = 0;
 	t->user_stack_region_id = -1;
 	t->user_stack_base = 0;
 	list_clear_node(&t->proc_node);
-	t->priority = -1;
+	sched_init_thread(t, -1);
 	t->args = NULL;
 	t->sig_pending = 0;
 	t->sig_block_mask = 0;
@@ -337,7 +585,7 @@ static struct thread *create_thread_struct(const char *name)
 err2:
 	sem_delete_etc(t->return_code_sem, -1);
 err1:
-	kfree(t);
+	object_cache_free(thread_cache, t);
 err:
 	return NULL;
 }
@@ -346,16 +594,19 @@ static void delete_thread_struct(struct thread *t)
 {
 	if(t->return_code_sem >= 0)
 		sem_delete_etc(t->return_code_sem, -1);
-	kfree(t);
+	if(t->futex_sem >= 0)
+		sem_delete_etc(t->futex_sem, -1);
+	object_cache_free(thread_cache, t);
 }
 
 static int _create_user_thread_kentry(void)
 {
 	struct thread *t;
 
-	// simulates the thread spinlock release that would occur if the thread had been
-	// rescheded from. The resched didn't happen because the thread is new.
-	RELEASE_THREAD_LOCK();
+	// finishes the context switch that got us here, like thread_resched would have
+	// if the thread had been rescheded from. The resched didn't happen because the
+	// thread is new.
+	thread_finish_switch(false);
 	int_restore_interrupts(); // this essentially simulates a return-from-interrupt
 
 	t = thread_get_current_thread();
@@ -380,9 +631,10 @@ static int _create_kernel_thread_kentry(void)
 	struct thread *t;
 	int retcode;
 
-	// simulates the thread spinlock release that would occur if the thread had been
-	// rescheded from. The resched didn't happen because the thread is new.
-	RELEASE_THREAD_LOCK();
+	// finishes the context switch that got us here, like thread_resched would have
+	// if the thread had been rescheded from. The resched didn't happen because the
+	// thread is new.
+	thread_finish_switch(false);
 	int_restore_interrupts(); // this essentially simulates a return-from-interrupt
 
 	// start tracking kernel time
@@ -412,7 +664,7 @@ static thread_id _create_thread(const char *name, proc_id pid, addr_t entry, voi
 	if(t == NULL)
 		return ERR_NO_MEMORY;
 
-	t->priority = THREAD_MEDIUM_PRIORITY;
+	sched_init_thread(t, THREAD_MEDIUM_PRIORITY);
 	t->state = THREAD_STATE_BIRTH;
 	t->next_state = THREAD_STATE_SUSPENDED;
 
@@ -537,6 +789,19 @@ thread_id thread_get_current_thread_id(void)
 	return t ? t->id : 0;
 }
 
+// used by the adaptive locks to decide if it's worth spinning on a lock holder.
+// The answer may be stale by the time it's returned.
+bool thread_is_running(thread_id id)
+{
+	int i;
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		if(cpu[i].running_thread == id)
+			return true;
+	}
+	return false;
+}
+
 int thread_resume_thread(thread_id id)
 {
 	return send_signal_etc(id, SIGCONT, SIG_FLAG_NO_RESCHED);
@@ -545,7 +810,9 @@ int thread_resume_thread(thread_id id)
 int thread_set_priority(thread_id id, int priority)
 {
 	struct thread *t;
+	struct run_queue *rq;
 	int retval;
+	int target = -1;
 
 	// make sure the passed in priority is within bounds
 	if(priority > THREAD_MAX_RT_PRIORITY)
@@ -557,7 +824,7 @@ int thread_set_priority(thread_id id, int priority)
 	if(t->id == id) {
 		// it's ourself, so we know we aren't in a run queue, and we can manipulate
 		// our structure directly
-		t->priority = priority;
+		sched_set_base_priority(t, priority);
 		retval = NO_ERROR;
 	} else {
 		int_disable_interrupts();
@@ -565,20 +832,31 @@ int thread_set_priority(thread_id id, int priority)
 
 		t = thread_get_thread_struct_locked(id);
 		if(t) {
-			if(t->state == THREAD_STATE_READY && t->priority != priority) {
+			rq = thread_lock_run_q(t);
+			if(t->run_q_cpu >= 0 && t->base_priority != priority) {
 				// this thread is in a ready queue right now, so it needs to be reinserted
-				thread_dequeue_thread(t);
-				t->priority = priority;
-				thread_enqueue_run_q(t);
+				target = t->run_q_cpu;
+				run_q_remove(rq, t);
+				sched_set_base_priority(t, priority);
+				run_q_insert(rq, t, target);
+				if(target == smp_get_current_cpu() || rq->curr_priority >= t->priority)
+					target = -1;
 			} else {
-				t->priority = priority;
+				sched_set_base_priority(t, priority);
 			}
+			if(rq != NULL)
+				RELEASE_RUN_Q_LOCK(rq);
 			retval = NO_ERROR;
 		} else {
 			retval = ERR_INVALID_HANDLE;
 		}
 
 		RELEASE_THREAD_LOCK();
+
+		// it may now be more important than what its cpu is running
+		if(target >= 0)
+			smp_send_ici(target, SMP_MSG_RESCHEDULE, 0, 0, 0, NULL, SMP_MSG_FLAG_ASYNC);
+
 		int_restore_interrupts();
 	}
 
@@ -618,6 +896,8 @@ int thread_get_thread_info(thread_id id, struct thread_info *outinfo)
 	info.user_stack_base = t->user_stack_base;
 	info.user_time = t->user_time;
 	info.kernel_time = t->kernel_time;
+	info.context_switches = t->context_switches;
+	info.preemptions = t->preemptions;
 
 	err = NO_ERROR;
 
@@ -699,6 +979,8 @@ int thread_get_next_thread_info(uint32 *_cookie, proc_id pid, struct thread_info
 	info.user_stack_base = t->user_stack_base;
 	info.user_time = t->user_time;
 	info.kernel_time = t->kernel_time;
+	info.context_switches = t->context_switches;
+	info.preemptions = t->preemptions;
 
 	err = NO_ERROR;
 
@@ -835,7 +1117,7 @@ static void _dump_thread_info(struct thread *t)
 	dprintf("name:        '%s'\n", t->name);
 	dprintf("next:        %p\nproc_node.prev:  %p\nproc_node.next:  %p\nq_node.prev:     %p\nq_node.next:     %p\n",
 		t->next, t->proc_node.prev, t->proc_node.next, t->q_node.prev, t->q_node.next);
-	dprintf("priority:    0x%x\n", t->priority);
+	dprintf("priority:    0x%x (base 0x%x)\n", t->priority, t->base_priority);
 	dprintf("state:       %s\n", state_to_text(t->state));
 	dprintf("next_state:  %s\n", state_to_text(t->next_state));
 	dprintf("cpu:         %p ", t->cpu);
@@ -843,6 +1125,8 @@ static void _dump_thread_info(struct thread *t)
 		dprintf("(%d)\n", t->cpu->cpu_num);
 	else
 		dprintf("\n");
+	dprintf("last_cpu:    %d\n", t->last_cpu);
+	dprintf("run_q_cpu:   %d\n", t->run_q_cpu);
 	dprintf("sig_pending:  0x%lx\n", t->sig_pending);
 	dprintf("sig_block_mask:  0x%lx\n", t->sig_block_mask);
 	dprintf("in_kernel:   %d\n", t->in_kernel);
@@ -863,6 +1147,11 @@ static void _dump_thread_info(struct thread *t)
 	dprintf("user_stack_base:   0x%lx\n", t->user_stack_base);
 	dprintf("kernel_time:       %Ld\n", t->kernel_time);
 	dprintf("user_time:         %Ld\n", t->user_time);
+	dprintf("run_avg:           %Ld\n", t->sched_run_avg);
+	dprintf("sleep_avg:         %Ld\n", t->sched_sleep_avg);
+	dprintf("quantum:           %Ld\n", t->quantum);
+	dprintf("context_switches:  %d\n", t->context_switches);
+	dprintf("preemptions:       %d\n", t->preemptions);
 	dprintf("architecture dependant section:\n");
 	arch_thread_dump_info(&t->arch_info);
 
@@ -979,6 +1268,29 @@ static void dump_next_thread_in_proc(int argc, char **argv)
 		dprintf("NULL\n");
 }
 
+static void dump_run_queues(int argc, char **argv)
+{
+	struct run_queue *rq;
+	struct thread *t;
+	int i;
+	int pri;
+
+	for(i = 0; i < smp_get_num_cpus(); i++) {
+		rq = &cpu[i].run_q;
+		dprintf("cpu %d: %d queued, running priority %d, %d stolen\n",
+			i, rq->count, rq->curr_priority, rq->steal_count);
+		for(pri = THREAD_NUM_PRIORITY_LEVELS - 1; pri >= 0; pri--) {
+			if(list_is_empty(&rq->q[pri]))
+				continue;
+			dprintf("  %2d:", pri);
+			list_for_every_entry(&rq->q[pri], t, struct thread, q_node) {
+				dprintf(" 0x%x", t->id);
+			}
+			dprintf("\n");
+		}
+	}
+}
+
 static int get_death_stack(void)
 {
 	int i;
@@ -1046,6 +1358,11 @@ int thread_init(kernel_args *ka)
 	dprintf("thread_init: entry\n");
 	kprintf("initializing threading system...\n");
 
+	// thread structures hold the fpu save area, which has to be 16 byte aligned
+	thread_cache = object_cache_create("thread", sizeof(struct thread), 16, NULL, NULL, NULL);
+	if(thread_cache == NULL)
+		panic("could not create thread object cache!\n");
+
 	// create the process hash table
 	proc_hash = hash_init(15, offsetof(struct proc, next), &proc_struct_compare, &proc_struct_hash);
 
@@ -1086,8 +1403,8 @@ int thread_init(kernel_args *ka)
 		&thread_struct_compare, &thread_struct_hash);
 
 	// zero out the run queues
-	for(i = 0; i < THREAD_NUM_PRIORITY_LEVELS; i++) {
-		list_initialize(&run_q[i]);
+	for(i = 0; i < _MAX_CPUS; i++) {
+		run_q_init(&cpu[i].run_q);
 	}
 
 	// zero out the dead thread structure q
@@ -1112,7 +1429,7 @@ int thread_init(kernel_args *ka)
 			return ERR_NO_MEMORY;
 		}
 		t->proc = proc_get_kernel_proc();
-		t->priority = THREAD_IDLE_PRIORITY;
+		sched_init_thread(t, THREAD_IDLE_PRIORITY);
 		t->state = THREAD_STATE_RUNNING;
 		t->next_state = THREAD_STATE_READY;
 		t->int_disable_level = 1; // ints are disabled until the int_restore_interrupts in main()
@@ -1131,6 +1448,8 @@ int thread_init(kernel_args *ka)
 		if(i == 0)
 			arch_thread_set_current_thread(t);
 		t->cpu = &cpu[i];
+		t->cpu->running_thread = t->id;
+		t->last_cpu = i;
 	}
 
 	// create a set of death stacks
@@ -1171,6 +1490,7 @@ int thread_init(kernel_args *ka)
 	dbg_add_command(dump_next_thread_in_all_list, "next_all", "dump the next thread in the global list of the last thread viewed");
 	dbg_add_command(dump_next_thread_in_proc, "next_proc", "dump the next thread in the process of the last thread viewed");
 	dbg_add_command(dump_proc_info, "proc", "list info about a particular process");
+	dbg_add_command(dump_run_queues, "run_q", "dump the per-cpu run queues");
 
 	// initialize the architectural specific thread routines
 	arch_thread_init(ka);
@@ -1420,6 +1740,7 @@ void thread_exit(int retcode)
 		// clean up resources owned by the process
 		vm_put_aspace(p->aspace);
 		vm_delete_aspace(p->aspace_id);
+		evq_delete_owned_evqs(p->id);
 		port_delete_owned_ports(p->id);
 		sem_delete_owned_sems(p->id);
 		vfs_free_ioctx(p->ioctx);
@@ -1437,6 +1758,12 @@ void thread_exit(int retcode)
 		sem_delete_etc(s, retcode);
 	}
 
+	// nobody can be waking us out of a futex wait anymore
+	if(t->futex_sem >= 0) {
+		sem_delete(t->futex_sem);
+		t->futex_sem = -1;
+	}
+
 	// get_death_stack leaves interrupts disabled
 	death_stack = get_death_stack();
 	{
@@ -1645,6 +1972,7 @@ static void thread_context_switch(struct thread *t_from, struct thread *t_to)
  
 	// set the current cpu and thread pointer
 	t_to->cpu = t_from->cpu;
+	t_to->cpu->running_thread = t_to->id;
 	arch_thread_set_current_thread(t_to);
 	t_from->cpu = NULL;
 
@@ -1691,23 +2019,41 @@ static int reschedule_event(void *unused)
 	return INT_RESCHEDULE;
 }
 
-// NOTE: expects thread_spinlock to be held
-void thread_resched(void)
+// picks the next thread to run on this cpu and switches to it. The run queue
+// lock is held across the switch, so the thread going out can't be picked by
+// another cpu before it's off of this one. If the thread lock is held, it
+// goes across too, and whoever gets switched to sorts it out.
+// NOTE: expects interrupts to be off
+static void _thread_resched(bool thread_locked)
 {
-	struct thread *next_thread = NULL;
-	int last_thread_pri = -1;
+	struct thread *next_thread;
 	struct thread *old_thread = thread_get_current_thread();
-	int i;
+	struct cpu_ent *curr_cpu = old_thread->cpu;
+	struct run_queue *rq = &curr_cpu->run_q;
+	bigtime_t now;
 	bigtime_t quantum;
 	struct timer_event *quantum_timer;
+	bool accounted = false;
 
 //	dprintf("top of thread_resched: cpu %d, cur_thread = 0x%x\n", smp_get_current_cpu(), thread_get_current_thread());
 
+	GRAB_RUN_Q_LOCK(rq);
+
+	// a thread at the end of its quantum or giving up the cpu gets accounted for
+	// up front, since the policy may adjust its priority before it's requeued
+	now = system_time();
+	if(curr_cpu->preempted
+		|| (old_thread->next_state != THREAD_STATE_READY && old_thread->next_state != THREAD_STATE_RUNNING)) {
+		sched_thread_stop_running(old_thread, now, curr_cpu->preempted);
+		accounted = true;
+	}
+
 	switch(old_thread->next_state) {
 		case THREAD_STATE_RUNNING:
 		case THREAD_STATE_READY:
 //			dprintf("enqueueing thread 0x%x into run q. pri = %d\n", old_thread, old_thread->priority);
-			thread_enqueue_run_q(old_thread);
+			// put it back on our own queue, it's cache hot here
+			run_q_insert(rq, old_thread, curr_cpu->cpu_num);
 			break;
 		case THREAD_STATE_SUSPENDED:
 			dprintf("suspending thread 0x%x\n", old_thread->id);
@@ -1721,61 +2067,101 @@ void thread_resched(void)
 	}
 	old_thread->state = old_thread->next_state;
 
-	// search the real-time queue
-	for(i = THREAD_MAX_RT_PRIORITY; i >= THREAD_MIN_RT_PRIORITY; i--) {
-		next_thread = thread_dequeue_run_q(i);
-		if(next_thread)
-			goto found_thread;
+	next_thread = thread_dequeue_run_q();
+	if(next_thread == NULL) {
+		// nothing but the idle thread here, see if another cpu has more work than it can handle
+		next_thread = thread_steal_run_q(curr_cpu->cpu_num);
 	}
 
-	// search the regular queue
-	for(i = THREAD_MAX_PRIORITY; i > THREAD_IDLE_PRIORITY; i--) {
-		next_thread = thread_lookat_run_q(i);
-		if(next_thread != NULL) {
-			// skip it sometimes
-			if(_rand() > 0x3000) {
-				next_thread = thread_dequeue_run_q(i);
-				goto found_thread;
-			}
-			last_thread_pri = i;
-			next_thread = NULL;
-		}
-	}
 	if(next_thread == NULL) {
-		if(last_thread_pri != -1) {
-			next_thread = thread_dequeue_run_q(last_thread_pri);
-			if(next_thread == NULL)
-				panic("next_thread == NULL! last_thread_pri = %d\n", last_thread_pri);
-		} else {
-			next_thread = thread_dequeue_run_q(THREAD_IDLE_PRIORITY);
-			if(next_thread == NULL)
-				panic("next_thread == NULL! no idle priorities!\n");
-		}
+		next_thread = run_q_dequeue(rq, THREAD_IDLE_PRIORITY);
+		if(next_thread == NULL)
+			panic("next_thread == NULL! no idle priorities!\n");
 	}
+	rq->curr_priority = next_thread->priority;
 
-found_thread:
 	next_thread->state = THREAD_STATE_RUNNING;
 	next_thread->next_state = THREAD_STATE_READY;
+	next_thread->last_cpu = curr_cpu->cpu_num;
 
-	// XXX should only reset the quantum timer if we are switching to a new thread,
-	// or we got here as a result of a quantum expire.
-
-	// XXX calculate quantum
-	quantum = 10000;
+	if(next_thread != old_thread) {
+		if(!accounted)
+			sched_thread_stop_running(old_thread, now, false);
+		// only a switch forced by the quantum running out counts, not a thread yielding
+		if(curr_cpu->preempted)
+			old_thread->preemptions++;
+		next_thread->context_switches++;
+		sched_thread_start_running(next_thread, now);
+	} else if(accounted) {
+		sched_thread_start_running(next_thread, now);
+	}
 
 	// get the quantum timer for this cpu
-	quantum_timer = &old_thread->cpu->quantum_timer;
-	if(!old_thread->cpu->preempted) {
-		_local_timer_cancel_event(old_thread->cpu->cpu_num, quantum_timer);
+	quantum_timer = &curr_cpu->quantum_timer;
+	if(next_thread == old_thread && !curr_cpu->preempted && quantum_timer->sched_time != 0) {
+		// the same thread keeps running and its quantum hasn't run out, leave the timer alone
+	} else {
+		if(!curr_cpu->preempted) {
+			_local_timer_cancel_event(curr_cpu->cpu_num, quantum_timer);
+		}
+		curr_cpu->preempted= 0;
+		quantum = sched_quantum(next_thread);
+		timer_setup_timer(&reschedule_event, NULL, quantum_timer);
+		timer_set_event(quantum, TIMER_MODE_ONESHOT, quantum_timer);
 	}
-	old_thread->cpu->preempted= 0;
-	timer_setup_timer(&reschedule_event, NULL, quantum_timer);
-	timer_set_event(quantum, TIMER_MODE_ONESHOT, quantum_timer);
 
 	if(next_thread != old_thread) {
 //		dprintf("thread_resched: cpu %d switching from thread %d to %d\n",
 //			smp_get_current_cpu(), old_thread->id, next_thread->id);
+		curr_cpu->switch_thread_locked = thread_locked;
 		thread_context_switch(old_thread, next_thread);
+
+		// running again, maybe on another cpu, switched to by whoever picked us
+		thread_finish_switch(thread_locked);
+	} else {
+		RELEASE_RUN_Q_LOCK(rq);
+	}
+}
+
+// called by a thread that was just switched to. Lets go of the run queue lock
+// the switch was done under. The thread lock is let go of too if it came across
+// and this thread doesn't expect to hold it, or picked up if it didn't and it does.
+// NOTE: expects interrupts to be off
+static void thread_finish_switch(bool thread_locked)
+{
+	struct cpu_ent *curr_cpu = get_curr_cpu_struct();
+	bool switch_thread_locked = curr_cpu->switch_thread_locked;
+
+	RELEASE_RUN_Q_LOCK(&curr_cpu->run_q);
+
+	if(switch_thread_locked && !thread_locked)
+		RELEASE_THREAD_LOCK();
+	else if(!switch_thread_locked && thread_locked)
+		GRAB_THREAD_LOCK();
+}
+
+// NOTE: expects interrupts to be off and thread_spinlock to be held
+void thread_resched(void)
+{
+	_thread_resched(true);
+}
+
+// reschedules on the way out of an interrupt. A running thread being preempted
+// only moves between this cpu and its run queue, which the run queue lock covers,
+// so this leaves the thread lock alone. Anything else, like a signal stopping the
+// thread, still needs it.
+// NOTE: expects interrupts to be off
+void thread_preempt(void)
+{
+	struct thread *t = thread_get_current_thread();
+
+	// only the thread itself sets its next state, so it can be looked at unlocked
+	if(t->next_state == THREAD_STATE_READY || t->next_state == THREAD_STATE_RUNNING) {
+		_thread_resched(false);
+	} else {
+		GRAB_THREAD_LOCK();
+		_thread_resched(true);
+		RELEASE_THREAD_LOCK();
 	}
 }
 
@@ -22,8 +22,18 @@ static bigtime_t tz_delta;
 // The current name of the timezone, saved for all to see
 static char tz_name[SYS_MAX_NAME_LEN];
 
+// system time comes straight from the arch's clocksource instead of sys_time
+static bool use_clocksource;
+
+int time_preboot_init(kernel_args *ka, int cpu_num)
+{
+	return arch_time_preboot_init(ka, cpu_num);
+}
+
 int time_init(kernel_args *ka)
 {
+	int err;
+
 	dprintf("time_init: entry\n");
 
 	sys_time = 0;
@@ -31,7 +41,20 @@ int time_init(kernel_args *ka)
 	tz_delta = 0;
 	strcpy(tz_name, "UTC");
 
-	return arch_time_init(ka);
+	err = arch_time_init(ka);
+	if(err < 0)
+		return err;
+
+	use_clocksource = arch_time_has_clocksource();
+	if(use_clocksource)
+		dprintf("time_init: using arch clocksource\n");
+
+	return 0;
+}
+
+bool time_has_clocksource(void)
+{
+	return use_clocksource;
 }
 
 int time_init2(kernel_args *ka)
@@ -52,6 +75,9 @@ bigtime_t system_time(void)
 	volatile bigtime_t *st = &sys_time;
 	bigtime_t val;
 
+	if(use_clocksource)
+		return arch_get_clocksource_time();
+
 retry:
 	// read the system time, make sure we didn't get a partial read
 	val = sys_time;
@@ -69,6 +95,9 @@ bigtime_t system_time_lores(void)
 	volatile bigtime_t *st = &sys_time;
 	bigtime_t val;
 
+	if(use_clocksource)
+		return arch_get_clocksource_time();
+
 retry:
 	// read the system time, make sure we didn't get a partial read
 	val = sys_time;
@@ -18,18 +18,82 @@
 #include <kernel/arch/timer.h>
 #include <kernel/arch/smp.h>
 
-#define DYNAMIC_TIMER 0
+// go tickless when the arch gives us a clocksource to keep system_time with.
+// The hardware timer is then run in one shot mode, set for the next event.
+#define DYNAMIC_TIMER 1
 
 #define TICK_RATE 5000 // 5 msecs
 
+// size of a wheel slot in one shot mode. Deadlines that fall in the same slot
+// share a single interrupt.
+#define TIMER_HIRES_RES 100
+
+// longest the hardware timer is allowed to go in one shot mode. Bounds how far
+// ahead timer_wheel_next_tick has to look, and how much of the wheel one
+// interrupt has to run through.
+#define TIMER_MAX_SLEEP 100000
+
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_RANGE (((bigtime_t)1 << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)
+
+static bool dynamic_timer;
+static bigtime_t wheel_res; // usecs per wheel tick
+
+static void timer_wheel_init(struct timer_wheel *wheel, bigtime_t now)
+{
+	int level;
+	int i;
+
+	wheel->clk = now / wheel_res;
+	wheel->next_hw_tick = 0;
+	wheel->count = 0;
+	for(level = 0; level < TIMER_WHEEL_LEVELS; level++) {
+		for(i = 0; i < TIMER_WHEEL_SLOTS; i++)
+			list_initialize(&wheel->slots[level][i]);
+	}
+}
+
+static void timer_wheel_program(struct timer_wheel *wheel);
+
+// start this cpu's hardware timer
+static void timer_start(void)
+{
+	cpu_ent *cpu;
+
+	if(!dynamic_timer) {
+		arch_timer_set_hardware_timer(TICK_RATE, HW_TIMER_REPEATING);
+		return;
+	}
+
+	int_disable_interrupts();
+	cpu = get_cpu_struct(smp_get_current_cpu());
+	acquire_spinlock(&cpu->timer_spinlock);
+	timer_wheel_program(&cpu->timer_wheel);
+	release_spinlock(&cpu->timer_spinlock);
+	int_restore_interrupts();
+}
+
 int timer_init(kernel_args *ka)
 {
+	bigtime_t now;
+	int i;
+
 	dprintf("init_timer: entry\n");
 
+	// without a clocksource, system_time is kept by counting ticks
+	dynamic_timer = DYNAMIC_TIMER && time_has_clocksource();
+	wheel_res = dynamic_timer ? TIMER_HIRES_RES : TICK_RATE;
+	dprintf("init_timer: %s mode, resolution %Ld usecs\n", dynamic_timer ? "one shot" : "periodic", wheel_res);
+
+	// set up all of the wheels now, events may be armed on cpus that haven't started yet
+	now = system_time();
+	for(i = 0; i < _MAX_CPUS; i++)
+		timer_wheel_init(&get_cpu_struct(i)->timer_wheel, now);
+
 	arch_init_timer(ka);
 
 	// start the system ticks
-	arch_timer_set_hardware_timer(TICK_RATE, HW_TIMER_REPEATING);
+	timer_start();
 
 	return 0;
 }
@@ -38,91 +102,219 @@ int timer_init_percpu(kernel_args *ka, int cpu_num)
 {
 	// start a hardware timer on this cpu
 	// XXX can we assume this for all architectures?
-	arch_timer_set_hardware_timer(TICK_RATE, HW_TIMER_REPEATING);
+	timer_start();
 
 	return 0;
 }
 
-// NOTE: expects interrupts to be off
-static void add_event_to_list(struct timer_event *event, struct timer_event * volatile *list)
+// the first wheel tick at or after the event's time, so it never goes off early
+static bigtime_t event_to_tick(struct timer_event *event)
 {
-	struct timer_event *next;
-	struct timer_event *last = NULL;
-
-	// stick it in the event list
-	next = *list;
-	while(next != NULL && next->sched_time < event->sched_time) {
-		last = next;
-		next = next->next;
+	return (event->sched_time + wheel_res - 1) / wheel_res;
+}
+
+// NOTE: expects interrupts to be off and the wheel's spinlock held
+static void add_event_to_wheel(struct timer_event *event, struct timer_wheel *wheel)
+{
+	bigtime_t expires = event_to_tick(event);
+	bigtime_t delta;
+	int level;
+
+	if(expires < wheel->clk)
+		expires = wheel->clk; // already late, catch it on the next pass
+	delta = expires - wheel->clk;
+
+	// pick the finest level that reaches out far enough
+	for(level = 0; level < TIMER_WHEEL_LEVELS - 1; level++) {
+		if(delta < ((bigtime_t)1 << (TIMER_WHEEL_BITS * (level + 1))))
+			break;
+	}
+	if(delta > TIMER_WHEEL_RANGE) {
+		// past the end of the wheel, park it in the last slot. It'll get sorted
+		// again when it cascades down.
+		expires = wheel->clk + TIMER_WHEEL_RANGE;
 	}
 
-	if(last != NULL) {
-		event->next = last->next;
-		last->next = event;
-	} else {
-		event->next = next;
-		*list = event;
+	list_add_tail(&wheel->slots[level][(expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK], &event->node);
+	wheel->count++;
+}
+
+// redistribute the events of the higher level slots that the wheel just moved into
+// NOTE: expects interrupts to be off and the wheel's spinlock held
+static void cascade_wheel(struct timer_wheel *wheel)
+{
+	struct list_node temp;
+	struct list_node *node;
+	int level;
+	int index;
+
+	for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		index = (wheel->clk >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+
+		// pull the whole slot off first, events past the end of the wheel may land back in it
+		list_initialize(&temp);
+		while((node = list_remove_head(&wheel->slots[level][index])) != NULL)
+			list_add_tail(&temp, node);
+
+		while((node = list_remove_head(&temp)) != NULL) {
+			wheel->count--;
+			add_event_to_wheel(containerof(node, struct timer_event, node), wheel);
+		}
+
+		if(index != 0)
+			break;
+	}
+}
+
+// find the first wheel tick that has something to do, either an event coming
+// due or a higher level slot that needs to be cascaded down
+// NOTE: expects interrupts to be off and the wheel's spinlock held
+static bigtime_t timer_wheel_next_tick(struct timer_wheel *wheel)
+{
+	bigtime_t next = wheel->clk + TIMER_MAX_SLEEP / wheel_res;
+	bigtime_t block;
+	bigtime_t tick;
+	int level;
+	int index;
+	int start;
+	int dist;
+	int i;
+
+	if(wheel->count == 0)
+		return next;
+
+	// the higher levels need waking up for when their next busy slot gets cascaded
+	for(level = 1; level < TIMER_WHEEL_LEVELS; level++) {
+		block = wheel->clk >> (TIMER_WHEEL_BITS * level);
+		index = block & TIMER_WHEEL_MASK;
+		// the current slot has already been cascaded, unless the wheel is sitting right at its start.
+		// Anything in it now is for the next time around.
+		start = (wheel->clk & (((bigtime_t)1 << (TIMER_WHEEL_BITS * level)) - 1)) ? 1 : 0;
+		for(dist = start; dist < TIMER_WHEEL_SLOTS + start; dist++) {
+			if(!list_is_empty(&wheel->slots[level][(index + dist) & TIMER_WHEEL_MASK]))
+				break;
+		}
+		if(dist == TIMER_WHEEL_SLOTS + start)
+			continue;
+		tick = (block + dist) << (TIMER_WHEEL_BITS * level);
+		if(tick < next)
+			next = tick;
+	}
+
+	// level 0 slots only hold events due at exactly that tick
+	for(i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+		tick = wheel->clk + i;
+		if(tick >= next)
+			break;
+		if(!list_is_empty(&wheel->slots[0][tick & TIMER_WHEEL_MASK]))
+			return tick;
+	}
+
+	return next;
+}
+
+// set the hardware timer to go off for the next thing the wheel has to do
+// NOTE: expects interrupts to be off and the wheel's spinlock held
+static void timer_wheel_program(struct timer_wheel *wheel)
+{
+	bigtime_t now = system_time();
+	bigtime_t tick = timer_wheel_next_tick(wheel);
+	bigtime_t delay = tick * wheel_res - now;
+
+	if(delay > TIMER_MAX_SLEEP) {
+		delay = TIMER_MAX_SLEEP;
+		tick = (now + delay) / wheel_res;
 	}
+	if(delay < 0)
+		delay = 0;
+
+	wheel->next_hw_tick = tick;
+	arch_timer_set_hardware_timer(delay, HW_TIMER_ONESHOT);
 }
 
 int timer_interrupt(void)
 {
-	bigtime_t curr_time;
+	bigtime_t target;
+	bigtime_t next;
 	struct timer_event *event;
+	struct list_node *slot;
 	spinlock_t *spinlock;
 	cpu_ent *cpu = get_curr_cpu_struct();
+	struct timer_wheel *wheel = &cpu->timer_wheel;
 	int rc = INT_NO_RESCHEDULE;
 
-	// cpu 0 gets to increment the system timer
-	if(cpu->cpu_num == 0)
-		time_tick(TICK_RATE);
-
-	curr_time = system_time_lores();
+	if(dynamic_timer) {
+		target = system_time() / wheel_res;
+	} else {
+		// cpu 0 gets to increment the system timer
+		if(cpu->cpu_num == 0)
+			time_tick(TICK_RATE);
+		target = system_time_lores() / wheel_res;
+	}
 
 	spinlock = &cpu->timer_spinlock;
 
 	acquire_spinlock(spinlock);
 
-restart_scan:
-	event = cpu->timer_events;
-	if(event != NULL && event->sched_time <= curr_time) {
-		// this event needs to happen
-		int mode = event->mode;
-		bigtime_t old_sched_time = event->sched_time;
+	while(wheel->clk <= target) {
+		if(wheel->count == 0) {
+			// nothing to run or cascade, skip ahead
+			wheel->clk = target + 1;
+			break;
+		}
 
-		cpu->timer_events = event->next;
-		event->sched_time = 0;
+		if(dynamic_timer) {
+			// the wheel is fine grained, jump over the ticks with nothing in them
+			next = timer_wheel_next_tick(wheel);
+			if(next > target) {
+				wheel->clk = target + 1;
+				break;
+			}
+			wheel->clk = next;
+		}
 
-		release_spinlock(spinlock);
+		if((wheel->clk & TIMER_WHEEL_MASK) == 0)
+			cascade_wheel(wheel);
 
-		// call the callback
-		// note: if the event is not periodic, it is ok
-		// to delete the event structure inside the callback
-		if(event->func != NULL) {
-			if(event->func(event->data) != INT_NO_RESCHEDULE)
-				rc = INT_RESCHEDULE;
-		}
+		slot = &wheel->slots[0][wheel->clk & TIMER_WHEEL_MASK];
+		while((event = list_remove_head_type(slot, struct timer_event, node)) != NULL) {
+			// this event needs to happen
+			int mode = event->mode;
+			bigtime_t old_sched_time = event->sched_time;
+
+			wheel->count--;
+			event->sched_time = 0;
+
+			release_spinlock(spinlock);
 
-		acquire_spinlock(spinlock);
+			// call the callback
+			// note: if the event is not periodic, it is ok
+			// to delete the event structure inside the callback
+			if(event->func != NULL) {
+				if(event->func(event->data) != INT_NO_RESCHEDULE)
+					rc = INT_RESCHEDULE;
+			}
 
-		if(mode == TIMER_MODE_PERIODIC) {
-			// we need to adjust it and add it back to the list
-			event->sched_time = old_sched_time + event->periodic_time;
-			if(event->sched_time == 0)
-				event->sched_time = 1; // if we wrapped around and happen
-				                       // to hit zero, set it to one, since
-				                       // zero represents not scheduled
-			add_event_to_list(event, &cpu->timer_events);
+			acquire_spinlock(spinlock);
+
+			// put it back, unless the callback already rescheduled it
+			if(mode == TIMER_MODE_PERIODIC && event->sched_time == 0) {
+				event->sched_time = old_sched_time + event->periodic_time;
+				if(event->sched_time == 0)
+					event->sched_time = 1; // if we wrapped around and happen
+					                       // to hit zero, set it to one, since
+					                       // zero represents not scheduled
+				event->scheduled_cpu = cpu->cpu_num;
+				add_event_to_wheel(event, wheel);
+			}
 		}
 
-		goto restart_scan; // the list may have changed
+		wheel->clk++;
 	}
 
-#if DYNAMIC_TIMER
 	// setup the next hardware timer
-	if(cpu->timer_events != NULL)
-		arch_timer_set_hardware_timer(cpu->timer_events->sched_time - system_time());
-#endif
+	if(dynamic_timer)
+		timer_wheel_program(wheel);
 
 	release_spinlock(spinlock);
 
@@ -134,14 +326,30 @@ void timer_setup_timer(timer_callback func, void *data, struct timer_event *even
 	event->func = func;
 	event->data = data;
 	event->sched_time = 0;
+	list_clear_node(&event->node);
 }
 
 int timer_set_event(bigtime_t relative_time, timer_mode mode, struct timer_event *event)
+{
+	return timer_set_event_etc(relative_time, mode, event, TIMER_CURRENT_CPU);
+}
+
+// Arm an event on any cpu's wheel, which only takes that wheel's spinlock.
+// In periodic mode the other cpu finds it on its next tick, which is no later
+// than the wheel's resolution would have it go off anyway. In one shot mode
+// the other cpu's hardware timer may be set as far as TIMER_MAX_SLEEP out, so
+// an event due before that gets an ici to pull the timer in. Either way the
+// event goes off at most one wheel tick late, plus the ici latency in the
+// second case. Events due after the timer is already set to go off need no ici.
+int timer_set_event_etc(bigtime_t relative_time, timer_mode mode, struct timer_event *event, int cpu_num)
 {
 	cpu_ent *cpu;
+	bool send_ici = false;
 
 	if(event == NULL)
 		return ERR_INVALID_ARGS;
+	if(cpu_num != TIMER_CURRENT_CPU && (cpu_num < 0 || cpu_num >= smp_get_num_cpus()))
+		return ERR_INVALID_ARGS;
 
 	if(relative_time < 0)
 		relative_time = 0;
@@ -160,69 +368,74 @@ int timer_set_event(bigtime_t relative_time, timer_mode mode, struct timer_event
 
 	int_disable_interrupts();
 
-	cpu = get_curr_cpu_struct();
+	if(cpu_num == TIMER_CURRENT_CPU)
+		cpu_num = smp_get_current_cpu();
+	cpu = get_cpu_struct(cpu_num);
 
 	acquire_spinlock(&cpu->timer_spinlock);
 
-	event->scheduled_cpu = cpu->cpu_num;
-	add_event_to_list(event, &cpu->timer_events);
-
-#if DYNAMIC_TIMER
-	// if we were stuck at the headof the list, set the hardware timer
-	if(event == cpu->timer_events) {
-		arch_timer_set_hardware_timer(relative_time);
+	event->scheduled_cpu = cpu_num;
+	add_event_to_wheel(event, &cpu->timer_wheel);
+
+	// if it's due before the hardware timer goes off, move the timer up
+	if(dynamic_timer && event_to_tick(event) < cpu->timer_wheel.next_hw_tick) {
+		if(cpu_num == smp_get_current_cpu()) {
+			timer_wheel_program(&cpu->timer_wheel);
+		} else {
+			// only the cpu itself can get at its timer. Note the earlier
+			// deadline now, so events armed behind this one don't send
+			// another ici before the other cpu gets to it.
+			cpu->timer_wheel.next_hw_tick = event_to_tick(event);
+			send_ici = true;
+		}
 	}
-#endif
 
 	release_spinlock(&cpu->timer_spinlock);
+
+	if(send_ici)
+		smp_send_ici(cpu_num, SMP_MSG_TIMER_REPROGRAM, 0, 0, 0, NULL, SMP_MSG_FLAG_ASYNC);
+
 	int_restore_interrupts();
 
 	return 0;
 }
 
+// another cpu armed an event here that's due before the hardware timer goes off
+// NOTE: called from the ici handler, with interrupts off
+void timer_reprogram(void)
+{
+	cpu_ent *cpu = get_curr_cpu_struct();
+
+	if(!dynamic_timer)
+		return;
+
+	acquire_spinlock(&cpu->timer_spinlock);
+	timer_wheel_program(&cpu->timer_wheel);
+	release_spinlock(&cpu->timer_spinlock);
+}
+
 /* this is a fast path to be called from reschedule and from timer_cancel_event */
 /* must always be invoked with interrupts disabled */
 int _local_timer_cancel_event(int curr_cpu, struct timer_event *event)
 {
-	struct timer_event *last = NULL;
-	struct timer_event *e;
 	bool foundit = false;
 	cpu_ent *cpu = get_cpu_struct(curr_cpu);
 
 	acquire_spinlock(&cpu->timer_spinlock);
-	e = cpu->timer_events;
-	while(e != NULL) {
-		if(e == event) {
-			// we found it
-			foundit = true;
-			if(e == cpu->timer_events) {
-				cpu->timer_events = e->next;
-			} else {
-				last->next = e->next;
-			}
-			e->next = NULL;
-			// break out of the whole thing
-			goto done;
-		}
-		last = e;
-		e = e->next;
-	}
-	release_spinlock(&cpu->timer_spinlock);
-done:
 
-#if DYNAMIC_TIMER
-	if(cpu->timer_events == NULL) {
-		arch_timer_clear_hardware_timer();
-	} else {
-		arch_timer_set_hardware_timer(cpu->timer_events->sched_time - system_time());
-	}
-#endif
-
-	if(foundit) {
-		release_spinlock(&cpu->timer_spinlock);
+	// it may have just gone off, or moved to another cpu
+	if(event->sched_time != 0 && event->scheduled_cpu == curr_cpu && event->node.next != NULL) {
+		list_delete(&event->node);
+		cpu->timer_wheel.count--;
 		event->sched_time = 0;
+		foundit = true;
 	}
 
+	// in one shot mode the hardware timer is left alone. Going off with nothing
+	// to do is cheaper than reprogramming it on every cancel.
+
+	release_spinlock(&cpu->timer_spinlock);
+
 	return (foundit ? 0 : ERR_GENERAL);
 }
 
@@ -233,53 +446,22 @@ int local_timer_cancel_event(struct timer_event *event)
 
 int timer_cancel_event(struct timer_event *event)
 {
-	struct timer_event *last;
-	struct timer_event *e;
 	bool foundit = false;
 	int num_cpus = smp_get_num_cpus();
-	int curr_cpu_num;
-	cpu_ent *cpu;
 
 	if(event->sched_time == 0)
 		return 0; // it's not scheduled
 
 	int_disable_interrupts();
-	curr_cpu_num = smp_get_current_cpu();
 
 	// check to see if this structure is sane
 	if(event->sched_time == 0)
 		goto done;
 	ASSERT(event->scheduled_cpu >= 0 && event->scheduled_cpu < num_cpus);
 
-	// check the queue the event was supposed to be in
-	if(event->scheduled_cpu == curr_cpu_num) {
-		if(_local_timer_cancel_event(curr_cpu_num, event) == 0)
-			foundit = true;
-	} else {
-		// it should be in another cpu's queue
-		cpu = get_cpu_struct(event->scheduled_cpu);
-		acquire_spinlock(&cpu->timer_spinlock);
-		last = NULL;
-		e = cpu->timer_events;
-		while(e != NULL) {
-			if(e == event) {
-				// we found it
-				foundit = true;
-				if(e == cpu->timer_events) {
-					cpu->timer_events = e->next;
-				} else {
-					last->next = e->next;
-				}
-				e->sched_time = 0;
-				e->next = NULL;
-				// break out of the whole thing
-				break;
-			}
-			last = e;
-			e = e->next;
-		}
-		release_spinlock(&cpu->timer_spinlock);
-	}
+	// the wheels are all reachable from here, no need to bother the other cpu
+	if(_local_timer_cancel_event(event->scheduled_cpu, event) == 0)
+		foundit = true;
 
 done:
 	int_restore_interrupts();
@@ -0,0 +1,162 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/id_table.h>
+#include <kernel/heap.h>
+#include <kernel/int.h>
+#include <kernel/smp.h>
+#include <kernel/debug.h>
+#include <kernel/arch/cpu.h>
+#include <newos/errors.h>
+#include <string.h>
+
+struct id_table_chunk {
+	int next_free[ID_TABLE_CHUNK_SLOTS];
+	int next_id[ID_TABLE_CHUNK_SLOTS];	// what the slot's next id will be
+	char *entries;
+};
+
+#define CHUNK_ENTRY(table, chunk, i) ((void *)((chunk)->entries + (i) * (table)->entry_size))
+
+int id_table_init(id_table *table, size_t entry_size, int max_slots, int initial_slots,
+	int *spinlock, void (*init_entry)(void *entry))
+{
+	int num_chunks = ROUNDUP(max_slots, ID_TABLE_CHUNK_SLOTS) / ID_TABLE_CHUNK_SLOTS;
+	int err;
+
+	table->entry_size = entry_size;
+	table->max_slots = num_chunks * ID_TABLE_CHUNK_SLOTS;
+	table->num_slots = 0;
+	table->free_head = -1;
+	table->free_count = 0;
+	table->growing = 0;
+	table->spinlock = spinlock;
+	table->init_entry = init_entry;
+
+	table->chunks = kmalloc(num_chunks * sizeof(struct id_table_chunk *));
+	if(table->chunks == NULL)
+		return ERR_NO_MEMORY;
+	memset(table->chunks, 0, num_chunks * sizeof(struct id_table_chunk *));
+
+	while(table->num_slots < initial_slots) {
+		err = id_table_grow(table);
+		if(err < 0)
+			return err;
+	}
+
+	return NO_ERROR;
+}
+
+// Adds another chunk of free slots. Call without the table's spinlock held.
+// If somebody else is already at it, that'll do for the both of us; that also
+// keeps an allocation that has to create a sem from recursing back in here.
+int id_table_grow(id_table *table)
+{
+	struct id_table_chunk *chunk;
+	int first_slot;
+	int i;
+
+	if(table->num_slots >= table->max_slots)
+		return ERR_NO_MORE_HANDLES;
+	if(test_and_set(&table->growing, 1, 0) != 0)
+		return NO_ERROR;
+
+	chunk = kmalloc(sizeof(struct id_table_chunk) + ID_TABLE_CHUNK_SLOTS * table->entry_size);
+	if(chunk == NULL) {
+		table->growing = 0;
+		return ERR_NO_MEMORY;
+	}
+	chunk->entries = (char *)(chunk + 1);
+	memset(chunk->entries, 0, ID_TABLE_CHUNK_SLOTS * table->entry_size);
+
+	// only the grower moves num_slots, so it can be read without the lock here
+	first_slot = table->num_slots;
+	for(i = 0; i < ID_TABLE_CHUNK_SLOTS; i++) {
+		chunk->next_free[i] = (i + 1 < ID_TABLE_CHUNK_SLOTS) ? first_slot + i + 1 : -1;
+		chunk->next_id[i] = first_slot + i;
+		if(table->init_entry)
+			table->init_entry(CHUNK_ENTRY(table, chunk, i));
+	}
+
+	int_disable_interrupts();
+	acquire_spinlock(table->spinlock);
+
+	// lookups don't take the lock, so the chunk has to be all there before they can see it
+	table->chunks[first_slot / ID_TABLE_CHUNK_SLOTS] = chunk;
+	arch_cpu_memory_barrier();
+	table->num_slots += ID_TABLE_CHUNK_SLOTS;
+
+	chunk->next_free[ID_TABLE_CHUNK_SLOTS - 1] = table->free_head;
+	table->free_head = first_slot;
+	table->free_count += ID_TABLE_CHUNK_SLOTS;
+
+	release_spinlock(table->spinlock);
+	int_restore_interrupts();
+
+	table->growing = 0;
+
+	return NO_ERROR;
+}
+
+void *id_table_alloc(id_table *table, int *_id)
+{
+	struct id_table_chunk *chunk;
+	int slot = table->free_head;
+	int i;
+
+	if(slot < 0)
+		return NULL;
+
+	chunk = table->chunks[slot / ID_TABLE_CHUNK_SLOTS];
+	i = slot % ID_TABLE_CHUNK_SLOTS;
+
+	table->free_head = chunk->next_free[i];
+	table->free_count--;
+
+	// every time around the slot gets a new id, so stale ids don't match
+	*_id = chunk->next_id[i];
+	if(chunk->next_id[i] > 0x7fffffff - table->max_slots)
+		chunk->next_id[i] = slot;
+	else
+		chunk->next_id[i] += table->max_slots;
+
+	return CHUNK_ENTRY(table, chunk, i);
+}
+
+void id_table_free(id_table *table, int id)
+{
+	struct id_table_chunk *chunk;
+	int slot = id % table->max_slots;
+	int i = slot % ID_TABLE_CHUNK_SLOTS;
+
+	chunk = table->chunks[slot / ID_TABLE_CHUNK_SLOTS];
+	ASSERT(chunk != NULL);
+
+	chunk->next_free[i] = table->free_head;
+	table->free_head = slot;
+	table->free_count++;
+}
+
+void *id_table_slot(id_table *table, int slot)
+{
+	struct id_table_chunk *chunk;
+
+	if(slot < 0 || slot >= table->max_slots)
+		return NULL;
+
+	chunk = table->chunks[slot / ID_TABLE_CHUNK_SLOTS];
+	if(chunk == NULL)
+		return NULL;
+
+	return CHUNK_ENTRY(table, chunk, slot % ID_TABLE_CHUNK_SLOTS);
+}
+
+void *id_table_lookup(id_table *table, int id)
+{
+	if(id < 0)
+		return NULL;
+
+	return id_table_slot(table, id % table->max_slots);
+}
@@ -5,10 +5,91 @@
 #include <kernel/kernel.h>
 #include <kernel/sem.h>
 #include <kernel/lock.h>
+#include <kernel/heap.h>
+#include <kernel/int.h>
+#include <kernel/thread.h>
+#include <kernel/smp.h>
 #include <kernel/debug.h>
 #include <kernel/arch/cpu.h>
 #include <newos/errors.h>
 
+#include <string.h>
+
+// how long to spin on a lock whose holder is running before blocking
+#define LOCK_SPIN_COUNT 1000
+// how often to check if the holder is still running while spinning
+#define LOCK_SPIN_CHECK_INTERVAL 64
+
+// returns the lock's semaphore, creating it if this is the first time it's needed
+static sem_id lock_get_sem(sem_id *sem, const char *name)
+{
+	sem_id old_sem = *sem;
+	sem_id new_sem;
+
+	if(old_sem >= 0)
+		return old_sem;
+
+	new_sem = sem_create(0, name);
+	if(new_sem < 0)
+		return new_sem;
+
+	if(test_and_set((int *)sem, new_sem, old_sem) != old_sem) {
+		// someone else beat us to it
+		sem_delete(new_sem);
+	}
+	return *sem;
+}
+
+static void lock_acquire(volatile int *count, volatile thread_id *holder, sem_id *sem, const char *name)
+{
+	thread_id h;
+	sem_id s;
+	int i;
+
+	// fast path, nobody holds it
+	if(test_and_set((int *)count, 1, 0) == 0)
+		return;
+
+	// if the holder is running on another cpu it'll probably let go soon
+	if(smp_get_num_cpus() > 1) {
+		for(i = 0; i < LOCK_SPIN_COUNT; i++) {
+			if(*count == 0 && test_and_set((int *)count, 1, 0) == 0)
+				return;
+			if((i % LOCK_SPIN_CHECK_INTERVAL) == 0) {
+				// the holder isn't set for a moment after the lock is taken
+				h = *holder;
+				if(h >= 0 && !thread_is_running(h))
+					break;
+			}
+			arch_cpu_pause();
+		}
+	}
+
+	s = lock_get_sem(sem, name);
+	if(s < 0) {
+		// semaphores aren't up yet or we're out of them, all we can do is poll
+		while(test_and_set((int *)count, 1, 0) != 0)
+			thread_yield();
+		return;
+	}
+
+	// become a waiter, the unlocker will hand the lock to us through the sem
+	if(atomic_add(count, 1) > 0)
+		sem_acquire(s, 1);
+}
+
+static void lock_release(volatile int *count, sem_id *sem, const char *name)
+{
+	sem_id s;
+
+	if(atomic_add(count, -1) > 1) {
+		// someone is waiting, the sem was created before they registered
+		s = lock_get_sem(sem, name);
+		if(s >= 0)
+			sem_release(s, 1);
+	}
+}
+
 int recursive_lock_get_recursion(recursive_lock *lock)
 {
 	thread_id thid = thread_get_current_thread_id();
@@ -24,11 +105,10 @@ int recursive_lock_create(recursive_lock *lock)
 {
 	if(lock == NULL)
 		return ERR_INVALID_ARGS;
+	lock->count = 0;
 	lock->holder = -1;
 	lock->recursion = 0;
-	lock->sem = sem_create(1, "recursive_lock_sem");
-//	if(lock->sem < 0)
-//		return -1;
+	lock->sem = -1; // created on first contention
 	return NO_ERROR;
 }
 
@@ -36,7 +116,7 @@ void recursive_lock_destroy(recursive_lock *lock)
 {
 	if(lock == NULL)
 		return;
-	if(lock->sem > 0)
+	if(lock->sem >= 0)
 		sem_delete(lock->sem);
 	lock->sem = -1;
 }
@@ -47,7 +127,7 @@ bool recursive_lock_lock(recursive_lock *lock)
 	bool retval = false;
 
 	if(thid != lock->holder) {
-		sem_acquire(lock->sem, 1);
+		lock_acquire(&lock->count, &lock->holder, &lock->sem, "recursive_lock_sem");
 
 		lock->holder = thid;
 		retval = true;
@@ -66,13 +146,18 @@ bool recursive_lock_unlock(recursive_lock *lock)
 
 	if(--lock->recursion == 0) {
 		lock->holder = -1;
-		sem_release(lock->sem, 1);
+		lock_release(&lock->count, &lock->sem, "recursive_lock_sem");
 		retval = true;
 	}
 	return retval;
 }
 
-int mutex_init(mutex *m, const char *in_name)
+int mutex_init(mutex *m, const char *name)
+{
+	return mutex_init_etc(m, name, 0);
+}
+
+int mutex_init_etc(mutex *m, const char *in_name, int flags)
 {
 	const char *name;
 
@@ -84,11 +169,16 @@ int mutex_init(mutex *m, const char *in_name)
 	else
 		name = in_name;
 
+	m->count = 0;
 	m->holder = -1;
+	m->sem = -1;
+	m->name = name;
 
-	m->sem = sem_create(1, name);
-	if(m->sem < 0)
-		return m->sem;
+	if(flags & MUTEX_FLAG_CREATE_SEM) {
+		m->sem = sem_create(0, name);
+		if(m->sem < 0)
+			return m->sem;
+	}
 
 	return 0;
 }
@@ -112,7 +202,7 @@ void mutex_lock(mutex *m)
 	if(me == m->holder)
 		panic("mutex_lock failure: mutex %p acquired twice by thread 0x%x\n", m, me);
 
-	sem_acquire(m->sem, 1);
+	lock_acquire(&m->count, &m->holder, &m->sem, m->name);
 	m->holder = me;
 }
 
@@ -124,6 +214,249 @@ void mutex_unlock(mutex *m)
 		panic("mutex_unlock failure: thread 0x%x is trying to release mutex %p (current holder 0x%x)\n",
 			me, m, m->holder);
 	m->holder = -1;
-	sem_release(m->sem, 1);
+	lock_release(&m->count, &m->sem, m->name);
+}
+
+#define RW_LOCK_CPU_STRIDE 16 // keep each cpu's reader count on its own cache line
+
+static int rw_lock_percpu_readers(rw_lock *lock)
+{
+	int sum = 0;
+	int i;
+
+	for(i = 0; i < _MAX_CPUS; i++)
+		sum += lock->cpu_readers[i * RW_LOCK_CPU_STRIDE];
+	return sum;
+}
+
+static void rw_lock_add_percpu_readers(rw_lock *lock, int count)
+{
+	// it doesn't matter if we get moved to another cpu, only the sum counts
+	atomic_add(&lock->cpu_readers[smp_get_current_cpu() * RW_LOCK_CPU_STRIDE], count);
+}
+
+// readers can come in if there's no writer holding or waiting for the lock
+static bool rw_lock_try_read_lock(rw_lock *lock)
+{
+	int state;
+
+	for(;;) {
+		state = lock->state;
+		if(state & (RW_LOCK_WRITER | RW_LOCK_WAITERS))
+			return false;
+
+		if(lock->cpu_readers) {
+			rw_lock_add_percpu_readers(lock, 1);
+			if((lock->state & (RW_LOCK_WRITER | RW_LOCK_WAITERS)) == 0)
+				return true;
+			// a writer showed up, back out
+			rw_lock_add_percpu_readers(lock, -1);
+			return false;
+		}
+
+		if(test_and_set((int *)&lock->state, state + 1, state) == state)
+			return true;
+	}
+}
+
+// hand the free lock over to whoever is waiting, writers first.
+// Must be called with the spinlock held. Returns the sem to release, and how
+// many times, once the spinlock has been dropped.
+static sem_id rw_lock_wake(rw_lock *lock, int *count)
+{
+	*count = 0;
+
+	if(lock->write_waiters > 0) {
+		lock->write_waiters--;
+		atomic_set(&lock->state, RW_LOCK_WRITER
+			| ((lock->write_waiters + lock->read_waiters) > 0 ? RW_LOCK_WAITERS : 0));
+		*count = 1;
+		return lock->write_sem;
+	}
+
+	if(lock->read_waiters > 0) {
+		*count = lock->read_waiters;
+		lock->read_waiters = 0;
+		if(lock->cpu_readers) {
+			rw_lock_add_percpu_readers(lock, *count);
+			atomic_set(&lock->state, 0);
+		} else {
+			atomic_set(&lock->state, *count);
+		}
+		return lock->read_sem;
+	}
+
+	atomic_and(&lock->state, ~RW_LOCK_WAITERS);
+	return -1;
+}
+
+// register the current thread as a waiter and block until the lock is handed to it
+static void rw_lock_wait(rw_lock *lock, bool write)
+{
+	sem_id sem;
+	sem_id wake_sem = -1;
+	int wake_count = 0;
+
+	int_disable_interrupts();
+	acquire_spinlock(&lock->lock);
+
+	if(write)
+		lock->write_waiters++;
+	else
+		lock->read_waiters++;
+	atomic_or(&lock->state, RW_LOCK_WAITERS);
+
+	// all unlocks go through the spinlock from here on, but the lock may have
+	// been dropped before the flag went in
+	if((lock->state & (RW_LOCK_WRITER | RW_LOCK_READER_MASK)) == 0)
+		wake_sem = rw_lock_wake(lock, &wake_count);
+
+	release_spinlock(&lock->lock);
+	int_restore_interrupts();
+
+	if(wake_count > 0)
+		sem_release(wake_sem, wake_count);
+
+	sem = write ? lock->write_sem : lock->read_sem;
+	sem_acquire(sem, 1);
+}
+
+// an unlock that found someone waiting
+static void rw_lock_unlock_slow(rw_lock *lock, int delta)
+{
+	sem_id wake_sem = -1;
+	int wake_count = 0;
+
+	int_disable_interrupts();
+	acquire_spinlock(&lock->lock);
+
+	atomic_add(&lock->state, delta);
+	if((lock->state & (RW_LOCK_WRITER | RW_LOCK_READER_MASK)) == 0)
+		wake_sem = rw_lock_wake(lock, &wake_count);
+
+	release_spinlock(&lock->lock);
+	int_restore_interrupts();
+
+	if(wake_count > 0)
+		sem_release(wake_sem, wake_count);
+}
+
+int rw_lock_init(rw_lock *lock, const char *name)
+{
+	return rw_lock_init_etc(lock, name, 0);
+}
+
+int rw_lock_init_etc(rw_lock *lock, const char *name, int flags)
+{
+	if(lock == NULL)
+		return ERR_INVALID_ARGS;
+
+	lock->state = 0;
+	lock->lock = 0;
+	lock->read_waiters = 0;
+	lock->write_waiters = 0;
+	lock->read_sem = -1;
+	lock->write_sem = -1;
+	lock->writer = -1;
+	lock->cpu_readers = NULL;
+
+	if(flags & RW_LOCK_FLAG_PERCPU_READERS) {
+		lock->cpu_readers = (volatile int *)kmalloc(_MAX_CPUS * RW_LOCK_CPU_STRIDE * sizeof(int));
+		if(lock->cpu_readers == NULL)
+			return ERR_NO_MEMORY;
+		memset((void *)lock->cpu_readers, 0, _MAX_CPUS * RW_LOCK_CPU_STRIDE * sizeof(int));
+	}
+
+	return 0;
+}
+
+void rw_lock_destroy(rw_lock *lock)
+{
+	if(lock == NULL)
+		return;
+
+	if(lock->read_sem >= 0)
+		sem_delete(lock->read_sem);
+	if(lock->write_sem >= 0)
+		sem_delete(lock->write_sem);
+	lock->read_sem = lock->write_sem = -1;
+
+	if(lock->cpu_readers)
+		kfree((void *)lock->cpu_readers);
+	lock->cpu_readers = NULL;
+}
+
+void rw_lock_read_lock(rw_lock *lock)
+{
+	if(rw_lock_try_read_lock(lock))
+		return;
+
+	if(lock_get_sem(&lock->read_sem, "rw_lock_read_sem") < 0) {
+		// semaphores aren't up yet or we're out of them, all we can do is poll
+		while(!rw_lock_try_read_lock(lock))
+			thread_yield();
+		return;
+	}
+
+	rw_lock_wait(lock, false);
+}
+
+void rw_lock_read_unlock(rw_lock *lock)
+{
+	int state;
+
+	if(lock->cpu_readers) {
+		// writers wait for the per-cpu counts to drain on their own
+		rw_lock_add_percpu_readers(lock, -1);
+		return;
+	}
+
+	for(;;) {
+		state = lock->state;
+		if((state & RW_LOCK_WAITERS) && (state & RW_LOCK_READER_MASK) == 1) {
+			// last reader out with someone waiting
+			rw_lock_unlock_slow(lock, -1);
+			return;
+		}
+		if(test_and_set((int *)&lock->state, state - 1, state) == state)
+			return;
+	}
 }
 
+void rw_lock_write_lock(rw_lock *lock)
+{
+	thread_id me = thread_get_current_thread_id();
+
+	if(me == lock->writer)
+		panic("rw_lock_write_lock: lock %p acquired twice by thread 0x%x\n", lock, me);
+
+	if(test_and_set((int *)&lock->state, RW_LOCK_WRITER, 0) != 0) {
+		if(lock_get_sem(&lock->write_sem, "rw_lock_write_sem") < 0) {
+			while(test_and_set((int *)&lock->state, RW_LOCK_WRITER, 0) != 0)
+				thread_yield();
+		} else {
+			rw_lock_wait(lock, true);
+		}
+	}
+
+	// readers on the per-cpu counts can't see us coming, wait for them to leave
+	if(lock->cpu_readers) {
+		while(rw_lock_percpu_readers(lock) > 0)
+			thread_yield();
+	}
+
+	lock->writer = me;
+}
+
+void rw_lock_write_unlock(rw_lock *lock)
+{
+	thread_id me = thread_get_current_thread_id();
+
+	if(me != lock->writer)
+		panic("rw_lock_write_unlock: thread 0x%x is trying to release lock %p (current writer 0x%x)\n",
+			me, lock, lock->writer);
+	lock->writer = -1;
+
+	if(test_and_set((int *)&lock->state, 0, RW_LOCK_WRITER) != RW_LOCK_WRITER)
+		rw_lock_unlock_slow(lock, -RW_LOCK_WRITER);
+}
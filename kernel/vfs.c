@@ -13,8 +13,10 @@
 #include <kernel/lock.h>
 #include <kernel/thread.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/arch/cpu.h>
 #include <kernel/elf.h>
+#include <kernel/evq.h>
 #include <kernel/fs/rootfs.h>
 #include <kernel/fs/bootfs.h>
 #include <kernel/fs/devfs.h>
@@ -54,6 +56,7 @@ struct file_descriptor {
 	struct vnode *vnode;
 	file_cookie cookie;
 	int ref_count;
+	int watch_count; // how many of the refs are event queue registrations
 	bool coe;
 	bool dir;
 };
@@ -94,6 +97,8 @@ static mutex vfs_vnode_mutex;
 
 #define VNODE_HASH_TABLE_SIZE 1024
 static void *vnode_table;
+static object_cache *vnode_cache;
+static object_cache *fd_cache;
 static struct vnode *root_vnode;
 
 #define MOUNTS_HASH_TABLE_SIZE 16
@@ -233,7 +238,7 @@ static struct vnode *create_new_vnode(void)
 {
 	struct vnode *v;
 
-	v = (struct vnode *)kmalloc(sizeof(struct vnode));
+	v = (struct vnode *)object_cache_alloc(vnode_cache);
 	if(v == NULL)
 		return NULL;
 
@@ -281,7 +286,7 @@ static int dec_vnode_ref_count(struct vnode *v, bool free_mem, bool r)
 #if MAKE_NOIZE
 			dprintf("dec_vnode_ref_count: freeing vnode %p\n", v);
 #endif
-			kfree(v);
+			object_cache_free(vnode_cache, v);
 		}
 		err = 1;
 	} else {
@@ -384,7 +389,7 @@ err1:
 err:
 	mutex_unlock(&vfs_vnode_mutex);
 	if(v)
-		kfree(v);
+		object_cache_free(vnode_cache, v);
 
 	return err;
 }
@@ -477,11 +482,12 @@ static struct file_descriptor *alloc_fd(void)
 {
 	struct file_descriptor *f;
 
-	f = kmalloc(sizeof(struct file_descriptor));
+	f = object_cache_alloc(fd_cache);
 	if(f) {
 		f->vnode = NULL;
 		f->cookie = NULL;
 		f->ref_count = 1;
+		f->watch_count = 0;
 		f->coe = false;
 		f->dir = false;
 	}
@@ -515,13 +521,19 @@ static void free_fd(struct file_descriptor *f)
 		f->vnode->mount->fs->calls->fs_closedir(f->vnode->mount->fscookie, f->vnode->priv_vnode, f->cookie);
 	}
 	dec_vnode_ref_count(f->vnode, true, false);
-	kfree(f);
+	object_cache_free(fd_cache, f);
 }
 
 static void put_fd(struct file_descriptor *f)
 {
-	if(atomic_add(&f->ref_count, -1) == 1) {
+	int refs = atomic_add(&f->ref_count, -1) - 1;
+
+	if(refs == 0) {
 		free_fd(f);
+	} else if(refs == f->watch_count) {
+		// nobody has it open anymore, just event queues watching it. Closing
+		// it is up to them, they drop their refs in here.
+		evq_file_closed(f);
 	}
 }
 
@@ -847,6 +859,14 @@ int vfs_init(kernel_args *ka)
 	if(vnode_table == NULL)
 		panic("vfs_init: error creating vnode hash table\n");
 
+	vnode_cache = object_cache_create("vnode", sizeof(struct vnode), 0, NULL, NULL, NULL);
+	if(vnode_cache == NULL)
+		panic("vfs_init: error creating vnode object cache\n");
+
+	fd_cache = object_cache_create("file_descriptor", sizeof(struct file_descriptor), 0, NULL, NULL, NULL);
+	if(fd_cache == NULL)
+		panic("vfs_init: error creating file descriptor object cache\n");
+
 	mounts_table = hash_init(MOUNTS_HASH_TABLE_SIZE, offsetof(struct fs_mount, next),
 		&mount_compare, &mount_hash);
 	if(mounts_table == NULL)
@@ -1800,6 +1820,64 @@ int vfs_put_vnode_ptr(void *vnode)
 	return 0;
 }
 
+int vfs_get_file_from_fd(int fd, bool kernel, void **file)
+{
+	struct file_descriptor *f;
+
+	// the reference keeps the file open even if the fd gets closed
+	f = get_fd(get_current_ioctx(kernel), fd);
+	if(!f)
+		return ERR_INVALID_HANDLE;
+
+	*file = f;
+
+	return NO_ERROR;
+}
+
+int vfs_put_file_ptr(void *file)
+{
+	put_fd((struct file_descriptor *)file);
+
+	return 0;
+}
+
+void vfs_watch_file(void *file)
+{
+	struct file_descriptor *f = file;
+
+	// the ref goes up first, so a put_fd racing with us never sees only
+	// watchers left while the caller's own ref is still there
+	atomic_add(&f->ref_count, 1);
+	atomic_add(&f->watch_count, 1);
+}
+
+int vfs_put_watched_file_ptr(void *file)
+{
+	struct file_descriptor *f = file;
+
+	// doesn't call back into evq_file_closed, the caller is the event queue
+	atomic_add(&f->watch_count, -1);
+	if(atomic_add(&f->ref_count, -1) == 1)
+		free_fd(f);
+
+	return 0;
+}
+
+int vfs_poll_file(void *file, struct poll_waiter *waiter)
+{
+	struct file_descriptor *f = file;
+	struct vnode *v = f->vnode;
+
+	if(f->dir)
+		return ERR_VFS_IS_DIR;
+
+	// streams that never block are always ready
+	if(v->mount->fs->calls->fs_poll == NULL)
+		return EVQ_IN | EVQ_OUT;
+
+	return v->mount->fs->calls->fs_poll(v->mount->fscookie, v->priv_vnode, f->cookie, waiter);
+}
+
 ssize_t vfs_canpage(void *_v)
 {
 	struct vnode *v = _v;
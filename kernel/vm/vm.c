@@ -12,6 +12,7 @@
 #include <kernel/vm_store_null.h>
 #include <kernel/vm_store_vnode.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/debug.h>
 #include <kernel/console.h>
 #include <kernel/int.h>
@@ -41,21 +42,24 @@ static vm_address_space *kernel_aspace;
 #define REGION_HASH_TABLE_SIZE 1024
 static region_id next_region_id;
 static void *region_table;
-static sem_id region_hash_sem;
+static rw_lock region_hash_lock;
 
 #define ASPACE_HASH_TABLE_SIZE 1024
 static aspace_id next_aspace_id;
 static void *aspace_table;
-static sem_id aspace_hash_sem;
+static rw_lock aspace_hash_lock;
 
 static spinlock_t max_commit_lock;
 
+static object_cache *region_cache;
+
 // function declarations
 static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char *name, int wiring, int lock);
 static int map_backing_store(vm_address_space *aspace, vm_store *store, void **vaddr,
 	off_t offset, addr_t size, int addr_type, int wiring, int lock, int mapping, vm_region **_region, const char *region_name);
 static int vm_soft_fault(addr_t address, bool is_write, bool is_user);
 static vm_region *vm_virtual_map_lookup(vm_virtual_map *map, addr_t address);
+static int _vm_delete_region(vm_address_space *aspace, region_id rid);
 
 static int region_compare(void *_r, const void *key)
 {
@@ -119,17 +123,33 @@ static unsigned int aspace_hash(void *_a, const void *key, unsigned int range)
 		return (*id % range);
 }
 
+// an aspace whose last ref is gone is still in the table until vm_put_aspace
+// gets the write lock to pull it out, and mustn't be brought back
+static bool vm_aspace_ref_if_live(vm_address_space *aspace)
+{
+	int ref;
+
+	do {
+		ref = *(volatile int *)&aspace->ref_count;
+		if(ref <= 0)
+			return false;
+	} while(test_and_set(&aspace->ref_count, ref + 1, ref) != ref);
+
+	return true;
+}
+
 vm_address_space *vm_get_aspace_by_id(aspace_id aid)
 {
 	vm_address_space *aspace;
 
-	sem_acquire(aspace_hash_sem, READ_COUNT);
+	rw_lock_read_lock(&aspace_hash_lock);
 	aspace = hash_lookup(aspace_table, &aid);
 	if(aspace) {
 		VERIFY_VM_ASPACE(aspace);
-		atomic_add(&aspace->ref_count, 1);
+		if(!vm_aspace_ref_if_live(aspace))
+			aspace = NULL;
 	}
-	sem_release(aspace_hash_sem, READ_COUNT);
+	rw_lock_read_unlock(&aspace_hash_lock);
 
 	return aspace;
 }
@@ -138,13 +158,13 @@ vm_region *vm_get_region_by_id(region_id rid)
 {
 	vm_region *region;
 
-	sem_acquire(region_hash_sem, READ_COUNT);
+	rw_lock_read_lock(&region_hash_lock);
 	region = hash_lookup(region_table, &rid);
 	if(region) {
 		VERIFY_VM_REGION(region);
 		atomic_add(&region->ref_count, 1);
 	}
-	sem_release(region_hash_sem, READ_COUNT);
+	rw_lock_read_unlock(&region_hash_lock);
 
 	return region;
 }
@@ -161,7 +181,7 @@ region_id vm_find_region_by_name(aspace_id aid, const char *name)
 	if(aspace == NULL)
 		return ERR_VM_INVALID_ASPACE;
 
-	sem_acquire(aspace->virtual_map.sem, READ_COUNT);
+	rw_lock_read_lock(&aspace->virtual_map.lock);
 
 	region = aspace->virtual_map.region_list;
 	while(region != NULL) {
@@ -174,7 +194,7 @@ region_id vm_find_region_by_name(aspace_id aid, const char *name)
 		region = region->aspace_next;
 	}
 
-	sem_release(aspace->virtual_map.sem, READ_COUNT);
+	rw_lock_read_unlock(&aspace->virtual_map.lock);
 	vm_put_aspace(aspace);
 	return id;
 }
@@ -186,12 +206,12 @@ static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char
 	VERIFY_VM_ASPACE(aspace);
 	ASSERT(name != NULL);
 
-	region = (vm_region *)kmalloc(sizeof(vm_region));
+	region = (vm_region *)object_cache_alloc(region_cache);
 	if(region == NULL)
 		return NULL;
 	region->name = (char *)kmalloc(strlen(name) + 1);
 	if(region->name == NULL) {
-		kfree(region);
+		object_cache_free(region_cache, region);
 		return NULL;
 	}
 	strcpy(region->name, name);
@@ -209,18 +229,18 @@ static vm_region *_vm_create_region_struct(vm_address_space *aspace, const char
 	region->aspace = aspace;
 	region->aspace_next = NULL;
 	region->map = &aspace->virtual_map;
+	region->tree_left = region->tree_right = region->tree_parent = NULL;
+	region->tree_height = 0;
 	list_clear_node(&region->cache_node);
 	region->hash_next = NULL;
 
 	return region;
 }
 
-// must be called with this address space's virtual_map.sem held
+// must be called with this address space's virtual_map.lock held
 static int find_and_insert_region_slot(vm_virtual_map *map, addr_t start, addr_t size, addr_t end, int addr_type, vm_region *region)
 {
-	vm_region *last_r = NULL;
-	vm_region *next_r;
-	bool foundspot = false;
+	addr_t base;
 
 //	dprintf("find_and_insert_region_slot: map %p, start 0x%lx, size %ld, end 0x%lx, addr_type %d, region %p\n",
 //		map, start, size, end, addr_type, region);
@@ -230,96 +250,29 @@ static int find_and_insert_region_slot(vm_virtual_map *map, addr_t start, addr_t
 	if(start < map->base || size == 0 || (end - 1) > (map->base + (map->size - 1)) || start + size > end)
 		return ERR_VM_BAD_ADDRESS;
 
-	// walk up to the spot where we should start searching
-	next_r = map->region_list;
-	while(next_r) {
-		if(next_r->base >= start + size) {
-			// we have a winner
-			break;
-		}
-		last_r = next_r;
-		next_r = next_r->aspace_next;
-	}
-
-#if 0
-	dprintf("last_r %p, next_r %p\n", last_r, next_r);
-	if(last_r) dprintf("last_r->base 0x%lx, last_r->size 0x%lx\n", last_r->base, last_r->size);
-	if(next_r) dprintf("next_r->base 0x%lx, next_r->size 0x%lx\n", next_r->base, next_r->size);
-#endif
-
 	switch(addr_type) {
 		case REGION_ADDR_ANY_ADDRESS:
-			// find a hole big enough for a new region
-			if(!last_r) {
-				// see if we can build it at the beginning of the virtual map
-				if(!next_r || (next_r->base >= map->base + size)) {
-					foundspot = true;
-					region->base = map->base;
-					break;
-				}
-				last_r = next_r;
-				next_r = next_r->aspace_next;
-			}
-			// keep walking
-			while(next_r) {
-				if(next_r->base >= last_r->base + last_r->size + size) {
-					// we found a spot
-					foundspot = true;
-					region->base = last_r->base + last_r->size;
-					break;
-				}
-				last_r = next_r;
-				next_r = next_r->aspace_next;
-			}
-			if((map->base + (map->size - 1)) >= (last_r->base + last_r->size + (size - 1))) {
-				// found a spot
-				foundspot = true;
-				region->base = last_r->base + last_r->size;
-				break;
-			}
+			// find the lowest hole at or above start that is big enough
+			if(vm_region_tree_find_slot(map, start, size, &base) < 0)
+				return ERR_VM_NO_REGION_SLOT;
 			break;
 		case REGION_ADDR_EXACT_ADDRESS:
 			// see if we can create it exactly here
-			if(!last_r) {
-				if(!next_r || (next_r->base >= start + size)) {
-					foundspot = true;
-					region->base = start;
-					break;
-				}
-			} else {
-				if(next_r) {
-					if(last_r->base + last_r->size <= start && next_r->base >= start + size) {
-						foundspot = true;
-						region->base = start;
-						break;
-					}
-				} else {
-					if((last_r->base + (last_r->size - 1)) <= start - 1) {
-						foundspot = true;
-						region->base = start;
-					}
-				}
-			}
+			if(!vm_region_tree_range_free(map, start, size))
+				return ERR_VM_NO_REGION_SLOT;
+			base = start;
 			break;
 		default:
 			return ERR_INVALID_ARGS;
 	}
 
-	if(foundspot) {
-		region->size = size;
-//		dprintf("found spot: base 0x%lx, size 0x%lx\n", region->base, region->size);
-		if(last_r) {
-			region->aspace_next = last_r->aspace_next;
-			last_r->aspace_next = region;
-		} else {
-			region->aspace_next = map->region_list;
-			map->region_list = region;
-		}
-		map->change_count++;
-		return NO_ERROR;
-	} else {
-		return ERR_VM_NO_REGION_SLOT;
-	}
+	region->base = base;
+	region->size = size;
+//	dprintf("found spot: base 0x%lx, size 0x%lx\n", region->base, region->size);
+	vm_region_tree_insert(map, region);
+	map->change_count++;
+
+	return NO_ERROR;
 }
 
 // a ref to the cache holding this store must be held before entering here
@@ -413,7 +366,7 @@ static int map_backing_store(vm_address_space *aspace, vm_store *store, void **v
 
 	vm_cache_acquire_ref(cache_ref, true);
 
-	sem_acquire(aspace->virtual_map.sem, WRITE_COUNT);
+	rw_lock_write_lock(&aspace->virtual_map.lock);
 
 	// check to see if this aspace has entered DELETE state
 	if(aspace->state == VM_ASPACE_STATE_DELETION) {
@@ -451,21 +404,21 @@ static int map_backing_store(vm_address_space *aspace, vm_store *store, void **v
 	vm_cache_insert_region(cache_ref, region);
 
 	// insert the region in the global region hash table
-	sem_acquire(region_hash_sem, WRITE_COUNT);
+	rw_lock_write_lock(&region_hash_lock);
 	hash_insert(region_table, region);
-	sem_release(region_hash_sem, WRITE_COUNT);
+	rw_lock_write_unlock(&region_hash_lock);
 
 	// grab a ref to the aspace (the region holds this)
 	atomic_add(&aspace->ref_count, 1);
 
-	sem_release(aspace->virtual_map.sem, WRITE_COUNT);
+	rw_lock_write_unlock(&aspace->virtual_map.lock);
 
 	*_region = region;
 
 	return NO_ERROR;
 
 err1b:
-	sem_release(aspace->virtual_map.sem, WRITE_COUNT);
+	rw_lock_write_unlock(&aspace->virtual_map.lock);
 	vm_cache_release_ref(cache_ref);
 	goto err;
 err1a:
@@ -477,10 +430,312 @@ err1a:
 	}
 err:
 	kfree(region->name);
-	kfree(region);
+	object_cache_free(region_cache, region);
 	return err;
 }
 
+#define POPULATE_BATCH 32
+
+// allocate, map and wire every page missing from [start, end) of an anonymous region.
+// Pages are pulled from the page allocator a batch at a time instead of faulting
+// each one in.
+static int populate_region_range(vm_address_space *aspace, vm_region *region, addr_t start, addr_t end)
+{
+	vm_cache_ref *cache_ref = region->cache_ref;
+	vm_page *pages[POPULATE_BATCH];
+	addr_t vas[POPULATE_BATCH];
+	addr_t va;
+	off_t offset;
+	int count;
+	int err;
+	int i;
+
+	mutex_lock(&cache_ref->lock);
+
+	va = start;
+	while(va < end) {
+		// gather up a batch of the pages that aren't there yet
+		for(count = 0; va < end && count < POPULATE_BATCH; va += PAGE_SIZE) {
+			offset = (va - region->base) + region->cache_offset;
+			if(vm_cache_lookup_page(cache_ref, offset) == NULL)
+				vas[count++] = va;
+		}
+		if(count == 0)
+			break;
+
+		err = vm_page_allocate_pages(count, PAGE_STATE_CLEAR, pages);
+		if(err < 0) {
+			mutex_unlock(&cache_ref->lock);
+			return err;
+		}
+
+		(*aspace->translation_map.ops->lock)(&aspace->translation_map);
+		for(i = 0; i < count; i++) {
+			offset = (vas[i] - region->base) + region->cache_offset;
+			atomic_add(&pages[i]->ref_count, 1);
+			(*aspace->translation_map.ops->map)(&aspace->translation_map, vas[i], pages[i]->ppn * PAGE_SIZE, region->lock);
+			vm_page_set_state(pages[i], PAGE_STATE_WIRED);
+			vm_cache_insert_page(cache_ref, pages[i], offset);
+		}
+		(*aspace->translation_map.ops->unlock)(&aspace->translation_map);
+	}
+
+	mutex_unlock(&cache_ref->lock);
+
+	return NO_ERROR;
+}
+
+// Lends out up to VM_LOAN_MAX_PAGES worth of the current process's buffer.
+// Each page keeps an extra mapping ref so the page scanner leaves it alone,
+// and the cache it lives in can't go away until the loan is returned.
+// Returns how many bytes of the buffer were loaned.
+ssize_t vm_loan_user_pages(const void *buf, addr_t len, vm_page_loan *loan)
+{
+	vm_address_space *aspace;
+	vm_region *region;
+	vm_cache_ref *cache_ref;
+	vm_page *page;
+	addr_t va = ROUNDOWN((addr_t)buf, PAGE_SIZE);
+	addr_t end;
+	addr_t pa;
+	unsigned int flags;
+	bool unloanable;
+	char dummy;
+	int err;
+
+	loan->num_pages = 0;
+	loan->offset = (addr_t)buf - va;
+	loan->len = min(len, VM_LOAN_MAX_PAGES * PAGE_SIZE - loan->offset);
+	if(loan->len == 0)
+		return 0;
+
+	if(is_kernel_address(buf) || is_kernel_address((addr_t)buf + loan->len - 1))
+		return ERR_VM_BAD_USER_MEMORY;
+
+	aspace = vm_get_current_user_aspace();
+	if(aspace == NULL)
+		return ERR_VM_BAD_USER_MEMORY;
+
+	end = (addr_t)buf + loan->len;
+	for(; va < end; va += PAGE_SIZE) {
+		for(;;) {
+			rw_lock_read_lock(&aspace->virtual_map.lock);
+
+			region = vm_virtual_map_lookup(&aspace->virtual_map, va);
+			if(region == NULL || (region->lock & LOCK_KERNEL) == LOCK_KERNEL) {
+				rw_lock_read_unlock(&aspace->virtual_map.lock);
+				err = ERR_VM_BAD_USER_MEMORY;
+				goto error;
+			}
+
+			cache_ref = region->cache_ref;
+			mutex_lock(&cache_ref->lock);
+
+			page = NULL;
+			unloanable = false;
+			(*aspace->translation_map.ops->query)(&aspace->translation_map, va, &pa, &flags);
+			if(flags & PAGE_PRESENT) {
+				page = vm_lookup_page(pa / PAGE_SIZE);
+				if(page != NULL && page->cache_ref != NULL) {
+					// the page may belong to a cache further down the chain,
+					// which stays around as long as ours does
+					atomic_add(&page->ref_count, 1);
+					vm_cache_acquire_ref(page->cache_ref, false);
+					loan->pages[loan->num_pages] = page;
+					loan->cache_refs[loan->num_pages] = page->cache_ref;
+					loan->num_pages++;
+				} else {
+					// mapped, but not to a page in a cache, like device memory
+					page = NULL;
+					unloanable = true;
+				}
+			}
+
+			mutex_unlock(&cache_ref->lock);
+			rw_lock_read_unlock(&aspace->virtual_map.lock);
+
+			if(page != NULL)
+				break;
+			if(unloanable)
+				goto short_loan;
+
+			// fault it in and try again
+			err = user_memcpy(&dummy, (void *)max(va, (addr_t)buf), 1);
+			if(err < 0)
+				goto error;
+		}
+	}
+
+	vm_put_aspace(aspace);
+	return loan->len;
+
+short_loan:
+	// lend out the pages up to the one that can't be, the caller copies the rest
+	vm_put_aspace(aspace);
+	if(loan->num_pages == 0)
+		loan->len = 0;
+	else
+		loan->len = loan->num_pages * PAGE_SIZE - loan->offset;
+	return loan->len;
+
+error:
+	vm_put_aspace(aspace);
+	vm_unloan_pages(loan);
+	return err;
+}
+
+void vm_unloan_pages(vm_page_loan *loan)
+{
+	int i;
+
+	for(i = 0; i < loan->num_pages; i++) {
+		// same as the page scanner dropping the last mapping
+		if(atomic_add(&loan->pages[i]->ref_count, -1) == 1)
+			vm_page_set_state(loan->pages[i], PAGE_STATE_INACTIVE);
+		vm_cache_release_ref(loan->cache_refs[i]);
+	}
+	loan->num_pages = 0;
+	loan->len = 0;
+}
+
+// copies len bytes starting pos bytes into the loan out to a user buffer
+int vm_loan_copy_to_user(vm_page_loan *loan, addr_t pos, void *buf, addr_t len)
+{
+	addr_t offset;
+	addr_t va;
+	addr_t copy_len;
+	int index;
+	int err;
+
+	if(pos + len > loan->len)
+		return ERR_INVALID_ARGS;
+
+	while(len > 0) {
+		offset = loan->offset + pos;
+		index = offset / PAGE_SIZE;
+		offset %= PAGE_SIZE;
+		copy_len = min(len, PAGE_SIZE - offset);
+
+		vm_get_physical_page(loan->pages[index]->ppn * PAGE_SIZE, &va, PHYSICAL_PAGE_CAN_WAIT);
+		err = user_memcpy(buf, (void *)(va + offset), copy_len);
+		vm_put_physical_page(va);
+		if(err < 0)
+			return err;
+
+		buf = (char *)buf + copy_len;
+		pos += copy_len;
+		len -= copy_len;
+	}
+
+	return NO_ERROR;
+}
+
+// Swaps a run of unowned pages in for the ones backing a page aligned piece
+// of the current process's private anonymous memory, instead of copying them.
+// Stops at the first page that can't be swapped; the caller copies the rest.
+// Returns the number of pages that now belong to the process.
+int vm_move_pages_to_user(void *buf, vm_page **pages, int count)
+{
+	vm_address_space *aspace;
+	vm_region *region;
+	vm_cache_ref *cache_ref;
+	vm_cache *cache;
+	vm_page *old_page;
+	addr_t va = (addr_t)buf;
+	addr_t end;
+	addr_t pa;
+	off_t offset;
+	unsigned int flags;
+	bool wired;
+	int mappings;
+	int i;
+
+	if(count <= 0 || (va % PAGE_SIZE) != 0)
+		return 0;
+	if(is_kernel_address(va) || is_kernel_address(va + count * PAGE_SIZE - 1))
+		return 0;
+
+	aspace = vm_get_current_user_aspace();
+	if(aspace == NULL)
+		return 0;
+
+	rw_lock_read_lock(&aspace->virtual_map.lock);
+
+	region = vm_virtual_map_lookup(&aspace->virtual_map, va);
+	if(region == NULL || (region->lock & LOCK_KERNEL) == LOCK_KERNEL || (region->lock & LOCK_RW) == 0) {
+		count = 0;
+		goto out;
+	}
+	end = min(va + count * PAGE_SIZE, region->base + region->size);
+	count = (end - va) / PAGE_SIZE;
+
+	cache_ref = region->cache_ref;
+	mutex_lock(&cache_ref->lock);
+
+	// the pages can only be swapped out from under the region if nobody else
+	// can see them: no clones, no copy on write source and no loans. Loans are
+	// taken with the cache locked, so no new ones can show up after this.
+	cache = cache_ref->cache;
+	if(!cache->temporary || cache->source != NULL || cache_ref->ref_count != 1) {
+		count = 0;
+		goto out_unlock;
+	}
+
+	// don't touch anything that's on its way in or out, or that is still
+	// referenced by something other than our own mapping of it
+	for(i = 0; i < count; i++) {
+		offset = (va + i * PAGE_SIZE - region->base) + region->cache_offset;
+		old_page = vm_cache_lookup_page(cache_ref, offset);
+		if(old_page == NULL)
+			continue;
+		if(old_page->state == PAGE_STATE_BUSY)
+			break;
+
+		mappings = 0;
+		(*aspace->translation_map.ops->query)(&aspace->translation_map, va + i * PAGE_SIZE, &pa, &flags);
+		if((flags & PAGE_PRESENT) && pa / PAGE_SIZE == old_page->ppn)
+			mappings = 1;
+		if(old_page->ref_count > mappings)
+			break;
+	}
+	count = i;
+
+	if(count > 0) {
+		(*aspace->translation_map.ops->lock)(&aspace->translation_map);
+		(*aspace->translation_map.ops->unmap)(&aspace->translation_map, va, va + (count * PAGE_SIZE - 1));
+		(*aspace->translation_map.ops->flush)(&aspace->translation_map);
+
+		for(i = 0; i < count; i++) {
+			offset = (va + i * PAGE_SIZE - region->base) + region->cache_offset;
+
+			wired = (region->wiring == REGION_WIRING_WIRED);
+			old_page = vm_cache_lookup_page(cache_ref, offset);
+			if(old_page != NULL) {
+				wired = (old_page->state == PAGE_STATE_WIRED);
+				vm_cache_remove_page(cache_ref, old_page);
+				// the only reference left was the mapping that just went away
+				old_page->ref_count = 0;
+				vm_page_set_state(old_page, PAGE_STATE_FREE);
+			}
+
+			vm_cache_insert_page(cache_ref, pages[i], offset);
+			atomic_add(&pages[i]->ref_count, 1);
+			(*aspace->translation_map.ops->map)(&aspace->translation_map, va + i * PAGE_SIZE,
+				pages[i]->ppn * PAGE_SIZE, region->lock);
+			vm_page_set_state(pages[i], wired ? PAGE_STATE_WIRED : PAGE_STATE_ACTIVE);
+		}
+
+		(*aspace->translation_map.ops->unlock)(&aspace->translation_map);
+	}
+
+out_unlock:
+	mutex_unlock(&cache_ref->lock);
+out:
+	rw_lock_read_unlock(&aspace->virtual_map.lock);
+	vm_put_aspace(aspace);
+	return count;
+}
+
 region_id user_vm_create_anonymous_region(char *uname, void **uaddress, int addr_type,
 	addr_t size, int wiring, int lock)
 {
@@ -580,17 +835,15 @@ region_id vm_create_anonymous_region(aspace_id aid, char *name, void **address,
 	switch(wiring) {
 		case REGION_WIRING_LAZY:
 			break; // do nothing
-		case REGION_WIRING_WIRED: {
-			// pages aren't mapped at this point, but we just simulate a fault on
-			// every page, which should allocate them
-			addr_t va;
-			// XXX remove
-			for(va = region->base; va < region->base + region->size; va += PAGE_SIZE) {
-//				dprintf("mapping wired pages: region %p, cache_ref %p %p, address 0x%lx\n", region, cache_ref, region->cache_ref, va);
-				vm_soft_fault(va, false, false);
+		case REGION_WIRING_WIRED:
+			// pages aren't mapped at this point, allocate and map them in batches
+			err = populate_region_range(aspace, region, region->base, region->base + region->size);
+			if(err < 0) {
+				_vm_delete_region(aspace, region->id);
+				vm_put_aspace(aspace);
+				return err;
 			}
 			break;
-		}
 		case REGION_WIRING_WIRED_ALREADY: {
 			// the pages should already be mapped. This is only really useful during
 			// boot time. Find the appropriate vm_page objects and stick them in
@@ -997,18 +1250,18 @@ int vm_delete_region(aspace_id aid, region_id rid)
 
 static void _vm_put_region(vm_region *region, bool aspace_locked)
 {
-	vm_region *temp, *last = NULL;
+	vm_region *temp;
 	vm_address_space *aspace;
 	bool removeit = false;
 
 	VERIFY_VM_REGION(region);
 
-	sem_acquire(region_hash_sem, WRITE_COUNT);
+	rw_lock_write_lock(&region_hash_lock);
 	if(atomic_add(&region->ref_count, -1) == 1) {
 		hash_remove(region_table, region);
 		removeit = true;
 	}
-	sem_release(region_hash_sem, WRITE_COUNT);
+	rw_lock_write_unlock(&region_hash_lock);
 
 	if(!removeit)
 		return;
@@ -1018,28 +1271,16 @@ static void _vm_put_region(vm_region *region, bool aspace_locked)
 
 	// remove the region from the aspace's virtual map
 	if(!aspace_locked)
-		sem_acquire(aspace->virtual_map.sem, WRITE_COUNT);
-	temp = aspace->virtual_map.region_list;
-	while(temp != NULL) {
-		if(region == temp) {
-			if(last != NULL) {
-				last->aspace_next = temp->aspace_next;
-			} else {
-				aspace->virtual_map.region_list = temp->aspace_next;
-			}
-			aspace->virtual_map.change_count++;
-			break;
-		}
-		last = temp;
-		temp = temp->aspace_next;
-	}
+		rw_lock_write_lock(&aspace->virtual_map.lock);
+	temp = vm_region_tree_lookup(&aspace->virtual_map, region->base);
+	if(temp != region)
+		panic("vm_region_release_ref: region not found in aspace's region tree\n");
+	vm_region_tree_remove(&aspace->virtual_map, region);
+	aspace->virtual_map.change_count++;
 	if(region == aspace->virtual_map.region_hint)
 		aspace->virtual_map.region_hint = NULL;
 	if(!aspace_locked)
-		sem_release(aspace->virtual_map.sem, WRITE_COUNT);
-
-	if(temp == NULL)
-		panic("vm_region_release_ref: region not found in aspace's region_list\n");
+		rw_lock_write_unlock(&aspace->virtual_map.lock);
 
 	vm_cache_remove_region(region->cache_ref, region);
 	vm_cache_release_ref(region->cache_ref);
@@ -1054,7 +1295,7 @@ static void _vm_put_region(vm_region *region, bool aspace_locked)
 
 	if(region->name)
 		kfree(region->name);
-	kfree(region);
+	object_cache_free(region_cache, region);
 
 	return;
 }
@@ -1223,6 +1464,7 @@ static void dump_cache_ref(int argc, char **argv)
 	else
 		dprintf("(BAD!)\n");
 	dprintf("cache: %p\n", cache_ref->cache);
+	dprintf("lock.count: %d\n", cache_ref->lock.count);
 	dprintf("lock.holder: %d\n", cache_ref->lock.holder);
 	dprintf("lock.sem: 0x%x\n", cache_ref->lock.sem);
 	dprintf("region_list:\n");
@@ -1323,6 +1565,10 @@ static void _dump_region(vm_region *region)
 	dprintf("cache_ref: %p\n", region->cache_ref);
 	dprintf("aspace: %p\n", region->aspace);
 	dprintf("aspace_next: %p\n", region->aspace_next);
+	dprintf("tree_left: %p tree_right: %p tree_parent: %p height %d\n",
+		region->tree_left, region->tree_right, region->tree_parent, region->tree_height);
+	dprintf("tree_min_base: 0x%lx tree_max_last: 0x%lx tree_max_gap: 0x%lx\n",
+		region->tree_min_base, region->tree_max_last, region->tree_max_gap);
 	dprintf("cache_node.prev: %p\n", region->cache_node.prev);
 	dprintf("cache_node.next: %p\n", region->cache_node.next);
 	dprintf("hash_next: %p\n", region->hash_next);
@@ -1403,8 +1649,9 @@ static void _dump_aspace(vm_address_space *aspace)
 	dprintf("virtual_map.alloc_base: 0x%lx\n", aspace->virtual_map.alloc_base);
 	dprintf("virtual_map.size: 0x%lx\n", aspace->virtual_map.size);
 	dprintf("virtual_map.change_count: 0x%x\n", aspace->virtual_map.change_count);
-	dprintf("virtual_map.sem: 0x%x\n", aspace->virtual_map.sem);
+	dprintf("virtual_map.lock: state 0x%x writer 0x%x\n", aspace->virtual_map.lock.state, aspace->virtual_map.lock.writer);
 	dprintf("virtual_map.region_hint: %p\n", aspace->virtual_map.region_hint);
+	dprintf("virtual_map.region_tree: %p\n", aspace->virtual_map.region_tree);
 	dprintf("virtual_map.region_list:\n");
 	for(region = aspace->virtual_map.region_list; region != NULL; region = region->aspace_next) {
 		dprintf(" region 0x%x: ", region->id);
@@ -1469,9 +1716,9 @@ vm_address_space *vm_get_kernel_aspace(void)
 	VERIFY_VM_ASPACE(kernel_aspace);
 
 	/* we can treat this one a little differently since it can't be deleted */
-	sem_acquire(aspace_hash_sem, READ_COUNT);
+	rw_lock_read_lock(&aspace_hash_lock);
 	atomic_add(&kernel_aspace->ref_count, 1);
-	sem_release(aspace_hash_sem, READ_COUNT);
+	rw_lock_read_unlock(&aspace_hash_lock);
 	return kernel_aspace;
 }
 
@@ -1498,20 +1745,19 @@ aspace_id vm_get_current_user_aspace_id(void)
 
 void vm_put_aspace(vm_address_space *aspace)
 {
-	bool removeit = false;
-
 	VERIFY_VM_ASPACE(aspace);
 
-	sem_acquire(aspace_hash_sem, WRITE_COUNT);
-	if(atomic_add(&aspace->ref_count, -1) == 1) {
-		hash_remove(aspace_table, aspace);
-		removeit = true;
-	}
-	sem_release(aspace_hash_sem, WRITE_COUNT);
-
-	if(!removeit)
+	// the write lock waits out every cpu's readers, so only the last put takes it.
+	// Lookups won't take a ref on it once it's hit zero, so nobody else can get here.
+	if(atomic_add(&aspace->ref_count, -1) != 1)
 		return;
 
+	rw_lock_write_lock(&aspace_hash_lock);
+	if(aspace->ref_count != 0)
+		panic("vm_put_aspace: aspace %p picked up a ref after reaching zero\n", aspace);
+	hash_remove(aspace_table, aspace);
+	rw_lock_write_unlock(&aspace_hash_lock);
+
 //	dprintf("vm_put_aspace: reached zero ref, deleting aspace\n");
 
 	if(aspace == kernel_aspace)
@@ -1526,7 +1772,7 @@ void vm_put_aspace(vm_address_space *aspace)
 	(*aspace->translation_map.ops->destroy)(&aspace->translation_map);
 
 	kfree(aspace->name);
-	sem_delete(aspace->virtual_map.sem);
+	rw_lock_destroy(&aspace->virtual_map.lock);
 	kfree(aspace);
 
 	return;
@@ -1570,16 +1816,16 @@ aspace_id vm_create_aspace(const char *name, addr_t base, addr_t alloc_base, add
 	aspace->virtual_map.base = base;
 	aspace->virtual_map.alloc_base = alloc_base;
 	aspace->virtual_map.size = size;
-	aspace->virtual_map.region_list = NULL;
+	vm_region_tree_init(&aspace->virtual_map);
 	aspace->virtual_map.region_hint = NULL;
 	aspace->virtual_map.change_count = 0;
-	aspace->virtual_map.sem = sem_create(WRITE_COUNT, "aspacelock");
+	rw_lock_init(&aspace->virtual_map.lock, "aspacelock");
 	aspace->virtual_map.aspace = aspace;
 
 	// add the aspace to the global hash table
-	sem_acquire(aspace_hash_sem, WRITE_COUNT);
+	rw_lock_write_lock(&aspace_hash_lock);
 	hash_insert(aspace_table, aspace);
-	sem_release(aspace_hash_sem, WRITE_COUNT);
+	rw_lock_write_unlock(&aspace_hash_lock);
 
 	return aspace->id;
 
@@ -1605,10 +1851,10 @@ int vm_delete_aspace(aspace_id aid)
 
 	// put this aspace in the deletion state
 	// this guarantees that no one else will add regions to the list
-	sem_acquire(aspace->virtual_map.sem, WRITE_COUNT);
+	rw_lock_write_lock(&aspace->virtual_map.lock);
 	if(aspace->state == VM_ASPACE_STATE_DELETION) {
 		// abort, someone else is already deleting this aspace
-		sem_release(aspace->virtual_map.sem, WRITE_COUNT);
+		rw_lock_write_unlock(&aspace->virtual_map.lock);
 		vm_put_aspace(aspace);
 		return NO_ERROR;
 	}
@@ -1625,7 +1871,7 @@ int vm_delete_aspace(aspace_id aid)
 	}
 
 	// unlock
-	sem_release(aspace->virtual_map.sem, WRITE_COUNT);
+	rw_lock_write_unlock(&aspace->virtual_map.lock);
 
 	// release two refs on the address space
 	vm_put_aspace(aspace);
@@ -1644,13 +1890,13 @@ vm_address_space *vm_aspace_walk_next(struct hash_iterator *i)
 {
 	vm_address_space *aspace;
 
-	sem_acquire(aspace_hash_sem, READ_COUNT);
-	aspace = hash_next(aspace_table, i);
-	if(aspace) {
+	rw_lock_read_lock(&aspace_hash_lock);
+	while((aspace = hash_next(aspace_table, i)) != NULL) {
 		VERIFY_VM_ASPACE(aspace);
-		atomic_add(&aspace->ref_count, 1);
+		if(vm_aspace_ref_if_live(aspace))
+			break;
 	}
-	sem_release(aspace_hash_sem, READ_COUNT);
+	rw_lock_read_unlock(&aspace_hash_lock);
 	return aspace;
 }
 
@@ -1671,9 +1917,8 @@ int vm_init(kernel_args *ka)
 	// initialize some globals
 	kernel_aspace = NULL;
 	next_region_id = 0;
-	region_hash_sem = -1;
+	rw_lock_init(&region_hash_lock, "region_hash_lock");
 	next_aspace_id = 0;
-	aspace_hash_sem = -1;
 	vm_info.max_commit = 0; // will be increased in vm_page_init
 	max_commit_lock = 0;
 	memset(&vm_info, 0, sizeof(vm_info));
@@ -1690,6 +1935,16 @@ int vm_init(kernel_args *ka)
 	kprintf("creating kernel heap at 0x%lx, size 0x%lx\n", heap_base, heap_size);
 	heap_init(heap_base, heap_size);
 
+	// looked up on every fault, but only written when an address space comes or goes
+	if(rw_lock_init_etc(&aspace_hash_lock, "aspace_hash_lock", RW_LOCK_FLAG_PERCPU_READERS) < 0)
+		panic("vm_init: error creating aspace hash lock\n");
+
+	// object caches start out carving slabs from the heap
+	slab_init(ka);
+	region_cache = object_cache_create("vm_region", sizeof(vm_region), 0, NULL, NULL, NULL);
+	if(region_cache == NULL)
+		panic("vm_init: error creating region object cache\n");
+
 	// initialize the free page list and page allocator
 	vm_page_init_postheap(ka);
 
@@ -1722,6 +1977,9 @@ int vm_init(kernel_args *ka)
 	arch_vm_init2(ka);
 	vm_page_init2(ka);
 
+	// the page allocator is ready, let the object caches get slabs from it
+	slab_init2(ka);
+
 	// allocate regions to represent stuff that already exists
 	null_addr = (void *)ROUNDOWN(heap_base, PAGE_SIZE);
 	vm_create_anonymous_region(vm_get_kernel_aspace_id(), "kernel_heap", &null_addr, REGION_ADDR_EXACT_ADDRESS,
@@ -1775,26 +2033,12 @@ int vm_init(kernel_args *ka)
 
 int vm_init_postsem(kernel_args *ka)
 {
-	vm_region *region;
-
 	// have the heap finish it's initialization
 	heap_init_postsem(ka);
 
-	// fill in all of the semaphores that were not allocated before
-	// since we're still single threaded and only the kernel address space exists,
-	// it isn't that hard to find all of the ones we need to create
+	// the locks set up before now create their semaphores the first time
+	// they're contended, only real semaphores are left to make
 	vm_translation_map_module_init_post_sem(ka);
-	kernel_aspace->virtual_map.sem = sem_create(WRITE_COUNT, "kernel_aspacelock");
-	recursive_lock_create(&kernel_aspace->translation_map.lock);
-
-	for(region = kernel_aspace->virtual_map.region_list; region; region = region->aspace_next) {
-		if(region->cache_ref->lock.sem < 0) {
-			mutex_init(&region->cache_ref->lock, "cache_ref_mutex");
-		}
-	}
-
-	region_hash_sem = sem_create(WRITE_COUNT, "region_hash_sem");
-	aspace_hash_sem = sem_create(WRITE_COUNT, "aspace_hash_sem");
 
 	return 0;
 }
@@ -1891,10 +2135,10 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	map = &aspace->virtual_map;
 	atomic_add(&aspace->fault_count, 1);
 
-	sem_acquire(map->sem, READ_COUNT);
+	rw_lock_read_lock(&map->lock);
 	region = vm_virtual_map_lookup(map, address);
 	if(region == NULL) {
-		sem_release(map->sem, READ_COUNT);
+		rw_lock_read_unlock(&map->lock);
 		vm_put_aspace(aspace);
 		dprintf("vm_soft_fault: va 0x%lx not covered by region in address space\n", address);
 		return ERR_VM_PF_BAD_ADDRESS; // BAD_ADDRESS
@@ -1902,13 +2146,13 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 
 	// check permissions
 	if(is_user && (region->lock & LOCK_KERNEL) == LOCK_KERNEL) {
-		sem_release(map->sem, READ_COUNT);
+		rw_lock_read_unlock(&map->lock);
 		vm_put_aspace(aspace);
 		dprintf("user access on kernel region\n");
 		return ERR_VM_PF_BAD_PERM; // BAD_PERMISSION
 	}
 	if(is_write && (region->lock & LOCK_RW) == 0) {
-		sem_release(map->sem, READ_COUNT);
+		rw_lock_read_unlock(&map->lock);
 		vm_put_aspace(aspace);
 		dprintf("write access attempted on read-only region\n");
 		return ERR_VM_PF_BAD_PERM; // BAD_PERMISSION
@@ -1921,7 +2165,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	cache_offset = address - region->base + region->cache_offset;
 	vm_cache_acquire_ref(top_cache_ref, true);
 	change_count = map->change_count;
-	sem_release(map->sem, READ_COUNT);
+	rw_lock_read_unlock(&map->lock);
 
 	VERIFY_VM_CACHE(top_cache_ref->cache);
 	VERIFY_VM_STORE(top_cache_ref->cache->store);
@@ -2100,7 +2344,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 	TRACE;
 
 	err = 0;
-	sem_acquire(map->sem, READ_COUNT);
+	rw_lock_read_lock(&map->lock);
 	if(change_count != map->change_count) {
 		// something may have changed, see if the address is still valid
 		region = vm_virtual_map_lookup(map, address);
@@ -2128,7 +2372,7 @@ static int vm_soft_fault(addr_t address, bool is_write, bool is_user)
 
 	TRACE;
 
-	sem_release(map->sem, READ_COUNT);
+	rw_lock_read_unlock(&map->lock);
 
 	TRACE;
 
@@ -2163,12 +2407,7 @@ static vm_region *vm_virtual_map_lookup(vm_virtual_map *map, addr_t address)
 	if(region && region->base <= address && (region->base + region->size) > address)
 		return region;
 
-	for(region = map->region_list; region != NULL; region = region->aspace_next) {
-		VERIFY_VM_REGION(region);
-		if(region->base <= address && (region->base + region->size) > address)
-			break;
-	}
-
+	region = vm_region_tree_lookup(map, address);
 	if(region) {
 		map->region_hint = region;
 		VERIFY_VM_REGION(region);
@@ -8,6 +8,7 @@
 #include <kernel/vm_cache.h>
 #include <kernel/vm_page.h>
 #include <kernel/heap.h>
+#include <kernel/slab.h>
 #include <kernel/int.h>
 #include <kernel/khash.h>
 #include <kernel/lock.h>
@@ -22,6 +23,8 @@
 static void *page_cache_table;
 static spinlock_t page_cache_table_lock;
 
+static object_cache *cache_ref_cache;
+
 struct page_lookup_key {
 	off_t offset;
 	vm_cache_ref *ref;
@@ -78,6 +81,10 @@ int vm_cache_init(kernel_args *ka)
 		panic("vm_cache_init: cannot allocate memory for page cache hash table\n");
 	page_cache_table_lock = 0;
 
+	cache_ref_cache = object_cache_create("vm_cache_ref", sizeof(vm_cache_ref), 0, NULL, NULL, NULL);
+	if(!cache_ref_cache)
+		panic("vm_cache_init: cannot create cache_ref object cache\n");
+
 	return 0;
 }
 
@@ -107,7 +114,7 @@ vm_cache_ref *vm_cache_ref_create(vm_cache *cache)
 {
 	vm_cache_ref *ref;
 
-	ref = kmalloc(sizeof(vm_cache_ref));
+	ref = object_cache_alloc(cache_ref_cache);
 	if(ref == NULL)
 		return NULL;
 
@@ -185,7 +192,7 @@ void vm_cache_release_ref(vm_cache_ref *cache_ref)
 
 		mutex_destroy(&cache_ref->lock);
 		kfree(cache_ref->cache);
-		kfree(cache_ref);
+		object_cache_free(cache_ref_cache, cache_ref);
 
 		return;
 	}
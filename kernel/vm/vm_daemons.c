@@ -13,11 +13,80 @@
 #include <kernel/vm_priv.h>
 #include <kernel/vm_cache.h>
 #include <kernel/vm_page.h>
+#include <kernel/slab.h>
 
 bool trimming_cycle;
 static addr_t free_memory_low_water;
 static addr_t free_memory_high_water;
 
+// pages picked to be stolen are unmapped in batches, so one tlb flush covers all of them
+#define SCAN_UNMAP_BATCH 16
+
+struct scan_victim {
+	addr_t va;
+	vm_page *page;
+	unsigned int flags;
+};
+
+static void mark_page_modified(vm_page *page)
+{
+	// if the page is modified, but the state is active or inactive, put it on the modified list
+	if(page->state == PAGE_STATE_ACTIVE || page->state == PAGE_STATE_INACTIVE) {
+		if(page->cache_ref->cache->temporary)
+			vm_page_set_state(page, PAGE_STATE_MODIFIED_TEMPORARY);
+		else
+			vm_page_set_state(page, PAGE_STATE_MODIFIED);
+	}
+}
+
+// unmap a batch of pages from the aspace and drop the mapping's ref on them.
+// Returns the number of pages that were unmapped for the last time.
+// NOTE: the cache_ref lock of the region the pages are in should be held
+static addr_t steal_pages(vm_address_space *aspace, struct scan_victim *victims, int count)
+{
+	vm_translation_map *map = &aspace->translation_map;
+	addr_t stolen = 0;
+	unsigned int flags;
+	addr_t pa;
+	int i;
+
+	if(count == 0)
+		return 0;
+
+	map->ops->lock(map);
+
+	for(i = 0; i < count; i++)
+		map->ops->unmap(map, victims[i].va, victims[i].va + PAGE_SIZE);
+
+	// flush the tlbs of the cpus using this map
+	map->ops->flush(map);
+
+	for(i = 0; i < count; i++) {
+		// re-query the flags on the old pte, to make sure we have accurate modified bit data
+		map->ops->query(map, victims[i].va, &pa, &flags);
+		victims[i].flags |= flags;
+
+		// clear the modified and accessed bits on the entries
+		map->ops->clear_flags(map, victims[i].va, PAGE_MODIFIED|PAGE_ACCESSED);
+
+		// decrement the ref count on the page. If we just unmapped it for the last time,
+		// put the page on the inactive list
+		if(atomic_add(&victims[i].page->ref_count, -1) == 1) {
+			vm_page_set_state(victims[i].page, PAGE_STATE_INACTIVE);
+			stolen++;
+		}
+	}
+
+	map->ops->unlock(map);
+
+	for(i = 0; i < count; i++) {
+		if(victims[i].flags & PAGE_MODIFIED)
+			mark_page_modified(victims[i].page);
+	}
+
+	return stolen;
+}
+
 static void scan_pages(vm_address_space *aspace, addr_t free_target)
 {
 	vm_region *first_region;
@@ -25,7 +94,10 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 	vm_page *page;
 	addr_t va;
 	addr_t pa;
-	unsigned int flags, flags2;
+	unsigned int flags;
+	struct scan_victim victims[SCAN_UNMAP_BATCH];
+	int num_victims;
+	addr_t stolen;
 	int quantum = PAGE_SCAN_QUANTUM;
 	int regions_examined = 0;
 	int pages_examined = 0;
@@ -36,7 +108,7 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 
 	dprintf("  scan_pages called on aspace %p, id 0x%x, free_target %ld\n", aspace, aspace->id, free_target);
 
-	sem_acquire(aspace->virtual_map.sem, READ_COUNT);
+	rw_lock_read_lock(&aspace->virtual_map.lock);
 
 	first_region = aspace->virtual_map.region_list;
 	while(first_region && (first_region->base + (first_region->size - 1)) < aspace->scan_va) {
@@ -53,7 +125,7 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 		VERIFY_VM_REGION(first_region);
 
 	if(!first_region) {
-		sem_release(aspace->virtual_map.sem, READ_COUNT);
+		rw_lock_read_unlock(&aspace->virtual_map.lock);
 		return;
 	}
 
@@ -66,6 +138,7 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 
 		// scan the pages in this region
 		mutex_lock(&region->cache_ref->lock);
+		num_victims = 0;
 		if(!region->cache_ref->cache->scan_skip) {
 			regions_examined++;
 			for(va = region->base; va < (region->base + region->size); va += PAGE_SIZE) {
@@ -90,33 +163,21 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 
 //				dprintf("**va 0x%x pa 0x%x fl 0x%x, st %d\n", va, pa, flags, page->state);
 
-				flags2 = 0;
-				if(free_target > 0) {
+				if(free_target > (addr_t)num_victims) {
 					// look for a page we can steal
 					if(!(flags & PAGE_ACCESSED) && page->state == PAGE_STATE_ACTIVE) {
 						pages_unmapped++;
 
-						aspace->translation_map.ops->lock(&aspace->translation_map);
-
-						// unmap the page
-						aspace->translation_map.ops->unmap(&aspace->translation_map, va, va + PAGE_SIZE);
-
-						// flush the tlbs of all cpus
-						aspace->translation_map.ops->flush(&aspace->translation_map);
-
-						// re-query the flags on the old pte, to make sure we have accurate modified bit data
-						aspace->translation_map.ops->query(&aspace->translation_map, va, &pa, &flags2);
-
-						// clear the modified and accessed bits on the entries
-						aspace->translation_map.ops->clear_flags(&aspace->translation_map, va, PAGE_MODIFIED|PAGE_ACCESSED);
-
-						// decrement the ref count on the page. If we just unmapped it for the last time,
-						// put the page on the inactive list
-						if(atomic_add(&page->ref_count, -1) == 1) {
-							vm_page_set_state(page, PAGE_STATE_INACTIVE);
-							free_target--;
+						// it gets unmapped along with the rest of the batch
+						victims[num_victims].va = va;
+						victims[num_victims].page = page;
+						victims[num_victims].flags = flags;
+						if(++num_victims == SCAN_UNMAP_BATCH) {
+							stolen = steal_pages(aspace, victims, num_victims);
+							free_target = (free_target > stolen) ? free_target - stolen : 0;
+							num_victims = 0;
 						}
-						aspace->translation_map.ops->unlock(&aspace->translation_map);
+						goto next_page;
 					} else if(flags & PAGE_ACCESSED) {
 						// clear the accessed bits of this page
 						aspace->translation_map.ops->lock(&aspace->translation_map);
@@ -125,19 +186,16 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 					}
 				}
 
-				// if the page is modified, but the state is active or inactive, put it on the modified list
-				if(((flags & PAGE_MODIFIED) || (flags2 & PAGE_MODIFIED))
-					&& (page->state == PAGE_STATE_ACTIVE || page->state == PAGE_STATE_INACTIVE)) {
-					if(page->cache_ref->cache->temporary)
-						vm_page_set_state(page, PAGE_STATE_MODIFIED_TEMPORARY);
-					else
-						vm_page_set_state(page, PAGE_STATE_MODIFIED);
-				}
+				if(flags & PAGE_MODIFIED)
+					mark_page_modified(page);
 
+next_page:
 				if(--quantum == 0)
 					break;
 			}
 		}
+		stolen = steal_pages(aspace, victims, num_victims);
+		free_target = (free_target > stolen) ? free_target - stolen : 0;
 		mutex_unlock(&region->cache_ref->lock);
 		// move to the next region, wrapping around and stopping if we get back to the first region
 		region = region->aspace_next ? region->aspace_next : aspace->virtual_map.region_list;
@@ -149,7 +207,7 @@ static void scan_pages(vm_address_space *aspace, addr_t free_target)
 	}
 
 	aspace->scan_va = region ? (first_region->base + first_region->size) : aspace->virtual_map.base;
-	sem_release(aspace->virtual_map.sem, READ_COUNT);
+	rw_lock_read_unlock(&aspace->virtual_map.lock);
 
 	dprintf("  exiting scan_pages, took %Ld usecs (re %d pe %d pp %d pu %d)\n", system_time() - start_time,
 		regions_examined, pages_examined, pages_present, pages_unmapped);
@@ -170,6 +228,10 @@ static int page_daemon()
 	for(;;) {
 		thread_snooze(PAGE_DAEMON_INTERVAL);
 
+		// memory is getting tight, have the object caches give back what they aren't using
+		if(trimming_cycle)
+			slab_reclaim();
+
 		// scan through all of the address spaces
 		vm_aspace_walk_start(&i);
 		aspace = vm_aspace_walk_next(&i);
@@ -30,9 +30,9 @@ extern bool trimming_cycle;
 
 static page_queue page_free_queue;
 static page_queue page_clear_queue;
-static page_queue page_active_queue;
 static page_queue page_modified_queue;
 static page_queue page_modified_temporary_queue;
+// pages that are in use (busy, active, inactive, wired, unused) aren't kept on a queue
 
 static vm_page *all_pages;
 static addr_t physical_page_offset;
@@ -40,6 +40,31 @@ static unsigned int num_pages;
 
 static spinlock_t page_lock;
 
+// per-cpu caches of free and clear pages. They are refilled from and drained to
+// the global queues in batches, so the common allocate and free paths only touch
+// the local cache lock. Cached pages keep their FREE/CLEAR state and are counted
+// as such in vm_info, but have the cached bit set and aren't on a queue.
+#define PAGE_CPU_CACHE_SIZE 32
+#define PAGE_CPU_CACHE_BATCH 16
+
+struct page_stack {
+	int count;
+	vm_page *pages[PAGE_CPU_CACHE_SIZE];
+};
+
+struct page_cpu_cache {
+	spinlock_t lock;
+	struct page_stack free;
+	struct page_stack clear;
+	unsigned int refills;
+	unsigned int drains;
+} _ALIGNED(64);
+
+static struct page_cpu_cache page_cpu_caches[_MAX_CPUS];
+
+// the page counters are updated both with and without page_lock held
+#define VM_INFO_ADD(field, delta) atomic_add(&vm_info.field, (delta))
+
 static sem_id modified_pages_available;
 
 void dump_page_stats(int argc, char **argv);
@@ -92,8 +117,120 @@ static void move_page_to_queue(page_queue *from_q, page_queue *to_q, vm_page *pa
 	VERIFY_VM_PAGE(page);
 #endif
 	if(from_q != to_q) {
-		remove_page_from_queue(from_q, page);
-		enqueue_page(to_q, page);
+		if(from_q)
+			remove_page_from_queue(from_q, page);
+		if(to_q)
+			enqueue_page(to_q, page);
+	}
+}
+
+// returns the queue pages in this state live on, NULL if they aren't queued
+static page_queue *page_state_queue(int page_state)
+{
+	switch(page_state) {
+		case PAGE_STATE_BUSY:
+		case PAGE_STATE_ACTIVE:
+		case PAGE_STATE_INACTIVE:
+		case PAGE_STATE_WIRED:
+		case PAGE_STATE_UNUSED:
+			return NULL;
+		case PAGE_STATE_MODIFIED:
+			return &page_modified_queue;
+		case PAGE_STATE_MODIFIED_TEMPORARY:
+			return &page_modified_temporary_queue;
+		case PAGE_STATE_FREE:
+			return &page_free_queue;
+		case PAGE_STATE_CLEAR:
+			return &page_clear_queue;
+		default:
+			panic("page_state_queue: invalid page state %d\n", page_state);
+			return NULL;
+	}
+}
+
+static void page_state_count(int page_state, int delta)
+{
+	switch(page_state) {
+		case PAGE_STATE_BUSY:
+			VM_INFO_ADD(busy_pages, delta);
+			break;
+		case PAGE_STATE_ACTIVE:
+			VM_INFO_ADD(active_pages, delta);
+			break;
+		case PAGE_STATE_INACTIVE:
+			VM_INFO_ADD(inactive_pages, delta);
+			break;
+		case PAGE_STATE_WIRED:
+			VM_INFO_ADD(wired_pages, delta);
+			break;
+		case PAGE_STATE_UNUSED:
+			VM_INFO_ADD(unused_pages, delta);
+			break;
+		case PAGE_STATE_MODIFIED:
+			VM_INFO_ADD(modified_pages, delta);
+			break;
+		case PAGE_STATE_MODIFIED_TEMPORARY:
+			VM_INFO_ADD(modified_temporary_pages, delta);
+			break;
+		case PAGE_STATE_FREE:
+			VM_INFO_ADD(free_pages, delta);
+			break;
+		case PAGE_STATE_CLEAR:
+			VM_INFO_ADD(clear_pages, delta);
+			break;
+		default:
+			panic("page_state_count: invalid page state %d\n", page_state);
+	}
+}
+
+// move up to count pages from the global queue onto a per-cpu stack
+// page_lock must be held
+static void page_cpu_cache_refill(struct page_stack *stack, page_queue *q, int count)
+{
+	vm_page *page;
+
+	while(count-- > 0 && stack->count < PAGE_CPU_CACHE_SIZE) {
+		page = dequeue_page(q);
+		if(page == NULL)
+			break;
+		page->cached = 1;
+		stack->pages[stack->count++] = page;
+	}
+}
+
+// give up to count pages from a per-cpu stack back to the global queue
+// page_lock must be held
+static void page_cpu_cache_drain(struct page_stack *stack, page_queue *q, int count)
+{
+	vm_page *page;
+
+	while(count-- > 0 && stack->count > 0) {
+		page = stack->pages[--stack->count];
+		page->cached = 0;
+		enqueue_page(q, page);
+	}
+}
+
+// push every cached page back to the global queues, for the allocators
+// that need to look at specific physical pages
+static void page_cpu_cache_drain_all(void)
+{
+	struct page_cpu_cache *pc;
+	int i;
+
+	for(i = 0; i < _MAX_CPUS; i++) {
+		pc = &page_cpu_caches[i];
+
+		int_disable_interrupts();
+		acquire_spinlock(&pc->lock);
+		acquire_spinlock(&page_lock);
+
+		page_cpu_cache_drain(&pc->free, &page_free_queue, pc->free.count);
+		page_cpu_cache_drain(&pc->clear, &page_clear_queue, pc->clear.count);
+
+		release_spinlock(&page_lock);
+		release_spinlock(&pc->lock);
+		int_restore_interrupts();
 	}
 }
 
@@ -119,8 +256,8 @@ static int pageout_daemon()
 		acquire_spinlock(&page_lock);
 		page = dequeue_page(&page_modified_queue);
 		page->state = PAGE_STATE_BUSY;
-		vm_info.modified_pages--;
-		vm_info.busy_pages++;
+		VM_INFO_ADD(modified_pages, -1);
+		VM_INFO_ADD(busy_pages, 1);
 		vm_cache_acquire_ref(page->cache_ref, true);
 		release_spinlock(&page_lock);
 		int_restore_interrupts();
@@ -134,8 +271,8 @@ static int pageout_daemon()
 			acquire_spinlock(&page_lock);
 			enqueue_page(&page_modified_queue, page);
 			page->state = PAGE_STATE_MODIFIED;
-			vm_info.busy_pages--;
-			vm_info.modified_pages++;
+			VM_INFO_ADD(busy_pages, -1);
+			VM_INFO_ADD(modified_pages, 1);
 			release_spinlock(&page_lock);
 			int_restore_interrupts();
 			vm_cache_release_ref(page->cache_ref);
@@ -167,15 +304,14 @@ static int pageout_daemon()
 
 		int_disable_interrupts();
 		acquire_spinlock(&page_lock);
-		vm_info.busy_pages--;
+		VM_INFO_ADD(busy_pages, -1);
 		if(page->ref_count > 0) {
 			page->state = PAGE_STATE_ACTIVE;
-			vm_info.active_pages++;
+			VM_INFO_ADD(active_pages, 1);
 		} else {
 			page->state = PAGE_STATE_INACTIVE;
-			vm_info.inactive_pages++;
+			VM_INFO_ADD(inactive_pages, 1);
 		}
-		enqueue_page(&page_active_queue, page);
 		release_spinlock(&page_lock);
 		int_restore_interrupts();
 
@@ -196,13 +332,13 @@ int vm_page_init(kernel_args *ka)
 	page_free_queue.count = 0;
 	list_initialize(&page_clear_queue.list);
 	page_clear_queue.count = 0;
-	list_initialize(&page_active_queue.list);
-	page_active_queue.count = 0;
 	list_initialize(&page_modified_queue.list);
 	page_modified_queue.count = 0;
 	list_initialize(&page_modified_temporary_queue.list);
 	page_modified_temporary_queue.count = 0;
 
+	memset(page_cpu_caches, 0, sizeof(page_cpu_caches));
+
 	// calculate the size of memory by looking at the phys_mem_range array
 	{
 		unsigned int last_phys_page = 0;
@@ -244,11 +380,13 @@ int vm_page_init_postheap(kernel_args *ka)
 		all_pages[i].ppn = physical_page_offset + i;
 		all_pages[i].type = PAGE_TYPE_PHYSICAL;
 		all_pages[i].state = PAGE_STATE_FREE;
+		all_pages[i].cached = 0;
 		all_pages[i].ref_count = 0;
-		vm_info.free_pages++;
 		enqueue_page(&page_free_queue, &all_pages[i]);
 	}
 
+	vm_info.free_pages = num_pages;
+
 	// mark some of the page ranges inuse
 	for(i = 0; i < ka->num_phys_alloc_ranges; i++) {
 		vm_mark_page_range_inuse(ka->phys_alloc_range[i].start / PAGE_SIZE,
@@ -319,7 +457,7 @@ static int page_scrubber(void *unused)
 				page[i] = dequeue_page(&page_free_queue);
 				if(page[i] == NULL)
 					break;
-				vm_info.free_pages--;
+				VM_INFO_ADD(free_pages, -1);
 			}
 
 			release_spinlock(&page_lock);
@@ -337,7 +475,7 @@ static int page_scrubber(void *unused)
 			for(i=0; i<scrub_count; i++) {
 				page[i]->state = PAGE_STATE_CLEAR;
 				enqueue_page(&page_clear_queue, page[i]);
-				vm_info.clear_pages++;
+				VM_INFO_ADD(clear_pages, 1);
 			}
 
 			release_spinlock(&page_lock);
@@ -381,6 +519,8 @@ int vm_mark_page_range_inuse(addr_t start_page, addr_t len)
 		return ERR_INVALID_ARGS;
 	}
 
+	page_cpu_cache_drain_all();
+
 	int_disable_interrupts();
 	acquire_spinlock(&page_lock);
 
@@ -389,6 +529,20 @@ int vm_mark_page_range_inuse(addr_t start_page, addr_t len)
 		switch(page->state) {
 			case PAGE_STATE_FREE:
 			case PAGE_STATE_CLEAR:
+				if(page->cached) {
+					// a cpu pulled it into its cache since the drain. push
+					// the caches back out and look at this page again, it'll
+					// either be back on a global queue or have been allocated.
+					release_spinlock(&page_lock);
+					int_restore_interrupts();
+
+					page_cpu_cache_drain_all();
+
+					int_disable_interrupts();
+					acquire_spinlock(&page_lock);
+					i--;
+					break;
+				}
 				vm_page_set_state_nolock(page, PAGE_STATE_UNUSED);
 				break;
 			case PAGE_STATE_WIRED:
@@ -416,6 +570,9 @@ vm_page *vm_page_allocate_specific_page(addr_t page_num, int page_state)
 	vm_page *p;
 	int old_page_state = PAGE_STATE_BUSY;
 
+	// the page may be sitting in one of the cpu caches
+	page_cpu_cache_drain_all();
+
 	int_disable_interrupts();
 	acquire_spinlock(&page_lock);
 
@@ -425,14 +582,16 @@ vm_page *vm_page_allocate_specific_page(addr_t page_num, int page_state)
 
 	switch(p->state) {
 		case PAGE_STATE_FREE:
-			remove_page_from_queue(&page_free_queue, p);
-			vm_info.free_pages--;
-			break;
 		case PAGE_STATE_CLEAR:
-			remove_page_from_queue(&page_clear_queue, p);
-			vm_info.clear_pages--;
+			if(p->cached) {
+				p = NULL;
+				break;
+			}
+			remove_page_from_queue(page_state_queue(p->state), p);
+			page_state_count(p->state, -1);
 			break;
 		case PAGE_STATE_UNUSED:
+			VM_INFO_ADD(unused_pages, -1);
 			break;
 		default:
 			// we can't allocate this page
@@ -443,10 +602,7 @@ vm_page *vm_page_allocate_specific_page(addr_t page_num, int page_state)
 
 	old_page_state = p->state;
 	p->state = PAGE_STATE_BUSY;
-	vm_info.busy_pages++;
-
-	if(old_page_state != PAGE_STATE_UNUSED)
-		enqueue_page(&page_active_queue, p);
+	VM_INFO_ADD(busy_pages, 1);
 
 out:
 	release_spinlock(&page_lock);
@@ -461,12 +617,111 @@ out:
 	return p;
 }
 
+// pulls a page out of this cpu's cache, refilling it from the global queues
+// as needed. returns NULL if there aren't any pages left anywhere.
+static vm_page *page_cpu_cache_allocate(int page_state)
+{
+	struct page_cpu_cache *pc;
+	struct page_stack *stack;
+	struct page_stack *stack_other;
+	page_queue *q;
+	page_queue *q_other;
+	vm_page *p;
+	int old_page_state;
+	bool drained = false;
+
+retry:
+	int_disable_interrupts();
+	pc = &page_cpu_caches[smp_get_current_cpu()];
+	acquire_spinlock(&pc->lock);
+
+	if(page_state == PAGE_STATE_FREE) {
+		stack = &pc->free;
+		stack_other = &pc->clear;
+		q = &page_free_queue;
+		q_other = &page_clear_queue;
+	} else {
+		stack = &pc->clear;
+		stack_other = &pc->free;
+		q = &page_clear_queue;
+		q_other = &page_free_queue;
+	}
+
+	if(stack->count == 0) {
+		// pull a batch from the global queue
+		acquire_spinlock(&page_lock);
+		page_cpu_cache_refill(stack, q, PAGE_CPU_CACHE_BATCH);
+		if(stack->count == 0 && stack_other->count == 0) {
+			// the queue we wanted is empty, grab some of the other kind
+			page_cpu_cache_refill(stack_other, q_other, PAGE_CPU_CACHE_BATCH);
+		}
+		release_spinlock(&page_lock);
+		pc->refills++;
+	}
+	if(stack->count == 0)
+		stack = stack_other;
+
+	if(stack->count == 0) {
+		release_spinlock(&pc->lock);
+		int_restore_interrupts();
+
+		if(!drained) {
+			// the other cpus may be sitting on the last of the pages
+			page_cpu_cache_drain_all();
+			drained = true;
+			goto retry;
+		}
+		return NULL;
+	}
+
+	p = stack->pages[--stack->count];
+	old_page_state = p->state;
+	p->state = PAGE_STATE_BUSY;
+	p->cached = 0;
+	page_state_count(old_page_state, -1);
+	VM_INFO_ADD(busy_pages, 1);
+
+	release_spinlock(&pc->lock);
+	int_restore_interrupts();
+
+	if(page_state == PAGE_STATE_CLEAR && old_page_state == PAGE_STATE_FREE) {
+		clear_page(p->ppn * PAGE_SIZE);
+	}
+
+	VERIFY_VM_PAGE(p);
+
+	return p;
+}
+
 vm_page *vm_page_allocate_page(int page_state)
 {
 	vm_page *p;
+
+	switch(page_state) {
+		case PAGE_STATE_FREE:
+		case PAGE_STATE_CLEAR:
+			break;
+		default:
+			return NULL; // invalid
+	}
+
+	p = page_cpu_cache_allocate(page_state);
+	if(p == NULL) {
+		// XXX hmm
+		panic("vm_allocate_page: out of memory!\n");
+	}
+
+	return p;
+}
+
+int vm_page_allocate_pages(addr_t count, int page_state, vm_page **pages)
+{
 	page_queue *q;
 	page_queue *q_other;
-	int old_page_state;
+	vm_page *p;
+	addr_t got = 0;
+	addr_t first_other;
+	addr_t i;
 
 	switch(page_state) {
 		case PAGE_STATE_FREE:
@@ -478,45 +733,53 @@ vm_page *vm_page_allocate_page(int page_state)
 			q_other = &page_free_queue;
 			break;
 		default:
-			return NULL; // invalid
+			return ERR_INVALID_ARGS;
 	}
 
+	// take as many as we can from the global queues in one go
 	int_disable_interrupts();
 	acquire_spinlock(&page_lock);
 
-	p = dequeue_page(q);
-	if(p == NULL) {
-		// the clear queue was empty, grab one from the free queue and zero it out
-		q = q_other;
+	while(got < count) {
 		p = dequeue_page(q);
-		if(p == NULL) {
-			// XXX hmm
-			panic("vm_allocate_page: out of memory!\n");
-		}
+		if(p == NULL)
+			break;
+		page_state_count(p->state, -1);
+		p->state = PAGE_STATE_BUSY;
+		pages[got++] = p;
 	}
-
-	if(q == &page_free_queue)
-		vm_info.free_pages--;
-	else
-		vm_info.clear_pages--;
-
-	old_page_state = p->state;
-	p->state = PAGE_STATE_BUSY;
-	vm_info.busy_pages++;
-
-	enqueue_page(&page_active_queue, p);
+	// pages past here came from the other queue
+	first_other = got;
+	while(got < count) {
+		p = dequeue_page(q_other);
+		if(p == NULL)
+			break;
+		page_state_count(p->state, -1);
+		p->state = PAGE_STATE_BUSY;
+		pages[got++] = p;
+	}
+	VM_INFO_ADD(busy_pages, got);
 
 	release_spinlock(&page_lock);
 	int_restore_interrupts();
 
-	if(page_state == PAGE_STATE_CLEAR && old_page_state == PAGE_STATE_FREE) {
-		clear_page(p->ppn * PAGE_SIZE);
+	if(page_state == PAGE_STATE_CLEAR) {
+		for(i = first_other; i < got; i++)
+			clear_page(pages[i]->ppn * PAGE_SIZE);
 	}
 
-	if(p)
-		VERIFY_VM_PAGE(p);
+	// whatever is left comes out of the cpu caches
+	for(; got < count; got++) {
+		pages[got] = page_cpu_cache_allocate(page_state);
+		if(pages[got] == NULL) {
+			// give back what we did get
+			for(i = 0; i < got; i++)
+				vm_page_set_state(pages[i], PAGE_STATE_FREE);
+			return ERR_NO_MEMORY;
+		}
+	}
 
-	return p;
+	return NO_ERROR;
 }
 
 vm_page *vm_page_allocate_page_run(int page_state, addr_t len)
@@ -527,6 +790,8 @@ vm_page *vm_page_allocate_page_run(int page_state, addr_t len)
 
 	start = 0;
 
+	page_cpu_cache_drain_all();
+
 	int_disable_interrupts();
 	acquire_spinlock(&page_lock);
 
@@ -536,8 +801,9 @@ vm_page *vm_page_allocate_page_run(int page_state, addr_t len)
 			break;
 		}
 		for(i = 0; i < len; i++) {
-			if(all_pages[start + i].state != PAGE_STATE_FREE &&
-			  all_pages[start + i].state != PAGE_STATE_CLEAR) {
+			if((all_pages[start + i].state != PAGE_STATE_FREE &&
+			  all_pages[start + i].state != PAGE_STATE_CLEAR) ||
+			  all_pages[start + i].cached) {
 				foundit = false;
 				i++;
 				break;
@@ -578,85 +844,12 @@ vm_page *vm_lookup_page(addr_t page_num)
 
 static int vm_page_set_state_nolock(vm_page *page, int page_state)
 {
-	page_queue *from_q = NULL;
-	page_queue *to_q = NULL;
-
-	switch(page->state) {
-		case PAGE_STATE_BUSY:
-			vm_info.busy_pages--;
-			goto removefromactive;
-		case PAGE_STATE_ACTIVE:
-			vm_info.active_pages--;
-			goto removefromactive;
-		case PAGE_STATE_INACTIVE:
-			vm_info.inactive_pages--;
-			goto removefromactive;
-		case PAGE_STATE_WIRED:
-			vm_info.wired_pages--;
-			goto removefromactive;
-		case PAGE_STATE_UNUSED:
-			vm_info.unused_pages--;
-removefromactive:
-			from_q = &page_active_queue;
-			break;
-		case PAGE_STATE_MODIFIED:
-			vm_info.modified_pages--;
-			from_q = &page_modified_queue;
-			break;
-		case PAGE_STATE_MODIFIED_TEMPORARY:
-			vm_info.modified_temporary_pages--;
-			from_q = &page_modified_temporary_queue;
-			break;
-		case PAGE_STATE_FREE:
-			vm_info.free_pages--;
-			from_q = &page_free_queue;
-			break;
-		case PAGE_STATE_CLEAR:
-			vm_info.clear_pages--;
-			from_q = &page_clear_queue;
-			break;
-		default:
-			panic("vm_page_set_state: vm_page %p in invalid state %d\n", page, page->state);
-	}
+	if(page->cached)
+		panic("vm_page_set_state: vm_page %p is in a cpu cache\n", page);
 
-	switch(page_state) {
-		case PAGE_STATE_BUSY:
-			vm_info.busy_pages++;
-			goto addtoactive;
-		case PAGE_STATE_ACTIVE:
-			vm_info.active_pages++;
-			goto addtoactive;
-		case PAGE_STATE_INACTIVE:
-			vm_info.inactive_pages++;
-			goto addtoactive;
-		case PAGE_STATE_WIRED:
-			vm_info.wired_pages++;
-			goto addtoactive;
-		case PAGE_STATE_UNUSED:
-			vm_info.unused_pages++;
-addtoactive:
-			to_q = &page_active_queue;
-			break;
-		case PAGE_STATE_MODIFIED:
-			vm_info.modified_pages++;
-			to_q = &page_modified_queue;
-			break;
-		case PAGE_STATE_MODIFIED_TEMPORARY:
-			vm_info.modified_temporary_pages++;
-			to_q = &page_modified_temporary_queue;
-			break;
-		case PAGE_STATE_FREE:
-			vm_info.free_pages++;
-			to_q = &page_free_queue;
-			break;
-		case PAGE_STATE_CLEAR:
-			vm_info.clear_pages++;
-			to_q = &page_clear_queue;
-			break;
-		default:
-			panic("vm_page_set_state: invalid target state %d\n", page_state);
-	}
-	move_page_to_queue(from_q, to_q, page);
+	move_page_to_queue(page_state_queue(page->state), page_state_queue(page_state), page);
+	page_state_count(page->state, -1);
+	page_state_count(page_state, 1);
 	page->state = page_state;
 
 	return 0;
@@ -664,11 +857,56 @@ addtoactive:
 
 int vm_page_set_state(vm_page *page, int page_state)
 {
+	struct page_cpu_cache *pc;
+	struct page_stack *stack;
+	int old_page_state;
 	int err;
 
 	VERIFY_VM_PAGE(page);
 
 	int_disable_interrupts();
+
+	if((page_state == PAGE_STATE_FREE || page_state == PAGE_STATE_CLEAR)
+		&& page_state_queue(page->state) == NULL) {
+		// freeing an in use page, stick it in this cpu's cache
+		pc = &page_cpu_caches[smp_get_current_cpu()];
+		stack = (page_state == PAGE_STATE_FREE) ? &pc->free : &pc->clear;
+
+		acquire_spinlock(&pc->lock);
+
+		if(stack->count == PAGE_CPU_CACHE_SIZE) {
+			acquire_spinlock(&page_lock);
+			page_cpu_cache_drain(stack, page_state_queue(page_state), PAGE_CPU_CACHE_BATCH);
+			release_spinlock(&page_lock);
+			pc->drains++;
+		}
+
+		old_page_state = page->state;
+		page->cached = 1;
+		page->state = page_state;
+		stack->pages[stack->count++] = page;
+		page_state_count(old_page_state, -1);
+		page_state_count(page_state, 1);
+
+		release_spinlock(&pc->lock);
+		int_restore_interrupts();
+
+		return 0;
+	}
+
+	if(page_state_queue(page->state) == NULL && page_state_queue(page_state) == NULL) {
+		// neither state has a queue (busy -> active on a fault, wiring, etc),
+		// the page is owned by the caller and the counts are atomic
+		old_page_state = page->state;
+		page->state = page_state;
+		page_state_count(old_page_state, -1);
+		page_state_count(page_state, 1);
+
+		int_restore_interrupts();
+
+		return 0;
+	}
+
 	acquire_spinlock(&page_lock);
 
 	err = vm_page_set_state_nolock(page, page_state);
@@ -686,7 +924,8 @@ addr_t vm_page_num_pages()
 
 addr_t vm_page_num_free_pages()
 {
-	return page_free_queue.count + page_clear_queue.count;
+	// includes the pages sitting in the cpu caches
+	return vm_info.free_pages + vm_info.clear_pages;
 }
 
 void dump_free_page_table(int argc, char **argv)
@@ -699,6 +938,7 @@ void dump_page_stats(int argc, char **argv)
 {
 	unsigned int page_types[9];
 	addr_t i;
+	int cpu;
 
 	memset(page_types, 0, sizeof(page_types));
 
@@ -711,8 +951,14 @@ void dump_page_stats(int argc, char **argv)
 		page_types[PAGE_STATE_ACTIVE], page_types[PAGE_STATE_INACTIVE], page_types[PAGE_STATE_BUSY], page_types[PAGE_STATE_UNUSED]);
 	dprintf("modified: %d\nmodified_temporary %d\nfree: %d\nclear: %d\nwired: %d\n",
 		page_types[PAGE_STATE_MODIFIED], page_types[PAGE_STATE_MODIFIED_TEMPORARY], page_types[PAGE_STATE_FREE], page_types[PAGE_STATE_CLEAR], page_types[PAGE_STATE_WIRED]);
-}
 
+	dprintf("free queue: %d, clear queue: %d\n", page_free_queue.count, page_clear_queue.count);
+	for(cpu = 0; cpu < smp_get_num_cpus(); cpu++) {
+		dprintf("cpu %d cache: free %d clear %d refills %d drains %d\n", cpu,
+			page_cpu_caches[cpu].free.count, page_cpu_caches[cpu].clear.count,
+			page_cpu_caches[cpu].refills, page_cpu_caches[cpu].drains);
+	}
+}
 
 #if 0
 static void dump_free_page_table(int argc, char **argv)
@@ -0,0 +1,303 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <kernel/kernel.h>
+#include <kernel/vm.h>
+#include <kernel/vm_priv.h>
+#include <kernel/debug.h>
+#include <newos/errors.h>
+
+// AVL tree of the regions in a virtual map, keyed on base address.
+// Every node also tracks the span of its subtree and the largest hole
+// between regions inside it, so a free range can be found without
+// walking every region. The sorted aspace_next list is kept in sync
+// for the users that just want to iterate.
+// Lookups must be called with the map's lock held for reading, anything
+// that inserts or removes a region needs it held for writing.
+
+#define TREE_HEIGHT(r) ((r) ? (r)->tree_height : 0)
+#define MAP_LAST(map) ((map)->base + ((map)->size - 1))
+
+static void tree_update(vm_region *r)
+{
+	vm_region *left = r->tree_left;
+	vm_region *right = r->tree_right;
+	addr_t gap = 0;
+
+	r->tree_height = 1 + max(TREE_HEIGHT(left), TREE_HEIGHT(right));
+	r->tree_min_base = left ? left->tree_min_base : r->base;
+	r->tree_max_last = right ? right->tree_max_last : r->base + (r->size - 1);
+
+	if(left) {
+		gap = max(left->tree_max_gap, r->base - (left->tree_max_last + 1));
+	}
+	if(right) {
+		gap = max(gap, right->tree_max_gap);
+		gap = max(gap, right->tree_min_base - (r->base + r->size));
+	}
+	r->tree_max_gap = gap;
+}
+
+static void tree_replace_child(vm_virtual_map *map, vm_region *parent, vm_region *old, vm_region *new)
+{
+	if(parent == NULL)
+		map->region_tree = new;
+	else if(parent->tree_left == old)
+		parent->tree_left = new;
+	else
+		parent->tree_right = new;
+	if(new)
+		new->tree_parent = parent;
+}
+
+static vm_region *tree_rotate_left(vm_virtual_map *map, vm_region *x)
+{
+	vm_region *y = x->tree_right;
+
+	x->tree_right = y->tree_left;
+	if(y->tree_left)
+		y->tree_left->tree_parent = x;
+	tree_replace_child(map, x->tree_parent, x, y);
+	y->tree_left = x;
+	x->tree_parent = y;
+
+	tree_update(x);
+	tree_update(y);
+	return y;
+}
+
+static vm_region *tree_rotate_right(vm_virtual_map *map, vm_region *x)
+{
+	vm_region *y = x->tree_left;
+
+	x->tree_left = y->tree_right;
+	if(y->tree_right)
+		y->tree_right->tree_parent = x;
+	tree_replace_child(map, x->tree_parent, x, y);
+	y->tree_right = x;
+	x->tree_parent = y;
+
+	tree_update(x);
+	tree_update(y);
+	return y;
+}
+
+static vm_region *tree_balance(vm_virtual_map *map, vm_region *r)
+{
+	int balance = TREE_HEIGHT(r->tree_left) - TREE_HEIGHT(r->tree_right);
+
+	if(balance > 1) {
+		if(TREE_HEIGHT(r->tree_left->tree_left) < TREE_HEIGHT(r->tree_left->tree_right))
+			tree_rotate_left(map, r->tree_left);
+		return tree_rotate_right(map, r);
+	} else if(balance < -1) {
+		if(TREE_HEIGHT(r->tree_right->tree_right) < TREE_HEIGHT(r->tree_right->tree_left))
+			tree_rotate_right(map, r->tree_right);
+		return tree_rotate_left(map, r);
+	}
+
+	tree_update(r);
+	return r;
+}
+
+// rebalance and refresh the subtree data from r all the way up to the root
+static void tree_fixup(vm_virtual_map *map, vm_region *r)
+{
+	while(r != NULL) {
+		r = tree_balance(map, r);
+		r = r->tree_parent;
+	}
+}
+
+static vm_region *tree_prev(vm_region *r)
+{
+	if(r->tree_left) {
+		r = r->tree_left;
+		while(r->tree_right)
+			r = r->tree_right;
+		return r;
+	}
+	while(r->tree_parent && r->tree_parent->tree_left == r)
+		r = r->tree_parent;
+	return r->tree_parent;
+}
+
+// see if the hole between prev and next (NULL meaning the edge of the map)
+// can hold size bytes at or above start
+static bool hole_fits(vm_virtual_map *map, vm_region *prev, vm_region *next, addr_t start, addr_t size, addr_t *_base)
+{
+	addr_t first;
+	addr_t last;
+
+	if(prev) {
+		// a region that runs to the very end of the map has nothing after it
+		if(prev->base + (prev->size - 1) == MAP_LAST(map))
+			return false;
+		first = prev->base + prev->size;
+	} else {
+		first = map->base;
+	}
+	if(first < start)
+		first = start;
+
+	if(next) {
+		if(next->base <= first)
+			return false;
+		last = next->base - 1;
+	} else {
+		last = MAP_LAST(map);
+	}
+
+	if(first > last || last - first < size - 1)
+		return false;
+
+	*_base = first;
+	return true;
+}
+
+// prev and next are the regions just outside of this subtree
+static bool tree_find_slot(vm_virtual_map *map, vm_region *r, vm_region *prev, vm_region *next,
+	addr_t start, addr_t size, addr_t *_base)
+{
+	addr_t edge;
+
+	if(r == NULL)
+		return hole_fits(map, prev, next, start, size, _base);
+
+	// everything around this subtree ends before the search starts
+	if(next != NULL && next->base <= start)
+		return false;
+
+	// skip the subtree if neither its inner holes nor the ones on its edges are big enough
+	if(r->tree_max_gap < size) {
+		edge = r->tree_min_base - (prev ? prev->base + prev->size : map->base);
+		if(edge < size) {
+			edge = (next ? next->base - 1 : MAP_LAST(map)) - r->tree_max_last;
+			if(edge < size)
+				return false;
+		}
+	}
+
+	if(tree_find_slot(map, r->tree_left, prev, r, start, size, _base))
+		return true;
+	return tree_find_slot(map, r->tree_right, r, next, start, size, _base);
+}
+
+void vm_region_tree_init(vm_virtual_map *map)
+{
+	map->region_tree = NULL;
+	map->region_list = NULL;
+}
+
+vm_region *vm_region_tree_lookup(vm_virtual_map *map, addr_t address)
+{
+	vm_region *r = map->region_tree;
+
+	while(r != NULL) {
+		if(address < r->base)
+			r = r->tree_left;
+		else if(address - r->base < r->size)
+			return r;
+		else
+			r = r->tree_right;
+	}
+	return NULL;
+}
+
+int vm_region_tree_find_slot(vm_virtual_map *map, addr_t start, addr_t size, addr_t *_base)
+{
+	if(size == 0)
+		return ERR_INVALID_ARGS;
+
+	if(!tree_find_slot(map, map->region_tree, NULL, NULL, start, size, _base))
+		return ERR_VM_NO_REGION_SLOT;
+	return NO_ERROR;
+}
+
+bool vm_region_tree_range_free(vm_virtual_map *map, addr_t start, addr_t size)
+{
+	vm_region *r = map->region_tree;
+	addr_t last = start + (size - 1);
+
+	while(r != NULL) {
+		if(r->base > last)
+			r = r->tree_left;
+		else if(r->base + (r->size - 1) < start)
+			r = r->tree_right;
+		else
+			return false;
+	}
+	return true;
+}
+
+void vm_region_tree_insert(vm_virtual_map *map, vm_region *region)
+{
+	vm_region *parent = NULL;
+	vm_region **link = &map->region_tree;
+	vm_region *prev;
+
+	while(*link != NULL) {
+		parent = *link;
+		if(region->base < parent->base)
+			link = &parent->tree_left;
+		else
+			link = &parent->tree_right;
+	}
+
+	region->tree_left = region->tree_right = NULL;
+	region->tree_parent = parent;
+	*link = region;
+	tree_update(region);
+	tree_fixup(map, parent);
+
+	// keep the sorted list in order
+	prev = tree_prev(region);
+	if(prev) {
+		region->aspace_next = prev->aspace_next;
+		prev->aspace_next = region;
+	} else {
+		region->aspace_next = map->region_list;
+		map->region_list = region;
+	}
+}
+
+void vm_region_tree_remove(vm_virtual_map *map, vm_region *region)
+{
+	vm_region *prev = tree_prev(region);
+	vm_region *fix;
+	vm_region *child;
+	vm_region *succ;
+
+	if(prev)
+		prev->aspace_next = region->aspace_next;
+	else
+		map->region_list = region->aspace_next;
+	region->aspace_next = NULL;
+
+	if(region->tree_left && region->tree_right) {
+		// put the successor in our place
+		succ = region->tree_right;
+		while(succ->tree_left)
+			succ = succ->tree_left;
+
+		if(succ->tree_parent != region) {
+			fix = succ->tree_parent;
+			tree_replace_child(map, succ->tree_parent, succ, succ->tree_right);
+			succ->tree_right = region->tree_right;
+			succ->tree_right->tree_parent = succ;
+		} else {
+			fix = succ;
+		}
+		succ->tree_left = region->tree_left;
+		succ->tree_left->tree_parent = succ;
+		tree_replace_child(map, region->tree_parent, region, succ);
+	} else {
+		child = region->tree_left ? region->tree_left : region->tree_right;
+		fix = region->tree_parent;
+		tree_replace_child(map, region->tree_parent, region, child);
+	}
+
+	region->tree_left = region->tree_right = region->tree_parent = NULL;
+	tree_fixup(map, fix);
+}
@@ -41,22 +41,22 @@ int hoardGetThreadID (void)
 }
 
 
+// futex backed, so a lock nobody is fighting over never leaves user space
 void hoardLockInit (hoardLockType &lock)
 {
- 	lock.ben = 0;
-	lock.sem = _kern_sem_create(1, "a hoard lock");
+  mutex_init(&lock);
 }
 
 
 void hoardLock (hoardLockType &lock)
 {
-  if((atomic_add(&(lock.ben), 1)) >= 1) _kern_sem_acquire(lock.sem, 1);
+  mutex_lock(&lock);
 }
 
 
 void hoardUnlock (hoardLockType &lock)
 {
-  if((atomic_add(&(lock.ben), -1)) > 1) _kern_sem_release(lock.sem, 1);
+  mutex_unlock(&lock);
 }
 
 int hoardGetPageSize (void)
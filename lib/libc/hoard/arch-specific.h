@@ -25,6 +25,7 @@
 #if defined(NEWOS)
 
 #include <sys/syscalls.h>
+#include <sys/mutex.h>
 #include <assert.h>
 
 #else
@@ -73,10 +74,7 @@ typedef HANDLE 	hoardThreadType;
 
 #if defined(NEWOS)
 
-typedef struct {
-  int32 ben;
-  sem_id sem;
-} hoardLockType;
+typedef mutex_t			hoardLockType;
 typedef thread_id		hoardThreadType;
 inline void * operator new(size_t, void *_P)
 	{return (_P); }
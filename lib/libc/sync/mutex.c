@@ -0,0 +1,128 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+#include <sys/mutex.h>
+#include <sys/syscalls.h>
+#include <sys/atomic.h>
+#include <newos/errors.h>
+
+/*
+ * state goes 0 -> 1 when the lock is taken without a fight. Anyone who has
+ * to wait sets it to 2 before going to sleep, which tells the holder to come
+ * into the kernel and wake somebody up when it lets go. A thread that got
+ * the lock after sleeping leaves it at 2, since there may be more sleepers
+ * behind it; at worst that costs one wake call nobody needed.
+ */
+
+int mutex_init(mutex_t *m)
+{
+	m->state = 0;
+	return NO_ERROR;
+}
+
+int mutex_destroy(mutex_t *m)
+{
+	return NO_ERROR;
+}
+
+// takes the lock, marking it contended, and sleeps as long as it's held
+static void mutex_lock_contended(mutex_t *m)
+{
+	while(atomic_set(&m->state, 2) != 0)
+		_kern_futex_wait(&m->state, 2, 0, 0);
+}
+
+int mutex_lock(mutex_t *m)
+{
+	if(test_and_set(&m->state, 1, 0) != 0)
+		mutex_lock_contended(m);
+
+	return NO_ERROR;
+}
+
+int mutex_trylock(mutex_t *m)
+{
+	// like a sem acquire with a zero timeout
+	if(test_and_set(&m->state, 1, 0) != 0)
+		return ERR_TIMED_OUT;
+
+	return NO_ERROR;
+}
+
+int mutex_unlock(mutex_t *m)
+{
+	if(atomic_add(&m->state, -1) != 1) {
+		// somebody is or was sleeping on it
+		atomic_set(&m->state, 0);
+		_kern_futex_wake(&m->state, 1);
+	}
+
+	return NO_ERROR;
+}
+
+/*
+ * A waiter notes the sequence number before it drops the mutex and then sleeps
+ * for as long as it hasn't changed, so a signal that lands in between is never
+ * lost. Signals with nobody waiting don't leave the process.
+ */
+
+int cond_init(cond_t *c)
+{
+	c->seq = 0;
+	c->waiters = 0;
+	return NO_ERROR;
+}
+
+int cond_destroy(cond_t *c)
+{
+	return NO_ERROR;
+}
+
+static int cond_wait_etc(cond_t *c, mutex_t *m, int flags, bigtime_t timeout)
+{
+	int seq;
+	int err;
+
+	atomic_add(&c->waiters, 1);
+	seq = *(volatile int *)&c->seq;
+
+	mutex_unlock(m);
+	err = _kern_futex_wait(&c->seq, seq, flags, timeout);
+
+	atomic_add(&c->waiters, -1);
+
+	// a broadcast wakes everyone at once, so assume there's a crowd
+	// behind us and make the next unlock wake one of them
+	mutex_lock_contended(m);
+
+	return (err == ERR_TIMED_OUT) ? err : NO_ERROR;
+}
+
+int cond_wait(cond_t *c, mutex_t *m)
+{
+	return cond_wait_etc(c, m, 0, 0);
+}
+
+int cond_timedwait(cond_t *c, mutex_t *m, bigtime_t timeout)
+{
+	return cond_wait_etc(c, m, FUTEX_FLAG_TIMEOUT, timeout);
+}
+
+int cond_signal(cond_t *c)
+{
+	atomic_add(&c->seq, 1);
+	if(*(volatile int *)&c->waiters > 0)
+		_kern_futex_wake(&c->seq, 1);
+
+	return NO_ERROR;
+}
+
+int cond_broadcast(cond_t *c)
+{
+	atomic_add(&c->seq, 1);
+	if(*(volatile int *)&c->waiters > 0)
+		_kern_futex_wake(&c->seq, 0x7fffffff);
+
+	return NO_ERROR;
+}
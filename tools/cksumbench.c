@@ -0,0 +1,197 @@
+/*
+** Copyright 2008, Travis Geiselbrecht. All rights reserved.
+** Distributed under the terms of the NewOS License.
+*/
+/*
+** Host side test and benchmark for the network checksum routines.
+** Checks the 32/64 bit versions against the old 16 bit loop over random
+** buffers, alignments and lengths, then times each of them.
+** The portable version is the kernel's own, from include/kernel/net/ones_sum.h,
+** and the x86 ones are linked in straight from the kernel's arch assembly, with
+** the i386 sse2/adcl split from include/kernel/arch/i386/ones_sum.h.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <sys/time.h>
+
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+typedef uintptr_t addr_t;
+typedef int bool;
+#define true 1
+#define false 0
+
+#include "../include/kernel/net/ones_sum.h"
+
+#if defined(__x86_64__)
+uint32 x86_64_ones_sum(uint32 sum, const void *buf, size_t len);
+#define ARCH_NAME "x86_64 adcq"
+#define arch_ones_sum x86_64_ones_sum
+#elif defined(__i386__)
+#define ARCH_NAME "i386 sse2+adcl"
+
+// a user process already owns the fpu, there's nothing to borrow
+#define I386_ONES_SUM_GET_FPU() 0
+#define I386_ONES_SUM_PUT_FPU(state) (void)(state)
+#include "../include/kernel/arch/i386/ones_sum.h"
+
+static uint32 arch_ones_sum(uint32 sum, const void *buf, size_t len)
+{
+	return i386_ones_sum_split(sum, buf, len, true);
+}
+#endif
+
+// the original 16 bit at a time loop, used as the reference
+static uint16 scalar_sum16(uint32 sum, const void *_buf, int len)
+{
+	const uint16 *buf = _buf;
+
+	while(len >= 2) {
+		sum += *buf++;
+		if(sum & 0x80000000)
+			sum = (sum & 0xffff) + (sum >> 16);
+		len -= 2;
+	}
+
+	if (len) {
+		uint8 temp[2];
+		temp[0] = *(uint8 *) buf;
+		temp[1] = 0;
+		sum += *(uint16 *) temp;
+	}
+
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+
+	return sum;
+}
+
+static uint16 fold(uint32 sum)
+{
+	while(sum >> 16)
+		sum = (sum & 0xffff) + (sum >> 16);
+	return sum;
+}
+
+// 0 and 0xffff are both zero in ones complement
+static int sums_match(uint16 a, uint16 b)
+{
+	return a == b || (a == 0 && b == 0xffff) || (a == 0xffff && b == 0);
+}
+
+static double now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+#define BUF_SIZE (64*1024 + 64)
+#define CHECK_ITERATIONS 200000
+#define BENCH_BYTES (256*1024*1024)
+
+static int check(uint8 *buf)
+{
+	int i, j;
+
+	for(i = 0; i < CHECK_ITERATIONS; i++) {
+		int fill = rand() % 4;
+		size_t offset = rand() % 16;
+		size_t len = (i % 8) ? (size_t)(rand() % 4096) : (size_t)(rand() % (BUF_SIZE - 16));
+		uint32 sum = rand() & 0xffff;
+		uint16 ref;
+
+		// all ones and mostly ones buffers are the ones that shake out lost carries
+		for(j = 0; j < (int)(offset + len); j++)
+			buf[j] = (fill == 0) ? 0xff : (fill == 1) ? ((rand() & 7) ? 0xff : rand()) : rand();
+
+		ref = scalar_sum16(sum, buf + offset, len);
+		if(!sums_match(ref, fold(ones_sum_generic(sum, buf + offset, len)))) {
+			printf("generic mismatch: offset %d len %d: 0x%04x vs 0x%04x\n", (int)offset, (int)len,
+				ref, fold(ones_sum_generic(sum, buf + offset, len)));
+			return -1;
+		}
+#ifdef ARCH_NAME
+		if(!sums_match(ref, fold(arch_ones_sum(sum, buf + offset, len)))) {
+			printf("arch mismatch: offset %d len %d: 0x%04x vs 0x%04x\n", (int)offset, (int)len,
+				ref, fold(arch_ones_sum(sum, buf + offset, len)));
+			return -1;
+		}
+#endif
+	}
+	return 0;
+}
+
+static uint32 scalar_sum(uint32 sum, const void *buf, size_t len)
+{
+	return scalar_sum16(sum, buf, len);
+}
+
+typedef uint32 (*sum_func)(uint32 sum, const void *buf, size_t len);
+
+static const struct {
+	const char *name;
+	sum_func func;
+} funcs[] = {
+	{ "scalar", &scalar_sum },
+	{ "generic", &ones_sum_generic },
+#ifdef ARCH_NAME
+	{ ARCH_NAME, &arch_ones_sum },
+#endif
+};
+
+static void bench(uint8 *buf, size_t len)
+{
+	int iterations = BENCH_BYTES / len;
+	unsigned int f;
+	int i;
+
+	printf("%6d bytes:", (int)len);
+	for(f = 0; f < sizeof(funcs) / sizeof(funcs[0]); f++) {
+		// call through a volatile pointer so the loop can't be hoisted
+		sum_func volatile func = funcs[f].func;
+		uint32 acc = 0;
+		double t;
+
+		t = now();
+		for(i = 0; i < iterations; i++)
+			acc += func(acc & 0xffff, buf, len);
+		t = now() - t;
+
+		printf(" %s %7.1f MB/s%s", funcs[f].name, BENCH_BYTES / t / (1024*1024),
+			f + 1 < sizeof(funcs) / sizeof(funcs[0]) ? "," : "");
+	}
+	printf("\n");
+}
+
+int main(int argc, char **argv)
+{
+	static const size_t sizes[] = { 20, 64, 576, 1460, 2024, 8192, 65536 };
+	uint8 *buf;
+	unsigned int i;
+
+	buf = malloc(BUF_SIZE);
+	if(!buf) {
+		printf("out of memory\n");
+		return 1;
+	}
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+
+	printf("checking against the 16 bit loop...\n");
+	if(check(buf) < 0)
+		return 1;
+	printf("ok\n");
+
+	for(i = 0; i < BUF_SIZE; i++)
+		buf[i] = rand();
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+		bench(buf, sizes[i]);
+
+	free(buf);
+	return 0;
+}